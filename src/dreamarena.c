@@ -0,0 +1,310 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <string.h>
+
+#include "dreamarena.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreamarena_debug);
+#define GST_CAT_DEFAULT dreamarena_debug
+
+/* g_malloc aligns to at least 8 bytes */
+#define ARENA_ALIGN_MASK 7
+
+typedef struct _DreamArenaBucket DreamArenaBucket;
+typedef struct _DreamArenaBlock DreamArenaBlock;
+
+struct _DreamArenaBlock {
+	GstMemory mem;
+	guint8 *data;
+	DreamArenaBucket *bucket;
+	DreamArenaBlock *next;
+};
+
+struct _DreamArenaBucket {
+	GMutex lock;
+	gsize size;
+	guint max_cached;
+	DreamArenaBlock *free;
+	guint cached;
+	guint64 reused, allocated, released;
+};
+
+struct _DreamArena {
+	GstAllocator parent;
+
+	GstAllocator *fallback;
+	DreamArenaBucket buckets[DREAM_ARENA_MAX_BUCKETS];
+	guint n_buckets;
+	DreamArenaBucket shares;
+	guint64 fallbacks;
+};
+
+G_DEFINE_TYPE (DreamArena, dream_arena, GST_TYPE_ALLOCATOR);
+
+static void bucket_init (DreamArenaBucket *b, gsize size, guint max_cached)
+{
+	memset (b, 0, sizeof (*b));
+	g_mutex_init (&b->lock);
+	b->size = size;
+	b->max_cached = max_cached;
+}
+
+static DreamArenaBlock *bucket_pop (DreamArenaBucket *b)
+{
+	DreamArenaBlock *block;
+
+	g_mutex_lock (&b->lock);
+	block = b->free;
+	if (block)
+	{
+		b->free = block->next;
+		b->cached--;
+		b->reused++;
+	}
+	else
+		b->allocated++;
+	g_mutex_unlock (&b->lock);
+
+	if (!block)
+	{
+		block = g_new (DreamArenaBlock, 1);
+		block->data = b->size ? g_malloc (b->size) : NULL;
+		block->bucket = b;
+	}
+	block->next = NULL;
+	return block;
+}
+
+static void bucket_push (DreamArenaBucket *b, DreamArenaBlock *block)
+{
+	g_mutex_lock (&b->lock);
+	if (b->cached < b->max_cached)
+	{
+		block->next = b->free;
+		b->free = block;
+		b->cached++;
+		block = NULL;
+	}
+	else
+		b->released++;
+	g_mutex_unlock (&b->lock);
+
+	if (block)
+	{
+		if (b->size)
+			g_free (block->data);
+		g_free (block);
+	}
+}
+
+static void bucket_clear (DreamArenaBucket *b)
+{
+	while (b->free)
+	{
+		DreamArenaBlock *block = b->free;
+		b->free = block->next;
+		if (b->size)
+			g_free (block->data);
+		g_free (block);
+	}
+	g_mutex_clear (&b->lock);
+}
+
+static GstMemory *arena_alloc (GstAllocator *allocator, gsize size, GstAllocationParams *params)
+{
+	DreamArena *arena = DREAM_ARENA (allocator);
+	gsize maxsize = size + params->prefix + params->padding;
+	DreamArenaBucket *b = NULL;
+	DreamArenaBlock *block;
+	guint i;
+
+	if ((params->align & ~ARENA_ALIGN_MASK) == 0)
+		for (i = 0; i < arena->n_buckets && !b; i++)
+			if (maxsize <= arena->buckets[i].size)
+				b = &arena->buckets[i];
+	if (!b)
+	{
+		__atomic_fetch_add (&arena->fallbacks, 1, __ATOMIC_RELAXED);
+		return gst_allocator_alloc (arena->fallback, size, params);
+	}
+
+	block = bucket_pop (b);
+	gst_memory_init (GST_MEMORY_CAST (block), params->flags, allocator, NULL, b->size, params->align, params->prefix, size);
+	if (params->prefix && (params->flags & GST_MEMORY_FLAG_ZERO_PREFIXED))
+		memset (block->data, 0, params->prefix);
+	if ((params->flags & GST_MEMORY_FLAG_ZERO_PADDED) && b->size > params->prefix + size)
+		memset (block->data + params->prefix + size, 0, b->size - params->prefix - size);
+	return GST_MEMORY_CAST (block);
+}
+
+static void arena_free (GstAllocator *allocator, GstMemory *mem)
+{
+	DreamArenaBlock *block = (DreamArenaBlock *) mem;
+
+	bucket_push (block->bucket, block);
+}
+
+static gpointer arena_map (GstMemory *mem, gsize maxsize, GstMapFlags flags)
+{
+	return ((DreamArenaBlock *) mem)->data;
+}
+
+static void arena_unmap (GstMemory *mem)
+{
+}
+
+static GstMemory *arena_share (GstMemory *mem, gssize offset, gssize size)
+{
+	DreamArena *arena = DREAM_ARENA (mem->allocator);
+	GstMemory *parent = mem->parent ? mem->parent : mem;
+	DreamArenaBlock *sub;
+
+	if (size == -1)
+		size = mem->size - offset;
+	sub = bucket_pop (&arena->shares);
+	sub->data = ((DreamArenaBlock *) mem)->data;
+	gst_memory_init (GST_MEMORY_CAST (sub), GST_MINI_OBJECT_FLAGS (parent) | GST_MINI_OBJECT_FLAG_LOCK_READONLY,
+			 mem->allocator, parent, mem->maxsize, mem->align, mem->offset + offset, size);
+	return GST_MEMORY_CAST (sub);
+}
+
+static GstMemory *arena_copy (GstMemory *mem, gssize offset, gssize size)
+{
+	GstMemory *copy;
+	GstMapInfo map;
+
+	if (size == -1)
+		size = mem->size > (gsize) offset ? mem->size - offset : 0;
+	copy = gst_allocator_alloc (mem->allocator, size, NULL);
+	if (!gst_memory_map (copy, &map, GST_MAP_WRITE))
+	{
+		gst_memory_unref (copy);
+		return NULL;
+	}
+	memcpy (map.data, ((DreamArenaBlock *) mem)->data + mem->offset + offset, size);
+	gst_memory_unmap (copy, &map);
+	return copy;
+}
+
+static gboolean arena_is_span (GstMemory *mem1, GstMemory *mem2, gsize *offset)
+{
+	if (offset)
+		*offset = mem1->offset - (mem1->parent ? mem1->parent->offset : 0);
+	return ((DreamArenaBlock *) mem1)->data + mem1->offset + mem1->size == ((DreamArenaBlock *) mem2)->data + mem2->offset;
+}
+
+static void dream_arena_finalize (GObject *object)
+{
+	DreamArena *arena = DREAM_ARENA (object);
+	guint i;
+
+	for (i = 0; i < arena->n_buckets; i++)
+		bucket_clear (&arena->buckets[i]);
+	bucket_clear (&arena->shares);
+	gst_object_unref (arena->fallback);
+	G_OBJECT_CLASS (dream_arena_parent_class)->finalize (object);
+}
+
+static void dream_arena_class_init (DreamArenaClass *klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstAllocatorClass *allocator_class = GST_ALLOCATOR_CLASS (klass);
+
+	gobject_class->finalize = dream_arena_finalize;
+	allocator_class->alloc = arena_alloc;
+	allocator_class->free = arena_free;
+}
+
+static void dream_arena_init (DreamArena *arena)
+{
+	GstAllocator *allocator = GST_ALLOCATOR_CAST (arena);
+
+	allocator->mem_type = DREAM_ARENA_MEMORY_TYPE;
+	allocator->mem_map = arena_map;
+	allocator->mem_unmap = arena_unmap;
+	allocator->mem_copy = arena_copy;
+	allocator->mem_share = arena_share;
+	allocator->mem_is_span = arena_is_span;
+
+	arena->fallback = gst_allocator_find (GST_ALLOCATOR_SYSMEM);
+	/* every buffer with more than one memory block shares them */
+	bucket_init (&arena->shares, 0, 1024);
+}
+
+DreamArena *dream_arena_new (void)
+{
+	GST_DEBUG_CATEGORY_INIT (dreamarena_debug, "dreamarena", 0, "dreamrtspserver memory arena");
+	return g_object_new (DREAM_TYPE_ARENA, NULL);
+}
+
+/* only before the arena is installed, smallest first. prealloc blocks are put on the free
+ * list right away, at most max_cached are kept there */
+void dream_arena_add_bucket (DreamArena *arena, gsize size, guint prealloc, guint max_cached)
+{
+	DreamArenaBucket *b;
+	guint i;
+
+	g_return_if_fail (arena->n_buckets < DREAM_ARENA_MAX_BUCKETS);
+	/* the first bucket which fits is used */
+	g_return_if_fail (size > (arena->n_buckets ? arena->buckets[arena->n_buckets-1].size : 0));
+
+	b = &arena->buckets[arena->n_buckets];
+	bucket_init (b, size, MAX (prealloc, max_cached));
+	arena->n_buckets++;
+	for (i = 0; i < prealloc; i++)
+		bucket_push (b, bucket_pop (b));
+	GST_DEBUG ("bucket of %" G_GSIZE_FORMAT " bytes, %u preallocated, %u cached at most", size, prealloc, b->max_cached);
+}
+
+/* from now on gst_allocator_alloc (NULL, ...) and everything built on it,
+ * like gst_buffer_new_allocate (NULL, ...), uses the arena */
+void dream_arena_install (DreamArena *arena)
+{
+	gst_allocator_register (DREAM_ARENA_MEMORY_TYPE, gst_object_ref (arena));
+	gst_allocator_set_default (gst_object_ref (arena));
+	GST_INFO ("installed as default allocator with %u buckets", arena->n_buckets);
+}
+
+/* one entry per bucket, the sub-memory structs last */
+GArray *dream_arena_snapshot (DreamArena *arena)
+{
+	GArray *stats = g_array_new (FALSE, TRUE, sizeof (DreamArenaStats));
+	guint i;
+
+	for (i = 0; i <= arena->n_buckets; i++)
+	{
+		DreamArenaBucket *b = i < arena->n_buckets ? &arena->buckets[i] : &arena->shares;
+		DreamArenaStats s;
+		g_mutex_lock (&b->lock);
+		s.size = b->size;
+		s.reused = b->reused;
+		s.allocated = b->allocated;
+		s.released = b->released;
+		s.cached = b->cached;
+		g_mutex_unlock (&b->lock);
+		g_array_append_val (stats, s);
+	}
+	return stats;
+}
+
+/* requests which went to the system memory allocator */
+guint64 dream_arena_get_fallbacks (DreamArena *arena)
+{
+	return __atomic_load_n (&arena->fallbacks, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,63 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __DREAMARENA_H__
+#define __DREAMARENA_H__
+
+G_BEGIN_DECLS
+
+/* the process wide default allocator. memory of a bucket's size or smaller
+ * comes from the bucket's free list and goes back to it when it's freed, so
+ * once the lists are warm a steady stream of buffers needs no malloc/free.
+ * larger requests and stricter alignments are passed to the system memory
+ * allocator. the structs of shared sub-memories are recycled the same way */
+#define DREAM_TYPE_ARENA          (dream_arena_get_type ())
+#define DREAM_ARENA(obj)          (G_TYPE_CHECK_INSTANCE_CAST ((obj), DREAM_TYPE_ARENA, DreamArena))
+#define DREAM_IS_ARENA(obj)       (G_TYPE_CHECK_INSTANCE_TYPE ((obj), DREAM_TYPE_ARENA))
+
+#define DREAM_ARENA_MEMORY_TYPE "DreamArena"
+#define DREAM_ARENA_MAX_BUCKETS 8
+
+typedef struct _DreamArena DreamArena;
+typedef struct _DreamArenaClass DreamArenaClass;
+
+struct _DreamArenaClass {
+	GstAllocatorClass parent_class;
+};
+
+typedef struct {
+	/* 0 for the sub-memory structs */
+	gsize size;
+	/* served from the free list, newly allocated, freed because the list
+	 * was full */
+	guint64 reused, allocated, released;
+	guint cached;
+} DreamArenaStats;
+
+GType        dream_arena_get_type      (void);
+DreamArena * dream_arena_new           (void);
+void         dream_arena_add_bucket    (DreamArena *arena, gsize size, guint prealloc, guint max_cached);
+void         dream_arena_install       (DreamArena *arena);
+GArray *     dream_arena_snapshot      (DreamArena *arena);
+guint64      dream_arena_get_fallbacks (DreamArena *arena);
+
+G_END_DECLS
+
+#endif /* __DREAMARENA_H__ */
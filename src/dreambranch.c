@@ -0,0 +1,307 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include "dreambranch.h"
+#include "dreammetrics.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreambranch_debug);
+#define GST_CAT_DEFAULT dreambranch_debug
+
+typedef enum {
+	BRANCH_DETACHED = 0,
+	BRANCH_ATTACHED,
+	BRANCH_DETACHING
+} DreamBranchState;
+
+struct _DreamBranch {
+	gint ref_count;
+	gchar *name;
+	GstElement *queue, *sink;
+
+	GMutex lock;
+	DreamBranchState state;
+	GstBin *bin;
+	GstElement *tee;
+	GstPad *teepad;
+	GstClockTime detach_start;
+	DreamBranchFunc done;
+	gpointer done_data;
+};
+
+static gint branches_live;
+static guint64 branches_attached, branches_detached;
+static GstClockTime detach_max;
+G_LOCK_DEFINE_STATIC (branch_stats);
+
+static void branch_debug_init (void)
+{
+	static gsize init = 0;
+	if (g_once_init_enter (&init))
+	{
+		GST_DEBUG_CATEGORY_INIT (dreambranch_debug, "dreambranch", 0, "dreamrtspserver branch attach/detach");
+		g_once_init_leave (&init, 1);
+	}
+}
+
+/* takes the floating references of queue and sink */
+DreamBranch *dream_branch_new (const gchar *name, GstElement *queue, GstElement *sink)
+{
+	DreamBranch *branch;
+
+	g_return_val_if_fail (GST_IS_ELEMENT (queue) && GST_IS_ELEMENT (sink), NULL);
+	branch_debug_init ();
+	branch = g_new0 (DreamBranch, 1);
+	branch->ref_count = 1;
+	branch->name = g_strdup (name);
+	branch->queue = gst_object_ref_sink (queue);
+	branch->sink = gst_object_ref_sink (sink);
+	g_mutex_init (&branch->lock);
+	g_atomic_int_inc (&branches_live);
+	GST_DEBUG ("branch %s created", name);
+	return branch;
+}
+
+DreamBranch *dream_branch_ref (DreamBranch *branch)
+{
+	g_atomic_int_inc (&branch->ref_count);
+	return branch;
+}
+
+void dream_branch_unref (DreamBranch *branch)
+{
+	if (!g_atomic_int_dec_and_test (&branch->ref_count))
+		return;
+	g_warn_if_fail (branch->state == BRANCH_DETACHED);
+	GST_DEBUG ("branch %s freed", branch->name);
+	gst_object_unref (branch->queue);
+	gst_object_unref (branch->sink);
+	g_mutex_clear (&branch->lock);
+	g_free (branch->name);
+	g_free (branch);
+	g_atomic_int_add (&branches_live, -1);
+}
+
+const gchar *dream_branch_get_name (DreamBranch *branch)
+{
+	return branch->name;
+}
+
+GstElement *dream_branch_get_queue (DreamBranch *branch)
+{
+	return branch->queue;
+}
+
+GstElement *dream_branch_get_sink (DreamBranch *branch)
+{
+	return branch->sink;
+}
+
+gboolean dream_branch_is_attached (DreamBranch *branch)
+{
+	gboolean attached;
+	g_mutex_lock (&branch->lock);
+	attached = branch->state == BRANCH_ATTACHED;
+	g_mutex_unlock (&branch->lock);
+	return attached;
+}
+
+/* adds the branch to bin and links it to a new pad of tee. the elements
+ * follow the state of bin, so a branch attached to a READY pipeline starts
+ * with it */
+gboolean dream_branch_attach (DreamBranch *branch, GstBin *bin, GstElement *tee)
+{
+	GstPad *teepad, *sinkpad;
+	GstPadLinkReturn ret;
+
+	g_mutex_lock (&branch->lock);
+	if (branch->state != BRANCH_DETACHED)
+	{
+		g_mutex_unlock (&branch->lock);
+		GST_WARNING ("branch %s is already attached", branch->name);
+		return FALSE;
+	}
+	branch->state = BRANCH_ATTACHED;
+	g_mutex_unlock (&branch->lock);
+
+	/* the bin takes a reference of its own, ours stays with the branch */
+	gst_bin_add_many (bin, branch->queue, branch->sink, NULL);
+	if (!gst_element_link (branch->queue, branch->sink))
+	{
+		GST_ERROR ("branch %s: couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT, branch->name, branch->queue, branch->sink);
+		goto fail;
+	}
+
+	/* sink first so the queue never pushes into a stopped element */
+	if (!gst_element_sync_state_with_parent (branch->sink) || !gst_element_sync_state_with_parent (branch->queue))
+	{
+		GST_ERROR ("branch %s: couldn't bring elements to the state of %" GST_PTR_FORMAT, branch->name, bin);
+		goto fail;
+	}
+
+	teepad = gst_element_get_request_pad (tee, "src_%u");
+	sinkpad = gst_element_get_static_pad (branch->queue, "sink");
+	ret = gst_pad_link (teepad, sinkpad);
+	gst_object_unref (sinkpad);
+	if (ret != GST_PAD_LINK_OK)
+	{
+		GST_ERROR ("branch %s: couldn't link %" GST_PTR_FORMAT " (%i)", branch->name, teepad, ret);
+		gst_element_release_request_pad (tee, teepad);
+		gst_object_unref (teepad);
+		goto fail;
+	}
+
+	g_mutex_lock (&branch->lock);
+	branch->bin = gst_object_ref (bin);
+	branch->tee = gst_object_ref (tee);
+	branch->teepad = teepad;
+	g_mutex_unlock (&branch->lock);
+
+	G_LOCK (branch_stats);
+	branches_attached++;
+	G_UNLOCK (branch_stats);
+	GST_INFO ("branch %s attached to %" GST_PTR_FORMAT, branch->name, tee);
+	return TRUE;
+
+fail:
+	gst_element_set_state (branch->sink, GST_STATE_NULL);
+	gst_element_set_state (branch->queue, GST_STATE_NULL);
+	gst_bin_remove_many (bin, branch->queue, branch->sink, NULL);
+	g_mutex_lock (&branch->lock);
+	branch->state = BRANCH_DETACHED;
+	g_mutex_unlock (&branch->lock);
+	return FALSE;
+}
+
+static gboolean branch_detach_done (gpointer user_data)
+{
+	DreamBranch *branch = user_data;
+	DreamBranchFunc done;
+	gpointer done_data;
+
+	g_mutex_lock (&branch->lock);
+	done = branch->done;
+	done_data = branch->done_data;
+	branch->done = NULL;
+	branch->done_data = NULL;
+	g_mutex_unlock (&branch->lock);
+
+	if (done)
+		done (branch, done_data);
+	dream_branch_unref (branch);
+	return G_SOURCE_REMOVE;
+}
+
+/* runs on a GStreamer worker thread: bringing a sink down can block, e.g. a
+ * tcpclientsink in a send, and neither the streaming thread which found the
+ * pad idle nor the control context should wait for that */
+static void branch_teardown (GstElement *element, gpointer user_data)
+{
+	DreamBranch *branch = user_data;
+	GstBin *bin;
+	GstClockTime duration;
+
+	gst_element_set_state (branch->sink, GST_STATE_NULL);
+	gst_element_set_state (branch->queue, GST_STATE_NULL);
+
+	g_mutex_lock (&branch->lock);
+	bin = branch->bin;
+	branch->bin = NULL;
+	g_mutex_unlock (&branch->lock);
+
+	gst_bin_remove_many (bin, branch->queue, branch->sink, NULL);
+	gst_object_unref (bin);
+
+	g_mutex_lock (&branch->lock);
+	branch->state = BRANCH_DETACHED;
+	duration = gst_util_get_timestamp () - branch->detach_start;
+	g_mutex_unlock (&branch->lock);
+
+	G_LOCK (branch_stats);
+	branches_detached++;
+	detach_max = MAX (detach_max, duration);
+	G_UNLOCK (branch_stats);
+	dream_metrics_observe (DREAM_METRIC_BRANCH_DETACH_SECONDS, duration / GST_USECOND);
+	GST_INFO ("branch %s detached after %" GST_TIME_FORMAT, branch->name, GST_TIME_ARGS (duration));
+
+	g_main_context_invoke (NULL, branch_detach_done, branch);
+}
+
+static GstPadProbeReturn branch_idle_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	DreamBranch *branch = user_data;
+	GstPad *teepad;
+	GstElement *tee;
+
+	g_mutex_lock (&branch->lock);
+	teepad = branch->teepad;
+	tee = branch->tee;
+	branch->teepad = NULL;
+	branch->tee = NULL;
+	g_mutex_unlock (&branch->lock);
+
+	/* IDLE probes may fire more than once */
+	if (!teepad)
+		return GST_PAD_PROBE_REMOVE;
+
+	GST_DEBUG ("branch %s idle, unlinking %" GST_PTR_FORMAT, branch->name, teepad);
+	gst_pad_unlink (teepad, pad);
+	gst_element_release_request_pad (tee, teepad);
+	gst_object_unref (teepad);
+	gst_object_unref (tee);
+
+	gst_element_call_async (branch->sink, branch_teardown, branch, NULL);
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/* unlinks the branch as soon as no buffer passes its queue's sink pad.
+ * returns FALSE if it isn't attached, otherwise done is called on the
+ * control context once the elements are out of the bin */
+gboolean dream_branch_detach (DreamBranch *branch, DreamBranchFunc done, gpointer user_data)
+{
+	GstPad *sinkpad;
+
+	g_mutex_lock (&branch->lock);
+	if (branch->state != BRANCH_ATTACHED)
+	{
+		g_mutex_unlock (&branch->lock);
+		GST_DEBUG ("branch %s isn't attached", branch->name);
+		return FALSE;
+	}
+	branch->state = BRANCH_DETACHING;
+	branch->done = done;
+	branch->done_data = user_data;
+	branch->detach_start = gst_util_get_timestamp ();
+	g_mutex_unlock (&branch->lock);
+
+	/* released in branch_detach_done */
+	dream_branch_ref (branch);
+	sinkpad = gst_element_get_static_pad (branch->queue, "sink");
+	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, branch_idle_probe, branch, NULL);
+	gst_object_unref (sinkpad);
+	return TRUE;
+}
+
+void dream_branch_get_stats (DreamBranchStats *stats)
+{
+	stats->live = g_atomic_int_get (&branches_live);
+	G_LOCK (branch_stats);
+	stats->attached = branches_attached;
+	stats->detached = branches_detached;
+	stats->detach_max = detach_max;
+	G_UNLOCK (branch_stats);
+}
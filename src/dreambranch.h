@@ -0,0 +1,58 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __DREAMBRANCH_H__
+#define __DREAMBRANCH_H__
+
+G_BEGIN_DECLS
+
+/* a consumer of the source pipeline: a queue and a sink hanging off one of
+ * its tees. attaching happens on the calling thread, detaching waits for
+ * the tee pad to become idle, tears the elements down on a GStreamer worker
+ * thread and reports back on the control context.
+ *
+ * locking order: the caller may hold its output's lock when attaching or
+ * detaching, the branch lock nests inside it and is never held while
+ * changing element states. the completion callback runs with no lock held */
+typedef struct _DreamBranch DreamBranch;
+
+typedef void (*DreamBranchFunc) (DreamBranch *branch, gpointer user_data);
+
+typedef struct {
+	guint live;
+	guint64 attached, detached;
+	/* slowest detach so far, idle probe to completion */
+	GstClockTime detach_max;
+} DreamBranchStats;
+
+DreamBranch * dream_branch_new       (const gchar *name, GstElement *queue, GstElement *sink);
+DreamBranch * dream_branch_ref       (DreamBranch *branch);
+void          dream_branch_unref     (DreamBranch *branch);
+const gchar * dream_branch_get_name  (DreamBranch *branch);
+GstElement *  dream_branch_get_queue (DreamBranch *branch);
+GstElement *  dream_branch_get_sink  (DreamBranch *branch);
+gboolean      dream_branch_attach    (DreamBranch *branch, GstBin *bin, GstElement *tee);
+gboolean      dream_branch_detach    (DreamBranch *branch, DreamBranchFunc done, gpointer user_data);
+gboolean      dream_branch_is_attached (DreamBranch *branch);
+void          dream_branch_get_stats (DreamBranchStats *stats);
+
+G_END_DECLS
+
+#endif /* __DREAMBRANCH_H__ */
@@ -0,0 +1,244 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include "dreambudget.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreambudget_debug);
+#define GST_CAT_DEFAULT dreambudget_debug
+
+/* no queue gets less than this, unless the budget is too small for all
+ * or the queue's own limit is lower */
+#define BUDGET_MIN_BYTES (256 * 1024)
+/* a queue may ask for twice its current level to keep filling */
+#define BUDGET_GROWTH 2
+/* smaller changes aren't applied */
+#define BUDGET_MIN_CHANGE 8
+#define BUDGET_PRESSURE_HIGH 0.9
+
+typedef struct {
+	DreamBranch *branch;
+	GstElement *queue;
+	guint weight;
+	guint original;
+	guint limit, level;
+	guint64 target;
+} DreamBudgetEntry;
+
+struct _DreamBudget {
+	GMutex lock;
+	guint64 bytes;
+	GList *entries;
+	guint64 used;
+	guint64 rebalances;
+	gboolean pressure_high;
+};
+
+DreamBudget *dream_budget_new (guint64 bytes)
+{
+	DreamBudget *budget = g_new0 (DreamBudget, 1);
+
+	GST_DEBUG_CATEGORY_INIT (dreambudget_debug, "dreambudget", 0, "dreamrtspserver buffering budget");
+	g_mutex_init (&budget->lock);
+	budget->bytes = bytes;
+	return budget;
+}
+
+static void entry_free (DreamBudgetEntry *e)
+{
+	g_object_set (e->queue, "max-size-bytes", e->original, NULL);
+	gst_object_unref (e->queue);
+	dream_branch_unref (e->branch);
+	g_free (e);
+}
+
+void dream_budget_free (DreamBudget *budget)
+{
+	g_list_free_full (budget->entries, (GDestroyNotify) entry_free);
+	g_mutex_clear (&budget->lock);
+	g_free (budget);
+}
+
+/* 0 disables the budget and gives the queues their own limits back */
+void dream_budget_set (DreamBudget *budget, guint64 bytes)
+{
+	GList *l;
+
+	g_mutex_lock (&budget->lock);
+	budget->bytes = bytes;
+	if (!bytes)
+	{
+		for (l = budget->entries; l; l = l->next)
+		{
+			DreamBudgetEntry *e = l->data;
+			g_object_set (e->queue, "max-size-bytes", e->original, NULL);
+			e->limit = e->original;
+		}
+	}
+	g_mutex_unlock (&budget->lock);
+	GST_INFO ("buffering budget %" G_GUINT64_FORMAT " bytes", bytes);
+	dream_budget_rebalance (budget);
+}
+
+/* the branch's queue is limited from now on, a higher weight gets a
+ * larger guaranteed share */
+void dream_budget_add (DreamBudget *budget, DreamBranch *branch, guint weight)
+{
+	DreamBudgetEntry *e = g_new0 (DreamBudgetEntry, 1);
+
+	e->branch = dream_branch_ref (branch);
+	e->queue = gst_object_ref (dream_branch_get_queue (branch));
+	e->weight = MAX (weight, 1);
+	g_object_get (e->queue, "max-size-bytes", &e->original, NULL);
+	e->limit = e->original;
+	g_mutex_lock (&budget->lock);
+	budget->entries = g_list_append (budget->entries, e);
+	g_mutex_unlock (&budget->lock);
+	GST_DEBUG ("branch %s joins the budget with weight %u", dream_branch_get_name (branch), e->weight);
+	dream_budget_rebalance (budget);
+}
+
+/* before detaching, the others can have its share right away */
+void dream_budget_remove (DreamBudget *budget, DreamBranch *branch)
+{
+	DreamBudgetEntry *e = NULL;
+	GList *l;
+
+	g_mutex_lock (&budget->lock);
+	for (l = budget->entries; l; l = l->next)
+	{
+		if (((DreamBudgetEntry *) l->data)->branch == branch)
+		{
+			e = l->data;
+			budget->entries = g_list_delete_link (budget->entries, l);
+			break;
+		}
+	}
+	g_mutex_unlock (&budget->lock);
+	if (!e)
+		return;
+	GST_DEBUG ("branch %s leaves the budget", dream_branch_get_name (branch));
+	entry_free (e);
+	dream_budget_rebalance (budget);
+}
+
+/* the most a queue is ever given, its own limit unless that was unlimited */
+static guint64 entry_cap (DreamBudgetEntry *e)
+{
+	return e->original ? e->original : G_MAXUINT;
+}
+
+/* called periodically from the control context. every queue is guaranteed
+ * the floor plus its weighted share of the rest, up to its own limit, so a
+ * burst on an idle output always has room. only what the shares leave over
+ * is lent by weight to the queues which need more than their share */
+gboolean dream_budget_rebalance (DreamBudget *budget)
+{
+	guint64 floor, assigned = 0, spare, needy_weight = 0, total_weight = 0, used = 0;
+	guint n = 0;
+	GList *l;
+
+	g_mutex_lock (&budget->lock);
+	for (l = budget->entries; l; l = l->next)
+	{
+		DreamBudgetEntry *e = l->data;
+		g_object_get (e->queue, "current-level-bytes", &e->level, NULL);
+		used += e->level;
+		total_weight += e->weight;
+		n++;
+	}
+	budget->used = used;
+	if (!budget->bytes || !n)
+	{
+		g_mutex_unlock (&budget->lock);
+		return G_SOURCE_CONTINUE;
+	}
+
+	/* all floors together never take more than the budget */
+	floor = MIN (BUDGET_MIN_BYTES, budget->bytes / n);
+	for (l = budget->entries; l; l = l->next)
+	{
+		DreamBudgetEntry *e = l->data;
+		guint64 share = floor + (budget->bytes - floor * n) * e->weight / total_weight;
+		e->target = MIN (share, entry_cap (e));
+		if ((guint64) e->level * BUDGET_GROWTH > e->target && e->target < entry_cap (e))
+			needy_weight += e->weight;
+		assigned += e->target;
+	}
+	spare = assigned < budget->bytes ? budget->bytes - assigned : 0;
+	for (l = budget->entries; l; l = l->next)
+	{
+		DreamBudgetEntry *e = l->data;
+		guint64 demand = MIN ((guint64) e->level * BUDGET_GROWTH, entry_cap (e));
+		if (needy_weight && demand > e->target)
+			e->target += MIN (demand - e->target, spare * e->weight / needy_weight);
+		/* a queue above its new limit leaks its oldest data on the next push */
+		if (e->limit == 0 || e->target < e->limit || e->target - e->limit > e->limit / BUDGET_MIN_CHANGE)
+		{
+			GST_LOG ("%s: level %u limit %u -> %" G_GUINT64_FORMAT, dream_branch_get_name (e->branch), e->level, e->limit, e->target);
+			e->limit = MIN (e->target, G_MAXUINT);
+			g_object_set (e->queue, "max-size-bytes", e->limit, NULL);
+		}
+	}
+	budget->rebalances++;
+
+	if (!budget->pressure_high && used > budget->bytes * BUDGET_PRESSURE_HIGH)
+		GST_WARNING ("buffering budget under pressure: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " bytes used", used, budget->bytes);
+	budget->pressure_high = used > budget->bytes * BUDGET_PRESSURE_HIGH;
+	g_mutex_unlock (&budget->lock);
+	return G_SOURCE_CONTINUE;
+}
+
+void dream_budget_get_stats (DreamBudget *budget, DreamBudgetStats *stats)
+{
+	g_mutex_lock (&budget->lock);
+	stats->budget = budget->bytes;
+	stats->used = budget->used;
+	stats->pressure = budget->bytes ? (gdouble) budget->used / budget->bytes : 0.0;
+	stats->rebalances = budget->rebalances;
+	g_mutex_unlock (&budget->lock);
+}
+
+/* levels as of the last rebalance */
+GArray *dream_budget_snapshot (DreamBudget *budget)
+{
+	GArray *queues = g_array_new (FALSE, TRUE, sizeof (DreamBudgetQueueStats));
+	GList *l;
+
+	g_mutex_lock (&budget->lock);
+	for (l = budget->entries; l; l = l->next)
+	{
+		DreamBudgetEntry *e = l->data;
+		DreamBudgetQueueStats q;
+		q.name = g_strdup (dream_branch_get_name (e->branch));
+		q.weight = e->weight;
+		q.limit = e->limit;
+		q.level = e->level;
+		g_array_append_val (queues, q);
+	}
+	g_mutex_unlock (&budget->lock);
+	return queues;
+}
+
+void dream_budget_snapshot_free (GArray *queues)
+{
+	guint i;
+
+	for (i = 0; i < queues->len; i++)
+		g_free (g_array_index (queues, DreamBudgetQueueStats, i).name);
+	g_array_free (queues, TRUE);
+}
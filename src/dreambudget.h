@@ -0,0 +1,61 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+#include "dreambranch.h"
+
+#ifndef __DREAMBUDGET_H__
+#define __DREAMBUDGET_H__
+
+G_BEGIN_DECLS
+
+/* one buffering budget in bytes for the queues of all attached branches.
+ * every branch is guaranteed its weighted share up to its own queue limit,
+ * what the shares leave over goes to the branches which are filling up.
+ * the sum of the queue limits never exceeds the budget, so a stall on
+ * every output at once stays within it */
+typedef struct _DreamBudget DreamBudget;
+
+typedef struct {
+	gchar *name;
+	guint weight;
+	guint limit;
+	guint level;
+} DreamBudgetQueueStats;
+
+typedef struct {
+	guint64 budget;
+	guint64 used;
+	/* used share of the budget */
+	gdouble pressure;
+	guint64 rebalances;
+} DreamBudgetStats;
+
+DreamBudget * dream_budget_new        (guint64 bytes);
+void          dream_budget_free       (DreamBudget *budget);
+void          dream_budget_set        (DreamBudget *budget, guint64 bytes);
+void          dream_budget_add        (DreamBudget *budget, DreamBranch *branch, guint weight);
+void          dream_budget_remove     (DreamBudget *budget, DreamBranch *branch);
+gboolean      dream_budget_rebalance  (DreamBudget *budget);
+void          dream_budget_get_stats  (DreamBudget *budget, DreamBudgetStats *stats);
+GArray *      dream_budget_snapshot   (DreamBudget *budget);
+void          dream_budget_snapshot_free (GArray *queues);
+
+G_END_DECLS
+
+#endif /* __DREAMBUDGET_H__ */
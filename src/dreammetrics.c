@@ -0,0 +1,487 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "dreammetrics.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreammetrics_debug);
+#define GST_CAT_DEFAULT dreammetrics_debug
+
+typedef struct _DreamMetricBlock DreamMetricBlock;
+
+/* native words, 64 bit atomics take a lock in libatomic on 32 bit MIPS.
+ * the owning thread carries into high when low wraps, which never
+ * happens where gulong is 64 bits wide */
+typedef struct {
+	gulong low;
+	gulong high;
+} DreamMetricValue;
+
+typedef struct {
+	DreamMetricValue buckets[DREAM_METRIC_N_BUCKETS];
+	DreamMetricValue sum_us;
+	DreamMetricValue count;
+} DreamMetricHistogramStore;
+
+struct _DreamMetricBlock {
+	DreamMetricValue counters[DREAM_METRIC_COUNTER_LAST];
+	DreamMetricHistogramStore histograms[DREAM_METRIC_HISTOGRAM_LAST];
+	DreamMetricHistogramStore latency[DREAM_LATENCY_PATH_LAST][DREAM_LATENCY_STAGE_LAST];
+	/* odd while the owner writes a carry */
+	gulong carries;
+	gint in_use;
+	DreamMetricBlock *next;
+	/* keep the next thread's block off this cache line */
+	gchar _padding[64];
+};
+
+static const guint64 bucket_bounds[DREAM_METRIC_N_BUCKETS] = DREAM_METRIC_BUCKETS;
+
+/* blocks are only ever prepended and never freed, so the scraper walks
+ * the list without a lock. a thread's block is recycled after it exited */
+static DreamMetricBlock *blocks = NULL;
+static GMutex blocks_lock;
+
+gint dream_latency_enabled = 0;
+/* origin of the last video buffer that went towards the muxer */
+static guint64 latency_last_origin = GST_CLOCK_TIME_NONE;
+
+static const gchar *latency_path_names[DREAM_LATENCY_PATH_LAST] = { "source", "es_rtsp", "ts_rtsp", "hls", "upstream" };
+static const gchar *latency_stage_names[DREAM_LATENCY_STAGE_LAST] = { "push", "parse", "queue", "mux", "handover", "payload", "sink" };
+
+static void release_block (gpointer data)
+{
+	DreamMetricBlock *block = data;
+	__atomic_store_n (&block->in_use, FALSE, __ATOMIC_RELEASE);
+}
+
+static GPrivate current_block = G_PRIVATE_INIT (release_block);
+
+static DreamMetricBlock *get_block (void)
+{
+	DreamMetricBlock *block = g_private_get (&current_block);
+
+	if (G_LIKELY (block))
+		return block;
+
+	g_mutex_lock (&blocks_lock);
+	for (block = blocks; block; block = block->next)
+		if (!__atomic_load_n (&block->in_use, __ATOMIC_ACQUIRE))
+			break;
+	if (!block)
+	{
+		block = g_new0 (DreamMetricBlock, 1);
+		block->next = blocks;
+		__atomic_store_n (&blocks, block, __ATOMIC_RELEASE);
+		GST_DEBUG ("new counter block %p for thread %p", block, g_thread_self ());
+	}
+	block->in_use = TRUE;
+	g_mutex_unlock (&blocks_lock);
+
+	g_private_set (&current_block, block);
+	return block;
+}
+
+/* only the owning thread writes, a relaxed load/store pair is enough and
+ * avoids the locked read-modify-write */
+static inline void metric_add (DreamMetricBlock *block, DreamMetricValue *v, guint64 value)
+{
+	gulong low = __atomic_load_n (&v->low, __ATOMIC_RELAXED);
+	gulong sum = low + (gulong) value;
+	gulong carry = sum < low;
+
+#if GLIB_SIZEOF_LONG == 4
+	carry += value >> 32;
+#endif
+	if (G_LIKELY (!carry))
+	{
+		__atomic_store_n (&v->low, sum, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_store_n (&block->carries, block->carries + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	__atomic_store_n (&v->low, sum, __ATOMIC_RELAXED);
+	__atomic_store_n (&v->high, v->high + carry, __ATOMIC_RELAXED);
+	__atomic_store_n (&block->carries, block->carries + 1, __ATOMIC_RELEASE);
+}
+
+/* widened to 64 bits here, retried if a carry was written meanwhile */
+static guint64 metric_get (DreamMetricBlock *block, DreamMetricValue *v)
+{
+	gulong carries;
+	guint64 value;
+
+	do {
+		carries = __atomic_load_n (&block->carries, __ATOMIC_ACQUIRE);
+		value = __atomic_load_n (&v->low, __ATOMIC_RELAXED);
+#if GLIB_SIZEOF_LONG == 4
+		value |= (guint64) __atomic_load_n (&v->high, __ATOMIC_RELAXED) << 32;
+#endif
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while ((carries & 1) || carries != __atomic_load_n (&block->carries, __ATOMIC_RELAXED));
+	return value;
+}
+
+void dream_metrics_init (void)
+{
+	GST_DEBUG_CATEGORY_INIT (dreammetrics_debug, "dreammetrics", 0, "dreamrtspserver metrics");
+}
+
+void dream_metrics_add (DreamMetricCounter counter, guint64 value)
+{
+	DreamMetricBlock *block = get_block ();
+	metric_add (block, &block->counters[counter], value);
+}
+
+static void histogram_observe (DreamMetricBlock *block, DreamMetricHistogramStore *h, gint64 duration_us)
+{
+	guint i;
+
+	if (duration_us < 0)
+		duration_us = 0;
+	for (i = 0; i < DREAM_METRIC_N_BUCKETS - 1 && (guint64) duration_us > bucket_bounds[i]; i++)
+		;
+	metric_add (block, &h->buckets[i], 1);
+	metric_add (block, &h->sum_us, duration_us);
+	metric_add (block, &h->count, 1);
+}
+
+void dream_metrics_observe (DreamMetricHistogram histogram, gint64 duration_us)
+{
+	DreamMetricBlock *block = get_block ();
+	histogram_observe (block, &block->histograms[histogram], duration_us);
+}
+
+guint64 dream_metrics_get (DreamMetricCounter counter)
+{
+	DreamMetricBlock *block;
+	guint64 sum = 0;
+
+	for (block = __atomic_load_n (&blocks, __ATOMIC_ACQUIRE); block; block = block->next)
+		sum += metric_get (block, &block->counters[counter]);
+	return sum;
+}
+
+static void histogram_sum (DreamMetricHistogramValue *value, DreamMetricBlock *block, DreamMetricHistogramStore *h)
+{
+	guint i;
+
+	for (i = 0; i < DREAM_METRIC_N_BUCKETS; i++)
+		value->buckets[i] += metric_get (block, &h->buckets[i]);
+	value->sum_us += metric_get (block, &h->sum_us);
+	value->count += metric_get (block, &h->count);
+}
+
+void dream_metrics_get_histogram (DreamMetricHistogram histogram, DreamMetricHistogramValue *value)
+{
+	DreamMetricBlock *block;
+
+	memset (value, 0, sizeof (DreamMetricHistogramValue));
+	for (block = __atomic_load_n (&blocks, __ATOMIC_ACQUIRE); block; block = block->next)
+		histogram_sum (value, block, &block->histograms[histogram]);
+}
+
+/* help and type are only written when help is given, so several labelled
+ * samples of the same metric can follow each other */
+void dream_metrics_append (GString *out, const gchar *type, const gchar *name, const gchar *help, const gchar *labels, gdouble value)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+	if (help)
+		g_string_append_printf (out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+	g_string_append_printf (out, "%s%s%s%s %s\n", name, labels ? "{" : "", labels ? labels : "", labels ? "}" : "", g_ascii_dtostr (buf, sizeof (buf), value));
+}
+
+/* labels are prepended to le= and used as is for _sum and _count */
+static void append_histogram_value (GString *out, const gchar *name, const gchar *labels, DreamMetricHistogramValue *h)
+{
+	gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+	const gchar *sep = labels ? "," : "";
+	guint64 cumulative = 0;
+	guint i;
+
+	if (!labels)
+		labels = "";
+	for (i = 0; i < DREAM_METRIC_N_BUCKETS; i++)
+	{
+		cumulative += h->buckets[i];
+		if (i < DREAM_METRIC_N_BUCKETS - 1)
+			g_string_append_printf (out, "%s_bucket{%s%sle=\"%s\"} %" G_GUINT64_FORMAT "\n", name, labels, sep, g_ascii_dtostr (buf, sizeof (buf), bucket_bounds[i] / 1e6), cumulative);
+		else
+			g_string_append_printf (out, "%s_bucket{%s%sle=\"+Inf\"} %" G_GUINT64_FORMAT "\n", name, labels, sep, cumulative);
+	}
+	g_string_append_printf (out, "%s_sum%s%s%s %s\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", g_ascii_dtostr (buf, sizeof (buf), h->sum_us / 1e6));
+	g_string_append_printf (out, "%s_count%s%s%s %" G_GUINT64_FORMAT "\n", name, *labels ? "{" : "", labels, *labels ? "}" : "", h->count);
+}
+
+void dream_metrics_append_histogram (GString *out, const gchar *name, const gchar *help, DreamMetricHistogram histogram)
+{
+	DreamMetricHistogramValue h;
+
+	dream_metrics_get_histogram (histogram, &h);
+	g_string_append_printf (out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+	append_histogram_value (out, name, NULL, &h);
+}
+
+void dream_metrics_append_process (GString *out)
+{
+	struct rusage usage;
+	unsigned long size = 0, resident = 0;
+	FILE *f;
+
+	if (getrusage (RUSAGE_SELF, &usage) == 0)
+		dream_metrics_append (out, "counter", "process_cpu_seconds_total", "Total user and system CPU time spent in seconds.", NULL,
+			usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6);
+
+	f = fopen ("/proc/self/statm", "r");
+	if (f)
+	{
+		if (fscanf (f, "%lu %lu", &size, &resident) == 2)
+		{
+			long pagesize = sysconf (_SC_PAGESIZE);
+			dream_metrics_append (out, "gauge", "process_virtual_memory_bytes", "Virtual memory size in bytes.", NULL, (gdouble) size * pagesize);
+			dream_metrics_append (out, "gauge", "process_resident_memory_bytes", "Resident memory size in bytes.", NULL, (gdouble) resident * pagesize);
+		}
+		fclose (f);
+	}
+}
+
+GType dream_latency_meta_api_get_type (void)
+{
+	static volatile GType type;
+	static const gchar *tags[] = { NULL };
+
+	if (g_once_init_enter (&type))
+	{
+		GType _type = gst_meta_api_type_register ("DreamLatencyMetaAPI", tags);
+		g_once_init_leave (&type, _type);
+	}
+	return type;
+}
+
+static gboolean latency_meta_init (GstMeta *meta, gpointer params, GstBuffer *buffer)
+{
+	((DreamLatencyMeta *) meta)->origin = GST_CLOCK_TIME_NONE;
+	return TRUE;
+}
+
+/* no tags, so payloaders and parsers carry the stamp over to their output */
+static gboolean latency_meta_transform (GstBuffer *dest, GstMeta *meta, GstBuffer *buffer, GQuark type, gpointer data)
+{
+	DreamLatencyMeta *dmeta = dream_buffer_get_latency_meta (dest);
+
+	if (!dmeta)
+		dmeta = (DreamLatencyMeta *) gst_buffer_add_meta (dest, DREAM_LATENCY_META_INFO, NULL);
+	if (!dmeta)
+		return FALSE;
+	dmeta->origin = ((DreamLatencyMeta *) meta)->origin;
+	return TRUE;
+}
+
+const GstMetaInfo *dream_latency_meta_get_info (void)
+{
+	static const GstMetaInfo *info = NULL;
+
+	if (g_once_init_enter (&info))
+	{
+		const GstMetaInfo *meta = gst_meta_register (DREAM_LATENCY_META_API_TYPE, "DreamLatencyMeta", sizeof (DreamLatencyMeta),
+			latency_meta_init, NULL, latency_meta_transform);
+		g_once_init_leave (&info, meta);
+	}
+	return info;
+}
+
+void dream_latency_set_enabled (gboolean enabled)
+{
+	GST_INFO ("latency tracing %s", enabled ? "enabled" : "disabled");
+	__atomic_store_n (&dream_latency_enabled, enabled ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+const gchar *dream_latency_path_name (DreamLatencyPath path)
+{
+	return latency_path_names[path];
+}
+
+const gchar *dream_latency_stage_name (DreamLatencyStage stage)
+{
+	return latency_stage_names[stage];
+}
+
+static void latency_observe_origin (GstClockTime origin, DreamLatencyPath path, DreamLatencyStage stage)
+{
+	GstClockTime now = gst_util_get_timestamp ();
+	DreamMetricBlock *block;
+
+	if (!GST_CLOCK_TIME_IS_VALID (origin))
+		return;
+	block = get_block ();
+	histogram_observe (block, &block->latency[path][stage], now > origin ? (now - origin) / GST_USECOND : 0);
+	if (path == DREAM_LATENCY_PATH_SOURCE)
+		__atomic_store_n (&latency_last_origin, origin, __ATOMIC_RELAXED);
+}
+
+void dream_latency_observe (GstBuffer *buffer, DreamLatencyPath path, DreamLatencyStage stage)
+{
+	DreamLatencyMeta *meta = dream_buffer_get_latency_meta (buffer);
+
+	if (meta)
+		latency_observe_origin (meta->origin, path, stage);
+}
+
+typedef struct {
+	DreamLatencyPath path;
+	DreamLatencyStage stage;
+} DreamLatencyWatch;
+
+static gboolean latency_observe_list (GstBuffer **buffer, guint idx, gpointer user_data)
+{
+	DreamLatencyWatch *watch = user_data;
+	DreamLatencyMeta *meta = dream_buffer_get_latency_meta (*buffer);
+
+	/* a payloaded frame spans several packets that all carry the stamp,
+	 * only the first one is counted */
+	if (meta)
+	{
+		latency_observe_origin (meta->origin, watch->path, watch->stage);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static GstPadProbeReturn latency_pad_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	DreamLatencyWatch *watch = user_data;
+
+	if (!DREAM_LATENCY_ENABLED ())
+		return GST_PAD_PROBE_OK;
+
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+		dream_latency_observe (GST_PAD_PROBE_INFO_BUFFER (info), watch->path, watch->stage);
+	else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+		gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info), latency_observe_list, watch);
+	return GST_PAD_PROBE_OK;
+}
+
+void dream_latency_watch_pad (GstPad *pad, DreamLatencyPath path, DreamLatencyStage stage)
+{
+	DreamLatencyWatch *watch = g_new (DreamLatencyWatch, 1);
+
+	watch->path = path;
+	watch->stage = stage;
+	gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, latency_pad_probe, watch, g_free);
+	GST_DEBUG_OBJECT (pad, "watching latency of %s %s", latency_path_names[path], latency_stage_names[stage]);
+}
+
+/* the origin is the capture time: the buffer's running time in clock time,
+ * so the push stage is the encoder delay */
+static GstPadProbeReturn latency_source_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	GstElement *pipeline = user_data;
+	GstBuffer *buffer;
+	DreamLatencyMeta *meta;
+	GstClockTime origin;
+
+	if (!DREAM_LATENCY_ENABLED ())
+		return GST_PAD_PROBE_OK;
+
+	buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+	if (!GST_BUFFER_PTS_IS_VALID (buffer))
+		return GST_PAD_PROBE_OK;
+	origin = gst_element_get_base_time (pipeline) + GST_BUFFER_PTS (buffer);
+
+	buffer = gst_buffer_make_writable (buffer);
+	meta = (DreamLatencyMeta *) gst_buffer_add_meta (buffer, DREAM_LATENCY_META_INFO, NULL);
+	meta->origin = origin;
+	GST_PAD_PROBE_INFO_DATA (info) = buffer;
+
+	latency_observe_origin (origin, DREAM_LATENCY_PATH_SOURCE, DREAM_LATENCY_STAGE_PUSH);
+	return GST_PAD_PROBE_OK;
+}
+
+void dream_latency_watch_source (GstPad *srcpad, GstElement *pipeline)
+{
+	gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, latency_source_probe, pipeline, NULL);
+	GST_DEBUG_OBJECT (srcpad, "stamping buffers for latency tracing");
+}
+
+/* the muxer drops metas, its output carries the origin of the newest
+ * video frame that went in */
+static GstPadProbeReturn latency_mux_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	GstBuffer *buffer;
+	DreamLatencyMeta *meta;
+	GstClockTime origin;
+
+	if (!DREAM_LATENCY_ENABLED () || !(info->type & GST_PAD_PROBE_TYPE_BUFFER))
+		return GST_PAD_PROBE_OK;
+
+	origin = __atomic_load_n (&latency_last_origin, __ATOMIC_RELAXED);
+	if (!GST_CLOCK_TIME_IS_VALID (origin))
+		return GST_PAD_PROBE_OK;
+
+	buffer = gst_buffer_make_writable (GST_PAD_PROBE_INFO_BUFFER (info));
+	meta = dream_buffer_get_latency_meta (buffer);
+	if (!meta)
+		meta = (DreamLatencyMeta *) gst_buffer_add_meta (buffer, DREAM_LATENCY_META_INFO, NULL);
+	meta->origin = origin;
+	GST_PAD_PROBE_INFO_DATA (info) = buffer;
+
+	latency_observe_origin (origin, DREAM_LATENCY_PATH_SOURCE, DREAM_LATENCY_STAGE_MUX);
+	return GST_PAD_PROBE_OK;
+}
+
+void dream_latency_watch_mux (GstPad *srcpad)
+{
+	gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, latency_mux_probe, NULL, NULL);
+	GST_DEBUG_OBJECT (srcpad, "restamping muxed buffers for latency tracing");
+}
+
+void dream_latency_get (DreamLatencyPath path, DreamLatencyStage stage, DreamMetricHistogramValue *value)
+{
+	DreamMetricBlock *block;
+
+	memset (value, 0, sizeof (DreamMetricHistogramValue));
+	for (block = __atomic_load_n (&blocks, __ATOMIC_ACQUIRE); block; block = block->next)
+		histogram_sum (value, block, &block->latency[path][stage]);
+}
+
+void dream_latency_append (GString *out)
+{
+	static const gchar *name = "dream_latency_seconds";
+	DreamMetricHistogramValue h;
+	DreamLatencyPath path;
+	DreamLatencyStage stage;
+
+	g_string_append_printf (out, "# HELP %s %s\n# TYPE %s histogram\n", name, "Time from video capture until a buffer passed the given stage.", name);
+	for (path = 0; path < DREAM_LATENCY_PATH_LAST; path++)
+		for (stage = 0; stage < DREAM_LATENCY_STAGE_LAST; stage++)
+		{
+			gchar *labels;
+			dream_latency_get (path, stage, &h);
+			if (!h.count)
+				continue;
+			labels = g_strdup_printf ("path=\"%s\",stage=\"%s\"", latency_path_names[path], latency_stage_names[stage]);
+			append_histogram_value (out, name, labels, &h);
+			g_free (labels);
+		}
+}
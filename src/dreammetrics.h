@@ -0,0 +1,136 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __DREAMMETRICS_H__
+#define __DREAMMETRICS_H__
+
+G_BEGIN_DECLS
+
+/* counters are kept per thread and summed up when scraped, so the
+ * streaming threads never share a cache line or take a lock */
+typedef enum {
+	DREAM_METRIC_RTSP_ES_AUDIO_BYTES,
+	DREAM_METRIC_RTSP_ES_AUDIO_BUFFERS,
+	DREAM_METRIC_RTSP_ES_VIDEO_BYTES,
+	DREAM_METRIC_RTSP_ES_VIDEO_BUFFERS,
+	DREAM_METRIC_RTSP_TS_BYTES,
+	DREAM_METRIC_RTSP_TS_BUFFERS,
+	DREAM_METRIC_RTSP_DISCARDED_BUFFERS,
+	DREAM_METRIC_RTSP_VARIANT_BUFFERS,
+	DREAM_METRIC_HLS_REQUESTS_OK,
+	DREAM_METRIC_HLS_REQUESTS_CLIENT_ERROR,
+	DREAM_METRIC_HLS_REQUESTS_SERVER_ERROR,
+	DREAM_METRIC_HLS_RESPONSE_BYTES,
+	DREAM_METRIC_SIGNALS_POSTED,
+	DREAM_METRIC_SIGNALS_EMITTED,
+	DREAM_METRIC_SIGNALS_COALESCED,
+	DREAM_METRIC_SIGNAL_POST_NS,
+	DREAM_METRIC_VIDEO_SWITCH_DROPPED_BUFFERS,
+	DREAM_METRIC_KEYFRAME_REQUESTS,
+	DREAM_METRIC_KEYFRAME_REQUESTS_SENT,
+	/* per DreamLockId */
+	DREAM_METRIC_LOCK_CONTENDED_UPSTREAM,
+	DREAM_METRIC_LOCK_CONTENDED_RTSP,
+	DREAM_METRIC_LOCK_CONTENDED_HLS,
+	DREAM_METRIC_LOCK_WAIT_NS_UPSTREAM,
+	DREAM_METRIC_LOCK_WAIT_NS_RTSP,
+	DREAM_METRIC_LOCK_WAIT_NS_HLS,
+	DREAM_METRIC_COUNTER_LAST
+} DreamMetricCounter;
+
+typedef enum {
+	DREAM_METRIC_HLS_PLAYLIST_SECONDS,
+	DREAM_METRIC_HLS_SEGMENT_SECONDS,
+	DREAM_METRIC_VIDEO_SWITCH_SECONDS,
+	DREAM_METRIC_SOURCE_WAKE_SECONDS,
+	DREAM_METRIC_BRANCH_DETACH_SECONDS,
+	DREAM_METRIC_HISTOGRAM_LAST
+} DreamMetricHistogram;
+
+/* upper bounds in microseconds, the last bucket is +Inf */
+#define DREAM_METRIC_BUCKETS { 1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, G_MAXUINT64 }
+#define DREAM_METRIC_N_BUCKETS 11
+
+typedef struct {
+	guint64 buckets[DREAM_METRIC_N_BUCKETS];
+	guint64 sum_us;
+	guint64 count;
+} DreamMetricHistogramValue;
+
+/* latency tracing: video buffers are stamped with their capture time at the
+ * source and observed at the following stages of each path */
+typedef enum {
+	DREAM_LATENCY_PATH_SOURCE,
+	DREAM_LATENCY_PATH_ES_RTSP,
+	DREAM_LATENCY_PATH_TS_RTSP,
+	DREAM_LATENCY_PATH_HLS,
+	DREAM_LATENCY_PATH_UPSTREAM,
+	DREAM_LATENCY_PATH_LAST
+} DreamLatencyPath;
+
+typedef enum {
+	DREAM_LATENCY_STAGE_PUSH,
+	DREAM_LATENCY_STAGE_PARSE,
+	DREAM_LATENCY_STAGE_QUEUE,
+	DREAM_LATENCY_STAGE_MUX,
+	DREAM_LATENCY_STAGE_HANDOVER,
+	DREAM_LATENCY_STAGE_PAYLOAD,
+	DREAM_LATENCY_STAGE_SINK,
+	DREAM_LATENCY_STAGE_LAST
+} DreamLatencyStage;
+
+typedef struct {
+	GstMeta meta;
+	GstClockTime origin;
+} DreamLatencyMeta;
+
+GType dream_latency_meta_api_get_type (void);
+const GstMetaInfo *dream_latency_meta_get_info (void);
+#define DREAM_LATENCY_META_API_TYPE (dream_latency_meta_api_get_type())
+#define DREAM_LATENCY_META_INFO (dream_latency_meta_get_info())
+#define dream_buffer_get_latency_meta(b) ((DreamLatencyMeta*)gst_buffer_get_meta((b), DREAM_LATENCY_META_API_TYPE))
+
+/* checked once per buffer by every probe, nothing else happens while it's 0 */
+extern gint dream_latency_enabled;
+#define DREAM_LATENCY_ENABLED() G_UNLIKELY (__atomic_load_n (&dream_latency_enabled, __ATOMIC_RELAXED))
+
+void     dream_latency_set_enabled     (gboolean enabled);
+void     dream_latency_watch_source    (GstPad *srcpad, GstElement *pipeline);
+void     dream_latency_watch_mux       (GstPad *srcpad);
+void     dream_latency_watch_pad       (GstPad *pad, DreamLatencyPath path, DreamLatencyStage stage);
+void     dream_latency_observe         (GstBuffer *buffer, DreamLatencyPath path, DreamLatencyStage stage);
+void     dream_latency_get             (DreamLatencyPath path, DreamLatencyStage stage, DreamMetricHistogramValue *value);
+const gchar * dream_latency_path_name  (DreamLatencyPath path);
+const gchar * dream_latency_stage_name (DreamLatencyStage stage);
+void     dream_latency_append          (GString *out);
+
+void     dream_metrics_init            (void);
+void     dream_metrics_add             (DreamMetricCounter counter, guint64 value);
+void     dream_metrics_observe         (DreamMetricHistogram histogram, gint64 duration_us);
+guint64  dream_metrics_get             (DreamMetricCounter counter);
+void     dream_metrics_get_histogram   (DreamMetricHistogram histogram, DreamMetricHistogramValue *value);
+
+void     dream_metrics_append          (GString *out, const gchar *type, const gchar *name, const gchar *help, const gchar *labels, gdouble value);
+void     dream_metrics_append_histogram (GString *out, const gchar *name, const gchar *help, DreamMetricHistogram histogram);
+void     dream_metrics_append_process  (GString *out);
+
+G_END_DECLS
+
+#endif /* __DREAMMETRICS_H__ */
@@ -0,0 +1,311 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <string.h>
+
+#include "dreamprobe.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreamprobe_debug);
+#define GST_CAT_DEFAULT dreamprobe_debug
+
+struct _DreamProbe {
+	gint refcount;
+	gchar *name;
+	GstPad *pad;
+	gulong id;
+	GstElement *queue;
+	/* the level is read from the queue itself while it's still alive */
+	GWeakRef queue_ref;
+	gulong overrun_id;
+	GstClockTime window;
+	DreamProbeWindowFunc func;
+	gpointer user_data;
+	gint reset;
+
+	/* written by the streaming thread of pad */
+	guint64 bytes, buffers, keyframes;
+	GstClockTime window_start;
+	guint64 window_bytes, window_buffers, window_keyframes;
+	guint64 bitrate, buffer_rate_milli, keyframe_rate_milli;
+
+	/* written by the thread feeding the queue */
+	guint64 overruns;
+};
+
+/* the registry is only locked when probes come and go or get listed */
+static GList *probes = NULL;
+static GMutex probes_lock;
+static GQuark probe_quark;
+
+#define PROBE_SET(field, value) __atomic_store_n (&(field), (value), __ATOMIC_RELAXED)
+#define PROBE_GET(field) __atomic_load_n (&(field), __ATOMIC_RELAXED)
+#define PROBE_ADD(field, value) PROBE_SET (field, PROBE_GET (field) + (value))
+
+static void dream_probe_unref (gpointer data)
+{
+	DreamProbe *probe = data;
+
+	if (!g_atomic_int_dec_and_test (&probe->refcount))
+		return;
+	if (probe->queue)
+		g_weak_ref_clear (&probe->queue_ref);
+	g_free (probe->name);
+	g_free (probe);
+}
+
+/* the measured pad's probe owns the registry entry, it goes away with the pad */
+static void dream_probe_unregister (gpointer data)
+{
+	DreamProbe *probe = data;
+
+	g_mutex_lock (&probes_lock);
+	probes = g_list_remove (probes, probe);
+	g_mutex_unlock (&probes_lock);
+	GST_DEBUG ("probe %s removed", probe->name);
+	dream_probe_unref (probe);
+}
+
+static void probe_count (DreamProbe *probe, GstBuffer *buffer)
+{
+	PROBE_ADD (probe->bytes, gst_buffer_get_size (buffer));
+	PROBE_ADD (probe->buffers, 1);
+	if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		PROBE_ADD (probe->keyframes, 1);
+}
+
+static void probe_roll_window (DreamProbe *probe)
+{
+	GstClockTime now = gst_util_get_timestamp ();
+	GstClockTime elapsed;
+	DreamProbeWindowFunc func;
+	guint64 bytes, buffers, keyframes;
+
+	if (g_atomic_int_compare_and_exchange (&probe->reset, 1, 0))
+		probe->window_start = GST_CLOCK_TIME_NONE;
+
+	bytes = probe->bytes;
+	buffers = probe->buffers;
+	keyframes = probe->keyframes;
+	if (GST_CLOCK_TIME_IS_VALID (probe->window_start))
+	{
+		elapsed = now - probe->window_start;
+		if (elapsed < probe->window)
+			return;
+		PROBE_SET (probe->bitrate, gst_util_uint64_scale (bytes - probe->window_bytes, 8 * GST_SECOND, elapsed));
+		PROBE_SET (probe->buffer_rate_milli, gst_util_uint64_scale (buffers - probe->window_buffers, 1000 * GST_SECOND, elapsed));
+		PROBE_SET (probe->keyframe_rate_milli, gst_util_uint64_scale (keyframes - probe->window_keyframes, 1000 * GST_SECOND, elapsed));
+		func = __atomic_load_n (&probe->func, __ATOMIC_ACQUIRE);
+		if (func)
+			func (probe, probe->bitrate, probe->user_data);
+	}
+	probe->window_start = now;
+	probe->window_bytes = bytes;
+	probe->window_buffers = buffers;
+	probe->window_keyframes = keyframes;
+}
+
+static gboolean probe_count_list (GstBuffer **buffer, guint idx, gpointer user_data)
+{
+	probe_count (user_data, *buffer);
+	return TRUE;
+}
+
+static GstPadProbeReturn probe_out (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	DreamProbe *probe = user_data;
+
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
+		probe_count (probe, GST_PAD_PROBE_INFO_BUFFER (info));
+	else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+		gst_buffer_list_foreach (GST_PAD_PROBE_INFO_BUFFER_LIST (info), probe_count_list, probe);
+	probe_roll_window (probe);
+	return GST_PAD_PROBE_OK;
+}
+
+static void probe_overrun (GstElement *queue, gpointer user_data)
+{
+	DreamProbe *probe = user_data;
+	PROBE_ADD (probe->overruns, 1);
+}
+
+static DreamProbe *probe_new (const gchar *name, GstClockTime window)
+{
+	static gsize init = 0;
+	DreamProbe *probe;
+
+	if (g_once_init_enter (&init))
+	{
+		GST_DEBUG_CATEGORY_INIT (dreamprobe_debug, "dreamprobe", 0, "dreamrtspserver pad probes");
+		probe_quark = g_quark_from_static_string ("dream-probe");
+		g_once_init_leave (&init, 1);
+	}
+
+	probe = g_new0 (DreamProbe, 1);
+	probe->refcount = 1;
+	probe->name = g_strdup (name);
+	probe->window = window;
+	probe->window_start = GST_CLOCK_TIME_NONE;
+	return probe;
+}
+
+static void probe_register (DreamProbe *probe, GstObject *owner)
+{
+	g_object_set_qdata (G_OBJECT (owner), probe_quark, probe);
+	probe->id = gst_pad_add_probe (probe->pad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST, probe_out, probe, dream_probe_unregister);
+	g_mutex_lock (&probes_lock);
+	probes = g_list_append (probes, probe);
+	g_mutex_unlock (&probes_lock);
+	GST_DEBUG_OBJECT (owner, "probe %s attached to %s:%s", probe->name, GST_DEBUG_PAD_NAME (probe->pad));
+}
+
+/* name defaults to element:pad, a pad is measured at most once */
+DreamProbe *dream_probe_attach (GstPad *pad, const gchar *name, GstClockTime window)
+{
+	DreamProbe *probe = dream_probe_get (GST_OBJECT (pad));
+	gchar *padname;
+
+	if (probe)
+		return probe;
+
+	padname = name ? NULL : g_strdup_printf ("%s:%s", GST_DEBUG_PAD_NAME (pad));
+	probe = probe_new (name ? name : padname, window);
+	g_free (padname);
+	probe->pad = pad;
+	probe_register (probe, GST_OBJECT (pad));
+	return probe;
+}
+
+/* measures what leaves the queue. the fill level comes from the queue's own
+ * properties, counting what goes in drifts as soon as a leaky queue drops */
+DreamProbe *dream_probe_attach_queue (GstElement *queue, GstClockTime window)
+{
+	DreamProbe *probe = dream_probe_get (GST_OBJECT (queue));
+
+	if (probe)
+		return probe;
+
+	probe = probe_new (GST_ELEMENT_NAME (queue), window);
+	probe->queue = queue;
+	g_weak_ref_init (&probe->queue_ref, queue);
+	probe->pad = gst_element_get_static_pad (queue, "src");
+	/* the pad lives as long as the queue */
+	gst_object_unref (probe->pad);
+
+	probe->overrun_id = g_signal_connect (queue, "overrun", G_CALLBACK (probe_overrun), probe);
+	probe_register (probe, GST_OBJECT (queue));
+	return probe;
+}
+
+DreamProbe *dream_probe_get (GstObject *object)
+{
+	if (!probe_quark)
+		return NULL;
+	return g_object_get_qdata (G_OBJECT (object), probe_quark);
+}
+
+/* only for probes whose pads are known to be still alive */
+void dream_probe_detach (DreamProbe *probe)
+{
+	if (probe->queue)
+	{
+		g_signal_handler_disconnect (probe->queue, probe->overrun_id);
+		g_object_set_qdata (G_OBJECT (probe->queue), probe_quark, NULL);
+	}
+	else
+		g_object_set_qdata (G_OBJECT (probe->pad), probe_quark, NULL);
+	gst_pad_remove_probe (probe->pad, probe->id);
+}
+
+/* the window restarts with the next buffer */
+void dream_probe_reset (DreamProbe *probe)
+{
+	g_return_if_fail (probe != NULL);
+	PROBE_SET (probe->bitrate, 0);
+	PROBE_SET (probe->buffer_rate_milli, 0);
+	PROBE_SET (probe->keyframe_rate_milli, 0);
+	g_atomic_int_set (&probe->reset, 1);
+}
+
+void dream_probe_set_window_func (DreamProbe *probe, DreamProbeWindowFunc func, gpointer user_data)
+{
+	g_return_if_fail (probe != NULL);
+	probe->user_data = user_data;
+	__atomic_store_n (&probe->func, func, __ATOMIC_RELEASE);
+}
+
+static void probe_level (DreamProbe *probe, guint *bytes, guint *buffers, guint64 *time)
+{
+	GstElement *queue = g_weak_ref_get (&probe->queue_ref);
+
+	*bytes = *buffers = *time = 0;
+	if (!queue)
+		return;
+	g_object_get (queue, "current-level-bytes", bytes, "current-level-buffers", buffers, "current-level-time", time, NULL);
+	gst_object_unref (queue);
+}
+
+void dream_probe_get_stats (DreamProbe *probe, DreamProbeStats *stats)
+{
+	memset (stats, 0, sizeof (DreamProbeStats));
+	stats->name = g_strdup (probe->name);
+	stats->queue = probe->queue != NULL;
+	stats->bytes = PROBE_GET (probe->bytes);
+	stats->buffers = PROBE_GET (probe->buffers);
+	stats->keyframes = PROBE_GET (probe->keyframes);
+	stats->bitrate = PROBE_GET (probe->bitrate);
+	stats->buffer_rate = PROBE_GET (probe->buffer_rate_milli) / 1000.0;
+	stats->keyframe_rate = PROBE_GET (probe->keyframe_rate_milli) / 1000.0;
+	if (probe->queue)
+	{
+		probe_level (probe, &stats->level_bytes, &stats->level_buffers, &stats->level_time);
+		stats->overruns = PROBE_GET (probe->overruns);
+	}
+}
+
+void dream_probe_get_level (GstElement *queue, guint *bytes, guint *buffers, guint64 *time)
+{
+	DreamProbe *probe = dream_probe_get (GST_OBJECT (queue));
+
+	if (probe && probe->queue)
+		probe_level (probe, bytes, buffers, time);
+	else
+		*bytes = *buffers = *time = 0;
+}
+
+static void stats_clear (gpointer data)
+{
+	g_free (((DreamProbeStats *) data)->name);
+}
+
+/* every probe in attach order, the caller frees the array */
+GArray *dream_probe_snapshot (void)
+{
+	GArray *array = g_array_new (FALSE, FALSE, sizeof (DreamProbeStats));
+	DreamProbeStats stats;
+	GList *l;
+
+	g_array_set_clear_func (array, stats_clear);
+	g_mutex_lock (&probes_lock);
+	for (l = probes; l; l = l->next)
+	{
+		dream_probe_get_stats (l->data, &stats);
+		g_array_append_val (array, stats);
+	}
+	g_mutex_unlock (&probes_lock);
+	return array;
+}
@@ -0,0 +1,58 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __DREAMPROBE_H__
+#define __DREAMPROBE_H__
+
+G_BEGIN_DECLS
+
+/* measures the data flow through a pad. the streaming thread only ever does
+ * relaxed loads and stores on its own fields, readers get a snapshot */
+typedef struct _DreamProbe DreamProbe;
+
+/* called from the streaming thread each time a window was completed */
+typedef void (*DreamProbeWindowFunc) (DreamProbe *probe, guint64 bitrate, gpointer user_data);
+
+typedef struct {
+	gchar *name;
+	gboolean queue;
+	guint64 bytes, buffers, keyframes;
+	/* over the last completed window */
+	guint64 bitrate;
+	gdouble buffer_rate, keyframe_rate;
+	/* queues only */
+	guint level_bytes, level_buffers;
+	GstClockTime level_time;
+	guint64 overruns;
+} DreamProbeStats;
+
+DreamProbe * dream_probe_attach          (GstPad *pad, const gchar *name, GstClockTime window);
+DreamProbe * dream_probe_attach_queue    (GstElement *queue, GstClockTime window);
+DreamProbe * dream_probe_get             (GstObject *object);
+void         dream_probe_detach          (DreamProbe *probe);
+void         dream_probe_reset           (DreamProbe *probe);
+void         dream_probe_set_window_func (DreamProbe *probe, DreamProbeWindowFunc func, gpointer user_data);
+void         dream_probe_get_stats       (DreamProbe *probe, DreamProbeStats *stats);
+void         dream_probe_get_level       (GstElement *queue, guint *bytes, guint *buffers, guint64 *time);
+GArray *     dream_probe_snapshot        (void);
+
+G_END_DECLS
+
+#endif /* __DREAMPROBE_H__ */
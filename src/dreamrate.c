@@ -0,0 +1,283 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "dreamrate.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreamrate_debug);
+#define GST_CAT_DEFAULT dreamrate_debug
+
+/* stream time over which the frame sizes are judged */
+#define RATE_WINDOW (2 * GST_SECOND)
+/* below this share of the budget the scene is considered static */
+#define RATE_FILL_LOW 0.6
+/* above this share, or with P frames this large against the last I frame,
+ * the encoder is starved */
+#define RATE_FILL_HIGH 0.9
+#define RATE_MOTION_HIGH 0.35
+#define RATE_STEP_UP 1.3
+#define RATE_STEP_DOWN 0.8
+/* a lowered target keeps this much room above the measured rate */
+#define RATE_HEADROOM 1.3
+/* smaller changes aren't worth a reconfiguration */
+#define RATE_MIN_CHANGE 0.05
+/* frame sizes kept for the percentiles */
+#define RATE_FRAMES 1024
+/* timestamps going back further than this are a new stream, not reordering */
+#define RATE_MAX_BACKSTEP GST_SECOND
+
+typedef struct {
+	guint32 sizes[RATE_FRAMES];
+	guint count, next;
+} DreamRateFrames;
+
+struct _DreamRateController {
+	GMutex lock;
+	DreamRateFunc func;
+	gpointer user_data;
+	GstPad *pad;
+	gulong probe_id;
+
+	gint enabled;
+	gint min_kbps, max_kbps, limit_kbps, target_kbps;
+	guint adjustments;
+	gdouble fill, motion;
+	gdouble saved_kbit, elapsed_s;
+
+	GstClockTime window_start, last_ts;
+	guint64 window_bytes, p_bytes, p_frames;
+	guint64 key_bytes;
+
+	DreamRateFrames adapted, ceiling;
+};
+
+static void frames_add (DreamRateFrames *f, gsize size)
+{
+	f->sizes[f->next] = size;
+	f->next = (f->next + 1) % RATE_FRAMES;
+	f->count = MIN (f->count + 1, RATE_FRAMES);
+}
+
+static gint compare_sizes (gconstpointer a, gconstpointer b)
+{
+	guint32 x = *(const guint32 *) a, y = *(const guint32 *) b;
+	return x < y ? -1 : x > y;
+}
+
+static void frames_percentiles (DreamRateFrames *f, guint64 *out)
+{
+	static const gdouble quantiles[3] = { 0.5, 0.95, 0.99 };
+	guint32 sorted[RATE_FRAMES];
+	guint i;
+
+	if (!f->count)
+	{
+		memset (out, 0, 3 * sizeof (guint64));
+		return;
+	}
+	memcpy (sorted, f->sizes, f->count * sizeof (guint32));
+	qsort (sorted, f->count, sizeof (guint32), compare_sizes);
+	for (i = 0; i < 3; i++)
+		out[i] = sorted[MIN (f->count - 1, (guint) (f->count * quantiles[i]))];
+}
+
+static gint ceiling_kbps (DreamRateController *rc)
+{
+	return rc->limit_kbps ? MIN (rc->limit_kbps, rc->max_kbps) : rc->max_kbps;
+}
+
+/* called with the lock held at the end of each window, returns the new
+ * target or 0 to keep the current one */
+static gint rate_decide (DreamRateController *rc, GstClockTime duration)
+{
+	gdouble seconds = (gdouble) duration / GST_SECOND;
+	gdouble actual_kbps = rc->window_bytes * 8 / 1000.0 / seconds;
+	gdouble target = rc->target_kbps;
+	gint ceiling = ceiling_kbps (rc);
+
+	rc->fill = rc->target_kbps ? actual_kbps / rc->target_kbps : 1.0;
+	rc->motion = rc->p_frames && rc->key_bytes ? (gdouble) rc->p_bytes / rc->p_frames / rc->key_bytes : 0.0;
+	rc->saved_kbit += (rc->max_kbps - MIN (rc->target_kbps, rc->max_kbps)) * seconds;
+	rc->elapsed_s += seconds;
+
+	if (rc->fill > RATE_FILL_HIGH || rc->motion > RATE_MOTION_HIGH)
+		target *= RATE_STEP_UP;
+	else if (rc->fill < RATE_FILL_LOW)
+		target = MAX (actual_kbps * RATE_HEADROOM, target * RATE_STEP_DOWN);
+	target = CLAMP (target, rc->min_kbps, ceiling);
+
+	GST_LOG ("window %.2fs: %.0f kbit/s of %d, fill %.2f motion %.2f -> %.0f kbit/s", seconds, actual_kbps, rc->target_kbps, rc->fill, rc->motion, target);
+	if (ABS (target - rc->target_kbps) < rc->target_kbps * RATE_MIN_CHANGE && rc->target_kbps <= ceiling)
+		return 0;
+	return (gint) target;
+}
+
+static GstPadProbeReturn rate_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	DreamRateController *rc = user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+	/* the pts of b-frames goes back and forth, the dts only increases */
+	GstClockTime ts = GST_BUFFER_DTS_IS_VALID (buffer) ? GST_BUFFER_DTS (buffer) : GST_BUFFER_PTS (buffer);
+	gsize size = gst_buffer_get_size (buffer);
+	gint kbps = 0;
+
+	if (!g_atomic_int_get (&rc->enabled) || !GST_CLOCK_TIME_IS_VALID (ts))
+		return GST_PAD_PROBE_OK;
+
+	g_mutex_lock (&rc->lock);
+	if (!GST_CLOCK_TIME_IS_VALID (rc->window_start) || GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DISCONT) ||
+	    ts + RATE_MAX_BACKSTEP < rc->last_ts)
+	{
+		rc->window_start = rc->last_ts = ts;
+		rc->window_bytes = rc->p_bytes = rc->p_frames = 0;
+	}
+	/* a pts which went back a little doesn't shorten the window */
+	rc->last_ts = MAX (ts, rc->last_ts);
+	rc->window_bytes += size;
+	if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+	{
+		rc->p_bytes += size;
+		rc->p_frames++;
+	}
+	else
+		rc->key_bytes = size;
+	frames_add (rc->target_kbps < rc->max_kbps ? &rc->adapted : &rc->ceiling, size);
+
+	if (rc->last_ts - rc->window_start >= RATE_WINDOW)
+	{
+		kbps = rate_decide (rc, rc->last_ts - rc->window_start);
+		if (kbps)
+		{
+			rc->target_kbps = kbps;
+			rc->adjustments++;
+		}
+		rc->window_start = rc->last_ts;
+		rc->window_bytes = rc->p_bytes = rc->p_frames = 0;
+	}
+	g_mutex_unlock (&rc->lock);
+
+	if (kbps)
+	{
+		GST_DEBUG ("adapting video bitrate to %d kbit/s", kbps);
+		rc->func (rc, kbps, rc->user_data);
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+DreamRateController *dream_rate_controller_new (DreamRateFunc func, gpointer user_data)
+{
+	DreamRateController *rc = g_new0 (DreamRateController, 1);
+
+	GST_DEBUG_CATEGORY_INIT (dreamrate_debug, "dreamrate", 0, "dreamrtspserver adaptive bitrate");
+	g_mutex_init (&rc->lock);
+	rc->func = func;
+	rc->user_data = user_data;
+	rc->window_start = GST_CLOCK_TIME_NONE;
+	return rc;
+}
+
+void dream_rate_controller_free (DreamRateController *rc)
+{
+	dream_rate_controller_detach (rc);
+	g_mutex_clear (&rc->lock);
+	g_free (rc);
+}
+
+/* the current target is kept and clamped into the new envelope on the next window */
+gboolean dream_rate_controller_set_envelope (DreamRateController *rc, gboolean enabled, gint min_kbps, gint max_kbps)
+{
+	if (enabled && (min_kbps <= 0 || max_kbps < min_kbps))
+		return FALSE;
+	g_mutex_lock (&rc->lock);
+	rc->min_kbps = min_kbps;
+	rc->max_kbps = max_kbps;
+	if (!rc->target_kbps)
+		rc->target_kbps = max_kbps;
+	rc->window_start = GST_CLOCK_TIME_NONE;
+	g_atomic_int_set (&rc->enabled, enabled);
+	g_mutex_unlock (&rc->lock);
+	GST_INFO ("adaptive bitrate %s, %d..%d kbit/s", enabled ? "enabled" : "disabled", min_kbps, max_kbps);
+	return TRUE;
+}
+
+/* an outside ceiling, e.g. the upstream bandwidth, 0 lifts it */
+void dream_rate_controller_set_limit (DreamRateController *rc, gint kbps)
+{
+	g_mutex_lock (&rc->lock);
+	rc->limit_kbps = kbps;
+	if (kbps && rc->target_kbps > kbps)
+		rc->target_kbps = kbps;
+	g_mutex_unlock (&rc->lock);
+}
+
+/* the bitrate was set from somewhere else, continue from there */
+void dream_rate_controller_set_target (DreamRateController *rc, gint kbps)
+{
+	g_mutex_lock (&rc->lock);
+	rc->target_kbps = kbps;
+	rc->window_start = GST_CLOCK_TIME_NONE;
+	g_mutex_unlock (&rc->lock);
+}
+
+/* watches the encoded video frames leaving pad */
+void dream_rate_controller_attach (DreamRateController *rc, GstPad *pad)
+{
+	dream_rate_controller_detach (rc);
+	g_mutex_lock (&rc->lock);
+	rc->pad = gst_object_ref (pad);
+	rc->window_start = GST_CLOCK_TIME_NONE;
+	rc->key_bytes = 0;
+	rc->probe_id = gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, rate_probe, rc, NULL);
+	g_mutex_unlock (&rc->lock);
+}
+
+void dream_rate_controller_detach (DreamRateController *rc)
+{
+	GstPad *pad;
+	gulong id;
+
+	g_mutex_lock (&rc->lock);
+	pad = rc->pad;
+	id = rc->probe_id;
+	rc->pad = NULL;
+	rc->probe_id = 0;
+	g_mutex_unlock (&rc->lock);
+	if (!pad)
+		return;
+	gst_pad_remove_probe (pad, id);
+	gst_object_unref (pad);
+}
+
+void dream_rate_controller_get_stats (DreamRateController *rc, DreamRateStats *stats)
+{
+	g_mutex_lock (&rc->lock);
+	stats->enabled = g_atomic_int_get (&rc->enabled);
+	stats->min_kbps = rc->min_kbps;
+	stats->max_kbps = rc->max_kbps;
+	stats->limit_kbps = rc->limit_kbps;
+	stats->target_kbps = rc->target_kbps;
+	stats->adjustments = rc->adjustments;
+	stats->fill = rc->fill;
+	stats->motion = rc->motion;
+	stats->saved_kbit_per_hour = rc->elapsed_s > 0 ? rc->saved_kbit * 3600 / rc->elapsed_s : 0;
+	frames_percentiles (&rc->adapted, stats->adapted);
+	frames_percentiles (&rc->ceiling, stats->ceiling);
+	g_mutex_unlock (&rc->lock);
+}
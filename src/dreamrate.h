@@ -0,0 +1,60 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __DREAMRATE_H__
+#define __DREAMRATE_H__
+
+G_BEGIN_DECLS
+
+/* content adaptive video bitrate. the encoded frame sizes show how much of
+ * its budget the encoder actually needs: static scenes leave it unused and
+ * the target is lowered towards the real rate, motion fills it up and the
+ * target is raised. the target always stays within the configured envelope */
+typedef struct _DreamRateController DreamRateController;
+
+/* called from the streaming thread when the target should change */
+typedef void (*DreamRateFunc) (DreamRateController *rc, gint kbps, gpointer user_data);
+
+typedef struct {
+	gboolean enabled;
+	gint min_kbps, max_kbps, limit_kbps;
+	gint target_kbps;
+	guint adjustments;
+	/* used share of the budget and P/I frame size ratio of the last window */
+	gdouble fill, motion;
+	/* against running at max_kbps all the time */
+	gdouble saved_kbit_per_hour;
+	/* frame size percentiles in bytes of the frames encoded below the
+	 * ceiling and of those encoded at it */
+	guint64 adapted[3], ceiling[3];
+} DreamRateStats;
+
+DreamRateController * dream_rate_controller_new          (DreamRateFunc func, gpointer user_data);
+void                  dream_rate_controller_free         (DreamRateController *rc);
+gboolean              dream_rate_controller_set_envelope (DreamRateController *rc, gboolean enabled, gint min_kbps, gint max_kbps);
+void                  dream_rate_controller_set_limit    (DreamRateController *rc, gint kbps);
+void                  dream_rate_controller_set_target   (DreamRateController *rc, gint kbps);
+void                  dream_rate_controller_attach       (DreamRateController *rc, GstPad *pad);
+void                  dream_rate_controller_detach       (DreamRateController *rc);
+void                  dream_rate_controller_get_stats    (DreamRateController *rc, DreamRateStats *stats);
+
+G_END_DECLS
+
+#endif /* __DREAMRATE_H__ */
@@ -0,0 +1,501 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+
+#include "dreamrecorder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+GST_DEBUG_CATEGORY_STATIC (dreamrecorder_debug);
+#define GST_CAT_DEFAULT dreamrecorder_debug
+
+#define RECORDER_FILE_FORMAT "dreamrtspserver-%Y%m%d-%H%M%S"
+/* files rotated within the same second get a suffix */
+#define RECORDER_MAX_SUFFIX 100
+
+typedef struct {
+	GstBuffer *buffer;
+	gsize size;
+	gboolean keyframe;
+	gint64 time;
+} DreamRecorderItem;
+
+/* the lock guards the queue, the file name and the stats. the file and the
+ * chunk belong to the i/o thread, the gap tracking to the streaming thread */
+struct _DreamRecorder {
+	GMutex lock;
+	GCond cond;
+	GThread *thread;
+	gchar *directory;
+	guint64 max_bytes;
+	gint64 max_time;
+	GQueue queue;
+	gboolean stopping;
+	/* the i/o thread closed the file and is done */
+	gboolean finished;
+	DreamRecorderFunc stopped;
+	gpointer stopped_data;
+	GSource *stopped_source;
+	/* set once by the i/o thread, nothing is recorded afterwards */
+	gchar *error;
+	DreamRecorderFunc failed;
+	gpointer failed_data;
+	GSource *failed_source;
+
+	gboolean last_delta, dropping;
+	gint64 gap_start;
+	guint64 gap_bytes;
+
+	int fd;
+	gchar *file;
+	gboolean direct;
+	guint8 *chunk;
+	gsize chunk_fill;
+	/* everything before is written, always a multiple of the chunk */
+	guint64 flushed;
+	guint64 allocated, unsynced;
+	gint64 file_start, last_sync;
+
+	guint files;
+	guint64 bytes, backlog, max_backlog;
+	guint64 writes, write_us, max_write_us, syncs, sync_us;
+	guint64 gaps, dropped;
+};
+
+static void file_sync (DreamRecorder *rec)
+{
+	gint64 start = g_get_monotonic_time (), took;
+
+	if (fdatasync (rec->fd) < 0)
+		GST_WARNING ("syncing %s failed: %s", rec->file, g_strerror (errno));
+	took = g_get_monotonic_time () - start;
+	rec->unsynced = 0;
+	rec->last_sync = start + took;
+
+	g_mutex_lock (&rec->lock);
+	rec->syncs++;
+	rec->sync_us += took;
+	g_mutex_unlock (&rec->lock);
+	GST_LOG ("synced %s in %" G_GINT64_FORMAT " us", rec->file, took);
+}
+
+/* keeps the size, so a crash doesn't leave zeroes at the end */
+static void file_preallocate (DreamRecorder *rec)
+{
+	if (fallocate (rec->fd, FALLOC_FL_KEEP_SIZE, rec->allocated, DREAM_RECORDER_PREALLOC) == 0)
+	{
+		rec->allocated += DREAM_RECORDER_PREALLOC;
+		return;
+	}
+	if (errno != EOPNOTSUPP)
+		GST_WARNING ("can't preallocate %s: %s", rec->file, g_strerror (errno));
+	/* not for this file */
+	rec->allocated = G_MAXUINT64;
+}
+
+static gboolean recorder_failed (gpointer user_data)
+{
+	DreamRecorder *rec = user_data;
+
+	rec->failed (rec, rec->failed_data);
+	return G_SOURCE_REMOVE;
+}
+
+/* on the i/o thread, takes error */
+static void recorder_fail (DreamRecorder *rec, gchar *error)
+{
+	GST_ERROR ("%s, the recording ends", error);
+	g_mutex_lock (&rec->lock);
+	rec->error = error;
+	rec->failed_source = g_idle_source_new ();
+	g_source_set_callback (rec->failed_source, recorder_failed, rec, NULL);
+	g_source_attach (rec->failed_source, NULL);
+	g_mutex_unlock (&rec->lock);
+}
+
+/* a failed write ends the recording */
+static void chunk_write (DreamRecorder *rec, gsize size)
+{
+	gint64 start = g_get_monotonic_time (), took;
+	gsize done = 0;
+	gssize n = 0;
+
+	if (rec->flushed + size > rec->allocated)
+		file_preallocate (rec);
+	while (done < size && (n = pwrite (rec->fd, rec->chunk + done, size - done, rec->flushed + done)) > 0)
+		done += n;
+	took = g_get_monotonic_time () - start;
+	if (done < size)
+	{
+		recorder_fail (rec, g_strdup_printf ("writing %s at %" G_GUINT64_FORMAT " failed: %s", rec->file, rec->flushed, n < 0 ? g_strerror (errno) : "short write"));
+		close (rec->fd);
+		rec->fd = -1;
+		return;
+	}
+	rec->flushed += size;
+	rec->unsynced += size;
+	rec->chunk_fill = 0;
+
+	g_mutex_lock (&rec->lock);
+	rec->writes++;
+	rec->write_us += took;
+	rec->max_write_us = MAX (rec->max_write_us, (guint64) took);
+	g_mutex_unlock (&rec->lock);
+}
+
+static void file_close (DreamRecorder *rec)
+{
+	guint64 size = rec->flushed + rec->chunk_fill;
+
+	if (rec->fd < 0)
+		return;
+	if (rec->chunk_fill)
+	{
+		/* direct i/o writes whole blocks, the padding is cut off again */
+		gsize padded = rec->direct ? (rec->chunk_fill + DREAM_RECORDER_ALIGN - 1) / DREAM_RECORDER_ALIGN * DREAM_RECORDER_ALIGN : rec->chunk_fill;
+		memset (rec->chunk + rec->chunk_fill, 0, padded - rec->chunk_fill);
+		chunk_write (rec, padded);
+		if (rec->fd < 0)
+			return;
+	}
+	/* also gives back what was preallocated beyond */
+	if (ftruncate (rec->fd, size) < 0)
+		GST_WARNING ("can't truncate %s: %s", rec->file, g_strerror (errno));
+	file_sync (rec);
+	close (rec->fd);
+	rec->fd = -1;
+	GST_INFO ("recorded %" G_GUINT64_FORMAT " bytes to %s", size, rec->file);
+}
+
+static gboolean file_open (DreamRecorder *rec, gint64 now)
+{
+	GDateTime *date = g_date_time_new_now_local ();
+	gchar *base = g_date_time_format (date, RECORDER_FILE_FORMAT);
+	const int flags = O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC;
+	gboolean direct = TRUE;
+	gchar *file = NULL;
+	int fd = -1;
+	guint i;
+
+	g_date_time_unref (date);
+	for (i = 0; fd < 0 && i < RECORDER_MAX_SUFFIX; i++)
+	{
+		g_free (file);
+		file = i ? g_strdup_printf ("%s/%s-%u.ts", rec->directory, base, i) : g_strdup_printf ("%s/%s.ts", rec->directory, base);
+		fd = open (file, flags | (direct ? O_DIRECT : 0), 0644);
+		/* tmpfs and others */
+		if (fd < 0 && errno == EINVAL && direct)
+		{
+			direct = FALSE;
+			fd = open (file, flags, 0644);
+		}
+		if (fd < 0 && errno != EEXIST)
+			break;
+	}
+	g_free (base);
+	if (fd < 0)
+	{
+		recorder_fail (rec, g_strdup_printf ("can't record to %s: %s", file, g_strerror (errno)));
+		g_free (file);
+		return FALSE;
+	}
+
+	rec->fd = fd;
+	rec->flushed = rec->allocated = rec->unsynced = 0;
+	rec->chunk_fill = 0;
+	rec->file_start = rec->last_sync = now;
+	g_mutex_lock (&rec->lock);
+	g_free (rec->file);
+	rec->file = file;
+	rec->direct = direct;
+	rec->files++;
+	g_mutex_unlock (&rec->lock);
+	file_preallocate (rec);
+	GST_INFO ("recording to %s%s", file, direct ? " with direct i/o" : "");
+	return TRUE;
+}
+
+static gboolean file_full (DreamRecorder *rec, gint64 now)
+{
+	if (rec->max_bytes && rec->flushed + rec->chunk_fill >= rec->max_bytes)
+		return TRUE;
+	return rec->max_time && now - rec->file_start >= rec->max_time;
+}
+
+static void record (DreamRecorder *rec, DreamRecorderItem *item)
+{
+	GstMapInfo map;
+	gsize done = 0;
+
+	/* files start with a keyframe, up to the first one nothing is written */
+	if (item->keyframe && (rec->fd < 0 || file_full (rec, item->time)))
+	{
+		file_close (rec);
+		if (!rec->error)
+			file_open (rec, item->time);
+	}
+	if (rec->fd < 0 || !gst_buffer_map (item->buffer, &map, GST_MAP_READ))
+		return;
+	while (done < map.size && rec->fd >= 0)
+	{
+		gsize n = MIN (map.size - done, DREAM_RECORDER_CHUNK - rec->chunk_fill);
+		memcpy (rec->chunk + rec->chunk_fill, map.data + done, n);
+		rec->chunk_fill += n;
+		done += n;
+		if (rec->chunk_fill == DREAM_RECORDER_CHUNK)
+			chunk_write (rec, DREAM_RECORDER_CHUNK);
+	}
+	gst_buffer_unmap (item->buffer, &map);
+
+	g_mutex_lock (&rec->lock);
+	rec->bytes += done;
+	g_mutex_unlock (&rec->lock);
+	if (rec->fd >= 0 && (rec->unsynced >= DREAM_RECORDER_SYNC_BYTES || item->time - rec->last_sync >= DREAM_RECORDER_SYNC_INTERVAL))
+		file_sync (rec);
+}
+
+static gboolean recorder_stopped (gpointer user_data)
+{
+	DreamRecorder *rec = user_data;
+
+	rec->stopped (rec, rec->stopped_data);
+	return G_SOURCE_REMOVE;
+}
+
+/* called with the lock held, once the thread is finished and stopping */
+static void stopped_later (DreamRecorder *rec)
+{
+	rec->stopped_source = g_idle_source_new ();
+	g_source_set_callback (rec->stopped_source, recorder_stopped, rec, NULL);
+	g_source_attach (rec->stopped_source, NULL);
+}
+
+static gpointer recorder_thread (gpointer user_data)
+{
+	DreamRecorder *rec = user_data;
+	DreamRecorderItem *item;
+
+	g_mutex_lock (&rec->lock);
+	while (TRUE)
+	{
+		while ((item = g_queue_pop_head (&rec->queue)))
+		{
+			g_mutex_unlock (&rec->lock);
+			if (!rec->error)
+				record (rec, item);
+			gst_buffer_unref (item->buffer);
+			g_mutex_lock (&rec->lock);
+			/* only now it's off the backlog, a slow write keeps it there */
+			rec->backlog -= item->size;
+			g_slice_free (DreamRecorderItem, item);
+		}
+		if (rec->stopping || rec->error)
+			break;
+		/* an idle file gets synced as well */
+		if (!g_cond_wait_until (&rec->cond, &rec->lock, g_get_monotonic_time () + DREAM_RECORDER_SYNC_INTERVAL) && rec->fd >= 0 && rec->unsynced)
+		{
+			g_mutex_unlock (&rec->lock);
+			file_sync (rec);
+			g_mutex_lock (&rec->lock);
+		}
+	}
+	g_mutex_unlock (&rec->lock);
+	file_close (rec);
+
+	g_mutex_lock (&rec->lock);
+	rec->finished = TRUE;
+	if (rec->stopped)
+		stopped_later (rec);
+	g_mutex_unlock (&rec->lock);
+	return NULL;
+}
+
+DreamRecorder *dream_recorder_new (const gchar *directory, guint64 max_bytes, gint64 max_time, DreamRecorderFunc failed, gpointer user_data)
+{
+	DreamRecorder *rec;
+
+	GST_DEBUG_CATEGORY_INIT (dreamrecorder_debug, "dreamrecorder", 0, "dreamrtspserver recorder");
+	if (!g_file_test (directory, G_FILE_TEST_IS_DIR) || access (directory, W_OK) < 0)
+	{
+		GST_WARNING ("can't record to %s, not a writable directory", directory);
+		return NULL;
+	}
+	rec = g_new0 (DreamRecorder, 1);
+	if (posix_memalign ((void **) &rec->chunk, DREAM_RECORDER_ALIGN, DREAM_RECORDER_CHUNK))
+	{
+		GST_WARNING ("can't allocate the recording chunk");
+		g_free (rec);
+		return NULL;
+	}
+	g_mutex_init (&rec->lock);
+	g_cond_init (&rec->cond);
+	g_queue_init (&rec->queue);
+	rec->directory = g_strdup (directory);
+	rec->max_bytes = max_bytes;
+	rec->max_time = max_time;
+	rec->failed = failed;
+	rec->failed_data = user_data;
+	rec->fd = -1;
+	rec->last_delta = TRUE;
+	rec->thread = g_thread_new ("recorder", recorder_thread, rec);
+	GST_INFO ("recording to %s, new file after %" G_GUINT64_FORMAT " bytes or %" G_GINT64_FORMAT " s", directory, max_bytes, max_time / G_TIME_SPAN_SECOND);
+	return rec;
+}
+
+/* the thread writes out what is still queued, at most
+ * DREAM_RECORDER_MAX_BACKLOG, and closes the file. stopped is called on
+ * the default main context afterwards */
+void dream_recorder_stop (DreamRecorder *rec, DreamRecorderFunc stopped, gpointer user_data)
+{
+	g_mutex_lock (&rec->lock);
+	rec->stopping = TRUE;
+	rec->stopped = stopped;
+	rec->stopped_data = user_data;
+	if (rec->finished)
+		stopped_later (rec);
+	g_cond_signal (&rec->cond);
+	g_mutex_unlock (&rec->lock);
+}
+
+/* waits for the file to be closed unless dream_recorder_stop() said it is */
+void dream_recorder_free (DreamRecorder *rec)
+{
+	g_mutex_lock (&rec->lock);
+	rec->stopping = TRUE;
+	g_cond_signal (&rec->cond);
+	g_mutex_unlock (&rec->lock);
+	g_thread_join (rec->thread);
+	/* freed before the callbacks ran */
+	if (rec->stopped_source)
+	{
+		g_source_destroy (rec->stopped_source);
+		g_source_unref (rec->stopped_source);
+	}
+	if (rec->failed_source)
+	{
+		g_source_destroy (rec->failed_source);
+		g_source_unref (rec->failed_source);
+	}
+
+	free (rec->chunk);
+	g_cond_clear (&rec->cond);
+	g_mutex_clear (&rec->lock);
+	g_free (rec->error);
+	g_free (rec->file);
+	g_free (rec->directory);
+	g_free (rec);
+}
+
+/* called from the streaming thread, never waits for the disk */
+void dream_recorder_push (DreamRecorder *rec, GstBuffer *buffer)
+{
+	gboolean delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	gboolean keyframe = !delta && rec->last_delta;
+	gsize size = gst_buffer_get_size (buffer);
+	gint64 now = g_get_monotonic_time ();
+	DreamRecorderItem *item;
+
+	rec->last_delta = delta;
+	g_mutex_lock (&rec->lock);
+	if (rec->error)
+	{
+		g_mutex_unlock (&rec->lock);
+		return;
+	}
+	/* resume with some room, not right at the limit again */
+	if (rec->dropping && keyframe && rec->backlog + size <= DREAM_RECORDER_MAX_BACKLOG / 2)
+	{
+		rec->dropping = FALSE;
+		rec->gaps++;
+		GST_WARNING ("gap of %" G_GUINT64_FORMAT " bytes, %.1f s in the recording %s", rec->gap_bytes, (gdouble) (now - rec->gap_start) / G_TIME_SPAN_SECOND, rec->file ? rec->file : rec->directory);
+	}
+	else if (!rec->dropping && rec->backlog + size > DREAM_RECORDER_MAX_BACKLOG)
+	{
+		rec->dropping = TRUE;
+		rec->gap_start = now;
+		rec->gap_bytes = 0;
+		GST_WARNING ("storage of %s is %" G_GUINT64_FORMAT " bytes behind, dropping to the next keyframe", rec->directory, rec->backlog);
+	}
+	if (rec->dropping)
+	{
+		rec->gap_bytes += size;
+		rec->dropped += size;
+		g_mutex_unlock (&rec->lock);
+		return;
+	}
+
+	item = g_slice_new (DreamRecorderItem);
+	item->buffer = gst_buffer_ref (buffer);
+	item->size = size;
+	item->keyframe = keyframe;
+	item->time = now;
+	g_queue_push_tail (&rec->queue, item);
+	rec->backlog += size;
+	rec->max_backlog = MAX (rec->max_backlog, rec->backlog);
+	g_cond_signal (&rec->cond);
+	g_mutex_unlock (&rec->lock);
+}
+
+const gchar *dream_recorder_get_directory (DreamRecorder *rec)
+{
+	return rec->directory;
+}
+
+/* the file being written, NULL before the first keyframe */
+gchar *dream_recorder_get_file (DreamRecorder *rec)
+{
+	gchar *file;
+
+	g_mutex_lock (&rec->lock);
+	file = g_strdup (rec->file);
+	g_mutex_unlock (&rec->lock);
+	return file;
+}
+
+/* why the recording ended, NULL while it's fine */
+gchar *dream_recorder_get_error (DreamRecorder *rec)
+{
+	gchar *error;
+
+	g_mutex_lock (&rec->lock);
+	error = g_strdup (rec->error);
+	g_mutex_unlock (&rec->lock);
+	return error;
+}
+
+void dream_recorder_get_stats (DreamRecorder *rec, DreamRecorderStats *stats)
+{
+	g_mutex_lock (&rec->lock);
+	stats->files = rec->files;
+	stats->direct = rec->direct;
+	stats->bytes = rec->bytes;
+	stats->backlog = rec->backlog;
+	stats->max_backlog = rec->max_backlog;
+	stats->writes = rec->writes;
+	stats->write_us = rec->write_us;
+	stats->max_write_us = rec->max_write_us;
+	stats->syncs = rec->syncs;
+	stats->sync_us = rec->sync_us;
+	stats->gaps = rec->gaps;
+	stats->dropped = rec->dropped;
+	g_mutex_unlock (&rec->lock);
+}
@@ -0,0 +1,82 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+
+#include <gst/gst.h>
+
+#ifndef __DREAMRECORDER_H__
+#define __DREAMRECORDER_H__
+
+G_BEGIN_DECLS
+
+/* records the TS into files in a directory, named after the time they
+ * start. the streaming thread only queues the buffers, a thread of the
+ * recorder's own collects them into aligned DREAM_RECORDER_CHUNK writes,
+ * with O_DIRECT where the file system supports it. the file is allocated
+ * DREAM_RECORDER_PREALLOC ahead and synced every DREAM_RECORDER_SYNC_BYTES
+ * or DREAM_RECORDER_SYNC_INTERVAL instead of after every write.
+ *
+ * a new file starts with the first keyframe after max_bytes or max_time.
+ * once more than DREAM_RECORDER_MAX_BACKLOG is waiting for the disk, the
+ * recorder drops the stream up to the next keyframe and logs the gap, it
+ * never holds up the streaming thread.
+ *
+ * dream_recorder_stop() has the i/o thread write out the rest and calls
+ * back on the default main context once the file is closed, so the
+ * dream_recorder_free() from there doesn't wait for the disk. a file which
+ * can't be created or written, the disk full or gone, ends the recording
+ * instead of a new attempt at every keyframe, failed is called there too */
+#define DREAM_RECORDER_CHUNK (1024 * 1024)
+#define DREAM_RECORDER_ALIGN 4096
+#define DREAM_RECORDER_PREALLOC (64 * 1024 * 1024)
+#define DREAM_RECORDER_SYNC_BYTES (16 * 1024 * 1024)
+#define DREAM_RECORDER_SYNC_INTERVAL (2 * G_TIME_SPAN_SECOND)
+#define DREAM_RECORDER_MAX_BACKLOG (16 * 1024 * 1024)
+
+typedef struct _DreamRecorder DreamRecorder;
+typedef void (*DreamRecorderFunc) (DreamRecorder *rec, gpointer user_data);
+
+typedef struct {
+	guint files;
+	/* the current file is written with O_DIRECT */
+	gboolean direct;
+	guint64 bytes;
+	/* queued for the disk, and the most there ever was */
+	guint64 backlog;
+	guint64 max_backlog;
+	guint64 writes;
+	guint64 write_us;
+	guint64 max_write_us;
+	guint64 syncs;
+	guint64 sync_us;
+	guint64 gaps;
+	guint64 dropped;
+} DreamRecorderStats;
+
+DreamRecorder * dream_recorder_new           (const gchar *directory, guint64 max_bytes, gint64 max_time, DreamRecorderFunc failed, gpointer user_data);
+void            dream_recorder_stop          (DreamRecorder *rec, DreamRecorderFunc stopped, gpointer user_data);
+void            dream_recorder_free          (DreamRecorder *rec);
+void            dream_recorder_push          (DreamRecorder *rec, GstBuffer *buffer);
+const gchar *   dream_recorder_get_directory (DreamRecorder *rec);
+gchar *         dream_recorder_get_file      (DreamRecorder *rec);
+gchar *         dream_recorder_get_error     (DreamRecorder *rec);
+void            dream_recorder_get_stats     (DreamRecorder *rec, DreamRecorderStats *stats);
+
+G_END_DECLS
+
+#endif /* __DREAMRECORDER_H__ */
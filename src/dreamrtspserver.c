@@ -22,28 +22,68 @@
 #define QUEUE_DEBUG \
 		guint cur_bytes, cur_buf; \
 		guint64 cur_time; \
-		g_object_get (t->tstcpq, "current-level-bytes", &cur_bytes, NULL); \
-		g_object_get (t->tstcpq, "current-level-buffers", &cur_buf, NULL); \
-		g_object_get (t->tstcpq, "current-level-time", &cur_time, NULL);
+		dream_probe_get_level (t->tstcpq, &cur_bytes, &cur_buf, &cur_time);
 
 
-static void send_signal (App *app, const gchar *signal_name, GVariant *parameters)
+static void send_signal_sync (App *app, const gchar *signal_name, GVariant *parameters)
 {
+	dream_metrics_add (DREAM_METRIC_SIGNALS_POSTED, 1);
 	if (app->dbus_connection)
 	{
-		GST_DEBUG ("sending signal name=%s parameters=%s", signal_name, parameters?g_variant_print (parameters, TRUE):"[not given]");
+		if (gst_debug_category_get_threshold (dreamrtspserver_debug) >= GST_LEVEL_DEBUG)
+		{
+			gchar *params = parameters ? g_variant_print (parameters, TRUE) : NULL;
+			GST_DEBUG ("sending signal name=%s parameters=%s", signal_name, params ? params : "[not given]");
+			g_free (params);
+		}
 		g_dbus_connection_emit_signal (app->dbus_connection, NULL, object_name, service, signal_name, parameters, NULL);
+		dream_metrics_add (DREAM_METRIC_SIGNALS_EMITTED, 1);
 	}
 	else
+	{
 		GST_DEBUG ("no dbus connection, can't send signal %s", signal_name);
+		if (parameters)
+			g_variant_unref (g_variant_ref_sink (parameters));
+	}
+}
+
+static void sync_signal_properties (App *app, const gchar *signal_name, GVariant *parameters);
+static gboolean source_has_consumers (App *app);
+
+static void send_signal (App *app, const gchar *signal_name, GVariant *parameters)
+{
+	GstClockTime start = gst_util_get_timestamp ();
+	if (app->sync_signals)
+	{
+		if (parameters)
+			sync_signal_properties (app, signal_name, parameters);
+		send_signal_sync (app, signal_name, parameters);
+	}
+	else
+		dream_signal_post (app->signals, signal_name, parameters);
+	dream_metrics_add (DREAM_METRIC_SIGNAL_POST_NS, gst_util_get_timestamp () - start);
+}
+
+static const gchar *lock_names[DREAM_LOCK_LAST] = { "upstream", "rtsp", "hls" };
+static const gchar *shm_stream_names[SHM_STREAM_LAST] = { "ts", "video", "audio" };
+
+/* the slow path of DREAM_LOCK(), only taken when another thread holds it */
+static void dream_lock_wait (App *app, DreamLockId id)
+{
+	GstClockTime start = gst_util_get_timestamp (), waited;
+	g_mutex_lock (&app->locks[id]);
+	waited = gst_util_get_timestamp () - start;
+	GST_LOG_OBJECT (app, "waited %" GST_TIME_FORMAT " for the %s lock", GST_TIME_ARGS (waited), lock_names[id]);
+	dream_metrics_add (DREAM_METRIC_LOCK_CONTENDED_UPSTREAM + id, 1);
+	dream_metrics_add (DREAM_METRIC_LOCK_WAIT_NS_UPSTREAM + id, waited);
 }
 
 static gboolean gst_set_inputmode(App *app, inputMode input_mode)
 {
 	if (!app->pipeline)
 		return FALSE;
-	if (!GST_IS_ELEMENT(app->asrc) ||
-	    !GST_IS_ELEMENT(app->vsrc))
+	if (!IS_DREAM_SOURCE(app, app->asrc) ||
+	    !IS_DREAM_SOURCE(app, app->vsrc))
 		return FALSE;
 
 	g_object_set (G_OBJECT (app->asrc), "input_mode", input_mode, NULL);
@@ -60,220 +100,428 @@ static gboolean gst_set_inputmode(App *app, inputMode input_mode)
 	return TRUE;
 }
 
-static gboolean gst_set_framerate(App *app, int value)
+/* GstForceKeyUnit events like gst_video_event_new_*_force_key_unit() builds
+ * them, without pulling in libgstvideo. the live sources start their
+ * segment at 0, so the pts doubles as running time */
+static GstEvent *force_key_unit_event (gboolean upstream, GstClockTime running_time)
 {
-	GstCaps *oldcaps = NULL;
-	GstCaps *newcaps = NULL;
-	GstStructure *structure;
-	gboolean ret = FALSE;
-
-	if (!app->pipeline)
-		return FALSE;
-	if (!GST_IS_ELEMENT(app->vsrc))
-		return FALSE;
+	GstStructure *s;
 
-	g_object_get (G_OBJECT (app->vsrc), "caps", &oldcaps, NULL);
-	if (!GST_IS_CAPS(oldcaps))
-		return FALSE;
+	if (upstream)
+		s = gst_structure_new ("GstForceKeyUnit", "running-time", G_TYPE_UINT64, running_time,
+			"all-headers", G_TYPE_BOOLEAN, TRUE, "count", G_TYPE_UINT, 0, NULL);
+	else
+		s = gst_structure_new ("GstForceKeyUnit", "timestamp", G_TYPE_UINT64, running_time,
+			"stream-time", G_TYPE_UINT64, running_time, "running-time", G_TYPE_UINT64, running_time,
+			"all-headers", G_TYPE_BOOLEAN, TRUE, "count", G_TYPE_UINT, 0, NULL);
+	return gst_event_new_custom (upstream ? GST_EVENT_CUSTOM_UPSTREAM : GST_EVENT_CUSTOM_DOWNSTREAM, s);
+}
 
-	GST_DEBUG("set framerate %d fps... old caps %" GST_PTR_FORMAT, value, oldcaps);
+static void video_force_keyframe (App *app)
+{
+	GstPad *srcpad = gst_element_get_static_pad (app->vsrc, "src");
+	if (!srcpad)
+		return;
+	gst_pad_send_event (srcpad, force_key_unit_event (TRUE, GST_CLOCK_TIME_NONE));
+	gst_object_unref (srcpad);
+	dream_metrics_add (DREAM_METRIC_KEYFRAME_REQUESTS_SENT, 1);
+}
 
-	newcaps = gst_caps_make_writable(oldcaps);
-	structure = gst_caps_steal_structure (newcaps, 0);
-	if (!structure)
-		goto out;
+static gboolean keyframe_request_dispatch (gpointer user_data)
+{
+	App *app = user_data;
+	DreamKeyframeRequests *k = &app->keyframes;
+	gint64 now = g_get_monotonic_time ();
+	gint64 wait = k->last + KEYFRAME_REQUEST_INTERVAL * G_GINT64_CONSTANT (1000) - now;
 
-	if (value)
-		gst_structure_set (structure, "framerate", GST_TYPE_FRACTION, value, 1, NULL);
+	if (wait > 0)
+	{
+		g_timeout_add (wait / 1000 + 1, keyframe_request_dispatch, app);
+		return G_SOURCE_REMOVE;
+	}
+	k->last = now;
+	g_atomic_int_set (&k->pending, FALSE);
+	if (app->pipeline && app->vsrc)
+	{
+		GST_DEBUG_OBJECT (app, "requesting keyframe");
+		video_force_keyframe (app);
+	}
+	return G_SOURCE_REMOVE;
+}
 
-	gst_caps_append_structure (newcaps, structure);
-	GST_INFO("new caps %" GST_PTR_FORMAT, newcaps);
-	g_object_set (G_OBJECT (app->vsrc), "caps", newcaps, NULL);
-	ret = TRUE;
+/* asks the encoder for an IDR when a consumer attaches instead of letting
+ * it wait for the next natural one. callable from any thread, requests are
+ * sent at most every KEYFRAME_REQUEST_INTERVAL from the control context and
+ * everything in between is merged */
+static void request_keyframe (App *app, const gchar *reason)
+{
+	DreamKeyframeRequests *k = &app->keyframes;
 
-out:
-	if (GST_IS_CAPS(oldcaps))
-		gst_caps_unref(oldcaps);
-	if (GST_IS_CAPS(newcaps))
-		gst_caps_unref(newcaps);
-	return ret;
+	dream_metrics_add (DREAM_METRIC_KEYFRAME_REQUESTS, 1);
+	if (!g_atomic_int_compare_and_exchange (&k->pending, FALSE, TRUE))
+	{
+		GST_LOG ("keyframe request for %s merged", reason);
+		return;
+	}
+	GST_DEBUG ("keyframe request for %s", reason);
+	g_main_context_invoke (NULL, keyframe_request_dispatch, app);
 }
 
-static gboolean gst_set_resolution(App *app, int width, int height)
+/* frames of the old configuration pass until the new caps, then everything
+ * up to the first keyframe is dropped so no output sees frames which don't
+ * match its caps. the keyframe is preceded by a downstream force-key-unit,
+ * which makes h264parse repeat SPS/PPS, mpegtsmux its PAT/PMT and hlssink
+ * start a new fragment */
+static GstPadProbeReturn video_switch_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
-	GstCaps *oldcaps = NULL;
-	GstCaps *newcaps = NULL;
-	GstStructure *structure;
-	gboolean ret = FALSE;
-
-	if (!app->pipeline)
-		return FALSE;
-	if (!GST_IS_ELEMENT(app->vsrc))
-		return FALSE;
+	App *app = user_data;
+	DreamVideoSwitch *v = &app->video_switch;
+	GstBuffer *buffer;
+	GstClockTime duration;
 
-	g_object_get (G_OBJECT (app->vsrc), "caps", &oldcaps, NULL);
-	if (!GST_IS_CAPS(oldcaps))
-		return FALSE;
+	if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+	{
+		if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS &&
+		    g_atomic_int_compare_and_exchange (&v->state, VIDEO_SWITCH_WAIT_CAPS, VIDEO_SWITCH_WAIT_KEYFRAME))
+			GST_DEBUG_OBJECT (pad, "new caps after %" GST_TIME_FORMAT ", waiting for keyframe", GST_TIME_ARGS (gst_util_get_timestamp () - v->start));
+		return GST_PAD_PROBE_OK;
+	}
+	if (g_atomic_int_get (&v->state) != VIDEO_SWITCH_WAIT_KEYFRAME)
+		return GST_PAD_PROBE_OK;
 
-	GST_DEBUG("set new resolution %ix%i... old caps %" GST_PTR_FORMAT, width, height, oldcaps);
+	buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+	if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+	{
+		v->dropped++;
+		dream_metrics_add (DREAM_METRIC_VIDEO_SWITCH_DROPPED_BUFFERS, 1);
+		return GST_PAD_PROBE_DROP;
+	}
+	/* another switch started meanwhile and keeps the probe */
+	if (!g_atomic_int_compare_and_exchange (&v->state, VIDEO_SWITCH_WAIT_KEYFRAME, VIDEO_SWITCH_IDLE))
+		return GST_PAD_PROBE_OK;
+
+	duration = gst_util_get_timestamp () - v->start;
+	GST_INFO_OBJECT (pad, "video switch done after %" GST_TIME_FORMAT ", dropped %u frames", GST_TIME_ARGS (duration), v->dropped);
+	dream_metrics_observe (DREAM_METRIC_VIDEO_SWITCH_SECONDS, duration / GST_USECOND);
+	__atomic_store_n (&v->hls_switch_time, GST_BUFFER_PTS (buffer), __ATOMIC_RELAXED);
+	gst_pad_push_event (pad, force_key_unit_event (FALSE, GST_BUFFER_PTS (buffer)));
+	return GST_PAD_PROBE_REMOVE;
+}
 
-	newcaps = gst_caps_make_writable(oldcaps);
-	structure = gst_caps_steal_structure (newcaps, 0);
-	if (!structure)
-		goto out;
+static void video_switch_begin (App *app)
+{
+	DreamVideoSwitch *v = &app->video_switch;
 
-	if (width && height)
+	v->start = gst_util_get_timestamp ();
+	v->dropped = 0;
+	if (g_atomic_int_compare_and_exchange (&v->state, VIDEO_SWITCH_IDLE, VIDEO_SWITCH_WAIT_CAPS))
 	{
-		gst_structure_set (structure, "width", G_TYPE_INT, width, NULL);
-		gst_structure_set (structure, "height", G_TYPE_INT, height, NULL);
+		GstPad *srcpad = gst_element_get_static_pad (app->vsrc, "src");
+		gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, video_switch_probe, app, NULL);
+		gst_object_unref (srcpad);
 	}
-	gst_caps_append_structure (newcaps, structure);
-	GST_INFO("new caps %" GST_PTR_FORMAT, newcaps);
-	g_object_set (G_OBJECT (app->vsrc), "caps", newcaps, NULL);
-	ret = TRUE;
-
-out:
-	if (GST_IS_CAPS(oldcaps))
-		gst_caps_unref(oldcaps);
-	if (GST_IS_CAPS(newcaps))
-		gst_caps_unref(newcaps);
-	return ret;
+	else
+		g_atomic_int_set (&v->state, VIDEO_SWITCH_WAIT_CAPS);
 }
 
-static gboolean gst_set_profile(App *app, int value)
+/* changes all given fields of the video caps in one renegotiation, -1 keeps
+ * a field. actual changes go through the live switch above and ask the
+ * encoder for an IDR right away */
+static gboolean gst_set_video_caps(App *app, int framerate, int width, int height, int profile, gboolean *changed)
 {
 	GstCaps *oldcaps = NULL;
 	GstCaps *newcaps = NULL;
 	GstStructure *structure;
-	gboolean ret = FALSE;
 
+	if (changed)
+		*changed = FALSE;
 	if (!app->pipeline)
 		return FALSE;
-	if (!GST_IS_ELEMENT(app->vsrc))
+	if (!IS_DREAM_SOURCE(app, app->vsrc))
 		return FALSE;
 
 	g_object_get (G_OBJECT (app->vsrc), "caps", &oldcaps, NULL);
-	if (!GST_IS_CAPS(oldcaps))
+	if (!GST_IS_CAPS(oldcaps) || gst_caps_is_empty (oldcaps))
+	{
+		if (oldcaps)
+			gst_caps_unref(oldcaps);
 		return FALSE;
+	}
 
-	GST_DEBUG("set profile %d... old caps %" GST_PTR_FORMAT, value, oldcaps);
+	GST_DEBUG("set framerate %d fps, resolution %ix%i, profile %d... old caps %" GST_PTR_FORMAT, framerate, width, height, profile, oldcaps);
 
-	newcaps = gst_caps_make_writable(oldcaps);
-	structure = gst_caps_steal_structure (newcaps, 0);
-	if (!structure)
-		goto out;
+	newcaps = gst_caps_copy(oldcaps);
+	structure = gst_caps_get_structure (newcaps, 0);
 
-	if (value == 1)
+	if (framerate > 0)
+		gst_structure_set (structure, "framerate", GST_TYPE_FRACTION, framerate, 1, NULL);
+	if (width > 0 && height > 0)
+	{
+		gst_structure_set (structure, "width", G_TYPE_INT, width, NULL);
+		gst_structure_set (structure, "height", G_TYPE_INT, height, NULL);
+	}
+	if (profile == 1)
 		gst_structure_set (structure, "profile", G_TYPE_STRING, "high", NULL);
-	else
+	else if (profile == 0)
 		gst_structure_set (structure, "profile", G_TYPE_STRING, "main", NULL);
 
-	gst_caps_append_structure (newcaps, structure);
-	GST_INFO("new caps %" GST_PTR_FORMAT, newcaps);
-	g_object_set (G_OBJECT (app->vsrc), "caps", newcaps, NULL);
-	ret = TRUE;
+	if (gst_caps_is_equal (oldcaps, newcaps))
+		GST_DEBUG("caps unchanged");
+	else
+	{
+		GST_INFO("new caps %" GST_PTR_FORMAT, newcaps);
+		video_switch_begin (app);
+		g_object_set (G_OBJECT (app->vsrc), "caps", newcaps, NULL);
+		video_force_keyframe (app);
+		if (changed)
+			*changed = TRUE;
+	}
 
-out:
-	if (GST_IS_CAPS(oldcaps))
-		gst_caps_unref(oldcaps);
-	if (GST_IS_CAPS(newcaps))
-		gst_caps_unref(newcaps);
-	return ret;
+	gst_caps_unref(oldcaps);
+	gst_caps_unref(newcaps);
+	return TRUE;
 }
 
-static gboolean gst_get_capsprop(App *app, GstElement *element, const gchar* prop_name, guint32 *value)
+static gboolean gst_set_framerate(App *app, int value)
 {
-	GstCaps *caps = NULL;
-	const GstStructure *structure;
-	gboolean ret = FALSE;
+	return gst_set_video_caps(app, value, -1, -1, -1, NULL);
+}
 
-	if (!app->pipeline)
-		return FALSE;
-	if (!GST_IS_ELEMENT(element))
-		return FALSE;
+static gboolean gst_set_resolution(App *app, int width, int height)
+{
+	return gst_set_video_caps(app, -1, width, height, -1, NULL);
+}
 
-	g_object_get (G_OBJECT (element), "caps", &caps, NULL);
-	if (!GST_IS_CAPS(caps))
-		return FALSE;
+static gboolean gst_set_profile(App *app, int value)
+{
+	return gst_set_video_caps(app, -1, -1, -1, value == 1 ? 1 : 0, NULL);
+}
 
-	if (gst_caps_is_empty(caps))
-		goto out;
+typedef struct {
+	const gchar *property;
+	/* NULL when the value is taken from the video caps */
+	const gchar *element_property;
+	gboolean video, boolean;
+	gsize offset;
+} DreamCachedProperty;
+
+#define CACHE_OFFSET(field) G_STRUCT_OFFSET (DreamPropertyCache, field)
+#define CACHE_VALUE(c, prop) (*(gint32 *) G_STRUCT_MEMBER_P ((c), (prop)->offset))
+
+static const DreamCachedProperty cached_properties[] = {
+	{ "inputMode", "input-mode", FALSE, FALSE, CACHE_OFFSET (input_mode) },
+	{ "audioBitrate", "bitrate", FALSE, FALSE, CACHE_OFFSET (source.audioBitrate) },
+	{ "videoBitrate", "bitrate", TRUE, FALSE, CACHE_OFFSET (source.videoBitrate) },
+	{ "gopLength", "gop-length", TRUE, FALSE, CACHE_OFFSET (source.gopLength) },
+	{ "gopOnSceneChange", "gop-scene", TRUE, TRUE, CACHE_OFFSET (source.gopOnSceneChange) },
+	{ "openGop", "open-gop", TRUE, TRUE, CACHE_OFFSET (source.openGop) },
+	{ "bFrames", "bframes", TRUE, FALSE, CACHE_OFFSET (source.bFrames) },
+	{ "pFrames", "pframes", TRUE, FALSE, CACHE_OFFSET (source.pFrames) },
+	{ "slices", "slices", TRUE, FALSE, CACHE_OFFSET (source.slices) },
+	{ "level", "level", TRUE, FALSE, CACHE_OFFSET (source.level) },
+	{ "width", NULL, TRUE, FALSE, CACHE_OFFSET (source.width) },
+	{ "height", NULL, TRUE, FALSE, CACHE_OFFSET (source.height) },
+	{ "framerate", NULL, TRUE, FALSE, CACHE_OFFSET (source.framerate) },
+	{ "profile", NULL, TRUE, FALSE, CACHE_OFFSET (source.profile) },
+};
+
+/* D-Bus signals which announce the new value of a property as first
+ * argument, the dispatcher maps them to PropertiesChanged */
+static const struct {
+	const gchar *signal, *property;
+} signal_properties[] = {
+	{ "sourceStateChanged", "sourceState" },
+	{ "rtspStateChanged", "rtspState" },
+	{ "hlsStateChanged", "hlsState" },
+	{ "upstreamStateChanged", "upstreamState" },
+	{ "rtspClientCountChanged", "rtspClientCount" },
+	{ "uriParametersChanged", "uriParameters" },
+};
+
+static GVariant *cached_property_value (const DreamCachedProperty *prop, gint32 value)
+{
+	return prop->boolean ? g_variant_new_boolean (value) : g_variant_new_int32 (value);
+}
 
-	GST_DEBUG ("current caps %" GST_PTR_FORMAT, caps);
+/* in --sync-signals mode the dispatcher doesn't see the signals, it only
+ * gets told about the properties they change */
+static void sync_signal_properties (App *app, const gchar *signal_name, GVariant *parameters)
+{
+	guint i;
+	for (i = 0; i < G_N_ELEMENTS (signal_properties); i++)
+		if (g_strcmp0 (signal_properties[i].signal, signal_name) == 0)
+			dream_signal_post_property (app->signals, signal_properties[i].property, g_variant_get_child_value (parameters, 0));
+}
+
+static void cache_set (App *app, const DreamCachedProperty *prop, gint32 value)
+{
+	DreamPropertyCache *c = &app->properties;
+	gboolean changed;
+
+	g_mutex_lock (&c->lock);
+	changed = CACHE_VALUE (c, prop) != value;
+	CACHE_VALUE (c, prop) = value;
+	g_mutex_unlock (&c->lock);
+	if (changed)
+	{
+		GST_LOG ("cached %s = %i", prop->property, value);
+		dream_signal_post_property (app->signals, prop->property, cached_property_value (prop, value));
+	}
+}
+
+static void cache_parse_caps (App *app, GstCaps *caps)
+{
+	const GstStructure *structure;
+	const GValue *framerate;
+	const gchar *profile;
+	guint i, width = 0, height = 0;
 
+	if (!GST_IS_CAPS (caps) || gst_caps_is_empty (caps))
+		return;
 	structure = gst_caps_get_structure (caps, 0);
-	if (!structure)
-		goto out;
+	GST_DEBUG ("current caps %" GST_PTR_FORMAT, caps);
 
-	if (g_strcmp0 (prop_name, "framerate") == 0 && value)
+	gst_structure_get_uint (structure, "width", &width);
+	gst_structure_get_uint (structure, "height", &height);
+	framerate = gst_structure_get_value (structure, "framerate");
+	profile = gst_structure_get_string (structure, "profile");
+	if (!profile)
+		GST_WARNING ("profile missing in caps! returned main profile");
+
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
 	{
-		const GValue *framerate = gst_structure_get_value (structure, "framerate");
-		if (GST_VALUE_HOLDS_FRACTION(framerate))
-			*value = gst_value_get_fraction_numerator (framerate);
-		else
-			*value = 0;
-	}
-	else if (g_strcmp0 (prop_name, "profile") == 0 && value)
-	{
-		const gchar* profile = gst_structure_get_string(structure, "profile");
-		*value = 0;
-		if (!profile)
-			GST_WARNING("profile missing in caps! returned main profile");
-		else if (g_strcmp0 (profile, "high") == 0)
-			*value = 1;
-		else if (g_strcmp0 (profile, "main") == 0)
-			*value = 1;
-		else
-			GST_WARNING("unknown profile '%s' in caps! returned main profile", profile);
+		const DreamCachedProperty *prop = &cached_properties[i];
+		if (prop->element_property)
+			continue;
+		if (g_strcmp0 (prop->property, "width") == 0)
+			cache_set (app, prop, width);
+		else if (g_strcmp0 (prop->property, "height") == 0)
+			cache_set (app, prop, height);
+		else if (g_strcmp0 (prop->property, "framerate") == 0)
+			cache_set (app, prop, GST_VALUE_HOLDS_FRACTION (framerate) ? gst_value_get_fraction_numerator (framerate) : 0);
+		else if (g_strcmp0 (prop->property, "profile") == 0)
+			cache_set (app, prop, g_strcmp0 (profile, "high") == 0 ? 1 : 0);
 	}
-	else if ((g_strcmp0 (prop_name, "width") == 0 || g_strcmp0 (prop_name, "height") == 0) && value)
+}
+
+static void cache_read_property (App *app, GObject *source, const DreamCachedProperty *prop)
+{
+	gint32 value = 0;
+
+	if (prop->boolean)
 	{
-		if (!gst_structure_get_uint(structure, prop_name, value))
-			*value = 0;
+		gboolean enabled = FALSE;
+		g_object_get (source, prop->element_property, &enabled, NULL);
+		value = enabled;
 	}
 	else
-		goto out;
+		g_object_get (source, prop->element_property, &value, NULL);
+	cache_set (app, prop, value);
+}
 
-	GST_DEBUG ("%" GST_PTR_FORMAT"'s %s = %i", element, prop_name, *value);
-	ret = TRUE;
-out:
-	if (GST_IS_CAPS(caps))
-		gst_caps_unref(caps);
-	return ret;
+/* runs in whichever thread set the property, one read per actual change */
+static void source_property_notify (GObject *source, GParamSpec *pspec, gpointer user_data)
+{
+	App *app = user_data;
+	gboolean video = (GstElement *) source == app->vsrc;
+	guint i;
+
+	if (video && g_strcmp0 (pspec->name, "caps") == 0)
+	{
+		GstCaps *caps = NULL;
+		g_object_get (source, "caps", &caps, NULL);
+		cache_parse_caps (app, caps);
+		if (caps)
+			gst_caps_unref (caps);
+		return;
+	}
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
+		if (cached_properties[i].video == video && g_strcmp0 (cached_properties[i].element_property, pspec->name) == 0)
+			cache_read_property (app, source, &cached_properties[i]);
 }
 
-static void get_source_properties (App *app)
+static GstPadProbeReturn source_caps_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
 {
-	SourceProperties *p = &app->source_properties;
-	if (GST_IS_ELEMENT(app->asrc))
-		g_object_get (G_OBJECT (app->asrc), "bitrate", &p->audioBitrate, NULL);
-	if (GST_IS_ELEMENT(app->vsrc))
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+
+	if (GST_EVENT_TYPE (event) == GST_EVENT_CAPS)
 	{
-		g_object_get (G_OBJECT (app->vsrc), "bitrate", &p->videoBitrate, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "gop-length", &p->gopLength, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "gop-scene", &p->gopOnSceneChange, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "open-gop", &p->openGop, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "bframes", &p->bFrames, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "pframes", &p->pFrames, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "slices", &p->slices, NULL);
-		g_object_get (G_OBJECT (app->vsrc), "level", &p->level, NULL);
+		GstCaps *caps;
+		gst_event_parse_caps (event, &caps);
+		cache_parse_caps (user_data, caps);
+	}
+	return GST_PAD_PROBE_OK;
+}
+
+/* fills the cache once, afterwards it follows notify:: and caps events */
+static void watch_source_properties (App *app)
+{
+	DreamPropertyCache *c = &app->properties;
+	GstCaps *caps = NULL;
+	GstPad *srcpad;
+	guint i;
+
+	if (!IS_DREAM_SOURCE(app, app->asrc) || !IS_DREAM_SOURCE(app, app->vsrc))
+		return;
+
+	g_signal_connect (app->asrc, "notify", G_CALLBACK (source_property_notify), app);
+	g_signal_connect (app->vsrc, "notify", G_CALLBACK (source_property_notify), app);
+	srcpad = gst_element_get_static_pad (app->vsrc, "src");
+	gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, source_caps_probe, app, NULL);
+	gst_object_unref (srcpad);
 
-		gst_get_capsprop(app, app->vsrc, "width", &p->width);
-		gst_get_capsprop(app, app->vsrc, "height", &p->height);
-		gst_get_capsprop(app, app->vsrc, "framerate", &p->framerate);
-		gst_get_capsprop(app, app->vsrc, "profile", &p->profile);
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
+		if (cached_properties[i].element_property)
+			cache_read_property (app, G_OBJECT (cached_properties[i].video ? app->vsrc : app->asrc), &cached_properties[i]);
+	g_object_get (G_OBJECT (app->vsrc), "caps", &caps, NULL);
+	cache_parse_caps (app, caps);
+	if (caps)
+		gst_caps_unref (caps);
+
+	g_mutex_lock (&c->lock);
+	c->valid = TRUE;
+	g_mutex_unlock (&c->lock);
+}
+
+static GVariant *get_cached_property (App *app, const gchar *property_name, gboolean *found)
+{
+	DreamPropertyCache *c = &app->properties;
+	GVariant *value = NULL;
+	guint i;
+
+	*found = FALSE;
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
+	{
+		if (g_strcmp0 (cached_properties[i].property, property_name) != 0)
+			continue;
+		*found = TRUE;
+		g_mutex_lock (&c->lock);
+		if (c->valid)
+			value = cached_property_value (&cached_properties[i], CACHE_VALUE (c, &cached_properties[i]));
+		g_mutex_unlock (&c->lock);
+		break;
 	}
+	return value;
+}
+
+static void get_source_properties (App *app)
+{
+	DreamPropertyCache *c = &app->properties;
+	g_mutex_lock (&c->lock);
+	if (c->valid)
+		app->source_properties = c->source;
+	g_mutex_unlock (&c->lock);
 }
 
 static void apply_source_properties (App *app)
 {
 	SourceProperties *p = &app->source_properties;
-	if (GST_IS_ELEMENT(app->asrc))
+	if (IS_DREAM_SOURCE(app, app->asrc))
 	{
 		if (p->audioBitrate)
 			g_object_set (G_OBJECT (app->asrc), "bitrate", p->audioBitrate, NULL);
 	}
-	if (GST_IS_ELEMENT(app->vsrc))
+	if (IS_DREAM_SOURCE(app, app->vsrc))
 	{
 		if (p->videoBitrate)
 			g_object_set (G_OBJECT (app->vsrc), "bitrate", p->videoBitrate, NULL);
@@ -286,17 +534,13 @@ static void apply_source_properties (App *app)
 		g_object_set (G_OBJECT (app->vsrc), "slices", p->slices, NULL);
 		g_object_set (G_OBJECT (app->vsrc), "level", p->level, NULL);
 
-		if (p->framerate)
-			gst_set_framerate(app, p->framerate);
-		if (p->width && p->height)
-			gst_set_resolution(app,  p->width, p->height);
-		gst_set_profile(app, p->profile);
+		gst_set_video_caps(app, p->framerate ? p->framerate : -1, p->width, p->height, p->profile == 1 ? 1 : 0, NULL);
 	}
 }
 
 static gboolean gst_set_int_property (App *app, GstElement *source, const gchar* key, gint32 value, gboolean zero_allowed)
 {
-	if (!GST_IS_ELEMENT (source) || (!value && !zero_allowed))
+	if (!IS_DREAM_SOURCE (app, source) || (!value && !zero_allowed))
 		return FALSE;
 
 	g_object_set (G_OBJECT (source), key, value, NULL);
@@ -314,7 +558,7 @@ static gboolean gst_set_int_property (App *app, GstElement *source, const gchar*
 
 static gboolean gst_set_boolean_property (App *app, GstElement *source, const gchar* key, gboolean value)
 {
-	if (!GST_IS_ELEMENT (source))
+	if (!IS_DREAM_SOURCE (app, source))
 		return FALSE;
 
 	g_object_set (G_OBJECT (source), key, value, NULL);
@@ -370,6 +614,201 @@ static gboolean gst_set_level (App *app, gint32 value)
 	return gst_set_int_property(app, app->vsrc, "level", value, TRUE);
 }
 
+typedef struct {
+	gint ref_count;
+	gint done;
+	gboolean caps_changed, caps_seen;
+	GDBusMethodInvocation *invocation;
+	GstPad *pad;
+	gulong probe_id;
+	GstClockTime start;
+} DreamReconfigure;
+
+static void reconfigure_unref (gpointer user_data)
+{
+	DreamReconfigure *r = user_data;
+	if (!g_atomic_int_dec_and_test (&r->ref_count))
+		return;
+	gst_object_unref (r->pad);
+	g_slice_free (DreamReconfigure, r);
+}
+
+/* pts is GST_CLOCK_TIME_NONE when no keyframe showed up in time */
+static void reconfigure_reply (DreamReconfigure *r, GstClockTime pts)
+{
+	guint64 delay_us = 0;
+	if (GST_CLOCK_TIME_IS_VALID (pts))
+		delay_us = (gst_util_get_timestamp () - r->start) / GST_USECOND;
+	g_dbus_method_invocation_return_value (r->invocation, g_variant_new ("(btt)", TRUE, (guint64) pts, delay_us));
+}
+
+/* the first keyframe after the new caps, or after the call if only
+ * encoder properties changed, is the IDR which resulted from it */
+static GstPadProbeReturn reconfigure_keyframe_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	DreamReconfigure *r = user_data;
+	GstBuffer *buffer;
+
+	if (info->type & GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM)
+	{
+		if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) == GST_EVENT_CAPS)
+			r->caps_seen = TRUE;
+		return GST_PAD_PROBE_OK;
+	}
+	buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+	if ((r->caps_changed && !r->caps_seen) || GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		return GST_PAD_PROBE_OK;
+	/* lost against the timeout, which removes the probe itself */
+	if (!g_atomic_int_compare_and_exchange (&r->done, 0, 1))
+		return GST_PAD_PROBE_OK;
+	GST_INFO ("reconfiguration resulted in keyframe %" GST_TIME_FORMAT " after %" GST_TIME_FORMAT, GST_TIME_ARGS (GST_BUFFER_PTS (buffer)), GST_TIME_ARGS (gst_util_get_timestamp () - r->start));
+	reconfigure_reply (r, GST_BUFFER_PTS (buffer));
+	return GST_PAD_PROBE_REMOVE;
+}
+
+static gboolean reconfigure_timeout (gpointer user_data)
+{
+	DreamReconfigure *r = user_data;
+	if (g_atomic_int_compare_and_exchange (&r->done, 0, 1))
+	{
+		GST_WARNING ("no keyframe within %d ms after reconfiguration", RECONFIGURE_KEYFRAME_TIMEOUT);
+		gst_pad_remove_probe (r->pad, r->probe_id);
+		reconfigure_reply (r, GST_CLOCK_TIME_NONE);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static const DreamCachedProperty *cached_property_find (const gchar *property_name)
+{
+	guint i;
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
+		if (g_strcmp0 (cached_properties[i].property, property_name) == 0)
+			return &cached_properties[i];
+	return NULL;
+}
+
+/* applies a{sv} of encoder settings as one transaction: everything is
+ * validated before anything is touched, the element properties are set back
+ * to back and the caps are changed once. the reply waits for the resulting
+ * keyframe so callers can measure the glitch */
+static void reconfigure_source (App *app, GDBusMethodInvocation *invocation, GVariant *changes)
+{
+	gint32 values[G_N_ELEMENTS (cached_properties)];
+	gboolean set[G_N_ELEMENTS (cached_properties)] = { FALSE, };
+	gint caps[4] = { -1, -1, -1, -1 };
+	gboolean caps_changed = FALSE, video_changed = FALSE;
+	GVariantIter iter;
+	const gchar *key;
+	GVariant *value;
+	DreamReconfigure *r;
+	GstPad *srcpad;
+	guint i;
+
+	if (!app->pipeline || !IS_DREAM_SOURCE(app, app->asrc) || !IS_DREAM_SOURCE(app, app->vsrc))
+	{
+		g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] Wrong state - can't reconfigure");
+		return;
+	}
+
+	g_variant_iter_init (&iter, changes);
+	while (g_variant_iter_loop (&iter, "{&sv}", &key, &value))
+	{
+		const DreamCachedProperty *prop = cached_property_find (key);
+		gint32 v;
+		if (!prop || g_strcmp0 (key, "inputMode") == 0)
+		{
+			g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "[RTSPserver] can't reconfigure '%s'", key);
+			g_variant_unref (value);
+			return;
+		}
+		if (!g_variant_is_of_type (value, prop->boolean ? G_VARIANT_TYPE_BOOLEAN : G_VARIANT_TYPE_INT32))
+		{
+			g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "[RTSPserver] '%s' must be of type %s", key, prop->boolean ? "b" : "i");
+			g_variant_unref (value);
+			return;
+		}
+		v = prop->boolean ? g_variant_get_boolean (value) : g_variant_get_int32 (value);
+		if (v < 0 || (v == 0 && (g_str_has_suffix (key, "Bitrate") || !prop->element_property)) || (g_strcmp0 (key, "profile") == 0 && v > 1))
+		{
+			g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "[RTSPserver] invalid value %d for '%s'", v, key);
+			g_variant_unref (value);
+			return;
+		}
+		i = prop - cached_properties;
+		values[i] = v;
+		set[i] = TRUE;
+	}
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
+	{
+		const DreamCachedProperty *prop = &cached_properties[i];
+		if (!set[i])
+			continue;
+		video_changed |= prop->video;
+		if (prop->element_property)
+			continue;
+		caps_changed = TRUE;
+		if (g_strcmp0 (prop->property, "framerate") == 0)
+			caps[0] = values[i];
+		else if (g_strcmp0 (prop->property, "width") == 0)
+			caps[1] = values[i];
+		else if (g_strcmp0 (prop->property, "height") == 0)
+			caps[2] = values[i];
+		else if (g_strcmp0 (prop->property, "profile") == 0)
+			caps[3] = values[i];
+	}
+	if ((caps[1] < 0) != (caps[2] < 0))
+	{
+		g_dbus_method_invocation_return_error (invocation, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "[RTSPserver] width and height must be changed together");
+		return;
+	}
+
+	r = g_slice_new0 (DreamReconfigure);
+	r->invocation = invocation;
+	r->start = gst_util_get_timestamp ();
+
+	/* the cache announces the changes in one PropertiesChanged after thawing */
+	g_object_freeze_notify (G_OBJECT (app->asrc));
+	g_object_freeze_notify (G_OBJECT (app->vsrc));
+	for (i = 0; i < G_N_ELEMENTS (cached_properties); i++)
+	{
+		const DreamCachedProperty *prop = &cached_properties[i];
+		if (!set[i] || !prop->element_property)
+			continue;
+		GST_DEBUG ("reconfigure %s = %d", prop->property, values[i]);
+		g_object_set (G_OBJECT (prop->video ? app->vsrc : app->asrc), prop->element_property, values[i], NULL);
+		/* the adaptive bitrate works towards the new setting from now on */
+		if (prop->video && g_strcmp0 (prop->element_property, "bitrate") == 0)
+			dream_rate_controller_set_target (app->rate, values[i]);
+	}
+	/* only frames encoded with the new properties count, the caps event
+	 * can't pass before the caps are changed below */
+	if (video_changed)
+	{
+		r->ref_count = 2;
+		r->caps_changed = caps_changed;
+		srcpad = gst_element_get_static_pad (app->vsrc, "src");
+		r->pad = srcpad;
+		r->probe_id = gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, reconfigure_keyframe_probe, r, reconfigure_unref);
+		g_timeout_add_full (G_PRIORITY_DEFAULT, RECONFIGURE_KEYFRAME_TIMEOUT, reconfigure_timeout, r, reconfigure_unref);
+	}
+	if (caps_changed)
+	{
+		gst_set_video_caps (app, caps[0], caps[1], caps[2], caps[3], &caps_changed);
+		/* same caps as before, take the next keyframe */
+		if (!caps_changed && video_changed)
+			g_atomic_int_set (&r->caps_changed, FALSE);
+	}
+	g_object_thaw_notify (G_OBJECT (app->vsrc));
+	g_object_thaw_notify (G_OBJECT (app->asrc));
+	get_source_properties (app);
+
+	if (!video_changed)
+	{
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(btt)", TRUE, (guint64) GST_CLOCK_TIME_NONE, (guint64) 0));
+		g_slice_free (DreamReconfigure, r);
+	}
+}
+
 gboolean upstream_resume_transmitting(App *app)
 {
 	DreamTCPupstream *t = app->tcp_upstream;
@@ -382,6 +821,7 @@ gboolean upstream_resume_transmitting(App *app)
 	if (t->id_signal_keepalive)
 		g_source_remove (t->id_signal_keepalive);
 	t->id_signal_keepalive = 0;
+	dream_rate_controller_set_limit (app->rate, 0);
 	return G_SOURCE_REMOVE;
 }
 
@@ -397,15 +837,29 @@ static GVariant *handle_get_property (GDBusConnection  *connection,
 
 	GST_DEBUG("dbus get property %s from %s", property_name, sender);
 
-	if (g_strcmp0 (property_name, "sourceState") == 0)
+	gboolean cached;
+	GVariant *value = get_cached_property (app, property_name, &cached);
+	if (cached)
+	{
+		if (value)
+			return value;
+	}
+	else if (g_strcmp0 (property_name, "sourceState") == 0)
 	{
 		if (app->pipeline)
 		{
-			GstState state = GST_STATE_VOID_PENDING;
-			gst_element_get_state (GST_ELEMENT(app->pipeline), &state, NULL, 1*GST_USECOND);
-			return g_variant_new_int32 ((int)state);
+			return g_variant_new_int32 (g_atomic_int_get (&app->properties.source_state));
 		}
 	}
+	else if (g_strcmp0 (property_name, "sourceIdle") == 0)
+	{
+		return g_variant_new_boolean (g_atomic_int_get (&app->idle.active));
+	}
+	else if (g_strcmp0 (property_name, "rtspState") == 0)
+	{
+		if (app->rtsp_server)
+			return g_variant_new_int32 (app->rtsp_server->state);
+	}
 	else if (g_strcmp0 (property_name, "upstreamState") == 0)
 	{
 		if (app->tcp_upstream)
@@ -416,112 +870,254 @@ static GVariant *handle_get_property (GDBusConnection  *connection,
 		if (app->hls_server)
 			return g_variant_new_int32 (app->hls_server->state);
 	}
-	else if (g_strcmp0 (property_name, "inputMode") == 0)
-	{
-		inputMode input_mode = -1;
-		if (GST_IS_ELEMENT(app->asrc))
-		{
-			g_object_get (G_OBJECT (app->asrc), "input_mode", &input_mode, NULL);
-			return g_variant_new_int32 (input_mode);
-		}
-	}
 	else if (g_strcmp0 (property_name, "rtspClientCount") == 0)
 	{
 		if (app->rtsp_server)
-			return g_variant_new_int32 (g_list_length(app->rtsp_server->clients_list));
+			return g_variant_new_int32 (g_atomic_int_get (&app->rtsp_server->clients_count));
 	}
-	else if (g_strcmp0 (property_name, "uriParameters") == 0)
+	else if (g_strcmp0 (property_name, "rtspBacklogLimits") == 0)
 	{
 		if (app->rtsp_server)
-			return g_variant_new_string (app->rtsp_server->uri_parameters);
+			return g_variant_new ("(uuu)", app->rtsp_server->backlog_bytes, app->rtsp_server->backlog_drop_ms, app->rtsp_server->backlog_evict_ms);
 	}
-	else if (g_strcmp0 (property_name, "audioBitrate") == 0)
+	else if (g_strcmp0 (property_name, "rtspCongestionCounters") == 0)
 	{
-		gint rate = 0;
-		if (GST_IS_ELEMENT(app->asrc))
-		{
-			g_object_get (G_OBJECT (app->asrc), "bitrate", &rate, NULL);
-			return g_variant_new_int32 (rate);
-		}
+		DreamRTSPserver *r = app->rtsp_server;
+		if (r)
+			return g_variant_new ("(uuuu)", g_atomic_int_get (&r->congested_count), g_atomic_int_get (&r->dropped_count), g_atomic_int_get (&r->resumed_count), g_atomic_int_get (&r->evicted_count));
 	}
-	else if (g_strcmp0 (property_name, "videoBitrate") == 0)
+	else if (g_strcmp0 (property_name, "rtspThreadPool") == 0)
 	{
-		gint rate = 0;
-		if (GST_IS_ELEMENT(app->vsrc))
+		DreamRTSPserver *r = app->rtsp_server;
+		if (r)
 		{
-			g_object_get (G_OBJECT (app->vsrc), "bitrate", &rate, NULL);
-			return g_variant_new_int32 (rate);
+			gchar *affinity = gst_dream_rtsp_thread_pool_get_affinity (r->thread_pool);
+			GVariant *value = g_variant_new ("(is)", gst_rtsp_thread_pool_get_max_threads (GST_RTSP_THREAD_POOL (r->thread_pool)), affinity);
+			g_free (affinity);
+			return value;
 		}
 	}
-	else if (g_strcmp0 (property_name, "gopLength") == 0)
+	else if (g_strcmp0 (property_name, "rtspThreadStats") == 0)
 	{
-		gint length = 0;
-		if (GST_IS_ELEMENT(app->vsrc))
+		DreamRTSPserver *r = app->rtsp_server;
+		if (r)
 		{
-			g_object_get (G_OBJECT (app->vsrc), "gop-length", &length, NULL);
-			return g_variant_new_int32 (length);
+			GVariantBuilder builder;
+			GArray *stats = gst_dream_rtsp_thread_pool_get_stats (r->thread_pool);
+			guint i;
+			g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(uibuttt)"));
+			for (i = 0; i < stats->len; i++)
+			{
+				GstDreamRTSPThreadStats *t = &g_array_index (stats, GstDreamRTSPThreadStats, i);
+				g_variant_builder_add (&builder, "(uibuttt)", t->index, t->cpu, t->running, t->clients, t->total_clients, t->requests, t->messages);
+			}
+			g_array_free (stats, TRUE);
+			return g_variant_builder_end (&builder);
 		}
 	}
-	else if (g_strcmp0 (property_name, "gopOnSceneChange") == 0)
+	else if (g_strcmp0 (property_name, "latencyTracing") == 0)
 	{
-		gboolean enabled = FALSE;
-		if (GST_IS_ELEMENT(app->vsrc))
-		{
-			g_object_get (G_OBJECT (app->vsrc), "gop-scene", &enabled, NULL);
-			return g_variant_new_boolean (enabled);
-		}
+		return g_variant_new_boolean (DREAM_LATENCY_ENABLED ());
 	}
-	else if (g_strcmp0 (property_name, "openGop") == 0)
+	else if (g_strcmp0 (property_name, "latencyStats") == 0)
 	{
-		gboolean enabled = FALSE;
-		if (GST_IS_ELEMENT(app->vsrc))
-		{
-			g_object_get (G_OBJECT (app->vsrc), "open-gop", &enabled, NULL);
-			return g_variant_new_boolean (enabled);
+		GVariantBuilder builder;
+		DreamLatencyPath path;
+		DreamLatencyStage stage;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssttat)"));
+		for (path = 0; path < DREAM_LATENCY_PATH_LAST; path++)
+			for (stage = 0; stage < DREAM_LATENCY_STAGE_LAST; stage++)
+			{
+				DreamMetricHistogramValue h;
+				GVariantBuilder buckets;
+				guint i;
+				dream_latency_get (path, stage, &h);
+				if (!h.count)
+					continue;
+				g_variant_builder_init (&buckets, G_VARIANT_TYPE ("at"));
+				for (i = 0; i < DREAM_METRIC_N_BUCKETS; i++)
+					g_variant_builder_add (&buckets, "t", h.buckets[i]);
+				g_variant_builder_add (&builder, "(ssttat)", dream_latency_path_name (path), dream_latency_stage_name (stage), h.count, h.sum_us, &buckets);
+			}
+		return g_variant_builder_end (&builder);
+	}
+	else if (g_strcmp0 (property_name, "probeStats") == 0)
+	{
+		GVariantBuilder builder;
+		GArray *probes = dream_probe_snapshot ();
+		guint i;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sttttdduutt)"));
+		for (i = 0; i < probes->len; i++)
+		{
+			DreamProbeStats *p = &g_array_index (probes, DreamProbeStats, i);
+			g_variant_builder_add (&builder, "(sttttdduutt)", p->name, p->bytes, p->buffers, p->keyframes, p->bitrate,
+				p->buffer_rate, p->keyframe_rate, p->level_bytes, p->level_buffers, p->level_time, p->overruns);
 		}
+		g_array_free (probes, TRUE);
+		return g_variant_builder_end (&builder);
 	}
-	else if (g_strcmp0 (property_name, "bFrames") == 0)
+	else if (g_strcmp0 (property_name, "threadPolicy") == 0)
 	{
-		gint bframes = 0;
-		if (GST_IS_ELEMENT(app->vsrc))
+		GVariantBuilder builder;
+		DreamThreadClass cls;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sis)"));
+		for (cls = 0; cls < DREAM_THREAD_CLASS_LAST; cls++)
 		{
-			g_object_get (G_OBJECT (app->vsrc), "bframes", &bframes, NULL);
-			return g_variant_new_int32 (bframes);
+			gint priority;
+			gchar *cpus;
+			dream_thread_policy_get (app->threads, cls, &priority, &cpus);
+			g_variant_builder_add (&builder, "(sis)", dream_thread_class_name (cls), priority, cpus);
+			g_free (cpus);
 		}
+		return g_variant_builder_end (&builder);
 	}
-	else if (g_strcmp0 (property_name, "pFrames") == 0)
+	else if (g_strcmp0 (property_name, "threadStats") == 0)
 	{
-		gint pframes = 0;
-		if (GST_IS_ELEMENT(app->vsrc))
+		GVariantBuilder builder;
+		GArray *threads = dream_thread_policy_snapshot (app->threads);
+		guint i;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(ssuttt)"));
+		for (i = 0; i < threads->len; i++)
 		{
-			g_object_get (G_OBJECT (app->vsrc), "pframes", &pframes, NULL);
-			return g_variant_new_int32 (pframes);
+			DreamThreadStats *t = &g_array_index (threads, DreamThreadStats, i);
+			g_variant_builder_add (&builder, "(ssuttt)", t->name, dream_thread_class_name (t->cls), t->tid, t->run_ns, t->wait_ns, t->timeslices);
 		}
+		g_array_free (threads, TRUE);
+		return g_variant_builder_end (&builder);
 	}
-	else if (g_strcmp0 (property_name, "slices") == 0)
+	else if (g_strcmp0 (property_name, "sharedMemory") == 0)
 	{
-		gint slices = 0;
-		if (GST_IS_ELEMENT(app->vsrc))
+		GVariantBuilder builder;
+		guint i;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sstttt)"));
+		g_mutex_lock (&app->shm.lock);
+		for (i = 0; i < SHM_STREAM_LAST; i++)
 		{
-			g_object_get (G_OBJECT (app->vsrc), "slices", &slices, NULL);
-			return g_variant_new_int32 (slices);
+			DreamShmStats s;
+			if (!app->shm.streams[i].ring)
+				continue;
+			dream_shm_ring_get_stats (app->shm.streams[i].ring, &s);
+			g_variant_builder_add (&builder, "(sstttt)", shm_stream_names[i], dream_shm_ring_get_name (app->shm.streams[i].ring), s.capacity, s.bytes, s.records, s.keyframes);
 		}
+		g_mutex_unlock (&app->shm.lock);
+		return g_variant_builder_end (&builder);
 	}
-	else if (g_strcmp0 (property_name, "level") == 0)
+	else if (g_strcmp0 (property_name, "unixSocket") == 0)
+	{
+		DreamUnixStats s = { 0, };
+		const gchar *path = "";
+		GVariant *value;
+		g_mutex_lock (&app->local.lock);
+		if (app->local.server)
+		{
+			dream_unix_server_get_stats (app->local.server, &s);
+			path = dream_unix_server_get_path (app->local.server);
+		}
+		value = g_variant_new ("(sutttt)", path, s.clients, s.bytes, s.batches, s.segments, s.drops);
+		g_mutex_unlock (&app->local.lock);
+		return value;
+	}
+	else if (g_strcmp0 (property_name, "timeshift") == 0)
+	{
+		DreamTimeshiftStats s = { 0, };
+		const gchar *directory = "";
+		GVariant *value;
+		g_mutex_lock (&app->timeshift.lock);
+		if (app->timeshift.store)
+		{
+			dream_timeshift_get_stats (app->timeshift.store, &s);
+			directory = dream_timeshift_get_directory (app->timeshift.store);
+		}
+		value = g_variant_new ("(sbttbdutttt)", directory, s.direct, s.capacity, s.written, s.wrapped, (gdouble) s.window / G_TIME_SPAN_SECOND, s.keyframes, s.writes, s.write_us, s.max_write_us, s.overruns);
+		g_mutex_unlock (&app->timeshift.lock);
+		return value;
+	}
+	else if (g_strcmp0 (property_name, "recording") == 0)
+	{
+		DreamRecorderStats s = { 0, };
+		const gchar *directory = "";
+		gchar *file = NULL;
+		GVariant *value;
+		g_mutex_lock (&app->recording.lock);
+		if (app->recording.recorder)
+		{
+			dream_recorder_get_stats (app->recording.recorder, &s);
+			directory = dream_recorder_get_directory (app->recording.recorder);
+			file = dream_recorder_get_file (app->recording.recorder);
+		}
+		value = g_variant_new ("(ssubtttttttttt)", directory, file ? file : "", s.files, s.direct, s.bytes, s.backlog, s.max_backlog, s.writes, s.write_us, s.max_write_us, s.syncs, s.sync_us, s.gaps, s.dropped);
+		g_mutex_unlock (&app->recording.lock);
+		g_free (file);
+		return value;
+	}
+	else if (g_strcmp0 (property_name, "allocStats") == 0)
+	{
+		GVariantBuilder builder;
+		GArray *buckets;
+		guint i;
+		if (!app->arena)
+			return g_variant_new ("(t@a(utttu))", G_GUINT64_CONSTANT(0), g_variant_new_array (G_VARIANT_TYPE ("(utttu)"), NULL, 0));
+		buckets = dream_arena_snapshot (app->arena);
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(utttu)"));
+		for (i = 0; i < buckets->len; i++)
+		{
+			DreamArenaStats *b = &g_array_index (buckets, DreamArenaStats, i);
+			g_variant_builder_add (&builder, "(utttu)", (guint32) b->size, b->reused, b->allocated, b->released, b->cached);
+		}
+		g_array_free (buckets, TRUE);
+		return g_variant_new ("(ta(utttu))", dream_arena_get_fallbacks (app->arena), &builder);
+	}
+	else if (g_strcmp0 (property_name, "bufferBudget") == 0)
+	{
+		DreamBudgetStats s;
+		dream_budget_get_stats (app->budget, &s);
+		return g_variant_new ("(ttdt)", s.budget, s.used, s.pressure, s.rebalances);
+	}
+	else if (g_strcmp0 (property_name, "bufferBudgetQueues") == 0)
+	{
+		GVariantBuilder builder;
+		GArray *queues = dream_budget_snapshot (app->budget);
+		guint i;
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(suuu)"));
+		for (i = 0; i < queues->len; i++)
+		{
+			DreamBudgetQueueStats *q = &g_array_index (queues, DreamBudgetQueueStats, i);
+			g_variant_builder_add (&builder, "(suuu)", q->name, q->weight, q->limit, q->level);
+		}
+		dream_budget_snapshot_free (queues);
+		return g_variant_builder_end (&builder);
+	}
+	else if (g_strcmp0 (property_name, "adaptiveBitrate") == 0)
+	{
+		DreamRateStats s;
+		dream_rate_controller_get_stats (app->rate, &s);
+		return g_variant_new ("(bii)", s.enabled, s.min_kbps, s.max_kbps);
+	}
+	else if (g_strcmp0 (property_name, "adaptiveBitrateStats") == 0)
+	{
+		DreamRateStats s;
+		dream_rate_controller_get_stats (app->rate, &s);
+		return g_variant_new ("(iiudddtttttt)", s.limit_kbps, s.target_kbps, s.adjustments, s.fill, s.motion, s.saved_kbit_per_hour,
+			s.adapted[0], s.adapted[1], s.adapted[2], s.ceiling[0], s.ceiling[1], s.ceiling[2]);
+	}
+	else if (g_strcmp0 (property_name, "rtspVariants") == 0)
 	{
-		gint level = 0;
-		if (GST_IS_ELEMENT(app->vsrc))
+		if (app->rtsp_server)
 		{
-			g_object_get (G_OBJECT (app->vsrc), "level", &level, NULL);
-			return g_variant_new_int32 (level);
+			GVariantBuilder builder;
+			GList *l;
+			g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+			RTSP_LOCK (app);
+			for (l = app->rtsp_server->variants; l; l = l->next)
+				g_variant_builder_add (&builder, "s", ((DreamRTSPVariant *) l->data)->key);
+			RTSP_UNLOCK (app);
+			return g_variant_builder_end (&builder);
 		}
 	}
-	else if (g_strcmp0 (property_name, "width") == 0 || g_strcmp0 (property_name, "height") == 0 || g_strcmp0 (property_name, "framerate") == 0 || g_strcmp0 (property_name, "profile") == 0)
+	else if (g_strcmp0 (property_name, "uriParameters") == 0)
 	{
-		guint32 value;
-		if (gst_get_capsprop(app, app->vsrc, property_name, &value))
-			return g_variant_new_int32(value);
-		GST_WARNING("can't handle_get_property name=%s", property_name);
+		if (app->rtsp_server)
+			return g_variant_new_string (app->rtsp_server->uri_parameters);
 	}
 	else if (g_strcmp0 (property_name, "autoBitrate") == 0)
 	{
@@ -537,6 +1133,25 @@ static GVariant *handle_get_property (GDBusConnection  *connection,
 	return NULL;
 } // handle_get_property
 
+/* every readable property except the statistics arrays in one a{sv} */
+static GVariant *get_state (App *app)
+{
+	GDBusPropertyInfo **props = introspection_data->interfaces[0]->properties;
+	GVariantBuilder builder;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	for (; props && *props; props++)
+	{
+		GVariant *value;
+		if (!((*props)->flags & G_DBUS_PROPERTY_INFO_FLAGS_READABLE) || (*props)->signature[0] == 'a')
+			continue;
+		value = handle_get_property (NULL, NULL, object_name, service, (*props)->name, NULL, app);
+		if (value)
+			g_variant_builder_add (&builder, "{sv}", (*props)->name, value);
+	}
+	return g_variant_builder_end (&builder);
+}
+
 static gboolean handle_set_property (GDBusConnection  *connection,
 				     const gchar      *sender,
 				     const gchar      *object_path,
@@ -571,7 +1186,10 @@ static gboolean handle_set_property (GDBusConnection  *connection,
 	else if (g_strcmp0 (property_name, "videoBitrate") == 0)
 	{
 		if (gst_set_bitrate (app, app->vsrc, g_variant_get_int32 (value)))
+		{
+			dream_rate_controller_set_target (app->rate, g_variant_get_int32 (value));
 			return 1;
+		}
 	}
 	else if (g_strcmp0 (property_name, "gopLength") == 0)
 	{
@@ -633,6 +1251,11 @@ static gboolean handle_set_property (GDBusConnection  *connection,
 			return 1;
 		}
 	}
+	else if (g_strcmp0 (property_name, "latencyTracing") == 0)
+	{
+		dream_latency_set_enabled (g_variant_get_boolean (value));
+		return 1;
+	}
 	else
 	{
 		g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED, "[RTSPserver] Invalid property: '%s'", property_name);
@@ -642,6 +1265,26 @@ static gboolean handle_set_property (GDBusConnection  *connection,
 	return 0;
 } // handle_set_property
 
+typedef struct {
+	App *app;
+	GDBusMethodInvocation *invocation;
+} DreamMethodCall;
+
+static gboolean handle_method_call_deferred (gpointer user_data)
+{
+	DreamMethodCall *call = user_data;
+	GDBusMethodInvocation *invocation = call->invocation;
+	handle_method_call (g_dbus_method_invocation_get_connection (invocation),
+			    g_dbus_method_invocation_get_sender (invocation),
+			    g_dbus_method_invocation_get_object_path (invocation),
+			    g_dbus_method_invocation_get_interface_name (invocation),
+			    g_dbus_method_invocation_get_method_name (invocation),
+			    g_dbus_method_invocation_get_parameters (invocation),
+			    invocation, call->app);
+	g_free (call);
+	return G_SOURCE_REMOVE;
+}
+
 static void handle_method_call (GDBusConnection       *connection,
 				const gchar           *sender,
 				const gchar           *object_path,
@@ -653,6 +1296,42 @@ static void handle_method_call (GDBusConnection       *connection,
 {
 	App *app = user_data;
 
+	/* getState only reads cached state and short-held locks, it never waits for
+	 * the pipeline and is answered right away */
+	if (g_strcmp0 (method_name, "getState") == 0)
+	{
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a{sv})", get_state (app)));
+		return;
+	}
+
+	/* methods may reconfigure the pipeline, so they're executed on the
+	 * control context and the D-Bus thread stays responsive meanwhile */
+	if (!g_main_context_is_owner (g_main_context_default ()))
+	{
+		DreamMethodCall *call = g_new0 (DreamMethodCall, 1);
+		call->app = app;
+		call->invocation = invocation;
+		g_main_context_invoke (NULL, handle_method_call_deferred, call);
+		return;
+	}
+
+	/* without set_property in the vtable GDBus checks the property and
+	 * passes Properties.Set on here, so it is deferred like the methods */
+	if (g_strcmp0 (interface_name, "org.freedesktop.DBus.Properties") == 0 && g_strcmp0 (method_name, "Set") == 0)
+	{
+		const gchar *property_interface, *property_name;
+		GVariant *value;
+		GError *error = NULL;
+
+		g_variant_get (parameters, "(&s&sv)", &property_interface, &property_name, &value);
+		if (handle_set_property (connection, sender, object_path, property_interface, property_name, value, &error, app))
+			g_dbus_method_invocation_return_value (invocation, NULL);
+		else
+			g_dbus_method_invocation_take_error (invocation, error);
+		g_variant_unref (value);
+		return;
+	}
+
 	gchar *paramstr = g_variant_print (parameters, TRUE);
 	GST_DEBUG("dbus handle method %s %s from %s", method_name, paramstr, sender);
 	g_free (paramstr);
@@ -673,11 +1352,6 @@ static void handle_method_call (GDBusConnection       *connection,
 			else if (state == FALSE && app->rtsp_server->state >= RTSP_STATE_IDLE)
                         {
 				result = disable_rtsp_server(app);
-				if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
-				{
-					destroy_pipeline(app);
-					create_source_pipeline(app);
-				}
                         }
 		}
 		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
@@ -699,15 +1373,84 @@ static void handle_method_call (GDBusConnection       *connection,
 			else if (state == FALSE && app->hls_server->state >= HLS_STATE_IDLE)
                         {
 				result = disable_hls_server(app);
-				if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->rtsp_server->state == RTSP_STATE_DISABLED)
-				{
-					destroy_pipeline(app);
-					create_source_pipeline(app);
-				}
                         }
 		}
 		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
 	}
+	else if (g_strcmp0 (method_name, "enableSharedMemory") == 0)
+	{
+		gboolean result = FALSE;
+		if (app->pipeline)
+		{
+			gboolean state;
+			const gchar *streams;
+
+			g_variant_get (parameters, "(b&s)", &state, &streams);
+			GST_DEBUG("app->pipeline=%p, enableSharedMemory state=%i streams=%s", app->pipeline, state, streams);
+
+			if (state == TRUE)
+				result = enable_shm_export(app, streams);
+			else
+				result = disable_shm_export(app, streams);
+		}
+		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "enableUnixSocket") == 0)
+	{
+		gboolean result = FALSE;
+		if (app->pipeline)
+		{
+			gboolean state;
+			const gchar *path;
+
+			g_variant_get (parameters, "(b&s)", &state, &path);
+			GST_DEBUG("app->pipeline=%p, enableUnixSocket state=%i path=%s", app->pipeline, state, path);
+
+			if (state == TRUE)
+				result = enable_unix_output(app, path);
+			else
+				result = disable_unix_output(app);
+		}
+		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "enableTimeshift") == 0)
+	{
+		gboolean result = FALSE;
+		if (app->pipeline)
+		{
+			gboolean state;
+			const gchar *directory;
+			guint32 megabytes;
+
+			g_variant_get (parameters, "(b&su)", &state, &directory, &megabytes);
+			GST_DEBUG("app->pipeline=%p, enableTimeshift state=%i directory=%s megabytes=%u", app->pipeline, state, directory, megabytes);
+
+			if (state == TRUE)
+				result = enable_timeshift(app, directory, megabytes);
+			else
+				result = disable_timeshift(app);
+		}
+		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "enableRecording") == 0)
+	{
+		gboolean result = FALSE;
+		if (app->pipeline)
+		{
+			gboolean state;
+			const gchar *directory;
+			guint32 megabytes, seconds;
+
+			g_variant_get (parameters, "(b&suu)", &state, &directory, &megabytes, &seconds);
+			GST_DEBUG("app->pipeline=%p, enableRecording state=%i directory=%s megabytes=%u seconds=%u", app->pipeline, state, directory, megabytes, seconds);
+
+			if (state == TRUE)
+				result = enable_recording(app, directory, megabytes, seconds);
+			else
+				result = disable_recording(app);
+		}
+		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
+	}
 	else if (g_strcmp0 (method_name, "enableUpstream") == 0)
 	{
 		gboolean result = FALSE;
@@ -725,15 +1468,77 @@ static void handle_method_call (GDBusConnection       *connection,
 			else if (state == FALSE && app->tcp_upstream->state >= UPSTREAM_STATE_CONNECTING)
 			{
 				result = disable_tcp_upstream(app);
-				if (app->rtsp_server->state == RTSP_STATE_DISABLED)
-				{
-					destroy_pipeline(app);
-					create_source_pipeline(app);
-				}
 			}
 		}
 		g_dbus_method_invocation_return_value (invocation,  g_variant_new ("(b)", result));
 	}
+	else if (g_strcmp0 (method_name, "setRTSPBacklogLimits") == 0)
+	{
+		DreamRTSPserver *r = app->rtsp_server;
+		guint32 bytes, drop_ms, evict_ms;
+		gboolean result = FALSE;
+		g_variant_get (parameters, "(uuu)", &bytes, &drop_ms, &evict_ms);
+		GST_DEBUG("setRTSPBacklogLimits bytes=%u drop_ms=%u evict_ms=%u", bytes, drop_ms, evict_ms);
+		if (r)
+		{
+			r->backlog_bytes = bytes;
+			r->backlog_drop_ms = drop_ms;
+			r->backlog_evict_ms = evict_ms;
+			result = TRUE;
+		}
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "setRTSPThreadPool") == 0)
+	{
+		DreamRTSPserver *r = app->rtsp_server;
+		gint max_threads;
+		const gchar *affinity;
+		gboolean result = FALSE;
+		g_variant_get (parameters, "(i&s)", &max_threads, &affinity);
+		GST_DEBUG("setRTSPThreadPool max_threads=%i affinity='%s'", max_threads, affinity);
+		if (max_threads >= 0 && max_threads <= RTSP_MAX_THREADS_LIMIT && gst_dream_rtsp_thread_pool_set_affinity (r->thread_pool, affinity))
+		{
+			r->max_threads = max_threads;
+			gst_rtsp_thread_pool_set_max_threads (GST_RTSP_THREAD_POOL (r->thread_pool), max_threads ? max_threads : (gint) g_get_num_processors ());
+			result = TRUE;
+		}
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "setThreadPolicy") == 0)
+	{
+		const gchar *name, *cpus;
+		gint priority, cls;
+		gboolean result = FALSE;
+		g_variant_get (parameters, "(&si&s)", &name, &priority, &cpus);
+		GST_DEBUG("setThreadPolicy class=%s priority=%i cpus='%s'", name, priority, cpus);
+		cls = dream_thread_class_from_name (name);
+		if (cls >= 0)
+			result = dream_thread_policy_set (app->threads, cls, priority, cpus);
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "setBufferBudget") == 0)
+	{
+		guint64 bytes;
+		g_variant_get (parameters, "(t)", &bytes);
+		GST_DEBUG("setBufferBudget bytes=%" G_GUINT64_FORMAT, bytes);
+		dream_budget_set (app->budget, bytes);
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", TRUE));
+	}
+	else if (g_strcmp0 (method_name, "setAdaptiveBitrate") == 0)
+	{
+		gboolean enabled, result;
+		gint min_kbps, max_kbps;
+		g_variant_get (parameters, "(bii)", &enabled, &min_kbps, &max_kbps);
+		GST_DEBUG("setAdaptiveBitrate enabled=%i min=%i max=%i", enabled, min_kbps, max_kbps);
+		result = dream_rate_controller_set_envelope (app->rate, enabled, min_kbps, max_kbps);
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(b)", result));
+	}
+	else if (g_strcmp0 (method_name, "reconfigure") == 0)
+	{
+		GVariant *changes = g_variant_get_child_value (parameters, 0);
+		reconfigure_source (app, invocation, changes);
+		g_variant_unref (changes);
+	}
 	else if (g_strcmp0 (method_name, "setResolution") == 0)
 	{
 		int width, height;
@@ -758,7 +1563,8 @@ static void on_bus_acquired (GDBusConnection *connection,
 	{
 		handle_method_call,
 		handle_get_property,
-		handle_set_property,
+		/* Properties.Set goes to handle_method_call, see there */
+		NULL,
 		{ 0, }
 	};
 
@@ -767,15 +1573,23 @@ static void on_bus_acquired (GDBusConnection *connection,
 	g_dbus_connection_register_object (connection, object_name, introspection_data->interfaces[0], &interface_vtable, user_data, NULL, &error);
 } // on_bus_acquired
 
+static gboolean set_pipeline_ready (gpointer user_data)
+{
+	App *app = user_data;
+	if (app->pipeline && gst_element_set_state (app->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_SUCCESS)
+		GST_ERROR ("Failed to bring state of source pipeline to READY");
+	return G_SOURCE_REMOVE;
+}
+
 static void on_name_acquired (GDBusConnection *connection,
 			      const gchar     *name,
 			      gpointer         user_data)
 {
 	App *app = user_data;
 	app->dbus_connection = connection;
+	dream_signal_dispatcher_set_connection (app->signals, connection);
 	GST_DEBUG ("aquired dbus name (\"%s\")", name);
-	if (gst_element_set_state (app->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_SUCCESS)
-		GST_ERROR ("Failed to bring state of source pipeline to READY");
+	g_main_context_invoke (NULL, set_pipeline_ready, app);
 } // on_name_acquired
 
 static void on_name_lost (GDBusConnection *connection,
@@ -784,6 +1598,7 @@ static void on_name_lost (GDBusConnection *connection,
 	{
 	App *app = user_data;
 	app->dbus_connection = NULL;
+	dream_signal_dispatcher_set_connection (app->signals, NULL);
 	GST_WARNING ("lost dbus name (\"%s\" @ %p)", name, connection);
 	//  g_main_loop_quit (app->loop);
 } // on_name_lost
@@ -792,7 +1607,6 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 {
 	App *app = user_data;
 
-// 	DREAMRTSPSERVER_LOCK (app);
 	GST_TRACE_OBJECT (app, "message %" GST_PTR_FORMAT "", message);
 	switch (GST_MESSAGE_TYPE (message)) {
 		case GST_MESSAGE_STATE_CHANGED:
@@ -805,6 +1619,7 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 			if (GST_MESSAGE_SRC(message) == GST_OBJECT(app->pipeline))
 			{
 				GST_DEBUG_OBJECT(app, "state transition %s -> %s", gst_element_state_get_name(old_state), gst_element_state_get_name(new_state));
+				g_atomic_int_set (&app->properties.source_state, new_state);
 				send_signal (app, "sourceStateChanged", g_variant_new("(i)", (int) new_state));
 			}
 			break;
@@ -821,7 +1636,6 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 				{
 					GST_INFO ("element %s: %s", name, err->message);
 					send_signal (app, "encoderError", NULL);
-// 					DREAMRTSPSERVER_UNLOCK (app);
 					disable_tcp_upstream(app);
 					destroy_pipeline(app);
 				}
@@ -830,13 +1644,7 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 					send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_FAILED));
 					GST_INFO ("element %s: %s -> this means PEER DISCONNECTED", name, err->message);
 					GST_DEBUG ("Additional ERROR debug info: %s", debug);
-// 					DREAMRTSPSERVER_UNLOCK (app);
 					disable_tcp_upstream(app);
-					if (app->rtsp_server->state == RTSP_STATE_DISABLED)
-					{
-						destroy_pipeline(app);
-						create_source_pipeline(app);
-					}
 				}
 			}
 			else
@@ -873,25 +1681,92 @@ static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_da
 			g_free (name);
 			break;
 		}
+		case GST_MESSAGE_ELEMENT:
+		{
+			const GstStructure *s = gst_message_get_structure (message);
+			DreamHLSserver *h = app->hls_server;
+			gint index;
+
+			/* posted by hls_switch_probe on the hls streaming thread, so it's
+			 * ahead of the message for the fragment the switch closes */
+			if (h && h->queue && gst_structure_has_name (s, "DreamHLSDiscontinuity") && GST_MESSAGE_SRC (message) == GST_OBJECT (h->queue))
+				h->discontinuity_marked = TRUE;
+			/* hlssink only tells about closed fragments, the next one is discontinuous */
+			else if (h && h->hlssink && h->discontinuity_marked && gst_structure_has_name (s, "GstMultiFileSink") &&
+			    gst_object_has_as_ancestor (GST_MESSAGE_SRC (message), GST_OBJECT (h->hlssink)) &&
+			    gst_structure_get_int (s, "index", &index))
+			{
+				guint next = index + 1;
+				h->discontinuity_marked = FALSE;
+				GST_DEBUG_OBJECT (app, "HLS discontinuity before fragment %u", next);
+				HLS_LOCK (app);
+				g_array_append_val (h->discontinuities, next);
+				HLS_UNLOCK (app);
+			}
+			break;
+		}
 		case GST_MESSAGE_EOS:
 			g_print ("Got EOS\n");
-// 			DREAMRTSPSERVER_UNLOCK (app);
 			g_main_loop_quit (app->loop);
 			return FALSE;
 		default:
 			break;
 	}
-// 	DREAMRTSPSERVER_UNLOCK (app);
 	return TRUE;
 }
 
+static DreamRTSPVariant *rtsp_find_variant (DreamRTSPserver *r, GstRTSPMedia *media)
+{
+	GList *l;
+	for (l = r->variants; l; l = l->next)
+	{
+		DreamRTSPVariant *v = l->data;
+		if (v->media == media)
+			return v;
+	}
+	return NULL;
+}
+
+static DreamRTSPVariant *rtsp_variant_ref (DreamRTSPVariant *v)
+{
+	g_atomic_int_inc (&v->refcount);
+	return v;
+}
+
+static void rtsp_variant_unref (DreamRTSPVariant *v)
+{
+	if (!g_atomic_int_dec_and_test (&v->refcount))
+		return;
+	GST_DEBUG ("free stream variant '%s'", v->key);
+	if (v->aappsrc)
+		gst_object_unref (v->aappsrc);
+	if (v->vappsrc)
+		gst_object_unref (v->vappsrc);
+	g_free (v->key);
+	g_free (v);
+}
+
 static void media_unprepare (GstRTSPMedia * media, gpointer user_data)
 {
 	App *app = user_data;
 	DreamRTSPserver *r = app->rtsp_server;
+	DreamRTSPVariant *v;
 	GST_INFO("no more clients -> media unprepared!");
 
-// 	DREAMRTSPSERVER_LOCK (app);
+	RTSP_LOCK (app);
+	v = rtsp_find_variant (r, media);
+	if (v)
+	{
+		r->variants = g_list_remove (r->variants, v);
+		g_atomic_int_inc (&r->variants_gen);
+	}
+	RTSP_UNLOCK (app);
+	if (v)
+	{
+		GST_INFO_OBJECT (app, "stream variant '%s' unprepared", v->key);
+		rtsp_variant_unref (v);
+	}
+
 	if (media == r->es_media)
 	{
 		r->es_media = NULL;
@@ -902,10 +1777,10 @@ static void media_unprepare (GstRTSPMedia * media, gpointer user_data)
 		r->ts_media = NULL;
 		r->ts_appsrc = NULL;
 	}
-	if (!r->es_media && !r->ts_media)
+	if (!r->es_media && !r->ts_media && !r->variants)
 	{
 		if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
-			halt_source_pipeline(app);
+			idle_source_pipeline(app);
 		if (r->state == RTSP_STATE_RUNNING)
 		{
 			GST_DEBUG ("set RTSP_STATE_IDLE");
@@ -913,139 +1788,401 @@ static void media_unprepare (GstRTSPMedia * media, gpointer user_data)
 			r->state = RTSP_STATE_IDLE;
 		}
 	}
-// 	DREAMRTSPSERVER_UNLOCK (app);
 }
 
 static void client_closed (GstRTSPClient * client, gpointer user_data)
 {
 	App *app = user_data;
-	app->rtsp_server->clients_list = g_list_remove(g_list_first (app->rtsp_server->clients_list), client);
-	gint no_clients = g_list_length(app->rtsp_server->clients_list);
+	DreamRTSPserver *r = app->rtsp_server;
+	RTSP_LOCK (app);
+	r->clients_list = g_list_remove(g_list_first (r->clients_list), client);
+	gint no_clients = g_list_length(r->clients_list);
+	g_atomic_int_set (&r->clients_count, no_clients);
+	RTSP_UNLOCK (app);
+	if (gst_dream_rtsp_client_get_congestion (GST_DREAM_RTSP_CLIENT (client), NULL) == GST_DREAM_RTSP_CLIENT_CONGESTION_RESUMING)
+	{
+		RTSP_LOCK (app);
+		if (g_list_find (r->resuming_es_clients, client) || g_list_find (r->resuming_ts_clients, client))
+		{
+			r->resuming_es_clients = g_list_remove (r->resuming_es_clients, client);
+			r->resuming_ts_clients = g_list_remove (r->resuming_ts_clients, client);
+			g_atomic_int_add (&r->resuming_count, -1);
+			g_object_unref (client);
+		}
+		RTSP_UNLOCK (app);
+	}
 	GST_INFO("client_closed  (number of clients: %i)", no_clients);
 	send_signal (app, "rtspClientCountChanged", g_variant_new("(is)", no_clients, ""));
 }
 
+#define CLIENT_PLAYED_KEY "dream-client-played"
+
+/* only a client joining a running source waits for the next natural IDR.
+ * a PLAY after PAUSE keeps its decoder state, a waking source starts with a
+ * keyframe anyway and request_keyframe() rate limits the rest */
+static void client_play_request (GstRTSPClient * client, GstRTSPContext * ctx, gpointer user_data)
+{
+	App *app = user_data;
+
+	if (g_object_get_data (G_OBJECT (client), CLIENT_PLAYED_KEY))
+		return;
+	g_object_set_data (G_OBJECT (client), CLIENT_PLAYED_KEY, GINT_TO_POINTER (TRUE));
+	if (g_atomic_int_get (&app->idle.active) || g_atomic_int_get (&app->properties.source_state) != GST_STATE_PLAYING)
+		return;
+	request_keyframe (app, "rtsp client");
+}
+
 static void client_connected (GstRTSPServer * server, GstRTSPClient * client, gpointer user_data)
 {
 	App *app = user_data;
-	app->rtsp_server->clients_list = g_list_append(app->rtsp_server->clients_list, client);
+	DreamRTSPserver *r = app->rtsp_server;
+	RTSP_LOCK (app);
+	r->clients_list = g_list_append(r->clients_list, client);
+	gint no_clients = g_list_length(r->clients_list);
+	g_atomic_int_set (&r->clients_count, no_clients);
+	RTSP_UNLOCK (app);
 	const gchar *ip = gst_rtsp_connection_get_ip (gst_rtsp_client_get_connection (client));
-	gint no_clients = g_list_length(app->rtsp_server->clients_list);
 	GST_INFO("client_connected %" GST_PTR_FORMAT " from %s  (number of clients: %i)", client, ip, no_clients);
 	g_signal_connect (client, "closed", (GCallback) client_closed, app);
+	g_signal_connect (client, "play-request", (GCallback) client_play_request, app);
 	send_signal (app, "rtspClientCountChanged", g_variant_new("(is)", no_clients, ip));
 }
 
-static void media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media, gpointer user_data)
+static void rtsp_client_set_congestion (App *app, GstDreamRTSPClient *client, GstDreamRTSPClientCongestion stage, GstClockTime now, gsize backlog)
+{
+	const gchar *ip = gst_rtsp_connection_get_ip (gst_rtsp_client_get_connection (GST_RTSP_CLIENT (client)));
+	GST_INFO_OBJECT (client, "client from %s enters congestion stage %i (backlog %" G_GSIZE_FORMAT " bytes)", ip, stage, backlog);
+	gst_dream_rtsp_client_set_congestion (client, stage, now);
+	send_signal (app, "rtspClientCongestionChanged", g_variant_new("(siu)", ip, stage, (guint32) backlog));
+}
+
+/* called from the streaming thread on every keyframe while clients are
+ * waiting to be resumed, so that they get back on the live stream at a
+ * position which they can decode from */
+static void rtsp_resume_clients (App *app, gboolean ts)
 {
-	App *app = user_data;
 	DreamRTSPserver *r = app->rtsp_server;
-	DREAMRTSPSERVER_LOCK (app);
+	GList *l, *clients;
 
-	if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->es_factory)
+	RTSP_LOCK (app);
+	if (ts)
 	{
-		r->es_media = media;
-		GstElement *element = gst_rtsp_media_get_element (media);
-		r->es_aappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_AAPPSRC);
-		r->es_vappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_VAPPSRC);
-		gst_object_unref(element);
-		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
-		g_object_set (r->es_aappsrc, "format", GST_FORMAT_TIME, NULL);
-		g_object_set (r->es_vappsrc, "format", GST_FORMAT_TIME, NULL);
+		clients = r->resuming_ts_clients;
+		r->resuming_ts_clients = NULL;
 	}
-	else if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->ts_factory)
+	else
 	{
-		r->ts_media = media;
-		GstElement *element = gst_rtsp_media_get_element (media);
-		r->ts_appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
-		r->ts_appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
-		gst_object_unref(element);
-		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
-		g_object_set (r->ts_appsrc, "format", GST_FORMAT_TIME, NULL);
+		clients = r->resuming_es_clients;
+		r->resuming_es_clients = NULL;
 	}
-	r->rtsp_start_pts = r->rtsp_start_dts = GST_CLOCK_TIME_NONE;
-	r->state = RTSP_STATE_RUNNING;
-	send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_RUNNING));
-	GST_DEBUG ("set RTSP_STATE_RUNNING");
-	start_rtsp_pipeline(app);
-	DREAMRTSPSERVER_UNLOCK (app);
+	for (l = clients; l; l = l->next)
+	{
+		GstDreamRTSPClient *client = l->data;
+		gst_dream_rtsp_client_set_interleaved_active (client, TRUE);
+		rtsp_client_set_congestion (app, client, GST_DREAM_RTSP_CLIENT_CONGESTION_NONE, GST_CLOCK_TIME_NONE, 0);
+		g_atomic_int_inc (&r->resumed_count);
+		g_atomic_int_add (&r->resuming_count, -1);
+		g_object_unref (client);
+	}
+	RTSP_UNLOCK (app);
+	g_list_free (clients);
 }
 
-static void uri_parametrized (GstDreamRTSPMediaFactory * factory, gchar *parameters, gpointer user_data)
+gboolean rtsp_backlog_check (gpointer user_data)
 {
 	App *app = user_data;
-	GST_INFO_OBJECT (app, "parametrized uri query: '%s'", parameters);
-	app->rtsp_server->uri_parameters = g_strdup(parameters);
-	send_signal (app, "uriParametersChanged", g_variant_new("(s)", app->rtsp_server->uri_parameters));
-}
+	DreamRTSPserver *r = app->rtsp_server;
+	GstClockTime now = g_get_monotonic_time () * GST_USECOND;
+	GList *l, *clients, *evict = NULL;
 
-static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data)
-{
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
-	if (((info->type & GST_PAD_PROBE_TYPE_BUFFER) && GST_IS_BUFFER(GST_PAD_PROBE_INFO_BUFFER(info))) ||
-	     ((info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) && gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info))))
+	if (!r->backlog_bytes)
+		return G_SOURCE_CONTINUE;
+
+	RTSP_LOCK (app);
+	clients = g_list_copy_deep (r->clients_list, (GCopyFunc) g_object_ref, NULL);
+	RTSP_UNLOCK (app);
+
+	for (l = clients; l; l = l->next)
 	{
-		QUEUE_DEBUG;
-		GST_LOG_OBJECT (app, "cancel upstream_set_waiting timeout because data flow was restored! queue properties current-level-bytes=%d current-level-buffers=%d current-level-time=%" GST_TIME_FORMAT "",
-				  cur_bytes, cur_buf, GST_TIME_ARGS(cur_time));
-		if (t->id_signal_waiting)
-			g_source_remove (t->id_signal_waiting);
-		t->id_signal_waiting = 0;
-		if (t->id_signal_keepalive)
-			g_source_remove (t->id_signal_keepalive);
-		t->id_signal_keepalive = 0;
-		if (t->id_signal_overrun == 0)
-			t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), app);
-		t->id_resume = 0;
-		return GST_PAD_PROBE_REMOVE;
-	}
-	else
-		GST_WARNING_OBJECT(app, "probed unhandled %" GST_PTR_FORMAT ", dataflow not restored?", info->data);
-	return GST_PAD_PROBE_OK;
-}
+		GstDreamRTSPClient *client = GST_DREAM_RTSP_CLIENT (l->data);
+		GstClockTime since;
+		GstDreamRTSPClientCongestion stage = gst_dream_rtsp_client_get_congestion (client, &since);
+		GstRTSPMedia *media;
+		gsize backlog;
 
-static GstPadProbeReturn bitrate_measure_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data)
-{
-	App *app = user_data;
-	DreamTCPupstream *t = app->tcp_upstream;
-	GstClockTime now = gst_clock_get_time (app->clock);
-	GstBuffer *buffer = NULL;
-	guint idx = 0, num_buffers = 1;
-	do {
-		if (info->type & GST_PAD_PROBE_TYPE_BUFFER)
-		{
-			buffer = GST_PAD_PROBE_INFO_BUFFER (info);
-		}
-		else if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST)
-		{
-			GstBufferList *bufferlist = GST_PAD_PROBE_INFO_BUFFER_LIST (info);
-			num_buffers = gst_buffer_list_length (bufferlist);
-			buffer = gst_buffer_list_get (bufferlist, idx);
+		if (stage == GST_DREAM_RTSP_CLIENT_CONGESTION_RESUMING || stage == GST_DREAM_RTSP_CLIENT_CONGESTION_EVICTED)
+			continue;
+
+		media = gst_dream_rtsp_client_get_interleaved_media (client);
+		if (!media)
+			continue;
+
+		backlog = gst_dream_rtsp_client_get_backlog (client);
+		GST_TRACE_OBJECT (client, "backlog=%" G_GSIZE_FORMAT " stage=%i", backlog, stage);
+
+		switch (stage) {
+			case GST_DREAM_RTSP_CLIENT_CONGESTION_NONE:
+				if (backlog > r->backlog_bytes)
+				{
+					g_atomic_int_inc (&r->congested_count);
+					rtsp_client_set_congestion (app, client, GST_DREAM_RTSP_CLIENT_CONGESTION_BACKLOG, now, backlog);
+				}
+				break;
+			case GST_DREAM_RTSP_CLIENT_CONGESTION_BACKLOG:
+				if (backlog <= r->backlog_bytes / 2)
+					rtsp_client_set_congestion (app, client, GST_DREAM_RTSP_CLIENT_CONGESTION_NONE, GST_CLOCK_TIME_NONE, backlog);
+				else if (r->backlog_drop_ms && now - since >= r->backlog_drop_ms * GST_MSECOND)
+				{
+					gst_dream_rtsp_client_set_interleaved_active (client, FALSE);
+					g_atomic_int_inc (&r->dropped_count);
+					rtsp_client_set_congestion (app, client, GST_DREAM_RTSP_CLIENT_CONGESTION_DROPPING, now, backlog);
+				}
+				else if (!r->backlog_drop_ms && r->backlog_evict_ms && now - since >= r->backlog_evict_ms * GST_MSECOND)
+					evict = g_list_prepend (evict, g_object_ref (client));
+				break;
+			case GST_DREAM_RTSP_CLIENT_CONGESTION_DROPPING:
+				if (backlog <= r->backlog_bytes / 4)
+				{
+					RTSP_LOCK (app);
+					if (media == r->ts_media)
+						r->resuming_ts_clients = g_list_prepend (r->resuming_ts_clients, g_object_ref (client));
+					else
+						r->resuming_es_clients = g_list_prepend (r->resuming_es_clients, g_object_ref (client));
+					g_atomic_int_inc (&r->resuming_count);
+					rtsp_client_set_congestion (app, client, GST_DREAM_RTSP_CLIENT_CONGESTION_RESUMING, now, backlog);
+					RTSP_UNLOCK (app);
+					request_keyframe (app, "resuming rtsp client");
+				}
+				else if (r->backlog_evict_ms && now - since >= r->backlog_evict_ms * GST_MSECOND)
+					evict = g_list_prepend (evict, g_object_ref (client));
+				break;
+			default:
+				break;
 		}
-		if (GST_IS_BUFFER(buffer))
-			t->bitrate_sum += gst_buffer_get_size (buffer);
-		idx++;
-	} while (idx < num_buffers);
+	}
 
-	QUEUE_DEBUG;
-	GST_TRACE_OBJECT(app, "probetype=%i num_buffers=%i data=%" GST_PTR_FORMAT " size was=%zu bitrate_sum=%zu now=%" GST_TIME_FORMAT " avg at %" GST_TIME_FORMAT " queue properties current-level-bytes=%d current-level-buffers=%d current-level-time=%" GST_TIME_FORMAT "",
-			info->type, num_buffers, info->data, gst_buffer_get_size (buffer), t->bitrate_sum, GST_TIME_ARGS(now), GST_TIME_ARGS(t->measure_start+BITRATE_AVG_PERIOD), cur_bytes, cur_buf, GST_TIME_ARGS(cur_time));
-	if (now > t->measure_start+BITRATE_AVG_PERIOD)
+	g_list_free_full (clients, g_object_unref);
+
+	/* closing emits "closed" which modifies clients_list, so evict afterwards */
+	for (l = evict; l; l = l->next)
+	{
+		GstDreamRTSPClient *client = l->data;
+		GstClockTime since;
+		gsize backlog = gst_dream_rtsp_client_get_backlog (client);
+		const gchar *ip = gst_rtsp_connection_get_ip (gst_rtsp_client_get_connection (GST_RTSP_CLIENT (client)));
+		gst_dream_rtsp_client_get_congestion (client, &since);
+		gchar *reason = g_strdup_printf ("backlog of %" G_GSIZE_FORMAT " bytes not drained within %" G_GUINT64_FORMAT " ms", backlog, GST_TIME_AS_MSECONDS (now - since));
+		GST_WARNING_OBJECT (client, "evicting client from %s: %s", ip, reason);
+		g_atomic_int_inc (&r->evicted_count);
+		send_signal (app, "rtspClientEvicted", g_variant_new("(ss)", ip, reason));
+		gst_dream_rtsp_client_set_congestion (client, GST_DREAM_RTSP_CLIENT_CONGESTION_EVICTED, now);
+		g_free (reason);
+		gst_rtsp_client_close (GST_RTSP_CLIENT (client));
+		g_object_unref (client);
+	}
+	g_list_free (evict);
+
+	return G_SOURCE_CONTINUE;
+}
+
+/* media-configure is emitted on the RTSP client's thread, the media waits
+ * for data to preroll anyway so the pipeline is started asynchronously */
+static gboolean start_rtsp_pipeline_cb (gpointer user_data)
+{
+	start_rtsp_pipeline ((App *) user_data);
+	return G_SOURCE_REMOVE;
+}
+
+/* in-band SPS/PPS with every IDR, so clients which already played the
+ * SDP's sprop-parameter-sets follow a video switch. -1 needs 1.12 */
+static void media_repeat_parameter_sets (GstElement *element)
+{
+	GstElement *pay = gst_bin_get_by_name (GST_BIN (element), "pay0");
+	GParamSpec *pspec;
+
+	if (!pay)
+		return;
+	pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (pay), "config-interval");
+	if (pspec && G_IS_PARAM_SPEC_INT (pspec))
+		g_object_set (pay, "config-interval", MAX (G_PARAM_SPEC_INT (pspec)->minimum, -1), NULL);
+	else if (pspec && G_IS_PARAM_SPEC_UINT (pspec))
+		g_object_set (pay, "config-interval", 1, NULL);
+	gst_object_unref (pay);
+}
+
+static void media_configure_variant (App *app, GstRTSPMedia * media, const gchar *key)
+{
+	DreamRTSPserver *r = app->rtsp_server;
+	DreamRTSPVariant *v = g_new0 (DreamRTSPVariant, 1);
+	GstElement *element = gst_rtsp_media_get_element (media);
+
+	v->refcount = 1;
+	v->media = media;
+	v->key = g_strdup (key);
+	v->aappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_AAPPSRC);
+	v->vappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_VAPPSRC);
+	v->start_pts = v->start_dts = GST_CLOCK_TIME_NONE;
+	media_repeat_parameter_sets (element);
+	gst_object_unref (element);
+	g_object_set (v->aappsrc, "format", GST_FORMAT_TIME, NULL);
+	g_object_set (v->vappsrc, "format", GST_FORMAT_TIME, NULL);
+	g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
+
+	RTSP_LOCK (app);
+	r->variants = g_list_append (r->variants, v);
+	g_atomic_int_inc (&r->variants_gen);
+	GST_INFO_OBJECT (app, "configured stream variant '%s' (%u variants)", key, g_list_length (r->variants));
+	if (r->state != RTSP_STATE_RUNNING)
+	{
+		r->state = RTSP_STATE_RUNNING;
+		send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_RUNNING));
+		GST_DEBUG ("set RTSP_STATE_RUNNING");
+	}
+	RTSP_UNLOCK (app);
+	g_main_context_invoke (NULL, (GSourceFunc) start_rtsp_pipeline_cb, app);
+}
+
+static void latency_watch_element (GstElement *element, const gchar *padname, DreamLatencyPath path, DreamLatencyStage stage)
+{
+	GstPad *pad = gst_element_get_static_pad (element, padname);
+	if (pad)
+	{
+		dream_latency_watch_pad (pad, path, stage);
+		gst_object_unref (pad);
+	}
+}
+
+static void media_sink_added (GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data)
+{
+	GstElementFactory *factory = gst_element_get_factory (element);
+	const gchar *factory_name = factory ? GST_OBJECT_NAME (factory) : NULL;
+
+	/* rtcp sinks see no stamped buffers and never produce a sample */
+	if (g_strcmp0 (factory_name, "multiudpsink") == 0 || g_strcmp0 (factory_name, "appsink") == 0)
+		latency_watch_element (element, "sink", GPOINTER_TO_INT (user_data), DREAM_LATENCY_STAGE_SINK);
+}
+
+static void media_watch_latency (GstElement *element, DreamLatencyPath path)
+{
+	GstElement *pay = gst_bin_get_by_name (GST_BIN (element), "pay0");
+	GstObject *pipeline = gst_object_get_parent (GST_OBJECT (element));
+
+	if (pay)
+	{
+		latency_watch_element (pay, "src", path, DREAM_LATENCY_STAGE_PAYLOAD);
+		gst_object_unref (pay);
+	}
+	/* the stream's sinks are only added when the media gets prepared */
+	if (pipeline)
+	{
+		g_signal_connect (pipeline, "deep-element-added", G_CALLBACK (media_sink_added), GINT_TO_POINTER (path));
+		gst_object_unref (pipeline);
+	}
+}
+
+static void media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media, gpointer user_data)
+{
+	App *app = user_data;
+	DreamRTSPserver *r = app->rtsp_server;
+	const gchar *variant = gst_dream_rtsp_media_get_variant (media);
+	if (variant)
+	{
+		media_configure_variant (app, media, variant);
+		return;
+	}
+	RTSP_LOCK (app);
+
+	if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->es_factory)
+	{
+		r->es_media = media;
+		GstElement *element = gst_rtsp_media_get_element (media);
+		r->es_aappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_AAPPSRC);
+		r->es_vappsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), ES_VAPPSRC);
+		media_watch_latency (element, DREAM_LATENCY_PATH_ES_RTSP);
+		media_repeat_parameter_sets (element);
+		gst_object_unref(element);
+		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
+		g_object_set (r->es_aappsrc, "format", GST_FORMAT_TIME, NULL);
+		g_object_set (r->es_vappsrc, "format", GST_FORMAT_TIME, NULL);
+	}
+	else if (GST_DREAM_RTSP_MEDIA_FACTORY (factory) == r->ts_factory)
+	{
+		r->ts_media = media;
+		GstElement *element = gst_rtsp_media_get_element (media);
+		r->ts_appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
+		r->ts_appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TS_APPSRC);
+		media_watch_latency (element, DREAM_LATENCY_PATH_TS_RTSP);
+		gst_object_unref(element);
+		g_signal_connect (media, "unprepared", (GCallback) media_unprepare, app);
+		g_object_set (r->ts_appsrc, "format", GST_FORMAT_TIME, NULL);
+	}
+	g_atomic_int_set (&r->rtsp_started, FALSE);
+	r->rtsp_start_pts = r->rtsp_start_dts = GST_CLOCK_TIME_NONE;
+	r->state = RTSP_STATE_RUNNING;
+	send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_RUNNING));
+	GST_DEBUG ("set RTSP_STATE_RUNNING");
+	RTSP_UNLOCK (app);
+	g_main_context_invoke (NULL, (GSourceFunc) start_rtsp_pipeline_cb, app);
+}
+
+static void uri_parametrized (GstDreamRTSPMediaFactory * factory, gchar *parameters, gpointer user_data)
+{
+	App *app = user_data;
+	GST_INFO_OBJECT (app, "parametrized uri query: '%s'", parameters);
+	app->rtsp_server->uri_parameters = g_strdup(parameters);
+	send_signal (app, "uriParametersChanged", g_variant_new("(s)", app->rtsp_server->uri_parameters));
+}
+
+static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	DreamTCPupstream *t = app->tcp_upstream;
+	if (((info->type & GST_PAD_PROBE_TYPE_BUFFER) && GST_IS_BUFFER(GST_PAD_PROBE_INFO_BUFFER(info))) ||
+	     ((info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) && gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info))))
 	{
-		gint bitrate = t->bitrate_sum*8/GST_TIME_AS_MSECONDS(BITRATE_AVG_PERIOD);
-		t->bitrate_avg ? (t->bitrate_avg = (t->bitrate_avg+bitrate)/2) : (t->bitrate_avg = bitrate);
-		send_signal (app, "tcpBitrate", g_variant_new("(i)", bitrate));
-		t->measure_start = now;
-		t->bitrate_sum = 0;
+		QUEUE_DEBUG;
+		GST_LOG_OBJECT (app, "cancel upstream_set_waiting timeout because data flow was restored! queue properties current-level-bytes=%d current-level-buffers=%d current-level-time=%" GST_TIME_FORMAT "",
+				  cur_bytes, cur_buf, GST_TIME_ARGS(cur_time));
+		if (t->id_signal_waiting)
+			g_source_remove (t->id_signal_waiting);
+		t->id_signal_waiting = 0;
+		if (t->id_signal_keepalive)
+			g_source_remove (t->id_signal_keepalive);
+		t->id_signal_keepalive = 0;
+		if (t->id_signal_overrun == 0)
+			t->id_signal_overrun = g_signal_connect (t->tstcpq, "overrun", G_CALLBACK (queue_overrun), app);
+		t->id_resume = 0;
+		return GST_PAD_PROBE_REMOVE;
 	}
+	else
+		GST_WARNING_OBJECT(app, "probed unhandled %" GST_PTR_FORMAT ", dataflow not restored?", info->data);
 	return GST_PAD_PROBE_OK;
 }
 
+static DreamProbe *upstream_probe (DreamTCPupstream *t)
+{
+	GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
+	DreamProbe *probe = dream_probe_get (GST_OBJECT (sinkpad));
+	gst_object_unref (sinkpad);
+	return probe;
+}
+
+static void upstream_bitrate_measured (DreamProbe *probe, guint64 bitrate, gpointer user_data)
+{
+	App *app = user_data;
+	DreamTCPupstream *t = app->tcp_upstream;
+	gint kbps = bitrate / 1000;
+
+	QUEUE_DEBUG;
+	GST_TRACE_OBJECT(app, "measured %i kbit/s queue properties current-level-bytes=%d current-level-buffers=%d current-level-time=%" GST_TIME_FORMAT "",
+			kbps, cur_bytes, cur_buf, GST_TIME_ARGS(cur_time));
+	t->bitrate_avg ? (t->bitrate_avg = (t->bitrate_avg+kbps)/2) : (t->bitrate_avg = kbps);
+	send_signal (app, "tcpBitrate", g_variant_new("(i)", kbps));
+}
+
 gboolean upstream_keep_alive (App *app)
 {
-	GstBuffer *buf = gst_buffer_new_allocate (NULL, TS_PACK_SIZE, NULL);
-	gst_buffer_memset (buf, 0, 0x00, TS_PACK_SIZE);
+	GstBuffer *buf;
 	GstPad * srcpad = gst_element_get_static_pad (app->tcp_upstream->tstcpq, "src");
 
 	GstState state;
@@ -1060,20 +2197,24 @@ gboolean upstream_keep_alive (App *app)
 		GST_DEBUG_OBJECT(app, "gst_element_set_state (tcpsink, GST_STATE_PLAYING) = %i", sret);
 		sret = gst_element_set_state (app->tcp_upstream->tstcpq, GST_STATE_PLAYING);
 		GST_DEBUG_OBJECT(app, "gst_element_set_state (tstcpq, GST_STATE_PLAYING) = %i", sret);
+		/* from the arena's TS packet bucket */
+		buf = gst_buffer_new_allocate (NULL, TS_PACK_SIZE, NULL);
+		gst_buffer_memset (buf, 0, 0x00, TS_PACK_SIZE);
 		GST_INFO ("injecting keepalive %" GST_PTR_FORMAT " on pad %s:%s", buf, GST_DEBUG_PAD_NAME (srcpad));
-		gst_pad_push (srcpad, gst_buffer_ref(buf));
+		gst_pad_push (srcpad, buf);
 		sret = gst_element_set_state (app->tcp_upstream->tcpsink, GST_STATE_PAUSED);
 		GST_DEBUG_OBJECT(app, "gst_element_set_state (tcpsink, GST_STATE_PAUSED) = %i", sret);
 		sret = gst_element_set_state (app->tcp_upstream->tstcpq, GST_STATE_PAUSED);
 		GST_DEBUG_OBJECT(app, "gst_element_set_state (tstcpq, GST_STATE_PAUSED) = %i", sret);
 	}
+	gst_object_unref (srcpad);
 
 	return G_SOURCE_REMOVE;
 }
 
 gboolean upstream_set_waiting (App *app)
 {
-	DREAMRTSPSERVER_LOCK (app);
+	UPSTREAM_LOCK (app);
 	DreamTCPupstream *t = app->tcp_upstream;
 	t->overrun_counter = 0;
 	t->overrun_period = GST_CLOCK_TIME_NONE;
@@ -1087,17 +2228,13 @@ gboolean upstream_set_waiting (App *app)
 		gst_pad_remove_probe (sinkpad, t->id_resume);
 		t->id_resume = 0;
 	}
-	if (t->id_bitrate_measure)
-	{
-		gst_pad_remove_probe (sinkpad, t->id_bitrate_measure);
-		t->id_bitrate_measure = 0;
-	}
+	dream_probe_set_window_func (upstream_probe (t), NULL, NULL);
 	send_signal (app, "tcpBitrate", g_variant_new("(i)", 0));
 	gst_object_unref (sinkpad);
 	pause_source_pipeline(app);
 	t->id_signal_waiting = 0;
 	t->id_signal_keepalive = g_timeout_add_seconds (5, (GSourceFunc) upstream_keep_alive, app);
-	DREAMRTSPSERVER_UNLOCK (app);
+	UPSTREAM_UNLOCK (app);
 	return G_SOURCE_REMOVE;
 }
 
@@ -1111,24 +2248,21 @@ static void queue_underrun (GstElement * queue, gpointer user_data)
 	{
 		if (unpause_source_pipeline(app))
 		{
-			DREAMRTSPSERVER_LOCK (app);
+			UPSTREAM_LOCK (app);
 // 			g_object_set (G_OBJECT (t->tstcpq), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
 			g_object_set (t->tcpsink, "max-lateness", G_GINT64_CONSTANT(-1), NULL);
 			g_signal_handlers_disconnect_by_func (queue, G_CALLBACK (queue_underrun), app);
 			t->id_signal_overrun = g_signal_connect (queue, "overrun", G_CALLBACK (queue_overrun), app);
 			t->state = UPSTREAM_STATE_TRANSMITTING;
 			send_signal (app, "upstreamStateChanged", g_variant_new("(i)", UPSTREAM_STATE_TRANSMITTING));
-			if (t->id_bitrate_measure == 0)
-			{
-				GstPad *sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
-				t->id_bitrate_measure = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_BUFFER|GST_PAD_PROBE_TYPE_BUFFER_LIST, (GstPadProbeCallback) bitrate_measure_probe, app, NULL);
-				gst_object_unref (sinkpad);
-			}
-			t->measure_start = gst_clock_get_time (app->clock);
-			t->bitrate_sum = t->bitrate_avg = 0;
+			DreamProbe *probe = upstream_probe (t);
+			dream_probe_reset (probe);
+			dream_probe_set_window_func (probe, upstream_bitrate_measured, app);
+			t->bitrate_avg = 0;
 			if (t->overrun_period == GST_CLOCK_TIME_NONE)
 				t->overrun_period = gst_clock_get_time (app->clock);
-			DREAMRTSPSERVER_UNLOCK (app);
+			UPSTREAM_UNLOCK (app);
+			request_keyframe (app, "upstream");
 		}
 	}
 }
@@ -1137,7 +2271,7 @@ static void queue_overrun (GstElement * queue, gpointer user_data)
 {
 	App *app = user_data;
 	DreamTCPupstream *t = app->tcp_upstream;
-	DREAMRTSPSERVER_LOCK (app);
+	UPSTREAM_LOCK (app);
 	if (queue == t->tstcpq/* && app->rtsp_server->state != RTSP_STATE_IDLE*/) //!!!TODO
 	{
 		QUEUE_DEBUG;
@@ -1149,7 +2283,7 @@ static void queue_overrun (GstElement * queue, gpointer user_data)
 // 			g_object_set (G_OBJECT (t->tstcpq), "leaky", 0, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, "min-threshold-buffers", 0, NULL);
 			g_signal_handlers_disconnect_by_func(t->tstcpq, G_CALLBACK (queue_overrun), app);
 			t->id_signal_overrun = 0;
-			DREAMRTSPSERVER_UNLOCK (app);
+			UPSTREAM_UNLOCK (app);
 			upstream_set_waiting (app);
 			return;
 		}
@@ -1160,7 +2294,7 @@ static void queue_overrun (GstElement * queue, gpointer user_data)
 				g_signal_handlers_disconnect_by_func(t->tstcpq, G_CALLBACK (queue_overrun), app);
 				t->id_signal_overrun = 0;
 				GST_DEBUG_OBJECT (queue, "disconnect overrun callback and wait for timeout or for buffer flow!");
-				DREAMRTSPSERVER_UNLOCK (app);
+				UPSTREAM_UNLOCK (app);
 				return;
 			}
 			t->overrun_counter++;
@@ -1229,7 +2363,7 @@ static void queue_overrun (GstElement * queue, gpointer user_data)
 			}
 		}
 	}
-	DREAMRTSPSERVER_UNLOCK (app);
+	UPSTREAM_UNLOCK (app);
 }
 
 static void auto_adjust_bitrate(App *app)
@@ -1243,12 +2377,78 @@ static void auto_adjust_bitrate(App *app)
 	p->videoBitrate = (t->bitrate_avg - p->audioBitrate) * 0.8;
 	GST_INFO_OBJECT (app, "auto overload handling: newAudioBitrate=%i newVideoBitrate=%i newTotalBitrate~%i kbit/s", p->audioBitrate, p->videoBitrate, p->audioBitrate+p->videoBitrate);
 	apply_source_properties(app);
+	dream_rate_controller_set_limit (app->rate, p->videoBitrate);
+	dream_rate_controller_set_target (app->rate, p->videoBitrate);
 	if (t->id_signal_waiting)
 		g_source_remove (t->id_signal_waiting);
 	t->id_signal_waiting = g_timeout_add_seconds (RESUME_DELAY, (GSourceFunc) upstream_resume_transmitting, app);
 	t->overrun_counter = 0;
 }
 
+/* variants get their own copy of the buffer with timestamps relative to
+ * the first keyframe they received, they're decoded and re-encoded anyway */
+/* called from the ES appsink's own streaming thread, so its snapshot needs
+ * no lock. returns the variants to feed, NULL if there are none */
+static GPtrArray *handover_variants_snapshot (App *app, gboolean video)
+{
+	DreamRTSPserver *r = app->rtsp_server;
+	gint gen = g_atomic_int_get (&r->variants_gen);
+	GList *l;
+
+	if (r->variants_snapshot[video] && r->variants_snapshot_gen[video] == gen)
+		return r->variants_snapshot[video]->len ? r->variants_snapshot[video] : NULL;
+	if (r->variants_snapshot[video])
+		g_ptr_array_unref (r->variants_snapshot[video]);
+	r->variants_snapshot[video] = g_ptr_array_new_with_free_func ((GDestroyNotify) rtsp_variant_unref);
+	RTSP_LOCK (app);
+	r->variants_snapshot_gen[video] = g_atomic_int_get (&r->variants_gen);
+	for (l = r->variants; l; l = l->next)
+		g_ptr_array_add (r->variants_snapshot[video], rtsp_variant_ref (l->data));
+	RTSP_UNLOCK (app);
+	return r->variants_snapshot[video]->len ? r->variants_snapshot[video] : NULL;
+}
+
+static void handover_variants (App *app, GstElement * appsink, GstSample *sample, GPtrArray *variants)
+{
+	DreamRTSPserver *r = app->rtsp_server;
+	GstBuffer *buffer = gst_sample_get_buffer (sample);
+	GstCaps *caps = gst_sample_get_caps (sample);
+	gboolean video = (appsink == r->vappsink);
+	guint i;
+
+	for (i = 0; i < variants->len; i++)
+	{
+		DreamRTSPVariant *v = g_ptr_array_index (variants, i);
+		GstAppSrc *appsrc = GST_APP_SRC (video ? v->vappsrc : v->aappsrc);
+		GstBuffer *copy;
+		GstCaps *oldcaps;
+
+		if (!appsrc)
+			continue;
+		if (!g_atomic_int_get (&v->started))
+		{
+			if (!video || GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+				continue;
+			v->start_pts = GST_BUFFER_PTS (buffer);
+			v->start_dts = GST_BUFFER_DTS (buffer);
+			g_atomic_int_set (&v->started, TRUE);
+			GST_DEBUG_OBJECT (appsink, "variant '%s' starts at pts=%" GST_TIME_FORMAT, v->key, GST_TIME_ARGS (v->start_pts));
+		}
+		copy = gst_buffer_copy (buffer);
+		GST_BUFFER_PTS (copy) = GST_BUFFER_PTS (buffer) < v->start_pts ? 0 : GST_BUFFER_PTS (buffer) - v->start_pts;
+		if (GST_BUFFER_DTS_IS_VALID (buffer) && GST_CLOCK_TIME_IS_VALID (v->start_dts))
+			GST_BUFFER_DTS (copy) = GST_BUFFER_DTS (buffer) < v->start_dts ? 0 : GST_BUFFER_DTS (buffer) - v->start_dts;
+
+		oldcaps = gst_app_src_get_caps (appsrc);
+		if (!oldcaps || !gst_caps_is_equal (oldcaps, caps))
+			gst_app_src_set_caps (appsrc, caps);
+		if (oldcaps)
+			gst_caps_unref (oldcaps);
+		gst_app_src_push_buffer (appsrc, copy);
+		dream_metrics_add (DREAM_METRIC_RTSP_VARIANT_BUFFERS, 1);
+	}
+}
+
 static GstFlowReturn handover_payload (GstElement * appsink, gpointer user_data)
 {
 	App *app = user_data;
@@ -1263,26 +2463,57 @@ static GstFlowReturn handover_payload (GstElement * appsink, gpointer user_data)
 		appsrc = GST_APP_SRC(r->ts_appsrc);
 
 	GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink));
-	if (appsrc && g_list_length(r->clients_list) > 0) {
+	if (appsink != r->tsappsink)
+	{
+		GPtrArray *variants = handover_variants_snapshot (app, appsink == r->vappsink);
+		if (variants)
+			handover_variants (app, appsink, sample, variants);
+	}
+	if (appsrc && g_atomic_int_get (&r->clients_count) > 0) {
 		GstBuffer *buffer = gst_sample_get_buffer (sample);
 		GstCaps *caps = gst_sample_get_caps (sample);
 
+		if (appsink == r->vappsink)
+		{
+			dream_metrics_add (DREAM_METRIC_RTSP_ES_VIDEO_BYTES, gst_buffer_get_size (buffer));
+			dream_metrics_add (DREAM_METRIC_RTSP_ES_VIDEO_BUFFERS, 1);
+			if (DREAM_LATENCY_ENABLED ())
+				dream_latency_observe (buffer, DREAM_LATENCY_PATH_ES_RTSP, DREAM_LATENCY_STAGE_HANDOVER);
+		}
+		else if (appsink == r->aappsink)
+		{
+			dream_metrics_add (DREAM_METRIC_RTSP_ES_AUDIO_BYTES, gst_buffer_get_size (buffer));
+			dream_metrics_add (DREAM_METRIC_RTSP_ES_AUDIO_BUFFERS, 1);
+		}
+		else
+		{
+			dream_metrics_add (DREAM_METRIC_RTSP_TS_BYTES, gst_buffer_get_size (buffer));
+			dream_metrics_add (DREAM_METRIC_RTSP_TS_BUFFERS, 1);
+			if (DREAM_LATENCY_ENABLED ())
+				dream_latency_observe (buffer, DREAM_LATENCY_PATH_TS_RTSP, DREAM_LATENCY_STAGE_HANDOVER);
+		}
+
 		GST_LOG_OBJECT(appsink, "%" GST_PTR_FORMAT" @ %" GST_PTR_FORMAT, buffer, appsrc);
-		if (r->rtsp_start_pts == GST_CLOCK_TIME_NONE) {
+		if (!g_atomic_int_get (&r->rtsp_started)) {
 			if (GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT))
 			{
 				GST_LOG("GST_BUFFER_FLAG_DELTA_UNIT dropping!");
+				dream_metrics_add (DREAM_METRIC_RTSP_DISCARDED_BUFFERS, 1);
 				gst_sample_unref(sample);
-//				DREAMRTSPSERVER_UNLOCK (app);
 				return GST_FLOW_OK;
 			}
 			else if (appsink == r->vappsink || appsink == r->tsappsink)
 			{
-				DREAMRTSPSERVER_LOCK (app);
-				r->rtsp_start_pts = GST_BUFFER_PTS (buffer);
-				r->rtsp_start_dts = GST_BUFFER_DTS (buffer);
-				GST_LOG_OBJECT(appsink, "frame is IFRAME! set rtsp_start_pts=%" GST_TIME_FORMAT " rtsp_start_dts=%" GST_TIME_FORMAT " @ %"GST_PTR_FORMAT"", GST_TIME_ARGS (GST_BUFFER_PTS (buffer)), GST_TIME_ARGS (GST_BUFFER_DTS (buffer)), appsrc);
-				DREAMRTSPSERVER_UNLOCK (app);
+				/* the es and ts streaming threads race for the first keyframe */
+				RTSP_LOCK (app);
+				if (!g_atomic_int_get (&r->rtsp_started))
+				{
+					r->rtsp_start_pts = GST_BUFFER_PTS (buffer);
+					r->rtsp_start_dts = GST_BUFFER_DTS (buffer);
+					g_atomic_int_set (&r->rtsp_started, TRUE);
+					GST_LOG_OBJECT(appsink, "frame is IFRAME! set rtsp_start_pts=%" GST_TIME_FORMAT " rtsp_start_dts=%" GST_TIME_FORMAT " @ %"GST_PTR_FORMAT"", GST_TIME_ARGS (GST_BUFFER_PTS (buffer)), GST_TIME_ARGS (GST_BUFFER_DTS (buffer)), appsrc);
+				}
+				RTSP_UNLOCK (app);
 			}
 		}
 		if (GST_BUFFER_PTS (buffer) < r->rtsp_start_pts)
@@ -1290,6 +2521,9 @@ static GstFlowReturn handover_payload (GstElement * appsink, gpointer user_data)
 		else
 			GST_BUFFER_PTS (buffer) -= r->rtsp_start_pts;
 		GST_BUFFER_DTS (buffer) -= r->rtsp_start_dts;
+
+		if (g_atomic_int_get (&r->resuming_count) && !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT) && (appsink == r->vappsink || appsink == r->tsappsink))
+			rtsp_resume_clients (app, appsink == r->tsappsink);
 		//    GST_LOG("new PTS %" GST_TIME_FORMAT " DTS %" GST_TIME_FORMAT "", GST_TIME_ARGS (GST_BUFFER_PTS (buffer)), GST_TIME_ARGS (GST_BUFFER_DTS (buffer)));
 
 		GstCaps *oldcaps;
@@ -1300,10 +2534,13 @@ static GstFlowReturn handover_payload (GstElement * appsink, gpointer user_data)
 			GST_DEBUG("CAPS changed! %" GST_PTR_FORMAT " to %" GST_PTR_FORMAT, oldcaps, caps);
 			gst_app_src_set_caps (appsrc, caps);
 		}
+		if (oldcaps)
+			gst_caps_unref (oldcaps);
 		gst_app_src_push_buffer (appsrc, gst_buffer_ref(buffer));
 	}
 	else
 	{
+		dream_metrics_add (DREAM_METRIC_RTSP_DISCARDED_BUFFERS, 1);
 		if ( gst_debug_category_get_threshold (dreamrtspserver_debug) >= GST_LEVEL_LOG)
 			GST_TRACE_OBJECT(appsink, "no rtsp clients, discard payload!");
 // 		else
@@ -1408,6 +2645,7 @@ void assert_tsmux(App *app)
 	GST_DEBUG_OBJECT (app, "inserting tsmux");
 
 	app->tsmux = gst_element_factory_make ("mpegtsmux", NULL);
+	dream_thread_policy_tag (app->tsmux, DREAM_THREAD_SOURCE);
 	gst_bin_add (GST_BIN (app->pipeline), app->tsmux);
 
 	GstPad *sinkpad, *srcpad;
@@ -1433,19 +2671,128 @@ void assert_tsmux(App *app)
 		g_error ("couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", app->tsmux, app->tstee);
 }
 
+/* every branch of the source pipeline starts with a queue */
+static void probe_watch_element (GstElement *element, const gchar *padname, GstClockTime window)
+{
+	GstPad *pad = gst_element_get_static_pad (element, padname);
+	if (pad)
+	{
+		dream_probe_attach (pad, GST_ELEMENT_NAME (element), window);
+		gst_object_unref (pad);
+	}
+}
+
+static void metrics_element_added (GstBin *bin, GstBin *sub_bin, GstElement *element, gpointer user_data)
+{
+	App *app = user_data;
+	GstElementFactory *factory = gst_element_get_factory (element);
+	const gchar *factory_name = factory ? GST_OBJECT_NAME (factory) : NULL;
+	const gchar *name = GST_OBJECT_NAME (element);
+	GstPad *pad;
+
+	if (g_strcmp0 (factory_name, "queue") == 0)
+	{
+		dream_probe_attach_queue (element, PROBE_WINDOW);
+		if (element == app->vq)
+			latency_watch_element (element, "src", DREAM_LATENCY_PATH_SOURCE, DREAM_LATENCY_STAGE_QUEUE);
+		else if (g_strcmp0 (name, "rtspvideoqueue") == 0)
+			latency_watch_element (element, "src", DREAM_LATENCY_PATH_ES_RTSP, DREAM_LATENCY_STAGE_QUEUE);
+		else if (g_strcmp0 (name, "tsrtspqueue") == 0)
+			latency_watch_element (element, "src", DREAM_LATENCY_PATH_TS_RTSP, DREAM_LATENCY_STAGE_QUEUE);
+		else if (g_strcmp0 (name, "hlsqueue") == 0)
+			latency_watch_element (element, "src", DREAM_LATENCY_PATH_HLS, DREAM_LATENCY_STAGE_QUEUE);
+		else if (g_strcmp0 (name, "tstcpqueue") == 0)
+			latency_watch_element (element, "src", DREAM_LATENCY_PATH_UPSTREAM, DREAM_LATENCY_STAGE_QUEUE);
+	}
+	else if (element == app->vsrc || element == app->asrc)
+	{
+		pad = gst_element_get_static_pad (element, "src");
+		dream_probe_attach (pad, GST_ELEMENT_NAME (element), PROBE_WINDOW);
+		if (element == app->vsrc)
+			dream_latency_watch_source (pad, app->pipeline);
+		gst_object_unref (pad);
+	}
+	else if (element == app->vparse)
+		latency_watch_element (element, "src", DREAM_LATENCY_PATH_SOURCE, DREAM_LATENCY_STAGE_PARSE);
+	else if (element == app->tsmux)
+	{
+		pad = gst_element_get_static_pad (element, "src");
+		dream_probe_attach (pad, GST_ELEMENT_NAME (element), PROBE_WINDOW);
+		dream_latency_watch_mux (pad);
+		gst_object_unref (pad);
+	}
+	else if (g_strcmp0 (factory_name, "appsink") == 0)
+		probe_watch_element (element, "sink", PROBE_WINDOW);
+	else if (g_strcmp0 (name, "hlssink") == 0)
+	{
+		probe_watch_element (element, "sink", PROBE_WINDOW);
+		latency_watch_element (element, "sink", DREAM_LATENCY_PATH_HLS, DREAM_LATENCY_STAGE_SINK);
+	}
+	else if (g_strcmp0 (factory_name, "tcpclientsink") == 0)
+	{
+		/* also measures the upstream bandwidth for the auto bitrate */
+		probe_watch_element (element, "sink", BITRATE_AVG_PERIOD);
+		latency_watch_element (element, "sink", DREAM_LATENCY_PATH_UPSTREAM, DREAM_LATENCY_STAGE_SINK);
+	}
+}
+
+static gboolean rate_apply (gpointer user_data)
+{
+	App *app = user_data;
+	gint kbps = g_atomic_int_get (&app->rate_kbps);
+
+	if (app->pipeline && IS_DREAM_SOURCE(app, app->vsrc))
+	{
+		GST_DEBUG_OBJECT (app, "adaptive bitrate: videoBitrate=%i", kbps);
+		g_object_set (G_OBJECT (app->vsrc), "bitrate", kbps, NULL);
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* the encoder serves every consumer, so one change on the control context
+ * is all it takes. the property cache announces it like any other */
+static void rate_changed (DreamRateController *rc, gint kbps, gpointer user_data)
+{
+	App *app = user_data;
+	g_atomic_int_set (&app->rate_kbps, kbps);
+	g_main_context_invoke (NULL, rate_apply, app);
+}
+
 gboolean create_source_pipeline(App *app)
 {
 	GST_INFO_OBJECT(app, "create_source_pipeline");
-	DREAMRTSPSERVER_LOCK (app);
 	app->pipeline = gst_pipeline_new ("dreamrtspserver_source_pipeline");
+	g_atomic_int_set (&app->properties.source_state, GST_STATE_NULL);
 
 	GstBus *bus = gst_pipeline_get_bus (GST_PIPELINE (app->pipeline));
 	gst_bus_add_signal_watch (bus);
 	g_signal_connect (G_OBJECT (bus), "message", G_CALLBACK (message_cb), app);
+	dream_thread_policy_watch (app->threads, bus);
 	gst_object_unref (GST_OBJECT (bus));
 
-	app->asrc = gst_element_factory_make ("dreamaudiosource", "dreamaudiosource0");
-	app->vsrc = gst_element_factory_make ("dreamvideosource", "dreamvideosource0");
+	g_signal_connect (app->pipeline, "deep-element-added", G_CALLBACK (metrics_element_added), app);
+
+	if (app->synthetic)
+	{
+		GError *error = NULL;
+		app->asrc = gst_parse_bin_from_description (SYNTHETIC_AUDIO_SOURCE, TRUE, &error);
+		if (error)
+		{
+			GST_ERROR_OBJECT (app, "synthetic audio source: %s", error->message);
+			g_clear_error (&error);
+		}
+		app->vsrc = gst_parse_bin_from_description (SYNTHETIC_VIDEO_SOURCE, TRUE, &error);
+		if (error)
+		{
+			GST_ERROR_OBJECT (app, "synthetic video source: %s", error->message);
+			g_clear_error (&error);
+		}
+	}
+	else
+	{
+		app->asrc = gst_element_factory_make ("dreamaudiosource", "dreamaudiosource0");
+		app->vsrc = gst_element_factory_make ("dreamvideosource", "dreamvideosource0");
+	}
 
 	app->aparse = gst_element_factory_make ("aacparse", NULL);
 	app->vparse = gst_element_factory_make ("h264parse", NULL);
@@ -1458,7 +2805,6 @@ gboolean create_source_pipeline(App *app)
 	app->vq = gst_element_factory_make ("queue", "vqueue");
 
 	app->tsmux = gst_element_factory_make ("mpegtsmux", NULL);
-        app->tstee = gst_element_factory_make ("tee", "tstee");
 
 	if (!(app->asrc && app->vsrc && app->aparse && app->vparse && app->aq && app->vq && app->atee && app->vtee && app->tsmux && app->tstee))
 	{
@@ -1491,9 +2837,15 @@ gboolean create_source_pipeline(App *app)
 		gst_object_unref (udpsrc);
 	}
 
+	dream_thread_policy_tag (app->asrc, DREAM_THREAD_SOURCE);
+	dream_thread_policy_tag (app->vsrc, DREAM_THREAD_SOURCE);
+	dream_thread_policy_tag (app->aq, DREAM_THREAD_SOURCE);
+	dream_thread_policy_tag (app->vq, DREAM_THREAD_SOURCE);
 	gst_bin_add_many (GST_BIN (app->pipeline), app->asrc, app->aparse, app->atee, app->aq, NULL);
 	gst_bin_add_many (GST_BIN (app->pipeline), app->vsrc, app->vparse, app->vtee, app->vq, NULL);
 	gst_bin_add (GST_BIN (app->pipeline), app->tstee);
+	/* the mux stays linked while no output is attached */
+	g_object_set (G_OBJECT (app->tstee), "allow-not-linked", TRUE, NULL);
 	gst_element_link_many (app->asrc, app->aparse, app->atee, NULL);
 	gst_element_link_many (app->vsrc, app->vparse, app->vtee, NULL);
 
@@ -1529,12 +2881,27 @@ gboolean create_source_pipeline(App *app)
 	app->clock = gst_system_clock_obtain();
 	gst_pipeline_use_clock(GST_PIPELINE (app->pipeline), app->clock);
 
+	/* a switch pending on the old pipeline lost its probe */
+	g_atomic_int_set (&app->video_switch.state, VIDEO_SWITCH_IDLE);
+	__atomic_store_n (&app->video_switch.hls_switch_time, GST_CLOCK_TIME_NONE, __ATOMIC_RELAXED);
+	watch_source_properties(app);
 	apply_source_properties(app);
 
-	g_signal_connect (app->asrc, "signal-lost", G_CALLBACK (encoder_signal_lost), app);
+	GstPad *srcpad = gst_element_get_static_pad (app->vparse, "src");
+	dream_rate_controller_set_target (app->rate, app->source_properties.videoBitrate);
+	dream_rate_controller_attach (app->rate, srcpad);
+	gst_object_unref (srcpad);
+
+	if (!app->synthetic)
+		g_signal_connect (app->asrc, "signal-lost", G_CALLBACK (encoder_signal_lost), app);
+
+	/* the encoders are opened once here, the first output only has to start them */
+	if (gst_element_set_state (app->pipeline, GST_STATE_READY) == GST_STATE_CHANGE_FAILURE)
+		GST_WARNING_OBJECT (app, "can't bring source pipeline to GST_STATE_READY");
+	g_atomic_int_set (&app->idle.active, FALSE);
+	g_atomic_int_set (&app->idle.requested, FALSE);
 
 	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"create_source_pipeline");
-	DREAMRTSPSERVER_UNLOCK (app);
 	return TRUE;
 }
 
@@ -1547,12 +2914,15 @@ static GstPadProbeReturn inject_authorization (GstPad * sinkpad, GstPadProbeInfo
 {
 	App *app = user_data;
 
-	GstBuffer *token_buf = gst_buffer_new_wrapped (app->tcp_upstream->token, TOKEN_LEN);
+	/* a copy, wrapping the token would hand app memory to g_free */
+	GstBuffer *token_buf = gst_buffer_new_allocate (NULL, TOKEN_LEN, NULL);
 	GstPad * srcpad = gst_element_get_static_pad (app->tcp_upstream->tstcpq, "src");
 
+	gst_buffer_fill (token_buf, 0, app->tcp_upstream->token, TOKEN_LEN);
 	GST_INFO ("injecting authorization on pad %s:%s, created token_buf %" GST_PTR_FORMAT "", GST_DEBUG_PAD_NAME (sinkpad), token_buf);
 	gst_pad_remove_probe (sinkpad, info->id);
-	gst_pad_push (srcpad, gst_buffer_ref(token_buf));
+	gst_pad_push (srcpad, token_buf);
+	gst_object_unref (srcpad);
 
 	return GST_PAD_PROBE_REMOVE;
 }
@@ -1572,12 +2942,12 @@ gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstr
 	if (t->state == UPSTREAM_STATE_DISABLED)
 	{
 		assert_tsmux (app);
-		DREAMRTSPSERVER_LOCK (app);
+		wake_source_pipeline (app);
+		UPSTREAM_LOCK (app);
 
 		t->id_signal_overrun = 0;
 		t->id_signal_waiting = 0;
 		t->id_signal_keepalive = 0;
-		t->id_bitrate_measure = 0;
 		t->id_resume = 0;
 		t->state = UPSTREAM_STATE_CONNECTING;
 		send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
@@ -1587,6 +2957,8 @@ gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstr
 
 		if (!(t->tstcpq && t->tcpsink ))
 			g_error ("Failed to create tcp upstream element(s):%s%s", t->tstcpq?"":"  ts queue", t->tcpsink?"":"  tcpclientsink" );
+		t->branch = dream_branch_new ("upstream", t->tstcpq, t->tcpsink);
+		dream_thread_policy_tag (t->tstcpq, DREAM_THREAD_UPSTREAM);
 
 		g_object_set (G_OBJECT (t->tstcpq), "leaky", 2, "max-size-buffers", 400, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(0), NULL);
 
@@ -1619,36 +2991,21 @@ gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstr
 		if (sret == GST_STATE_CHANGE_FAILURE)
 		{
 			GST_ERROR_OBJECT (app, "failed to set tcpsink to GST_STATE_READY. %s:%d probably refused connection", upstream_host, upstream_port);
-			gst_object_unref (t->tstcpq);
-			gst_object_unref (t->tcpsink);
+			gst_element_set_state (t->tcpsink, GST_STATE_NULL);
+			dream_branch_unref (t->branch);
+			t->branch = NULL;
+			t->tstcpq = t->tcpsink = NULL;
 			t->state = UPSTREAM_STATE_DISABLED;
 			send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
-			DREAMRTSPSERVER_UNLOCK (app);
+			UPSTREAM_UNLOCK (app);
 			return FALSE;
 		}
 
-		gst_bin_add_many (GST_BIN(app->pipeline), t->tstcpq, t->tcpsink, NULL);
-		if (!gst_element_link (t->tstcpq, t->tcpsink)) {
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", t->tstcpq, t->tcpsink);
-			goto fail;
-		}
-
-// 		if (!assert_state (app, t->tcpsink, GST_STATE_PLAYING) || !assert_state (app, t->tstcpq, GST_STATE_PLAYING))
-// 			goto fail;
-
-		GstPadLinkReturn ret;
-		GstPad *srcpad, *sinkpad;
-		srcpad = gst_element_get_request_pad (app->tstee, "src_%u");
-		sinkpad = gst_element_get_static_pad (t->tstcpq, "sink");
-		ret = gst_pad_link (srcpad, sinkpad);
-		gst_object_unref (srcpad);
-		gst_object_unref (sinkpad);
-		if (ret != GST_PAD_LINK_OK)
-		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", srcpad, sinkpad);
+		if (!dream_branch_attach (t->branch, GST_BIN (app->pipeline), app->tstee))
 			goto fail;
-		}
+		dream_budget_add (app->budget, t->branch, BUDGET_WEIGHT_UPSTREAM);
 
+		GstPad *sinkpad;
 		if (strlen(token))
 		{
 			sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
@@ -1658,14 +3015,15 @@ gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstr
 		}
 		else
 			GST_DEBUG_OBJECT (app, "no token specified!");
+		UPSTREAM_UNLOCK (app);
 
+		/* queue_overrun() takes the lock on the streaming thread */
 		if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
 		{
 			GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for TCP upstream");
 			return FALSE;
 		}
 		GST_INFO_OBJECT(app, "enabled TCP upstream! upstreamState = UPSTREAM_STATE_CONNECTING");
-		DREAMRTSPSERVER_UNLOCK (app);
 		return TRUE;
 	}
 	else
@@ -1673,7 +3031,7 @@ gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstr
 	return FALSE;
 
 fail:
-	DREAMRTSPSERVER_UNLOCK (app);
+	UPSTREAM_UNLOCK (app);
 	disable_tcp_upstream(app);
 	return FALSE;
 }
@@ -1722,43 +3080,411 @@ gboolean hls_client_timeout (gpointer user_data)
 	App *app = user_data;
 	if (app->hls_server)
 	{
+		app->hls_server->id_timeout = 0;
 		GST_INFO_OBJECT(app, "HLS clients stopped downloading, stopping hls pipeline!");
 		stop_hls_pipeline (app);
 	}
 	return FALSE;
 }
 
-static void
-soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app)
+typedef struct {
+	App *app;
+	SoupServer *server;
+	SoupMessage *msg;
+	gchar *path;
+	gboolean failed;
+} DreamHLSRequest;
+
+static gboolean hls_resume_request (gpointer user_data)
 {
-	gchar *hlspath = NULL;
-	guint status_code = SOUP_STATUS_NONE;
-	struct stat st;
+	DreamHLSRequest *req = user_data;
+	App *app = req->app;
+
+	/* there is no hls pipeline to serve from */
+	if (req->failed)
+		soup_message_set_status (req->msg, SOUP_STATUS_BAD_GATEWAY);
+	else if (app->hls_server->state != HLS_STATE_RUNNING)
+		soup_message_set_status (req->msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+	else
+		soup_do_get (req->server, req->msg, req->path, app);
+	GST_DEBUG_OBJECT (req->server, "resuming deferred request for '%s' -> %d", req->path, req->msg->status_code);
+	soup_server_unpause_message (req->server, req->msg);
+
+	g_object_unref (req->msg);
+	g_object_unref (req->server);
+	g_free (req->path);
+	g_free (req);
+	return G_SOURCE_REMOVE;
+}
 
-	if (path)
+static void hls_resume_request_later (DreamHLSRequest *req, guint delay)
+{
+	GSource *source = g_timeout_source_new_seconds (delay);
+	g_source_set_callback (source, hls_resume_request, req, NULL);
+	g_source_attach (source, req->app->http_service.context);
+	g_source_unref (source);
+}
+
+static gboolean hls_start_deferred (gpointer user_data)
+{
+	DreamHLSRequest *req = user_data;
+	App *app = req->app;
+
+	HLS_LOCK (app);
+	if (app->hls_server->state == HLS_STATE_IDLE)
 	{
-		if (strlen(path) < 1)
-			status_code = SOUP_STATUS_BAD_REQUEST;
-		if (strlen(path) == 1)
-			status_code = SOUP_STATUS_MOVED_PERMANENTLY;
-		else
-			hlspath = g_strdup_printf ("%s%s", HLS_PATH, path);
-	}
-	if (app->hls_server->state == HLS_STATE_IDLE && g_strcmp0 (path+1, HLS_PLAYLIST_NAME) == 0)
-	{
-		DREAMRTSPSERVER_LOCK (app);
-		GST_INFO_OBJECT (server, "client requested '%s' but we're idle... start pipeline!", path+1);
-		if (!start_hls_pipeline (app))
-			status_code = SOUP_STATUS_INTERNAL_SERVER_ERROR;
+		if (!start_hls_pipeline (app))
+			req->failed = TRUE;
 		else
 		{
-			GstState state;
-			gst_element_get_state (GST_ELEMENT(app->pipeline), &state, NULL, HLS_FRAGMENT_DURATION);
-			g_usleep (G_USEC_PER_SEC * (HLS_FRAGMENT_DURATION+1));
 			app->hls_server->state = HLS_STATE_RUNNING;
 			send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_RUNNING));
 		}
-		DREAMRTSPSERVER_UNLOCK (app);
+	}
+	HLS_UNLOCK (app);
+	g_atomic_int_set (&app->hls_server->starting, FALSE);
+	/* give hlssink the time to write the first fragment */
+	hls_resume_request_later (req, req->failed ? 0 : HLS_START_DELAY);
+	return G_SOURCE_REMOVE;
+}
+
+/* the http thread must not wait for the pipeline to start, so the request
+ * is paused and answered once the first fragments are available */
+static void hls_defer_request (App *app, SoupServer *server, SoupMessage *msg, const char *path)
+{
+	DreamHLSRequest *req = g_new0 (DreamHLSRequest, 1);
+	req->app = app;
+	req->server = g_object_ref (server);
+	req->msg = g_object_ref (msg);
+	req->path = g_strdup (path);
+	soup_server_pause_message (server, msg);
+
+	if (g_atomic_int_compare_and_exchange (&app->hls_server->starting, FALSE, TRUE))
+		g_main_context_invoke (NULL, hls_start_deferred, req);
+	else
+		hls_resume_request_later (req, HLS_START_DELAY);
+}
+
+/* the client timeout is a source of the control context */
+static gboolean hls_client_seen (gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSserver *h = app->hls_server;
+
+	if (h->state != HLS_STATE_RUNNING)
+		return G_SOURCE_REMOVE;
+	if (h->id_timeout)
+		g_source_remove (h->id_timeout);
+	h->id_timeout = g_timeout_add_seconds (5*HLS_FRAGMENT_DURATION, (GSourceFunc) hls_client_timeout, app);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean hls_assert_playing (gpointer user_data)
+{
+	App *app = user_data;
+	GstState state;
+	if (!app->pipeline || app->hls_server->state != HLS_STATE_RUNNING)
+		return G_SOURCE_REMOVE;
+	gst_element_get_state (app->asrc, &state, NULL, GST_MSECOND);
+	if (state != GST_STATE_PLAYING)
+	{
+		assert_tsmux (app);
+		wake_source_pipeline (app);
+		if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+			GST_WARNING_OBJECT (app, "couldn't bring pipeline to PLAYING for hls client");
+	}
+	return G_SOURCE_REMOVE;
+}
+
+/* hlssink knows nothing about caps changes, so the fragments following a
+ * video switch get their #EXT-X-DISCONTINUITY here and the ones which slid
+ * out of the window advance #EXT-X-DISCONTINUITY-SEQUENCE. returns NULL if
+ * the playlist can be served as it is */
+static gchar *hls_playlist_mark_discontinuities (App *app, const gchar *contents, gsize length)
+{
+	DreamHLSserver *h = app->hls_server;
+	GArray *d = h->discontinuities;
+	GString *out;
+	gchar *playlist, **lines, **line;
+	gint oldest = -1;
+	gboolean sequence_written = FALSE;
+	guint i;
+
+	HLS_LOCK (app);
+	if (!d->len && !h->discontinuity_sequence)
+	{
+		HLS_UNLOCK (app);
+		return NULL;
+	}
+	playlist = g_strndup (contents, length);
+	lines = g_strsplit (playlist, "\n", -1);
+	for (line = lines; *line; line++)
+	{
+		gint index;
+		if (**line != '#' && sscanf (*line, HLS_FRAGMENT_NAME, &index) == 1 && (oldest < 0 || index < oldest))
+			oldest = index;
+	}
+	/* forget the fragments which already left the playlist */
+	for (i = d->len; oldest >= 0 && i > 0; i--)
+		if (g_array_index (d, guint, i - 1) < (guint) oldest)
+		{
+			g_array_remove_index (d, i - 1);
+			h->discontinuity_sequence++;
+		}
+
+	out = g_string_sized_new (length + d->len * 24 + 40);
+	for (line = lines; *line; line++)
+	{
+		gint index;
+		if (!sequence_written && (g_str_has_prefix (*line, "#EXTINF") || (**line && **line != '#')))
+		{
+			g_string_append_printf (out, "#EXT-X-DISCONTINUITY-SEQUENCE:%u\n", h->discontinuity_sequence);
+			sequence_written = TRUE;
+		}
+		if (**line != '#' && sscanf (*line, HLS_FRAGMENT_NAME, &index) == 1)
+		{
+			for (i = 0; i < d->len; i++)
+				if (g_array_index (d, guint, i) == (guint) index)
+					g_string_append (out, "#EXT-X-DISCONTINUITY\n");
+		}
+		g_string_append (out, *line);
+		if (line[1])
+			g_string_append_c (out, '\n');
+	}
+	HLS_UNLOCK (app);
+
+	g_strfreev (lines);
+	g_free (playlist);
+	return g_string_free (out, FALSE);
+}
+
+/* the timeshift window as HLS. the ring drops its oldest segments, so it
+ * is always a sliding window and never an EVENT playlist, which may only
+ * grow. the store caps the segments, the target duration never changes */
+static gchar *timeshift_playlist (DreamTimeshift *store)
+{
+	GArray *segments = dream_timeshift_segments (store);
+	GString *out = g_string_new ("#EXTM3U\n#EXT-X-VERSION:3\n");
+	guint i;
+
+	g_string_append_printf (out, "#EXT-X-TARGETDURATION:%" G_GINT64_FORMAT "\n", DREAM_TIMESHIFT_TARGET / G_TIME_SPAN_SECOND);
+	g_string_append_printf (out, "#EXT-X-MEDIA-SEQUENCE:%" G_GUINT64_FORMAT "\n", segments->len ? g_array_index (segments, DreamTimeshiftSegment, 0).seq : 0);
+	for (i = 0; i < segments->len; i++)
+	{
+		DreamTimeshiftSegment *s = &g_array_index (segments, DreamTimeshiftSegment, i);
+		g_string_append_printf (out, "#EXTINF:%.3f,\n" TIMESHIFT_SEGMENT_NAME "\n", (gdouble) s->duration / G_TIME_SPAN_SECOND, s->seq);
+	}
+	g_array_free (segments, TRUE);
+	return g_string_free (out, FALSE);
+}
+
+/* looks a segment of the window up, without reading it */
+static gboolean timeshift_segment (DreamTimeshift *store, guint64 seq, DreamTimeshiftSegment *segment)
+{
+	GArray *segments = dream_timeshift_segments (store);
+	gboolean found = FALSE;
+	guint i;
+
+	for (i = 0; i < segments->len && !found; i++)
+	{
+		DreamTimeshiftSegment *s = &g_array_index (segments, DreamTimeshiftSegment, i);
+		if (s->seq == seq)
+		{
+			*segment = *s;
+			found = TRUE;
+		}
+	}
+	g_array_free (segments, TRUE);
+	return found;
+}
+
+/* a segment on its way to an http client. a reader thread fetches one
+ * chunk at a time, the http thread sends it and asks for the next once it
+ * is written, so the http thread never waits for the disk */
+typedef struct {
+	App *app;
+	SoupServer *server;
+	SoupMessage *msg;
+	DreamTimeshift *store;
+	DreamTimeshiftSegment segment;
+	guint64 sent;
+	guint8 *chunk;
+	gsize chunk_size;
+	/* http thread only. the reader has the request, the client is gone */
+	gboolean reading, finished;
+} DreamTimeshiftRequest;
+
+static void timeshift_request_free (DreamTimeshiftRequest *req)
+{
+	g_signal_handlers_disconnect_by_data (req->msg, req);
+	g_object_unref (req->msg);
+	g_object_unref (req->server);
+	dream_timeshift_unref (req->store);
+	g_free (req->chunk);
+	g_free (req);
+}
+
+/* on a reader thread of the timeshift's pool */
+static gboolean timeshift_request_write (gpointer user_data);
+static void timeshift_request_read (gpointer data, gpointer user_data)
+{
+	DreamTimeshiftRequest *req = data;
+	gsize size = MIN (TIMESHIFT_HTTP_CHUNK, req->segment.size - req->sent);
+
+	req->chunk = g_malloc (size);
+	req->chunk_size = size;
+	if (dream_timeshift_read (req->store, req->segment.pos + req->sent, req->chunk, size) != (gssize) size)
+		g_clear_pointer (&req->chunk, g_free);
+	g_main_context_invoke (req->app->http_service.context, timeshift_request_write, req);
+}
+
+static void timeshift_request_next (DreamTimeshiftRequest *req)
+{
+	req->reading = TRUE;
+	g_thread_pool_push (req->app->timeshift.readers, req, NULL);
+}
+
+/* the chunk is read. if the writer overwrote the segment meanwhile a
+ * client which didn't get anything yet gets a 404, one this far behind
+ * the window a short segment */
+static gboolean timeshift_request_write (gpointer user_data)
+{
+	DreamTimeshiftRequest *req = user_data;
+
+	req->reading = FALSE;
+	if (req->finished)
+	{
+		timeshift_request_free (req);
+		return G_SOURCE_REMOVE;
+	}
+	if (!req->chunk)
+	{
+		GST_INFO_OBJECT (req->server, "timeshift segment %" G_GUINT64_FORMAT " left the window after %" G_GUINT64_FORMAT " bytes", req->segment.seq, req->sent);
+		if (!req->sent)
+			soup_message_set_status (req->msg, SOUP_STATUS_NOT_FOUND);
+		soup_message_body_complete (req->msg->response_body);
+	}
+	else
+	{
+		if (!req->sent)
+			soup_message_set_status (req->msg, SOUP_STATUS_OK);
+		soup_message_body_append_take (req->msg->response_body, req->chunk, req->chunk_size);
+		req->chunk = NULL;
+		req->sent += req->chunk_size;
+		if (req->sent == req->segment.size)
+			soup_message_body_complete (req->msg->response_body);
+	}
+	soup_server_unpause_message (req->server, req->msg);
+	return G_SOURCE_REMOVE;
+}
+
+static void timeshift_request_wrote_chunk (SoupMessage *msg, DreamTimeshiftRequest *req)
+{
+	if (req->sent < req->segment.size && !req->reading)
+		timeshift_request_next (req);
+}
+
+static void timeshift_request_finished (SoupMessage *msg, DreamTimeshiftRequest *req)
+{
+	req->finished = TRUE;
+	if (!req->reading)
+		timeshift_request_free (req);
+}
+
+/* takes the store reference */
+static void timeshift_stream_segment (App *app, SoupServer *server, SoupMessage *msg, DreamTimeshift *store, const DreamTimeshiftSegment *segment)
+{
+	DreamTimeshiftRequest *req = g_new0 (DreamTimeshiftRequest, 1);
+
+	req->app = app;
+	req->server = g_object_ref (server);
+	req->msg = g_object_ref (msg);
+	req->store = store;
+	req->segment = *segment;
+	soup_message_headers_set_encoding (msg->response_headers, SOUP_ENCODING_CHUNKED);
+	soup_message_body_set_accumulate (msg->response_body, FALSE);
+	g_signal_connect (msg, "wrote-chunk", G_CALLBACK (timeshift_request_wrote_chunk), req);
+	g_signal_connect (msg, "finished", G_CALLBACK (timeshift_request_finished), req);
+	soup_server_pause_message (server, msg);
+	timeshift_request_next (req);
+}
+
+static void timeshift_do_get (SoupServer *server, SoupMessage *msg, const char *name, App *app)
+{
+	DreamTimeshift *store = NULL;
+	DreamTimeshiftSegment segment;
+	guint64 seq;
+	gchar *body;
+
+	g_mutex_lock (&app->timeshift.lock);
+	if (app->timeshift.enabled && app->timeshift.store)
+		store = dream_timeshift_ref (app->timeshift.store);
+	g_mutex_unlock (&app->timeshift.lock);
+	if (!store)
+	{
+		soup_message_set_status (msg, SOUP_STATUS_SERVICE_UNAVAILABLE);
+		return;
+	}
+
+	if (g_strcmp0 (name, TIMESHIFT_PLAYLIST_NAME) == 0)
+	{
+		body = timeshift_playlist (store);
+		dream_timeshift_unref (store);
+		soup_message_headers_set_content_type (msg->response_headers, "application/x-mpegURL", NULL);
+		if (msg->method == SOUP_METHOD_GET)
+			soup_message_body_append_take (msg->response_body, (guchar *) body, strlen (body));
+		else
+			g_free (body);
+		soup_message_set_status (msg, SOUP_STATUS_OK);
+	}
+	else if (sscanf (name, TIMESHIFT_SEGMENT_NAME, &seq) == 1 && timeshift_segment (store, seq, &segment) && segment.size)
+	{
+		soup_message_headers_set_content_type (msg->response_headers, "video/MP2T", NULL);
+		if (msg->method == SOUP_METHOD_GET)
+			timeshift_stream_segment (app, server, msg, store, &segment);
+		else
+		{
+			dream_timeshift_unref (store);
+			soup_message_headers_set_content_length (msg->response_headers, segment.size);
+			soup_message_set_status (msg, SOUP_STATUS_OK);
+		}
+	}
+	else
+	{
+		dream_timeshift_unref (store);
+		GST_INFO_OBJECT (server, "client requested '%s%s', not in the timeshift", TIMESHIFT_HLS_PREFIX, name);
+		soup_message_set_status (msg, SOUP_STATUS_NOT_FOUND);
+	}
+}
+
+static void
+soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app)
+{
+	gchar *hlspath = NULL;
+	guint status_code = SOUP_STATUS_NONE;
+	struct stat st;
+
+	if (g_str_has_prefix (path, TIMESHIFT_HLS_PREFIX))
+	{
+		timeshift_do_get (server, msg, path + strlen (TIMESHIFT_HLS_PREFIX), app);
+		return;
+	}
+
+	if (path)
+	{
+		if (strlen(path) < 1)
+			status_code = SOUP_STATUS_BAD_REQUEST;
+		if (strlen(path) == 1)
+			status_code = SOUP_STATUS_MOVED_PERMANENTLY;
+		else
+			hlspath = g_strdup_printf ("%s%s", HLS_PATH, path);
+	}
+	if (app->hls_server->state == HLS_STATE_IDLE && g_strcmp0 (path+1, HLS_PLAYLIST_NAME) == 0)
+	{
+		GST_INFO_OBJECT (server, "client requested '%s' but we're idle... start pipeline!", path+1);
+		hls_defer_request (app, server, msg, path);
+		g_free (hlspath);
+		return;
 	}
 	else if (status_code == SOUP_STATUS_NONE && stat (hlspath, &st) == -1) {
 		if (errno == EPERM)
@@ -1790,6 +3516,7 @@ soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app)
 	if (msg->method == SOUP_METHOD_GET) {
 		GMappedFile *mapping;
 		SoupBuffer *buffer;
+		gchar *playlist = NULL;
 
 		mapping = g_mapped_file_new (hlspath, FALSE, NULL);
 		if (!mapping) {
@@ -1801,27 +3528,21 @@ soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app)
 			soup_message_headers_set_content_type (msg->response_headers, "video/MP2T", NULL);
 		else
 		{
-			GstState state;
-			gst_element_get_state (app->asrc, &state, NULL, GST_MSECOND);
-			if (state != GST_STATE_PLAYING)
-			{
-				assert_tsmux (app);
-				if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
-				{
-					soup_message_set_status (msg, SOUP_STATUS_BAD_GATEWAY);
-					g_free (hlspath);
-					return;
-				}
-			}
+			g_main_context_invoke (NULL, hls_assert_playing, app);
 			soup_message_headers_set_content_type (msg->response_headers, "application/x-mpegURL", NULL);
+			playlist = hls_playlist_mark_discontinuities (app, g_mapped_file_get_contents (mapping), g_mapped_file_get_length (mapping));
 		}
-		if (app->hls_server->id_timeout)
-			g_source_remove (app->hls_server->id_timeout);
-		app->hls_server->id_timeout = g_timeout_add_seconds (5*HLS_FRAGMENT_DURATION, (GSourceFunc) hls_client_timeout, app);
+		g_main_context_invoke (NULL, hls_client_seen, app);
 
-		buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
-						     g_mapped_file_get_length (mapping),
-						     mapping, (GDestroyNotify)g_mapped_file_unref);
+		if (playlist)
+		{
+			g_mapped_file_unref (mapping);
+			buffer = soup_buffer_new (SOUP_MEMORY_TAKE, playlist, strlen (playlist));
+		}
+		else
+			buffer = soup_buffer_new_with_owner (g_mapped_file_get_contents (mapping),
+							     g_mapped_file_get_length (mapping),
+							     mapping, (GDestroyNotify)g_mapped_file_unref);
 		soup_message_body_append_buffer (msg->response_body, buffer);
 		soup_buffer_free (buffer);
 	}
@@ -1844,117 +3565,1011 @@ soup_server_auth_callback (SoupAuthDomain *domain, SoupMessage *msg, const char
 	return FALSE;
 }
 
+typedef struct {
+	gint64 start;
+	gboolean playlist;
+} DreamHLSRequestTiming;
+
+/* the response is complete, including paused requests for the idle start */
+static void metrics_request_finished (SoupMessage *msg, gpointer user_data)
+{
+	DreamHLSRequestTiming *timing = user_data;
+
+	if (SOUP_STATUS_IS_CLIENT_ERROR (msg->status_code))
+		dream_metrics_add (DREAM_METRIC_HLS_REQUESTS_CLIENT_ERROR, 1);
+	else if (SOUP_STATUS_IS_SERVER_ERROR (msg->status_code) || msg->status_code < 100)
+		dream_metrics_add (DREAM_METRIC_HLS_REQUESTS_SERVER_ERROR, 1);
+	else
+		dream_metrics_add (DREAM_METRIC_HLS_REQUESTS_OK, 1);
+	if (msg->response_body)
+		dream_metrics_add (DREAM_METRIC_HLS_RESPONSE_BYTES, msg->response_body->length);
+	dream_metrics_observe (timing->playlist ? DREAM_METRIC_HLS_PLAYLIST_SECONDS : DREAM_METRIC_HLS_SEGMENT_SECONDS, g_get_monotonic_time () - timing->start);
+}
+
 static void
 soup_server_callback (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *context, gpointer data)
 {
 	GST_TRACE_OBJECT (server, "%s %s HTTP/1.%d", msg->method, path, soup_message_get_http_version (msg));
+	if (g_strcmp0 (path, METRICS_PATH) == 0)
+	{
+		metrics_soup_callback (server, msg, path, query, context, data);
+		return;
+	}
 	if (msg->method == SOUP_METHOD_GET)
+	{
+		DreamHLSRequestTiming *timing = g_new0 (DreamHLSRequestTiming, 1);
+		timing->start = g_get_monotonic_time ();
+		timing->playlist = g_str_has_suffix (path, ".m3u8");
+		g_signal_connect_data (msg, "finished", G_CALLBACK (metrics_request_finished), timing, (GClosureNotify) g_free, 0);
 		soup_do_get (server, msg, path, (App *) data);
+	}
 	else
 		soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
 	GST_TRACE_OBJECT (server, "  -> %d %s", msg->status_code, msg->reason_phrase);
 }
 
-static GstPadProbeReturn hls_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+static void metrics_append_probes (GString *out)
 {
-	App *app = user_data;
+	GArray *probes = dream_probe_snapshot ();
+	gboolean first_pad = TRUE, first_queue = TRUE;
+	guint i;
+
+	for (i = 0; i < probes->len; i++)
+	{
+		DreamProbeStats *p = &g_array_index (probes, DreamProbeStats, i);
+		gchar *labels = g_strdup_printf ("probe=\"%s\"", p->name);
+		dream_metrics_append (out, "counter", "dream_probe_bytes_total", first_pad ? "Bytes which passed the probed pad." : NULL, labels, p->bytes);
+		dream_metrics_append (out, "counter", "dream_probe_buffers_total", first_pad ? "Buffers which passed the probed pad." : NULL, labels, p->buffers);
+		dream_metrics_append (out, "counter", "dream_probe_keyframes_total", first_pad ? "Buffers without the delta unit flag which passed the probed pad." : NULL, labels, p->keyframes);
+		dream_metrics_append (out, "gauge", "dream_probe_bitrate_bps", first_pad ? "Bitrate over the last measurement window." : NULL, labels, p->bitrate);
+		first_pad = FALSE;
+		g_free (labels);
+	}
+	for (i = 0; i < probes->len; i++)
+	{
+		DreamProbeStats *p = &g_array_index (probes, DreamProbeStats, i);
+		gchar *labels;
+		if (!p->queue)
+			continue;
+		labels = g_strdup_printf ("queue=\"%s\"", p->name);
+		dream_metrics_append (out, "gauge", "dream_queue_level_bytes", first_queue ? "Current fill level of the queue in bytes." : NULL, labels, p->level_bytes);
+		dream_metrics_append (out, "gauge", "dream_queue_level_buffers", first_queue ? "Current fill level of the queue in buffers." : NULL, labels, p->level_buffers);
+		dream_metrics_append (out, "gauge", "dream_queue_level_seconds", first_queue ? "Current fill level of the queue in seconds." : NULL, labels, p->level_time / (gdouble) GST_SECOND);
+		dream_metrics_append (out, "counter", "dream_queue_overruns_total", first_queue ? "Times the queue was full." : NULL, labels, p->overruns);
+		first_queue = FALSE;
+		g_free (labels);
+	}
+	g_array_free (probes, TRUE);
+}
+
+/* runs on the http thread, everything is read without touching the pipeline's locks */
+static gchar *metrics_render (App *app)
+{
+	GString *out = g_string_new (NULL);
+	DreamRTSPserver *r = app->rtsp_server;
 	DreamHLSserver *h = app->hls_server;
+	DreamTCPupstream *t = app->tcp_upstream;
+	SourceProperties *p = &app->source_properties;
+	guint i, n;
+
+	dream_metrics_append (out, "counter", "dream_branch_bytes_total", "Bytes handed over to a branch.", "branch=\"rtsp_es_audio\"", dream_metrics_get (DREAM_METRIC_RTSP_ES_AUDIO_BYTES));
+	dream_metrics_append (out, "counter", "dream_branch_bytes_total", NULL, "branch=\"rtsp_es_video\"", dream_metrics_get (DREAM_METRIC_RTSP_ES_VIDEO_BYTES));
+	dream_metrics_append (out, "counter", "dream_branch_bytes_total", NULL, "branch=\"rtsp_ts\"", dream_metrics_get (DREAM_METRIC_RTSP_TS_BYTES));
+	dream_metrics_append (out, "counter", "dream_branch_buffers_total", "Buffers handed over to a branch.", "branch=\"rtsp_es_audio\"", dream_metrics_get (DREAM_METRIC_RTSP_ES_AUDIO_BUFFERS));
+	dream_metrics_append (out, "counter", "dream_branch_buffers_total", NULL, "branch=\"rtsp_es_video\"", dream_metrics_get (DREAM_METRIC_RTSP_ES_VIDEO_BUFFERS));
+	dream_metrics_append (out, "counter", "dream_branch_buffers_total", NULL, "branch=\"rtsp_ts\"", dream_metrics_get (DREAM_METRIC_RTSP_TS_BUFFERS));
+	dream_metrics_append (out, "counter", "dream_rtsp_discarded_buffers_total", "Buffers dropped in the RTSP handover.", NULL, dream_metrics_get (DREAM_METRIC_RTSP_DISCARDED_BUFFERS));
+	dream_metrics_append (out, "counter", "dream_rtsp_variant_buffers_total", "Buffers pushed into variant medias.", NULL, dream_metrics_get (DREAM_METRIC_RTSP_VARIANT_BUFFERS));
+	dream_metrics_append (out, "counter", "dream_signals_total", "D-Bus signals by outcome.", "outcome=\"posted\"", dream_metrics_get (DREAM_METRIC_SIGNALS_POSTED));
+	dream_metrics_append (out, "counter", "dream_signals_total", NULL, "outcome=\"emitted\"", dream_metrics_get (DREAM_METRIC_SIGNALS_EMITTED));
+	dream_metrics_append (out, "counter", "dream_signals_total", NULL, "outcome=\"coalesced\"", dream_metrics_get (DREAM_METRIC_SIGNALS_COALESCED));
+	dream_metrics_append (out, "counter", "dream_signal_send_seconds_total", "Time the callers of send_signal spent in it.", NULL, dream_metrics_get (DREAM_METRIC_SIGNAL_POST_NS) / (gdouble) GST_SECOND);
+	for (i = 0; i < DREAM_LOCK_LAST; i++)
+	{
+		gchar *labels = g_strdup_printf ("lock=\"%s\"", lock_names[i]);
+		dream_metrics_append (out, "counter", "dream_lock_contended_total", i ? NULL : "Times a lock was taken while another thread held it.", labels, dream_metrics_get (DREAM_METRIC_LOCK_CONTENDED_UPSTREAM + i));
+		dream_metrics_append (out, "counter", "dream_lock_wait_seconds_total", i ? NULL : "Time spent waiting for a contended lock.", labels, dream_metrics_get (DREAM_METRIC_LOCK_WAIT_NS_UPSTREAM + i) / (gdouble) GST_SECOND);
+		g_free (labels);
+	}
+	metrics_append_probes (out);
 
-	GstElement *element = gst_pad_get_parent_element(pad);
+	if (r)
+	{
+		dream_metrics_append (out, "gauge", "dream_rtsp_state", "State of the RTSP server.", NULL, r->state);
+		dream_metrics_append (out, "gauge", "dream_rtsp_clients", "Connected RTSP clients.", NULL, g_atomic_int_get (&r->clients_count));
+		dream_metrics_append (out, "counter", "dream_rtsp_congestion_total", "RTSP client congestion transitions.", "stage=\"congested\"", g_atomic_int_get (&r->congested_count));
+		dream_metrics_append (out, "counter", "dream_rtsp_congestion_total", NULL, "stage=\"dropped\"", g_atomic_int_get (&r->dropped_count));
+		dream_metrics_append (out, "counter", "dream_rtsp_congestion_total", NULL, "stage=\"resumed\"", g_atomic_int_get (&r->resumed_count));
+		dream_metrics_append (out, "counter", "dream_rtsp_congestion_total", NULL, "stage=\"evicted\"", g_atomic_int_get (&r->evicted_count));
+
+		GArray *stats = gst_dream_rtsp_thread_pool_get_stats (r->thread_pool);
+		guint i;
+		for (i = 0; i < stats->len; i++)
+		{
+			GstDreamRTSPThreadStats *ts = &g_array_index (stats, GstDreamRTSPThreadStats, i);
+			gchar *labels = g_strdup_printf ("thread=\"%u\"", ts->index);
+			dream_metrics_append (out, "gauge", "dream_rtsp_thread_clients", i ? NULL : "Clients served by an RTSP client thread.", labels, ts->clients);
+			dream_metrics_append (out, "counter", "dream_rtsp_thread_requests_total", i ? NULL : "RTSP requests handled by an RTSP client thread.", labels, ts->requests);
+			g_free (labels);
+		}
+		g_array_free (stats, TRUE);
+	}
 
-	GST_DEBUG_OBJECT(pad, "unlink... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+	if (h)
+	{
+		dream_metrics_append (out, "gauge", "dream_hls_state", "State of the HLS server.", NULL, h->state);
+		dream_metrics_append (out, "counter", "dream_hls_requests_total", "HLS requests by result.", "result=\"ok\"", dream_metrics_get (DREAM_METRIC_HLS_REQUESTS_OK));
+		dream_metrics_append (out, "counter", "dream_hls_requests_total", NULL, "result=\"client_error\"", dream_metrics_get (DREAM_METRIC_HLS_REQUESTS_CLIENT_ERROR));
+		dream_metrics_append (out, "counter", "dream_hls_requests_total", NULL, "result=\"server_error\"", dream_metrics_get (DREAM_METRIC_HLS_REQUESTS_SERVER_ERROR));
+		dream_metrics_append (out, "counter", "dream_hls_response_bytes_total", "Bytes served by the HLS server.", NULL, dream_metrics_get (DREAM_METRIC_HLS_RESPONSE_BYTES));
+		dream_metrics_append_histogram (out, "dream_hls_playlist_duration_seconds", "Time to answer playlist requests.", DREAM_METRIC_HLS_PLAYLIST_SECONDS);
+		dream_metrics_append_histogram (out, "dream_hls_segment_duration_seconds", "Time to answer segment requests.", DREAM_METRIC_HLS_SEGMENT_SECONDS);
+		dream_metrics_append (out, "gauge", "dream_hls_discontinuities", "Fragments marked discontinuous after a video switch.", NULL, h->discontinuities->len);
+	}
 
-	GstPad *teepad;
-	teepad = gst_pad_get_peer(pad);
-	gst_pad_unlink (teepad, pad);
+	if (t)
+	{
+		dream_metrics_append (out, "gauge", "dream_upstream_state", "State of the TCP upstream.", NULL, t->state);
+		dream_metrics_append (out, "gauge", "dream_upstream_bandwidth_kbps", "Estimated upstream bandwidth in kbit/s.", NULL, t->bitrate_avg);
+		dream_metrics_append (out, "gauge", "dream_upstream_overruns", "Upstream queue overruns in the current period.", NULL, t->overrun_counter);
+	}
 
-	GstElement *tee = gst_pad_get_parent_element(teepad);
-	gst_element_release_request_pad (tee, teepad);
-	gst_object_unref (teepad);
-	gst_object_unref (tee);
+	dream_metrics_append (out, "gauge", "dream_encoder_bitrate_kbps", "Configured encoder bitrate in kbit/s.", "stream=\"audio\"", p->audioBitrate);
+	dream_metrics_append (out, "gauge", "dream_encoder_bitrate_kbps", NULL, "stream=\"video\"", p->videoBitrate);
+	dream_metrics_append (out, "gauge", "dream_encoder_width", "Configured video width.", NULL, p->width);
+	dream_metrics_append (out, "gauge", "dream_encoder_height", "Configured video height.", NULL, p->height);
+	dream_metrics_append (out, "gauge", "dream_encoder_framerate", "Configured video framerate.", NULL, p->framerate);
+	dream_metrics_append (out, "counter", "dream_keyframe_requests_total", "Keyframes requested by new consumers.", NULL, dream_metrics_get (DREAM_METRIC_KEYFRAME_REQUESTS));
+	dream_metrics_append (out, "counter", "dream_keyframe_requests_sent_total", "Keyframe requests sent to the encoder after rate limiting.", NULL, dream_metrics_get (DREAM_METRIC_KEYFRAME_REQUESTS_SENT));
+	dream_metrics_append_histogram (out, "dream_video_switch_seconds", "Time from a caps change to the first keyframe with the new caps.", DREAM_METRIC_VIDEO_SWITCH_SECONDS);
+	dream_metrics_append_histogram (out, "dream_source_wake_seconds", "Time from restarting idle encoders to their first keyframe.", DREAM_METRIC_SOURCE_WAKE_SECONDS);
+	dream_metrics_append (out, "gauge", "dream_source_idle", "Whether the encoders are paused for lack of outputs.", NULL, g_atomic_int_get (&app->idle.active));
+	{
+		DreamBranchStats b;
+		dream_branch_get_stats (&b);
+		dream_metrics_append (out, "gauge", "dream_branches", "Output branches currently allocated.", NULL, b.live);
+		dream_metrics_append (out, "counter", "dream_branch_attached_total", "Output branches attached to a tee.", NULL, b.attached);
+		dream_metrics_append (out, "counter", "dream_branch_detached_total", "Output branches detached and removed from the pipeline.", NULL, b.detached);
+		dream_metrics_append_histogram (out, "dream_branch_detach_seconds", "Time from a detach request to the branch being out of the pipeline.", DREAM_METRIC_BRANCH_DETACH_SECONDS);
+	}
+	{
+		GArray *threads = dream_thread_policy_snapshot (app->threads);
+		DreamThreadClass cls;
+		for (cls = 0; cls < DREAM_THREAD_CLASS_LAST; cls++)
+		{
+			gint priority;
+			gchar *cpus, *labels = g_strdup_printf ("class=\"%s\"", dream_thread_class_name (cls));
+			dream_thread_policy_get (app->threads, cls, &priority, &cpus);
+			dream_metrics_append (out, "gauge", "dream_thread_priority", cls ? NULL : "SCHED_FIFO priority of a streaming thread class, 0 is normal scheduling.", labels, priority);
+			g_free (labels);
+			g_free (cpus);
+		}
+		for (i = 0; i < threads->len; i++)
+		{
+			DreamThreadStats *t = &g_array_index (threads, DreamThreadStats, i);
+			gchar *labels = g_strdup_printf ("thread=\"%s\",class=\"%s\",tid=\"%d\"", t->name, dream_thread_class_name (t->cls), t->tid);
+			dream_metrics_append (out, "counter", "dream_thread_cpu_seconds_total", i ? NULL : "Time a streaming thread ran on a cpu.", labels, t->run_ns / (gdouble) GST_SECOND);
+			dream_metrics_append (out, "counter", "dream_thread_runqueue_seconds_total", i ? NULL : "Time a streaming thread was runnable but waited for a cpu.", labels, t->wait_ns / (gdouble) GST_SECOND);
+			dream_metrics_append (out, "counter", "dream_thread_timeslices_total", i ? NULL : "Times a streaming thread got a cpu.", labels, t->timeslices);
+			g_free (labels);
+		}
+		g_array_free (threads, TRUE);
+	}
+	{
+		DreamBudgetStats s;
+		GArray *queues = dream_budget_snapshot (app->budget);
+		dream_budget_get_stats (app->budget, &s);
+		dream_metrics_append (out, "gauge", "dream_buffer_budget_bytes", "Bytes shared by the queues of all outputs, 0 if unlimited.", NULL, s.budget);
+		dream_metrics_append (out, "gauge", "dream_buffer_used_bytes", "Bytes queued in all outputs at the last rebalance.", NULL, s.used);
+		dream_metrics_append (out, "gauge", "dream_buffer_pressure", "Used share of the buffering budget.", NULL, s.pressure);
+		dream_metrics_append (out, "counter", "dream_buffer_rebalances_total", "Times the queue limits were redistributed.", NULL, s.rebalances);
+		for (i = 0; i < queues->len; i++)
+		{
+			DreamBudgetQueueStats *q = &g_array_index (queues, DreamBudgetQueueStats, i);
+			gchar *labels = g_strdup_printf ("branch=\"%s\"", q->name);
+			dream_metrics_append (out, "gauge", "dream_buffer_limit_bytes", i ? NULL : "Byte limit currently assigned to a branch queue.", labels, q->limit);
+			g_free (labels);
+		}
+		dream_budget_snapshot_free (queues);
+	}
+	g_mutex_lock (&app->shm.lock);
+	for (i = 0, n = 0; i < SHM_STREAM_LAST; i++)
+	{
+		DreamShmStats s;
+		gchar *labels;
+		if (!app->shm.streams[i].ring)
+			continue;
+		dream_shm_ring_get_stats (app->shm.streams[i].ring, &s);
+		labels = g_strdup_printf ("stream=\"%s\"", shm_stream_names[i]);
+		dream_metrics_append (out, "counter", "dream_shm_bytes_total", n ? NULL : "Payload bytes written to a shared memory ring.", labels, s.bytes);
+		dream_metrics_append (out, "counter", "dream_shm_records_total", n ? NULL : "Records written to a shared memory ring.", labels, s.records);
+		dream_metrics_append (out, "counter", "dream_shm_keyframes_total", n ? NULL : "Keyframes indexed in a shared memory ring.", labels, s.keyframes);
+		dream_metrics_append (out, "counter", "dream_shm_dropped_total", n ? NULL : "Records too large for a shared memory ring.", labels, s.dropped);
+		g_free (labels);
+		n++;
+	}
+	g_mutex_unlock (&app->shm.lock);
+	g_mutex_lock (&app->local.lock);
+	if (app->local.server)
+	{
+		DreamUnixStats s;
+		dream_unix_server_get_stats (app->local.server, &s);
+		dream_metrics_append (out, "gauge", "dream_unix_clients", "Clients streaming from the unix socket.", NULL, s.clients);
+		dream_metrics_append (out, "counter", "dream_unix_bytes_total", "Bytes handed to unix socket clients.", NULL, s.bytes);
+		dream_metrics_append (out, "counter", "dream_unix_batches_total", "Batches written to the unix socket clients.", NULL, s.batches);
+		dream_metrics_append (out, "counter", "dream_unix_segments_total", "Memfd segments created for unix socket clients.", NULL, s.segments);
+		dream_metrics_append (out, "counter", "dream_unix_drops_total", "Times a unix socket client fell behind and was dropped to live.", NULL, s.drops);
+	}
+	g_mutex_unlock (&app->local.lock);
+	g_mutex_lock (&app->timeshift.lock);
+	if (app->timeshift.store)
+	{
+		DreamTimeshiftStats s;
+		dream_timeshift_get_stats (app->timeshift.store, &s);
+		dream_metrics_append (out, "gauge", "dream_timeshift_capacity_bytes", "Size of the timeshift ring.", NULL, s.capacity);
+		dream_metrics_append (out, "counter", "dream_timeshift_written_bytes_total", "Bytes recorded into the timeshift.", NULL, s.written);
+		dream_metrics_append (out, "gauge", "dream_timeshift_window_seconds", "Time span the timeshift can seek back.", NULL, (gdouble) s.window / G_TIME_SPAN_SECOND);
+		dream_metrics_append (out, "counter", "dream_timeshift_writes_total", "Chunks written to the timeshift file.", NULL, s.writes);
+		dream_metrics_append (out, "counter", "dream_timeshift_write_microseconds_total", "Time spent writing timeshift chunks.", NULL, s.write_us);
+		dream_metrics_append (out, "gauge", "dream_timeshift_max_write_microseconds", "Longest timeshift chunk write.", NULL, s.max_write_us);
+		dream_metrics_append (out, "counter", "dream_timeshift_overruns_total", "Reads of timeshift data which was overwritten meanwhile.", NULL, s.overruns);
+	}
+	g_mutex_unlock (&app->timeshift.lock);
+	g_mutex_lock (&app->recording.lock);
+	if (app->recording.recorder)
+	{
+		DreamRecorderStats s;
+		dream_recorder_get_stats (app->recording.recorder, &s);
+		dream_metrics_append (out, "counter", "dream_recording_files_total", "Files started by the recording.", NULL, s.files);
+		dream_metrics_append (out, "counter", "dream_recording_bytes_total", "Bytes written to recording files.", NULL, s.bytes);
+		dream_metrics_append (out, "gauge", "dream_recording_backlog_bytes", "Bytes queued for the recording's disk.", NULL, s.backlog);
+		dream_metrics_append (out, "gauge", "dream_recording_max_backlog_bytes", "Most bytes ever queued for the recording's disk.", NULL, s.max_backlog);
+		dream_metrics_append (out, "counter", "dream_recording_writes_total", "Chunks written to recording files.", NULL, s.writes);
+		dream_metrics_append (out, "counter", "dream_recording_write_microseconds_total", "Time spent writing recording chunks.", NULL, s.write_us);
+		dream_metrics_append (out, "gauge", "dream_recording_max_write_microseconds", "Longest recording chunk write.", NULL, s.max_write_us);
+		dream_metrics_append (out, "counter", "dream_recording_syncs_total", "fdatasync calls on recording files.", NULL, s.syncs);
+		dream_metrics_append (out, "counter", "dream_recording_sync_microseconds_total", "Time spent in fdatasync on recording files.", NULL, s.sync_us);
+		dream_metrics_append (out, "counter", "dream_recording_gaps_total", "Times the recording dropped to the next keyframe.", NULL, s.gaps);
+		dream_metrics_append (out, "counter", "dream_recording_dropped_bytes_total", "Bytes the recording dropped because the disk fell behind.", NULL, s.dropped);
+	}
+	g_mutex_unlock (&app->recording.lock);
+	if (app->arena)
+	{
+		GArray *buckets = dream_arena_snapshot (app->arena);
+		for (i = 0; i < buckets->len; i++)
+		{
+			DreamArenaStats *b = &g_array_index (buckets, DreamArenaStats, i);
+			gchar *labels = b->size ? g_strdup_printf ("bucket=\"%" G_GSIZE_FORMAT "\"", b->size) : g_strdup ("bucket=\"shared\"");
+			dream_metrics_append (out, "counter", "dream_alloc_reused_total", i ? NULL : "Memory blocks served from an arena bucket's free list.", labels, b->reused);
+			dream_metrics_append (out, "counter", "dream_alloc_heap_total", i ? NULL : "Memory blocks an arena bucket had to malloc.", labels, b->allocated);
+			dream_metrics_append (out, "counter", "dream_alloc_released_total", i ? NULL : "Memory blocks freed because an arena bucket's free list was full.", labels, b->released);
+			dream_metrics_append (out, "gauge", "dream_alloc_cached_blocks", i ? NULL : "Memory blocks on an arena bucket's free list.", labels, b->cached);
+			g_free (labels);
+		}
+		g_array_free (buckets, TRUE);
+		dream_metrics_append (out, "counter", "dream_alloc_fallback_total", "Allocations too large or too aligned for the arena.", NULL, dream_arena_get_fallbacks (app->arena));
+	}
+	dream_metrics_append (out, "counter", "dream_video_switch_dropped_buffers_total", "Frames dropped between new caps and the switch keyframe.", NULL, dream_metrics_get (DREAM_METRIC_VIDEO_SWITCH_DROPPED_BUFFERS));
 
-	gst_element_unlink (element, h->hlssink);
+	{
+		DreamRateStats s;
+		static const gchar *quantiles[3] = { "0.5", "0.95", "0.99" };
+		guint i;
+		dream_rate_controller_get_stats (app->rate, &s);
+		dream_metrics_append (out, "gauge", "dream_adaptive_bitrate_enabled", "Whether the content adaptive bitrate controller is active.", NULL, s.enabled);
+		dream_metrics_append (out, "gauge", "dream_adaptive_bitrate_target_kbps", "Video bitrate chosen by the adaptive controller.", NULL, s.target_kbps);
+		dream_metrics_append (out, "counter", "dream_adaptive_bitrate_adjustments_total", "Bitrate changes made by the adaptive controller.", NULL, s.adjustments);
+		dream_metrics_append (out, "gauge", "dream_adaptive_bitrate_saved_kbit_per_hour", "Video kbit per hour saved against running at the envelope maximum.", NULL, s.saved_kbit_per_hour);
+		for (i = 0; i < 3; i++)
+		{
+			gchar *labels = g_strdup_printf ("mode=\"adapted\",quantile=\"%s\"", quantiles[i]);
+			dream_metrics_append (out, "gauge", "dream_adaptive_frame_bytes", i ? NULL : "Encoded video frame size percentiles below and at the envelope maximum.", labels, s.adapted[i]);
+			g_free (labels);
+			labels = g_strdup_printf ("mode=\"ceiling\",quantile=\"%s\"", quantiles[i]);
+			dream_metrics_append (out, "gauge", "dream_adaptive_frame_bytes", NULL, labels, s.ceiling[i]);
+			g_free (labels);
+		}
+	}
 
-	GST_DEBUG_OBJECT(pad, "remove... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+	dream_metrics_append (out, "gauge", "dream_latency_tracing", "Whether video buffers are stamped for latency tracing.", NULL, DREAM_LATENCY_ENABLED () ? 1 : 0);
+	dream_latency_append (out);
 
-	gst_bin_remove_many (GST_BIN (app->pipeline), element, h->hlssink, NULL);
+	dream_metrics_append_process (out);
+	return g_string_free (out, FALSE);
+}
 
-	GST_DEBUG_OBJECT(pad, "set state null %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+static void metrics_soup_callback (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *context, gpointer data)
+{
+	gchar *body;
 
-	gst_element_set_state (h->hlssink, GST_STATE_NULL);
-	gst_element_set_state (element, GST_STATE_NULL);
+	if (msg->method != SOUP_METHOD_GET)
+	{
+		soup_message_set_status (msg, SOUP_STATUS_NOT_IMPLEMENTED);
+		return;
+	}
+	body = metrics_render ((App *) data);
+	soup_message_set_response (msg, "text/plain; version=0.0.4", SOUP_MEMORY_TAKE, body, strlen (body));
+	soup_message_set_status (msg, SOUP_STATUS_OK);
+}
 
-	GST_DEBUG_OBJECT(pad, "unref.... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, h->hlssink);
+/* the separate metrics server only listens on the loopback interface */
+static gboolean metrics_server_setup (gpointer user_data)
+{
+	App *app = user_data;
+#if SOUP_CHECK_VERSION(2,48,0)
+	GError *error = NULL;
+	app->metrics_server = soup_server_new (SOUP_SERVER_SERVER_HEADER, "dreammetrics", NULL);
+	if (!soup_server_listen_local (app->metrics_server, app->metrics_port, 0, &error))
+	{
+		GST_WARNING ("metrics server can't listen on port %u: %s", app->metrics_port, error->message);
+		g_error_free (error);
+	}
+#else
+	SoupAddress *address = soup_address_new ("127.0.0.1", app->metrics_port);
+	soup_address_resolve_sync (address, NULL);
+	app->metrics_server = soup_server_new (SOUP_SERVER_INTERFACE, address, SOUP_SERVER_SERVER_HEADER, "dreammetrics", SOUP_SERVER_ASYNC_CONTEXT, app->http_service.context, NULL);
+	g_object_unref (address);
+	soup_server_run_async (app->metrics_server);
+#endif
+	soup_server_add_handler (app->metrics_server, METRICS_PATH, metrics_soup_callback, app, NULL);
+	GST_INFO ("serving metrics on http://127.0.0.1:%u" METRICS_PATH, app->metrics_port);
+	return G_SOURCE_REMOVE;
+}
 
-	gst_object_unref (element);
-	gst_object_unref (h->hlssink);
+static gboolean metrics_server_teardown (gpointer user_data)
+{
+	App *app = user_data;
+	if (app->metrics_server)
+	{
+		soup_server_disconnect (app->metrics_server);
+		g_object_unref (app->metrics_server);
+		app->metrics_server = NULL;
+	}
+	return G_SOURCE_REMOVE;
+}
+
+static void hls_branch_detached (DreamBranch *branch, gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSserver *h = app->hls_server;
+
+	dream_branch_unref (branch);
+	h->branch = NULL;
 	h->queue = NULL;
 	h->hlssink = NULL;
 
-	if (h->id_timeout)
-		g_source_remove (h->id_timeout);
-
-	if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && g_list_length (app->rtsp_server->clients_list) == 0)
-		halt_source_pipeline(app);
+	if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && g_atomic_int_get (&app->rtsp_server->clients_count) == 0)
+		idle_source_pipeline(app);
 
 	GST_INFO ("HLS server unlinked!");
+}
 
-	return GST_PAD_PROBE_REMOVE;
+gboolean stop_hls_pipeline(App *app)
+{
+	GST_INFO_OBJECT(app, "stop_hls_pipeline");
+	DreamHLSserver *h = app->hls_server;
+	if (h->state == HLS_STATE_RUNNING)
+	{
+		HLS_LOCK (app);
+		h->state = HLS_STATE_IDLE;
+		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_IDLE));
+		if (h->id_timeout)
+			g_source_remove (h->id_timeout);
+		h->id_timeout = 0;
+		dream_budget_remove (app->budget, h->branch);
+		dream_branch_detach (h->branch, hls_branch_detached, app);
+		HLS_UNLOCK (app);
+		GST_INFO("hls server pipeline stopped, set HLS_STATE_IDLE");
+		return TRUE;
+	}
+	else
+		GST_INFO("hls server wasn't in HLS_STATE_RUNNING... can't stop");
+	return FALSE;
+}
+
+gboolean disable_hls_server(App *app)
+{
+	GST_INFO_OBJECT(app, "disable_hls_server");
+	DreamHLSserver *h = app->hls_server;
+	if (h->state == HLS_STATE_RUNNING)
+		stop_hls_pipeline (app);
+	if (h->state == HLS_STATE_IDLE)
+	{
+		/* soup_do_get takes HLS_LOCK on the http thread, don't wait for it while holding the lock */
+		service_thread_call (&app->http_service, soup_server_teardown, app);
+		GFile *tmp_dir_file = g_file_new_for_path (HLS_PATH);
+		_delete_dir_recursively (tmp_dir_file, NULL);
+		g_object_unref (tmp_dir_file);
+		HLS_LOCK (app);
+		h->state = HLS_STATE_DISABLED;
+		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_DISABLED));
+		HLS_UNLOCK (app);
+		GST_INFO("hls soupserver unref'ed, set HLS_STATE_DISABLED");
+		return TRUE;
+	}
+	else
+		GST_INFO("hls server in wrong state... can't disable");
+	return FALSE;
+}
+
+/* a detaching stream is no consumer anymore */
+static gboolean shm_export_active (App *app)
+{
+	guint i;
+
+	for (i = 0; i < SHM_STREAM_LAST; i++)
+		if (app->shm.streams[i].enabled)
+			return TRUE;
+	return FALSE;
 }
 
-gboolean stop_hls_pipeline(App *app)
-{
-	GST_INFO_OBJECT(app, "stop_hls_pipeline");
-	DreamHLSserver *h = app->hls_server;
-	if (h->state == HLS_STATE_RUNNING)
+/* a comma separated list of ts, video and audio */
+static gboolean shm_parse_streams (App *app, const gchar *streams, gboolean *want)
+{
+	gchar **names, **name;
+	gboolean ret = TRUE;
+	guint i;
+
+	names = g_strsplit (streams, ",", -1);
+	for (name = names; *name && ret; name++)
+	{
+		for (i = 0; i < SHM_STREAM_LAST && g_strcmp0 (g_strstrip (*name), shm_stream_names[i]); i++);
+		if (i == SHM_STREAM_LAST)
+		{
+			GST_WARNING_OBJECT (app, "unknown shared memory stream '%s'", *name);
+			ret = FALSE;
+		}
+		else
+			want[i] = TRUE;
+	}
+	g_strfreev (names);
+	return ret;
+}
+
+/* runs on the stream's streaming thread, the ring lives until the branch
+ * is detached */
+static GstFlowReturn shm_handover (GstElement *appsink, gpointer user_data)
+{
+	DreamShmStream *s = user_data;
+	GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink));
+	GstBuffer *buffer = gst_sample_get_buffer (sample);
+	GstCaps *caps = gst_sample_get_caps (sample);
+	guint32 flags = 0;
+	GstMapInfo map;
+
+	if (caps && caps != s->caps)
+	{
+		gchar *str = gst_caps_to_string (caps);
+		gst_caps_replace (&s->caps, caps);
+		dream_shm_ring_set_caps (s->ring, str);
+		g_free (str);
+	}
+	if (!GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		flags |= DREAM_SHM_FLAG_KEYFRAME;
+	if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DISCONT))
+		flags |= DREAM_SHM_FLAG_DISCONT;
+	if (gst_buffer_map (buffer, &map, GST_MAP_READ))
+	{
+		dream_shm_ring_write (s->ring, map.data, map.size, flags, GST_BUFFER_PTS (buffer), GST_BUFFER_DTS (buffer));
+		gst_buffer_unmap (buffer, &map);
+	}
+	gst_sample_unref (sample);
+	return GST_FLOW_OK;
+}
+
+static void shm_branch_detached (DreamBranch *branch, gpointer user_data)
+{
+	App *app = user_data;
+	guint i;
+
+	g_mutex_lock (&app->shm.lock);
+	for (i = 0; i < SHM_STREAM_LAST; i++)
+	{
+		DreamShmStream *s = &app->shm.streams[i];
+		if (s->branch != branch)
+			continue;
+		dream_shm_ring_free (s->ring);
+		gst_caps_replace (&s->caps, NULL);
+		s->ring = NULL;
+		s->branch = NULL;
+		s->queue = s->appsink = NULL;
+	}
+	g_mutex_unlock (&app->shm.lock);
+	dream_branch_unref (branch);
+
+	if (!shm_export_active (app))
+		idle_source_pipeline (app);
+	GST_INFO ("shared memory stream unlinked!");
+}
+
+/* empty streams means ts. readers open DREAM_SHM_PREFIX followed by the
+ * stream's name */
+gboolean enable_shm_export(App *app, const gchar *streams)
+{
+	gboolean want[SHM_STREAM_LAST] = { FALSE, };
+	gboolean attached = FALSE, ret = TRUE;
+	guint i;
+
+	GST_DEBUG_OBJECT (app, "enable_shm_export streams=%s", streams);
+	if (!shm_parse_streams (app, *streams ? streams : "ts", want))
+		return FALSE;
+
+	if (want[SHM_STREAM_TS])
+		assert_tsmux (app);
+	wake_source_pipeline (app);
+
+	for (i = 0; i < SHM_STREAM_LAST; i++)
+	{
+		DreamShmStream *s = &app->shm.streams[i];
+		GstElement *tee = i == SHM_STREAM_TS ? app->tstee : i == SHM_STREAM_VIDEO ? app->vtee : app->atee;
+		DreamShmRing *ring;
+		gchar *name;
+
+		if (!want[i] || s->enabled)
+			continue;
+		if (s->branch)
+		{
+			GST_INFO_OBJECT (app, "previous shared memory %s branch is still being detached", shm_stream_names[i]);
+			ret = FALSE;
+			continue;
+		}
+		name = g_strconcat (DREAM_SHM_PREFIX, shm_stream_names[i], NULL);
+		ring = dream_shm_ring_new (name, i == SHM_STREAM_AUDIO ? SHM_AUDIO_SIZE : app->shm.size);
+		g_free (name);
+		if (!ring)
+		{
+			ret = FALSE;
+			continue;
+		}
+
+		name = g_strdup_printf ("shm%s", shm_stream_names[i]);
+		s->queue = gst_element_factory_make ("queue", NULL);
+		s->appsink = gst_element_factory_make ("appsink", NULL);
+		g_object_set (G_OBJECT (s->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
+		/* readers pace themselves */
+		g_object_set (G_OBJECT (s->appsink), "emit-signals", TRUE, "enable-last-sample", FALSE, "sync", FALSE, NULL);
+		g_signal_connect (s->appsink, "new-sample", G_CALLBACK (shm_handover), s);
+		g_mutex_lock (&app->shm.lock);
+		s->ring = ring;
+		s->branch = dream_branch_new (name, s->queue, s->appsink);
+		g_mutex_unlock (&app->shm.lock);
+		g_free (name);
+		if (!dream_branch_attach (s->branch, GST_BIN (app->pipeline), tee))
+		{
+			g_mutex_lock (&app->shm.lock);
+			dream_branch_unref (s->branch);
+			dream_shm_ring_free (s->ring);
+			s->branch = NULL;
+			s->ring = NULL;
+			s->queue = s->appsink = NULL;
+			g_mutex_unlock (&app->shm.lock);
+			ret = FALSE;
+			continue;
+		}
+		dream_budget_add (app->budget, s->branch, BUDGET_WEIGHT_SHM);
+		s->enabled = TRUE;
+		attached = TRUE;
+	}
+	if (!attached)
+	{
+		if (!shm_export_active (app))
+			idle_source_pipeline (app);
+		return ret;
+	}
+
+	if (app->tcp_upstream->state == UPSTREAM_STATE_WAITING)
+		unpause_source_pipeline(app);
+	request_keyframe (app, "shm");
+	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+	{
+		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for shared memory export");
+		return FALSE;
+	}
+	return ret;
+}
+
+/* empty streams means all of them */
+gboolean disable_shm_export(App *app, const gchar *streams)
+{
+	gboolean want[SHM_STREAM_LAST] = { FALSE, };
+	gboolean ret = FALSE;
+	guint i;
+
+	GST_DEBUG_OBJECT (app, "disable_shm_export streams=%s", streams);
+	if (!shm_parse_streams (app, *streams ? streams : "ts,video,audio", want))
+		return FALSE;
+	for (i = 0; i < SHM_STREAM_LAST; i++)
+	{
+		DreamShmStream *s = &app->shm.streams[i];
+		if (!want[i] || !s->enabled)
+			continue;
+		s->enabled = FALSE;
+		dream_budget_remove (app->budget, s->branch);
+		dream_branch_detach (s->branch, shm_branch_detached, app);
+		ret = TRUE;
+	}
+	return ret;
+}
+
+/* an enabled socket without clients lets the encoders idle */
+static gboolean unix_output_active (App *app)
+{
+	return app->local.enabled && g_atomic_int_get (&app->local.clients) > 0;
+}
+
+static gboolean unix_clients_joined (gpointer user_data)
+{
+	App *app = user_data;
+
+	if (!unix_output_active (app))
+		return G_SOURCE_REMOVE;
+	wake_source_pipeline (app);
+	/* a client starting at a keyframe shouldn't wait a whole GOP */
+	request_keyframe (app, "unix");
+	return G_SOURCE_REMOVE;
+}
+
+/* runs on the unix service thread or the branch's streaming thread */
+static void unix_clients_changed (DreamUnixServer *server, guint clients, gpointer user_data)
+{
+	App *app = user_data;
+	guint before = g_atomic_int_get (&app->local.clients);
+
+	g_atomic_int_set (&app->local.clients, clients);
+	GST_DEBUG_OBJECT (app, "unix socket clients %u -> %u", before, clients);
+	if (clients > before)
+		g_main_context_invoke (NULL, unix_clients_joined, app);
+	else if (!clients && !source_has_consumers (app))
+		idle_source_pipeline (app);
+}
+
+static GstFlowReturn unix_handover (GstElement *appsink, gpointer user_data)
+{
+	DreamUnixServer *server = user_data;
+	GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink));
+
+	dream_unix_server_push (server, gst_sample_get_buffer (sample));
+	gst_sample_unref (sample);
+	return GST_FLOW_OK;
+}
+
+static gboolean unix_server_close (gpointer user_data)
+{
+	dream_unix_server_close (user_data);
+	return G_SOURCE_REMOVE;
+}
+
+static void unix_branch_detached (DreamBranch *branch, gpointer user_data)
+{
+	App *app = user_data;
+
+	g_mutex_lock (&app->local.lock);
+	dream_unix_server_free (app->local.server);
+	app->local.server = NULL;
+	app->local.branch = NULL;
+	app->local.queue = app->local.appsink = NULL;
+	g_mutex_unlock (&app->local.lock);
+	dream_branch_unref (branch);
+
+	if (!source_has_consumers (app))
+		idle_source_pipeline (app);
+	GST_INFO ("unix socket branch unlinked!");
+}
+
+/* the branch stays attached while the socket is enabled, the encoders
+ * follow the clients. empty path means DEFAULT_UNIX_SOCKET_PATH */
+gboolean enable_unix_output(App *app, const gchar *path)
+{
+	DreamUnixOutput *u = &app->local;
+	DreamUnixServer *server;
+
+	GST_DEBUG_OBJECT (app, "enable_unix_output path=%s", path);
+	if (u->enabled)
+	{
+		GST_INFO_OBJECT (app, "unix socket already enabled on %s", dream_unix_server_get_path (u->server));
+		return FALSE;
+	}
+	if (u->branch)
+	{
+		GST_INFO_OBJECT (app, "previous unix socket branch is still being detached");
+		return FALSE;
+	}
+	server = dream_unix_server_new (app->local_service.context, unix_clients_changed, app);
+	if (!dream_unix_server_listen (server, *path ? path : DEFAULT_UNIX_SOCKET_PATH))
+	{
+		dream_unix_server_free (server);
+		return FALSE;
+	}
+
+	assert_tsmux (app);
+	u->queue = gst_element_factory_make ("queue", NULL);
+	u->appsink = gst_element_factory_make ("appsink", NULL);
+	g_object_set (G_OBJECT (u->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
+	/* slow clients are dropped to live by the server, never waited for */
+	g_object_set (G_OBJECT (u->appsink), "emit-signals", TRUE, "enable-last-sample", FALSE, "sync", FALSE, NULL);
+	g_signal_connect (u->appsink, "new-sample", G_CALLBACK (unix_handover), server);
+	g_mutex_lock (&u->lock);
+	u->server = server;
+	u->branch = dream_branch_new ("unix", u->queue, u->appsink);
+	g_mutex_unlock (&u->lock);
+	if (!dream_branch_attach (u->branch, GST_BIN (app->pipeline), app->tstee))
+	{
+		service_thread_call (&app->local_service, unix_server_close, server);
+		g_mutex_lock (&u->lock);
+		dream_branch_unref (u->branch);
+		dream_unix_server_free (u->server);
+		u->server = NULL;
+		u->branch = NULL;
+		u->queue = u->appsink = NULL;
+		g_mutex_unlock (&u->lock);
+		return FALSE;
+	}
+	dream_budget_add (app->budget, u->branch, BUDGET_WEIGHT_UNIX);
+	u->enabled = TRUE;
+
+	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+	{
+		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for unix socket output");
+		return FALSE;
+	}
+	if (!source_has_consumers (app))
+		idle_source_pipeline (app);
+	return TRUE;
+}
+
+gboolean disable_unix_output(App *app)
+{
+	DreamUnixOutput *u = &app->local;
+
+	GST_DEBUG_OBJECT (app, "disable_unix_output");
+	if (!u->enabled)
+		return FALSE;
+	u->enabled = FALSE;
+	/* the clients are gone before the branch, nothing waits for them */
+	service_thread_call (&app->local_service, unix_server_close, u->server);
+	g_atomic_int_set (&u->clients, 0);
+	dream_budget_remove (app->budget, u->branch);
+	dream_branch_detach (u->branch, unix_branch_detached, app);
+	return TRUE;
+}
+
+static GstFlowReturn timeshift_handover (GstElement *appsink, gpointer user_data)
+{
+	DreamTimeshift *store = user_data;
+	GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink));
+
+	dream_timeshift_write (store, gst_sample_get_buffer (sample));
+	gst_sample_unref (sample);
+	return GST_FLOW_OK;
+}
+
+static void timeshift_branch_detached (DreamBranch *branch, gpointer user_data)
+{
+	App *app = user_data;
+	DreamTimeshift *store;
+
+	g_mutex_lock (&app->timeshift.lock);
+	store = app->timeshift.store;
+	app->timeshift.store = NULL;
+	app->timeshift.branch = NULL;
+	app->timeshift.queue = app->timeshift.appsink = NULL;
+	g_mutex_unlock (&app->timeshift.lock);
+	/* players still reading the window keep their own references */
+	dream_timeshift_unref (store);
+	dream_branch_unref (branch);
+
+	if (!source_has_consumers (app))
+		idle_source_pipeline (app);
+	GST_INFO ("timeshift branch unlinked!");
+}
+
+/* empty directory means DEFAULT_TIMESHIFT_DIRECTORY, 0 megabytes DEFAULT_TIMESHIFT_MB.
+ * the store records from now on, the window grows until it wraps */
+gboolean enable_timeshift(App *app, const gchar *directory, guint megabytes)
+{
+	DreamTimeshiftOutput *t = &app->timeshift;
+	DreamTimeshift *store;
+
+	GST_DEBUG_OBJECT (app, "enable_timeshift directory=%s megabytes=%u", directory, megabytes);
+	if (t->enabled)
+	{
+		GST_INFO_OBJECT (app, "timeshift already enabled in %s", dream_timeshift_get_directory (t->store));
+		return FALSE;
+	}
+	if (t->branch)
+	{
+		GST_INFO_OBJECT (app, "previous timeshift branch is still being detached");
+		return FALSE;
+	}
+	if (megabytes > TIMESHIFT_MAX_MB)
+	{
+		GST_WARNING_OBJECT (app, "timeshift of %u MB exceeds the maximum of %u MB", megabytes, TIMESHIFT_MAX_MB);
+		return FALSE;
+	}
+	store = dream_timeshift_new (*directory ? directory : DEFAULT_TIMESHIFT_DIRECTORY, (guint64) (megabytes ? megabytes : DEFAULT_TIMESHIFT_MB) * 1024 * 1024);
+	if (!store)
+		return FALSE;
+
+	assert_tsmux (app);
+	t->queue = gst_element_factory_make ("queue", NULL);
+	t->appsink = gst_element_factory_make ("appsink", NULL);
+	/* a slow disk loses data here, the live outputs never wait for it */
+	g_object_set (G_OBJECT (t->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
+	g_object_set (G_OBJECT (t->appsink), "emit-signals", TRUE, "enable-last-sample", FALSE, "sync", FALSE, NULL);
+	g_signal_connect (t->appsink, "new-sample", G_CALLBACK (timeshift_handover), store);
+	g_mutex_lock (&t->lock);
+	t->store = store;
+	t->branch = dream_branch_new ("timeshift", t->queue, t->appsink);
+	g_mutex_unlock (&t->lock);
+	if (!dream_branch_attach (t->branch, GST_BIN (app->pipeline), app->tstee))
+	{
+		g_mutex_lock (&t->lock);
+		dream_branch_unref (t->branch);
+		t->store = NULL;
+		t->branch = NULL;
+		t->queue = t->appsink = NULL;
+		g_mutex_unlock (&t->lock);
+		dream_timeshift_unref (store);
+		return FALSE;
+	}
+	dream_budget_add (app->budget, t->branch, BUDGET_WEIGHT_TIMESHIFT);
+	t->enabled = TRUE;
+
+	wake_source_pipeline (app);
+	/* the window starts with a keyframe instead of a GOP nobody can seek to */
+	request_keyframe (app, "timeshift");
+	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
+	{
+		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for timeshift");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+gboolean disable_timeshift(App *app)
+{
+	DreamTimeshiftOutput *t = &app->timeshift;
+
+	GST_DEBUG_OBJECT (app, "disable_timeshift");
+	if (!t->enabled)
+		return FALSE;
+	t->enabled = FALSE;
+	/* players play out what's left and end */
+	dream_timeshift_close (t->store);
+	dream_budget_remove (app->budget, t->branch);
+	dream_branch_detach (t->branch, timeshift_branch_detached, app);
+	return TRUE;
+}
+
+static GstFlowReturn recording_handover (GstElement *appsink, gpointer user_data)
+{
+	DreamRecorder *recorder = user_data;
+	GstSample *sample = gst_app_sink_pull_sample (GST_APP_SINK (appsink));
+
+	dream_recorder_push (recorder, gst_sample_get_buffer (sample));
+	gst_sample_unref (sample);
+	return GST_FLOW_OK;
+}
+
+static void recording_stopped (DreamRecorder *recorder, gpointer user_data)
+{
+	App *app = user_data;
+
+	g_mutex_lock (&app->recording.lock);
+	app->recording.stopping = NULL;
+	g_mutex_unlock (&app->recording.lock);
+	dream_recorder_free (recorder);
+	GST_INFO ("recording stopped");
+}
+
+/* the disk is full or gone, the recorder gave up */
+static void recording_failed (DreamRecorder *recorder, gpointer user_data)
+{
+	App *app = user_data;
+	gchar *error = dream_recorder_get_error (recorder);
+
+	send_signal (app, "recordingError", g_variant_new ("(ss)", dream_recorder_get_directory (recorder), error));
+	g_free (error);
+	/* unless it is being stopped already */
+	if (recorder == app->recording.recorder)
+		disable_recording (app);
+}
+
+static void recording_branch_detached (DreamBranch *branch, gpointer user_data)
+{
+	App *app = user_data;
+	DreamRecorder *recorder;
+
+	g_mutex_lock (&app->recording.lock);
+	recorder = app->recording.recorder;
+	app->recording.recorder = NULL;
+	app->recording.stopping = recorder;
+	app->recording.branch = NULL;
+	app->recording.queue = app->recording.appsink = NULL;
+	g_mutex_unlock (&app->recording.lock);
+	/* the last buffers were queued, the recorder's thread writes them out
+	 * while the control context goes on */
+	dream_recorder_stop (recorder, recording_stopped, app);
+	dream_branch_unref (branch);
+
+	if (!source_has_consumers (app))
+		idle_source_pipeline (app);
+	GST_INFO ("recording branch unlinked!");
+}
+
+/* empty directory means DEFAULT_RECORD_DIRECTORY. the recorder queues the
+ * stream for its own i/o thread, the branch's queue only covers the handover */
+gboolean enable_recording(App *app, const gchar *directory, guint megabytes, guint seconds)
+{
+	DreamRecordingOutput *r = &app->recording;
+	DreamRecorder *recorder;
+
+	GST_DEBUG_OBJECT (app, "enable_recording directory=%s megabytes=%u seconds=%u", directory, megabytes, seconds);
+	if (r->enabled)
+	{
+		GST_INFO_OBJECT (app, "already recording to %s", dream_recorder_get_directory (r->recorder));
+		return FALSE;
+	}
+	if (r->branch)
+	{
+		GST_INFO_OBJECT (app, "previous recording branch is still being detached");
+		return FALSE;
+	}
+	if (r->stopping)
+	{
+		GST_INFO_OBJECT (app, "previous recording is still being written out");
+		return FALSE;
+	}
+	recorder = dream_recorder_new (*directory ? directory : DEFAULT_RECORD_DIRECTORY, (guint64) (megabytes ? megabytes : DEFAULT_RECORD_MAX_MB) * 1024 * 1024, (gint64) seconds * G_TIME_SPAN_SECOND, recording_failed, app);
+	if (!recorder)
+		return FALSE;
+
+	assert_tsmux (app);
+	r->queue = gst_element_factory_make ("queue", NULL);
+	r->appsink = gst_element_factory_make ("appsink", NULL);
+	g_object_set (G_OBJECT (r->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
+	g_object_set (G_OBJECT (r->appsink), "emit-signals", TRUE, "enable-last-sample", FALSE, "sync", FALSE, NULL);
+	g_signal_connect (r->appsink, "new-sample", G_CALLBACK (recording_handover), recorder);
+	g_mutex_lock (&r->lock);
+	r->recorder = recorder;
+	r->branch = dream_branch_new ("recording", r->queue, r->appsink);
+	g_mutex_unlock (&r->lock);
+	if (!dream_branch_attach (r->branch, GST_BIN (app->pipeline), app->tstee))
+	{
+		g_mutex_lock (&r->lock);
+		dream_branch_unref (r->branch);
+		r->recorder = NULL;
+		r->branch = NULL;
+		r->queue = r->appsink = NULL;
+		g_mutex_unlock (&r->lock);
+		dream_recorder_free (recorder);
+		return FALSE;
+	}
+	dream_budget_add (app->budget, r->branch, BUDGET_WEIGHT_RECORDING);
+	r->enabled = TRUE;
+
+	wake_source_pipeline (app);
+	/* the first file starts with the next keyframe */
+	request_keyframe (app, "recording");
+	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
 	{
-		DREAMRTSPSERVER_LOCK (app);
-		h->state = HLS_STATE_IDLE;
-		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_IDLE));
-		gst_object_ref (h->queue);
-		gst_object_ref (h->hlssink);
-		GstPad *sinkpad;
-		sinkpad = gst_element_get_static_pad (h->queue, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, hls_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-		DREAMRTSPSERVER_UNLOCK (app);
-		GST_INFO("hls server pipeline stopped, set HLS_STATE_IDLE");
-		return TRUE;
+		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for recording");
+		return FALSE;
 	}
-	else
-		GST_INFO("hls server wasn't in HLS_STATE_RUNNING... can't stop");
-	return FALSE;
+	return TRUE;
 }
 
-gboolean disable_hls_server(App *app)
+gboolean disable_recording(App *app)
 {
-	GST_INFO_OBJECT(app, "disable_hls_server");
-	DreamHLSserver *h = app->hls_server;
-	if (h->state == HLS_STATE_RUNNING)
-		stop_hls_pipeline (app);
-	if (h->state == HLS_STATE_IDLE)
-	{
-		DREAMRTSPSERVER_LOCK (app);
-		soup_server_disconnect(h->soupserver);
-		if (h->soupauthdomain)
-		{
-			g_object_unref (h->soupauthdomain);
-			g_free(h->hls_user);
-			g_free(h->hls_pass);
-		}
-		g_object_unref (h->soupserver);
-		GFile *tmp_dir_file = g_file_new_for_path (HLS_PATH);
-		_delete_dir_recursively (tmp_dir_file, NULL);
-		g_object_unref (tmp_dir_file);
-		h->state = HLS_STATE_DISABLED;
-		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_DISABLED));
-		DREAMRTSPSERVER_UNLOCK (app);
-		GST_INFO("hls soupserver unref'ed, set HLS_STATE_DISABLED");
-		return TRUE;
-	}
-	else
-		GST_INFO("hls server in wrong state... can't disable");
-	return FALSE;
+	DreamRecordingOutput *r = &app->recording;
+
+	GST_DEBUG_OBJECT (app, "disable_recording");
+	if (!r->enabled)
+		return FALSE;
+	r->enabled = FALSE;
+	dream_budget_remove (app->budget, r->branch);
+	dream_branch_detach (r->branch, recording_branch_detached, app);
+	return TRUE;
 }
 
 #if 0
@@ -1982,6 +4597,50 @@ static GstPadProbeReturn _detect_keyframes_probe (GstPad * pad, GstPadProbeInfo
 }
 #endif
 
+/* soup isn't thread safe, the server is only touched from the http thread */
+static gboolean soup_server_setup (gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSserver *h = app->hls_server;
+#if SOUP_CHECK_VERSION(2,48,0)
+	h->soupserver = soup_server_new (SOUP_SERVER_SERVER_HEADER, "dreamhttplive", NULL);
+	soup_server_listen_all(h->soupserver, h->port, 0, NULL);
+#else
+	h->soupserver = soup_server_new (SOUP_SERVER_PORT, h->port, SOUP_SERVER_SERVER_HEADER, "dreamhttplive", SOUP_SERVER_ASYNC_CONTEXT, app->http_service.context, NULL);
+	soup_server_run_async (h->soupserver);
+#endif
+	soup_server_add_handler (h->soupserver, NULL, soup_server_callback, app, NULL);
+	if (h->hls_user)
+	{
+		h->soupauthdomain = soup_auth_domain_basic_new (
+		SOUP_AUTH_DOMAIN_REALM, "Dreambox HLS Server",
+		SOUP_AUTH_DOMAIN_BASIC_AUTH_CALLBACK, soup_server_auth_callback,
+		SOUP_AUTH_DOMAIN_BASIC_AUTH_DATA, app,
+		SOUP_AUTH_DOMAIN_ADD_PATH, "",
+		NULL);
+		soup_server_add_auth_domain (h->soupserver, h->soupauthdomain);
+	}
+	else
+		h->soupauthdomain = NULL;
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean soup_server_teardown (gpointer user_data)
+{
+	App *app = user_data;
+	DreamHLSserver *h = app->hls_server;
+	soup_server_disconnect(h->soupserver);
+	if (h->soupauthdomain)
+	{
+		g_object_unref (h->soupauthdomain);
+		g_free(h->hls_user);
+		g_free(h->hls_pass);
+	}
+	g_object_unref (h->soupserver);
+	h->soupserver = NULL;
+	return G_SOURCE_REMOVE;
+}
+
 gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar *pass)
 {
 	GST_INFO_OBJECT(app, "enable_hls_server port=%i user=%s pass=%s", port, user, pass);
@@ -1991,7 +4650,7 @@ gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar
 		return FALSE;
 	}
 
-	DREAMRTSPSERVER_LOCK (app);
+	HLS_LOCK (app);
 	DreamHLSserver *h = app->hls_server;
 
 	if (h->state == HLS_STATE_DISABLED)
@@ -2005,33 +4664,20 @@ gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar
 
 		h->port = port;
 
-#if SOUP_CHECK_VERSION(2,48,0)
-		h->soupserver = soup_server_new (SOUP_SERVER_SERVER_HEADER, "dreamhttplive", NULL);
-		soup_server_listen_all(h->soupserver, port, 0, NULL);
-#else
-		h->soupserver = soup_server_new (SOUP_SERVER_PORT, h->port, SOUP_SERVER_SERVER_HEADER, "dreamhttplive", NULL);
-		soup_server_run_async (h->soupserver);
-#endif
-		soup_server_add_handler (h->soupserver, NULL, soup_server_callback, app, NULL);
-
 		gchar *credentials = g_strdup("");
 		if (strlen(user)) {
 			h->hls_user = g_strdup(user);
 			h->hls_pass = g_strdup(pass);
-			h->soupauthdomain = soup_auth_domain_basic_new (
-			SOUP_AUTH_DOMAIN_REALM, "Dreambox HLS Server",
-			SOUP_AUTH_DOMAIN_BASIC_AUTH_CALLBACK, soup_server_auth_callback,
-			SOUP_AUTH_DOMAIN_BASIC_AUTH_DATA, app,
-			SOUP_AUTH_DOMAIN_ADD_PATH, "",
-			NULL);
-			soup_server_add_auth_domain (h->soupserver, h->soupauthdomain);
+			g_free (credentials);
 			credentials = g_strdup_printf("%s:%s@", user, pass);
 		}
 		else
-		{
 			h->hls_user = h->hls_pass = NULL;
-			h->soupauthdomain = NULL;
-		}
+
+		/* the http thread may need HLS_LOCK to finish what it's doing */
+		HLS_UNLOCK (app);
+		service_thread_call (&app->http_service, soup_server_setup, app);
+		HLS_LOCK (app);
 
 #if SOUP_CHECK_VERSION(2,48,0)
 		GSList *uris = soup_server_get_uris(h->soupserver);
@@ -2050,21 +4696,44 @@ gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar
 		send_signal (app, "hlsStateChanged", g_variant_new("(i)", HLS_STATE_IDLE));
 		GST_DEBUG ("set HLS_STATE_IDLE");
 		g_free (credentials);
-		DREAMRTSPSERVER_UNLOCK (app);
+		HLS_UNLOCK (app);
 		return TRUE;
 	}
 	else
 		GST_INFO_OBJECT (app, "HLS server already enabled!");
-	DREAMRTSPSERVER_UNLOCK (app);
+	HLS_UNLOCK (app);
 	return FALSE;
 
 fail:
-	DREAMRTSPSERVER_UNLOCK (app);
+	HLS_UNLOCK (app);
 	disable_hls_server(app);
 	return FALSE;
 
 }
 
+/* mpegtsmux turns the switch's force-key-unit into one of its own with the
+ * keyframe's running time, the first one at or after the switch is it. the
+ * marker travels the bus in order with hlssink's fragment messages */
+static GstPadProbeReturn hls_switch_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+	const GstStructure *s = gst_event_get_structure (event);
+	guint64 switch_time = __atomic_load_n (&app->video_switch.hls_switch_time, __ATOMIC_RELAXED);
+	guint64 running_time;
+
+	if (GST_EVENT_TYPE (event) != GST_EVENT_CUSTOM_DOWNSTREAM || !gst_structure_has_name (s, "GstForceKeyUnit") || !GST_CLOCK_TIME_IS_VALID (switch_time))
+		return GST_PAD_PROBE_OK;
+	if (!gst_structure_get_uint64 (s, "running-time", &running_time) || running_time < switch_time)
+		return GST_PAD_PROBE_OK;
+	if (!__atomic_compare_exchange_n (&app->video_switch.hls_switch_time, &switch_time, GST_CLOCK_TIME_NONE, FALSE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		return GST_PAD_PROBE_OK;
+	GST_DEBUG_OBJECT (pad, "video switch key unit at %" GST_TIME_FORMAT " reached hlssink", GST_TIME_ARGS (running_time));
+	gst_element_post_message (GST_ELEMENT (GST_OBJECT_PARENT (pad)), gst_message_new_element (GST_OBJECT_PARENT (pad), gst_structure_new_empty ("DreamHLSDiscontinuity")));
+	return GST_PAD_PROBE_OK;
+}
+
+/* called with HLS_LOCK held */
 gboolean start_hls_pipeline(App* app)
 {
 	GST_DEBUG_OBJECT (app, "start_hls_pipeline");
@@ -2075,8 +4744,20 @@ gboolean start_hls_pipeline(App* app)
 		GST_ERROR_OBJECT (app, "failed to start hls pipeline because hls server is not enabled!");
 		return FALSE;
 	}
+	if (h->branch)
+	{
+		GST_INFO_OBJECT (app, "previous hls branch is still being detached");
+		return FALSE;
+	}
 
 	assert_tsmux (app);
+	wake_source_pipeline (app);
+
+	/* hlssink counts its fragments from 0 again */
+	g_array_set_size (h->discontinuities, 0);
+	h->discontinuity_sequence = 0;
+	h->discontinuity_marked = FALSE;
+	__atomic_store_n (&app->video_switch.hls_switch_time, GST_CLOCK_TIME_NONE, __ATOMIC_RELAXED);
 
 	h->queue = gst_element_factory_make ("queue", "hlsqueue");
 	h->hlssink = gst_element_factory_make ("hlssink", "hlssink");
@@ -2095,30 +4776,26 @@ gboolean start_hls_pipeline(App* app)
 	g_object_set (G_OBJECT (h->hlssink), "playlist-location", playlist_location, NULL);
 	g_object_set (G_OBJECT (h->queue), "leaky", 2, "max-size-buffers", 0, "max-size-bytes", 0, "max-size-time", G_GINT64_CONSTANT(5)*GST_SECOND, NULL);
 
-	gst_bin_add_many (GST_BIN (app->pipeline), h->queue, h->hlssink,  NULL);
-	gst_element_link (h->queue, h->hlssink);
-
-	if (!assert_state (app, h->hlssink, GST_STATE_READY) || !assert_state (app, h->queue, GST_STATE_PLAYING))
-		return FALSE;
-
-	GstPad *teepad, *sinkpad;
-	GstPadLinkReturn ret;
-	teepad = gst_element_get_request_pad (app->tstee, "src_%u");
-	sinkpad = gst_element_get_static_pad (h->queue, "sink");
-	ret = gst_pad_link (teepad, sinkpad);
-	if (ret != GST_PAD_LINK_OK)
+	h->branch = dream_branch_new ("hls", h->queue, h->hlssink);
+	dream_thread_policy_tag (h->queue, DREAM_THREAD_HLS);
+	GstPad *srcpad = gst_element_get_static_pad (h->queue, "src");
+	gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM, hls_switch_probe, app, NULL);
+	gst_object_unref (srcpad);
+	if (!dream_branch_attach (h->branch, GST_BIN (app->pipeline), app->tstee))
 	{
-		GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
+		dream_branch_unref (h->branch);
+		h->branch = NULL;
+		h->queue = h->hlssink = NULL;
 		return FALSE;
 	}
-	gst_object_unref (teepad);
-	gst_object_unref (sinkpad);
+	dream_budget_add (app->budget, h->branch, BUDGET_WEIGHT_HLS);
 
 	if (app->tcp_upstream->state == UPSTREAM_STATE_WAITING)
 		unpause_source_pipeline(app);
 
 	GstStateChangeReturn sret = gst_element_set_state (h->hlssink, GST_STATE_PLAYING);
 	GST_DEBUG_OBJECT(app, "explicitely bring hlssink to GST_STATE_PLAYING = %i", sret);
+	request_keyframe (app, "hls");
 
 	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
 	{
@@ -2137,19 +4814,79 @@ DreamHLSserver *create_hls_server(App *app)
 	h->state = HLS_STATE_DISABLED;
 	h->queue = NULL;
 	h->hlssink = NULL;
+	h->branch = NULL;
+	h->soupserver = NULL;
+	h->id_timeout = 0;
+	h->starting = FALSE;
+	h->discontinuities = g_array_new (FALSE, FALSE, sizeof (guint));
+	h->discontinuity_sequence = 0;
+	h->discontinuity_marked = FALSE;
 	return h;
 }
 
+#define TIMESHIFT_PLAYER_KEY "dream-timeshift-player"
+
+static void timeshift_media_unprepared (GstRTSPMedia *media, gpointer user_data)
+{
+	g_object_set_data (G_OBJECT (media), TIMESHIFT_PLAYER_KEY, NULL);
+}
+
+/* every client gets its own media and player, so each one seeks on its own.
+ * a player keeps the store alive after the timeshift got disabled */
+static void timeshift_media_configure (GstRTSPMediaFactory * factory, GstRTSPMedia * media, gpointer user_data)
+{
+	App *app = user_data;
+	GstElement *element = gst_rtsp_media_get_element (media);
+	GstElement *appsrc = gst_bin_get_by_name_recurse_up (GST_BIN (element), TIMESHIFT_APPSRC);
+	DreamTimeshiftPlayer *player = NULL;
+
+	g_mutex_lock (&app->timeshift.lock);
+	if (app->timeshift.enabled && app->timeshift.store)
+		player = dream_timeshift_player_new (app->timeshift.store, appsrc);
+	g_mutex_unlock (&app->timeshift.lock);
+	if (player)
+	{
+		g_object_set_data_full (G_OBJECT (media), TIMESHIFT_PLAYER_KEY, player, (GDestroyNotify) dream_timeshift_player_free);
+		g_signal_connect (media, "unprepared", (GCallback) timeshift_media_unprepared, app);
+		GST_INFO_OBJECT (app, "timeshift media configured");
+	}
+	else
+	{
+		GST_WARNING_OBJECT (app, "timeshift requested but not enabled");
+		gst_app_src_end_of_stream (GST_APP_SRC (appsrc));
+	}
+	gst_object_unref (appsrc);
+	gst_object_unref (element);
+}
+
 DreamRTSPserver *create_rtsp_server(App *app)
 {
 	DreamRTSPserver *r = malloc(sizeof(DreamRTSPserver));
 	send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_DISABLED));
 	r->state = RTSP_STATE_DISABLED;
 	r->server = NULL;
-	r->ts_factory = r->es_factory = NULL;
+	r->ts_factory = r->es_factory = r->timeshift_factory = NULL;
 	r->ts_media = r->es_media = NULL;
 	r->ts_appsrc = r->es_aappsrc = r->es_vappsrc = NULL;
+	r->artspq = r->vrtspq = r->tsrtspq = NULL;
+	r->aappsink = r->vappsink = r->tsappsink = NULL;
+	r->abranch = r->vbranch = r->tsbranch = NULL;
 	r->clients_list = NULL;
+	r->clients_count = 0;
+	r->backlog_bytes = DEFAULT_RTSP_BACKLOG_BYTES;
+	r->backlog_drop_ms = DEFAULT_RTSP_BACKLOG_DROP_MS;
+	r->backlog_evict_ms = DEFAULT_RTSP_BACKLOG_EVICT_MS;
+	r->congested_count = r->dropped_count = r->resumed_count = r->evicted_count = 0;
+	r->id_backlog_check = 0;
+	r->resuming_es_clients = r->resuming_ts_clients = NULL;
+	r->resuming_count = 0;
+	r->variants = NULL;
+	r->variants_gen = 0;
+	r->variants_snapshot[0] = r->variants_snapshot[1] = NULL;
+	r->variants_snapshot_gen[0] = r->variants_snapshot_gen[1] = 0;
+	r->max_threads = DEFAULT_RTSP_MAX_THREADS;
+	r->thread_pool = gst_dream_rtsp_thread_pool_new ();
+	gst_rtsp_thread_pool_set_max_threads (GST_RTSP_THREAD_POOL (r->thread_pool), r->max_threads ? r->max_threads : (gint) g_get_num_processors ());
 	return r;
 }
 
@@ -2163,10 +4900,12 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 		return FALSE;
 	}
 
-	DREAMRTSPSERVER_LOCK (app);
+	RTSP_LOCK (app);
 	DreamRTSPserver *r = app->rtsp_server;
 
-	if (r->state == RTSP_STATE_DISABLED)
+	if (r->state == RTSP_STATE_DISABLED && (r->abranch || r->vbranch || r->tsbranch))
+		GST_INFO_OBJECT (app, "previous rtsp branches are still being detached");
+	else if (r->state == RTSP_STATE_DISABLED)
 	{
 		r->artspq = gst_element_factory_make ("queue", "rtspaudioqueue");
 		r->vrtspq = gst_element_factory_make ("queue", "rtspvideoqueue");
@@ -2193,77 +4932,56 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 		g_object_set (G_OBJECT (r->tsappsink), "enable-last-sample", FALSE, NULL);
 		g_signal_connect (r->tsappsink, "new-sample", G_CALLBACK (handover_payload), app);
 
-		gst_bin_add_many (GST_BIN (app->pipeline), r->artspq, r->vrtspq, r->aappsink, r->vappsink,  NULL);
-		gst_element_link (r->artspq, r->aappsink);
-		gst_element_link (r->vrtspq, r->vappsink);
-
-		gst_bin_add_many (GST_BIN (app->pipeline), r->tsrtspq, r->tsappsink,  NULL);
-		gst_element_link (r->tsrtspq, r->tsappsink);
-
-		GstState targetstate = GST_STATE_READY;
-
-		if (!assert_state (app, r->tsappsink, targetstate) || !assert_state (app, r->aappsink, targetstate) || !assert_state (app, r->vappsink, targetstate))
+		r->abranch = dream_branch_new ("rtspaudio", r->artspq, r->aappsink);
+		r->vbranch = dream_branch_new ("rtspvideo", r->vrtspq, r->vappsink);
+		r->tsbranch = dream_branch_new ("rtspts", r->tsrtspq, r->tsappsink);
+		dream_thread_policy_tag (r->artspq, DREAM_THREAD_RTSP);
+		dream_thread_policy_tag (r->vrtspq, DREAM_THREAD_RTSP);
+		dream_thread_policy_tag (r->tsrtspq, DREAM_THREAD_RTSP);
+		if (!dream_branch_attach (r->abranch, GST_BIN (app->pipeline), app->atee) ||
+		    !dream_branch_attach (r->vbranch, GST_BIN (app->pipeline), app->vtee) ||
+		    !dream_branch_attach (r->tsbranch, GST_BIN (app->pipeline), app->tstee))
 			goto fail;
+		dream_budget_add (app->budget, r->abranch, BUDGET_WEIGHT_RTSP_AUDIO);
+		dream_budget_add (app->budget, r->vbranch, BUDGET_WEIGHT_RTSP_VIDEO);
+		dream_budget_add (app->budget, r->tsbranch, BUDGET_WEIGHT_RTSP_VIDEO);
 
-		if (!assert_state (app, r->tsrtspq, targetstate) || !assert_state (app, r->artspq, targetstate) || !assert_state (app, r->vrtspq, targetstate))
-			goto fail;
-
-		GstPad *teepad, *sinkpad;
-		GstPadLinkReturn ret;
-		teepad = gst_element_get_request_pad (app->atee, "src_%u");
-		sinkpad = gst_element_get_static_pad (r->artspq, "sink");
-		ret = gst_pad_link (teepad, sinkpad);
-		if (ret != GST_PAD_LINK_OK)
-		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-			goto fail;
-		}
-		gst_object_unref (teepad);
-		gst_object_unref (sinkpad);
-		teepad = gst_element_get_request_pad (app->vtee, "src_%u");
-		sinkpad = gst_element_get_static_pad (r->vrtspq, "sink");
-		ret = gst_pad_link (teepad, sinkpad);
-		if (ret != GST_PAD_LINK_OK)
-		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-			goto fail;
-		}
-		gst_object_unref (teepad);
-		gst_object_unref (sinkpad);
-		teepad = gst_element_get_request_pad (app->tstee, "src_%u");
-		sinkpad = gst_element_get_static_pad (r->tsrtspq, "sink");
-		ret = gst_pad_link (teepad, sinkpad);
-		if (ret != GST_PAD_LINK_OK)
+		/* the appsinks follow the pipeline, which only has to run for other outputs */
+		if (app->tcp_upstream->state != UPSTREAM_STATE_DISABLED || app->hls_server->state != HLS_STATE_DISABLED)
 		{
-			GST_ERROR_OBJECT (app, "couldn't link %" GST_PTR_FORMAT " ! %" GST_PTR_FORMAT "", teepad, sinkpad);
-			goto fail;
+			/* the streaming threads may need the lock to get there */
+			RTSP_UNLOCK (app);
+			gboolean playing = assert_state (app, app->pipeline, GST_STATE_PLAYING);
+			RTSP_LOCK (app);
+			if (!playing)
+				goto fail;
 		}
-		gst_object_unref (teepad);
-		gst_object_unref (sinkpad);
-
-		if (app->tcp_upstream->state != UPSTREAM_STATE_DISABLED || app->hls_server->state != HLS_STATE_DISABLED)
-			targetstate = GST_STATE_PLAYING;
-
-		if (!assert_state (app, app->pipeline, targetstate))
-			goto fail;
 
 		r->server = g_object_new (GST_TYPE_DREAM_RTSP_SERVER, NULL);
+		gst_rtsp_server_set_thread_pool (GST_RTSP_SERVER(r->server), GST_RTSP_THREAD_POOL (r->thread_pool));
 		g_signal_connect (r->server, "client-connected", (GCallback) client_connected, app);
 
 		r->es_factory = gst_dream_rtsp_media_factory_new ();
 		gst_rtsp_media_factory_set_launch (GST_RTSP_MEDIA_FACTORY (r->es_factory), "( appsrc name=" ES_VAPPSRC " ! h264parse ! rtph264pay name=pay0 pt=96   appsrc name=" ES_AAPPSRC " ! aacparse ! rtpmp4apay name=pay1 pt=97 )");
 		gst_rtsp_media_factory_set_shared (GST_RTSP_MEDIA_FACTORY (r->es_factory), TRUE);
+		gst_dream_rtsp_media_factory_set_variant_launch (r->es_factory, RTSP_ES_VARIANT_LAUNCH);
 
 		g_signal_connect (r->es_factory, "media-configure", (GCallback) media_configure, app);
 
 		r->ts_factory = gst_dream_rtsp_media_factory_new ();
 		gst_rtsp_media_factory_set_launch (GST_RTSP_MEDIA_FACTORY (r->ts_factory), "( appsrc name=" TS_APPSRC " ! queue ! rtpmp2tpay name=pay0 pt=96 )");
 		gst_rtsp_media_factory_set_shared (GST_RTSP_MEDIA_FACTORY (r->ts_factory), TRUE);
+		gst_dream_rtsp_media_factory_set_variant_launch (r->ts_factory, RTSP_TS_VARIANT_LAUNCH);
 
 		g_signal_connect (r->ts_factory, "media-configure", (GCallback) media_configure, app);
 		g_signal_connect (r->ts_factory, "uri-parametrized", (GCallback) uri_parametrized, app);
 
-		DREAMRTSPSERVER_UNLOCK (app);
+		/* not shared, every client seeks in the timeshift on its own */
+		r->timeshift_factory = gst_dream_rtsp_media_factory_new ();
+		gst_rtsp_media_factory_set_launch (GST_RTSP_MEDIA_FACTORY (r->timeshift_factory), "( appsrc name=" TIMESHIFT_APPSRC " ! rtpmp2tpay name=pay0 pt=96 )");
+		g_signal_connect (r->timeshift_factory, "media-configure", (GCallback) timeshift_media_configure, app);
+
+		RTSP_UNLOCK (app);
 
 		gchar *credentials = g_strdup("");
 		if (strlen(user)) {
@@ -2274,6 +4992,7 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 			GstRTSPAuth *auth = gst_rtsp_auth_new ();
 			gst_rtsp_media_factory_add_role (GST_RTSP_MEDIA_FACTORY (r->es_factory), "user", GST_RTSP_PERM_MEDIA_FACTORY_ACCESS, G_TYPE_BOOLEAN, TRUE, GST_RTSP_PERM_MEDIA_FACTORY_CONSTRUCT, G_TYPE_BOOLEAN, TRUE, NULL);
 			gst_rtsp_media_factory_add_role (GST_RTSP_MEDIA_FACTORY (r->ts_factory), "user", GST_RTSP_PERM_MEDIA_FACTORY_ACCESS, G_TYPE_BOOLEAN, TRUE, GST_RTSP_PERM_MEDIA_FACTORY_CONSTRUCT, G_TYPE_BOOLEAN, TRUE, NULL);
+			gst_rtsp_media_factory_add_role (GST_RTSP_MEDIA_FACTORY (r->timeshift_factory), "user", GST_RTSP_PERM_MEDIA_FACTORY_ACCESS, G_TYPE_BOOLEAN, TRUE, GST_RTSP_PERM_MEDIA_FACTORY_CONSTRUCT, G_TYPE_BOOLEAN, TRUE, NULL);
 			token = gst_rtsp_token_new (GST_RTSP_TOKEN_MEDIA_FACTORY_ROLE, G_TYPE_STRING, "user", NULL);
 			basic = gst_rtsp_auth_make_basic (r->rtsp_user, r->rtsp_pass);
 			gst_rtsp_server_set_auth (GST_RTSP_SERVER(r->server), auth);
@@ -2293,20 +5012,24 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 		{
 			r->rtsp_ts_path = g_strdup_printf ("%s%s", path[0]=='/' ? "" : "/", path);
 			r->rtsp_es_path = g_strdup_printf ("%s%s%s", path[0]=='/' ? "" : "/", path, RTSP_ES_PATH_SUFX);
+			r->rtsp_timeshift_path = g_strdup_printf ("%s%s%s", path[0]=='/' ? "" : "/", path, RTSP_TIMESHIFT_PATH_SUFX);
 		}
 		else
 		{
 			r->rtsp_ts_path = g_strdup(DEFAULT_RTSP_PATH);
 			r->rtsp_es_path = g_strdup_printf ("%s%s", DEFAULT_RTSP_PATH, RTSP_ES_PATH_SUFX);
+			r->rtsp_timeshift_path = g_strdup_printf ("%s%s", DEFAULT_RTSP_PATH, RTSP_TIMESHIFT_PATH_SUFX);
 		}
 
 		r->mounts = gst_rtsp_server_get_mount_points (GST_RTSP_SERVER(r->server));
 		gst_rtsp_mount_points_add_factory (r->mounts, r->rtsp_ts_path, g_object_ref(GST_RTSP_MEDIA_FACTORY (r->ts_factory)));
 		gst_rtsp_mount_points_add_factory (r->mounts, r->rtsp_es_path, g_object_ref(GST_RTSP_MEDIA_FACTORY (r->es_factory)));
+		gst_rtsp_mount_points_add_factory (r->mounts, r->rtsp_timeshift_path, g_object_ref(GST_RTSP_MEDIA_FACTORY (r->timeshift_factory)));
 		r->state = RTSP_STATE_IDLE;
 		send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_IDLE));
 		GST_DEBUG ("set RTSP_STATE_IDLE");
-		r->source_id = gst_rtsp_server_attach (GST_RTSP_SERVER(r->server), NULL);
+		r->source_id = gst_rtsp_server_attach (GST_RTSP_SERVER(r->server), app->rtsp_service.context);
+		r->id_backlog_check = g_timeout_add (RTSP_BACKLOG_CHECK_INTERVAL, (GSourceFunc) rtsp_backlog_check, app);
 		r->uri_parameters = NULL;
 		GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"enabled_rtsp_server");
 		g_print ("dreambox encoder stream ready at rtsp://%s127.0.0.1:%s%s\n", credentials, app->rtsp_server->rtsp_port, app->rtsp_server->rtsp_ts_path);
@@ -2315,12 +5038,12 @@ gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gch
 	}
 	else
 		GST_INFO_OBJECT (app, "rtsp server already enabled!");
-	DREAMRTSPSERVER_UNLOCK (app);
+	RTSP_UNLOCK (app);
 	return FALSE;
 
 fail:
-	DREAMRTSPSERVER_UNLOCK (app);
-	disable_rtsp_server(app);
+	rtsp_detach_branches (app);
+	RTSP_UNLOCK (app);
 	return FALSE;
 }
 
@@ -2336,6 +5059,7 @@ gboolean start_rtsp_pipeline(App* app)
 	}
 
 	assert_tsmux (app);
+	wake_source_pipeline (app);
 	if (!assert_state (app, app->pipeline, GST_STATE_PLAYING))
 	{
 		GST_ERROR_OBJECT (app, "GST_STATE_CHANGE_FAILURE for rtsp pipeline");
@@ -2350,106 +5074,82 @@ gboolean start_rtsp_pipeline(App* app)
 	return TRUE;
 }
 
-static GstPadProbeReturn tsmux_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+static gboolean source_has_consumers (App *app)
 {
-	App *app = user_data;
-
-	GstElement *element = gst_pad_get_parent_element(pad);
-	GST_DEBUG_OBJECT(pad, "tsmux_pad_probe_unlink_cb %" GST_PTR_FORMAT, element);
-
-	GstElement *source = NULL;
-	if (element == app->aq)
-		source = app->asrc;
-	else if (element == app->vq)
-		source = app->vsrc;
-	else if (element == app->tsmux)
-	{
-		gst_element_unlink (app->tsmux, app->tstee);
-		gst_bin_remove (GST_BIN (app->pipeline), app->tsmux);
-		gst_element_set_state (app->tsmux, GST_STATE_NULL);
-		gst_object_unref (app->tsmux);
-		app->tsmux = NULL;
-		if (gst_element_set_state (app->pipeline, GST_STATE_READY) != GST_STATE_CHANGE_SUCCESS)
-			GST_WARNING_OBJECT (pad, "error bringing pipeline back to ready");
-//		DREAMRTSPSERVER_UNLOCK (app);
-		GST_DEBUG_OBJECT (pad, "finished unlinking and removing sources and tsmux");
-		return GST_PAD_PROBE_REMOVE;
-	}
+	return app->tcp_upstream->state != UPSTREAM_STATE_DISABLED || app->hls_server->state == HLS_STATE_RUNNING || app->rtsp_server->state == RTSP_STATE_RUNNING || shm_export_active (app) || unix_output_active (app) || app->timeshift.enabled || app->recording.enabled;
+}
 
-	if (gst_element_set_state (source, GST_STATE_NULL) != GST_STATE_CHANGE_SUCCESS)
-	{
-		GST_ERROR_OBJECT(pad, "can't set %" GST_PTR_FORMAT "'s state to GST_STATE_NULL", source);
-		goto fail;
-	}
+static gboolean source_idle_cb (gpointer user_data)
+{
+	App *app = user_data;
 
-	GstPad *srcpad, *muxpad;
-	srcpad = gst_element_get_static_pad (element, "src");
-	muxpad = gst_pad_get_peer (srcpad);
-	if (GST_IS_PAD (muxpad))
+	/* woken up again meanwhile */
+	if (!g_atomic_int_compare_and_exchange (&app->idle.requested, TRUE, FALSE))
+		return G_SOURCE_REMOVE;
+	if (!app->pipeline || source_has_consumers (app))
 	{
-		GST_DEBUG_OBJECT(pad, "srcpad %" GST_PTR_FORMAT " muxpad %" GST_PTR_FORMAT " tsmux %" GST_PTR_FORMAT, srcpad, muxpad, app->tsmux);
-		gst_pad_unlink (srcpad, muxpad);
-		gst_element_release_request_pad (app->tsmux, muxpad);
-		gst_object_unref (muxpad);
+		GST_DEBUG_OBJECT (app, "not idling source pipeline, there are consumers");
+		return G_SOURCE_REMOVE;
 	}
-	else
-		GST_DEBUG_OBJECT(pad, "srcpad %" GST_PTR_FORMAT "'s peer was already unreffed", srcpad);
-	gst_object_unref (srcpad);
-
-	gst_element_set_state (element, GST_STATE_READY);
-
-	GstState state;
-	gst_element_get_state (GST_ELEMENT(element), &state, NULL, 2*GST_SECOND);
-
-	if (state != GST_STATE_READY)
+	GST_INFO_OBJECT (app, "idle_source_pipeline... setting sources to GST_STATE_PAUSED");
+	if (gst_element_set_state (app->asrc, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE || gst_element_set_state (app->vsrc, GST_STATE_PAUSED) == GST_STATE_CHANGE_FAILURE)
 	{
-		GST_ERROR_OBJECT (app, "%" GST_PTR_FORMAT"'s state = %s (should be GST_STATE_READY)", element, gst_element_state_get_name (state));
-		goto fail;
+		GST_WARNING_OBJECT (app, "can't set sources to GST_STATE_PAUSED!");
+		return G_SOURCE_REMOVE;
 	}
+	app->idle.since = gst_util_get_timestamp ();
+	g_atomic_int_set (&app->idle.active, TRUE);
+	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"idle_source_pipeline");
+	return G_SOURCE_REMOVE;
+}
 
-	GstPad *sinkpad = NULL;
-	GstElement *nextelem = NULL;
-	if (element == app->aq)
-	{
-		nextelem = app->vq;
-		if (GST_IS_ELEMENT(nextelem))
-			sinkpad = gst_element_get_static_pad (nextelem, "sink");
-	}
-	if (element == app->vq)
-	{
-		nextelem = app->tsmux;
-		if (GST_IS_ELEMENT(nextelem))
-			sinkpad = gst_element_get_static_pad (nextelem, "src");
-	}
-	if (GST_IS_PAD(sinkpad) && GST_IS_ELEMENT(nextelem))
-	{
-		GST_DEBUG_OBJECT(pad, "element %" GST_PTR_FORMAT " is now in GST_STATE_READY, installing idle probe on %" GST_PTR_FORMAT, element, sinkpad);
-		gst_object_ref (nextelem);
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, tsmux_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-		return GST_PAD_PROBE_REMOVE;
-	}
+/* the last output went away. this is usually called from an unlink probe on
+ * a streaming thread, so the encoders are paused from the control context.
+ * everything downstream of them stays linked and in PLAYING */
+gboolean idle_source_pipeline(App* app)
+{
+	if (!g_atomic_int_compare_and_exchange (&app->idle.requested, FALSE, TRUE))
+		return TRUE;
+	g_main_context_invoke (NULL, source_idle_cb, app);
+	return TRUE;
+}
 
-fail:
-//	DREAMRTSPSERVER_UNLOCK (app);
+static GstPadProbeReturn source_wake_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+	App *app = user_data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER (info);
+	GstClockTime duration;
+
+	if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT))
+		return GST_PAD_PROBE_OK;
+	duration = gst_util_get_timestamp () - app->idle.wake;
+	GST_INFO_OBJECT (app, "first keyframe %" GST_TIME_FORMAT " after leaving idle", GST_TIME_ARGS (duration));
+	dream_metrics_observe (DREAM_METRIC_SOURCE_WAKE_SECONDS, duration / GST_USECOND);
 	return GST_PAD_PROBE_REMOVE;
 }
 
-gboolean halt_source_pipeline(App* app)
+/* called before an output attaches. restarts paused encoders and asks for
+ * a keyframe, so the output doesn't have to wait for the next GOP */
+gboolean wake_source_pipeline(App* app)
 {
-	GST_INFO_OBJECT(app, "halt_source_pipeline...");
-	GST_DEBUG_BIN_TO_DOT_FILE(GST_BIN(app->pipeline),GST_DEBUG_GRAPH_SHOW_ALL,"halt_source_pipeline_pre");
-	GstPad *sinkpad;
-	gst_object_ref (app->aq);
-	sinkpad = gst_element_get_static_pad (app->aq, "sink");
-	gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, tsmux_pad_probe_unlink_cb, app, NULL);
-	gst_object_unref (sinkpad);
+	g_atomic_int_set (&app->idle.requested, FALSE);
+	if (!g_atomic_int_compare_and_exchange (&app->idle.active, TRUE, FALSE))
+		return TRUE;
+
+	app->idle.wake = gst_util_get_timestamp ();
+	GST_INFO_OBJECT (app, "wake_source_pipeline after %" GST_TIME_FORMAT " idle", GST_TIME_ARGS (app->idle.wake - app->idle.since));
+	GstPad *srcpad = gst_element_get_static_pad (app->vparse, "src");
+	gst_pad_add_probe (srcpad, GST_PAD_PROBE_TYPE_BUFFER, source_wake_probe, app, NULL);
+	gst_object_unref (srcpad);
+	if (!unpause_source_pipeline (app))
+		return FALSE;
+	request_keyframe (app, "wake");
 	return TRUE;
 }
 
 gboolean pause_source_pipeline(App* app)
 {
-	if (app->rtsp_server->state <= RTSP_STATE_IDLE && app->hls_server->state == HLS_STATE_DISABLED)
+	if (app->rtsp_server->state <= RTSP_STATE_IDLE && app->hls_server->state == HLS_STATE_DISABLED && !shm_export_active (app) && !unix_output_active (app) && !app->timeshift.enabled && !app->recording.enabled)
 	{
 		GST_INFO_OBJECT(app, "pause_source_pipeline... setting sources to GST_STATE_PAUSED rtsp_server->state=%i hls_server->state=%i", app->rtsp_server->state, app->hls_server->state);
 		if (gst_element_set_state (app->asrc, GST_STATE_PAUSED) != GST_STATE_CHANGE_NO_PREROLL || gst_element_set_state (app->vsrc, GST_STATE_PAUSED) != GST_STATE_CHANGE_NO_PREROLL)
@@ -2480,12 +5180,10 @@ GstRTSPFilterResult remove_media_filter_func (GstRTSPSession * sess, GstRTSPSess
 	GstRTSPFilterResult res = GST_RTSP_FILTER_REF;
 	GstRTSPMedia *media;
 	media = gst_rtsp_session_media_get_media (session_media);
-// 	DREAMRTSPSERVER_LOCK (app);
-	if (media == app->rtsp_server->es_media || media == app->rtsp_server->ts_media) {
+	if (media == app->rtsp_server->es_media || media == app->rtsp_server->ts_media || rtsp_find_variant (app->rtsp_server, media) || g_object_get_data (G_OBJECT (media), TIMESHIFT_PLAYER_KEY)) {
 		GST_DEBUG_OBJECT (app, "matching RTSP media %p in filter, removing...", media);
 		res = GST_RTSP_FILTER_REMOVE;
 	}
-// 	DREAMRTSPSERVER_UNLOCK (app);
 	return res;
 }
 
@@ -2509,7 +5207,7 @@ GstRTSPFilterResult remove_client_filter_func (GstRTSPServer *server, GstRTSPCli
 	GList *session_filter_res;
 	GstRTSPFilterResult res = GST_RTSP_FILTER_KEEP;
 	int ret = g_signal_handlers_disconnect_by_func(client, (GCallback) client_closed, app);
-	GST_INFO("client_filter_func %" GST_PTR_FORMAT "  (number of clients: %i). disconnected %i callback handlers", client, g_list_length(app->rtsp_server->clients_list), ret);
+	GST_INFO("client_filter_func %" GST_PTR_FORMAT "  (number of clients: %i). disconnected %i callback handlers", client, g_atomic_int_get (&app->rtsp_server->clients_count), ret);
 	session_filter_res = gst_rtsp_client_session_filter (client, remove_session_filter_func, app);
 	if (g_list_length (session_filter_res) == 0) {
 		GST_DEBUG_OBJECT (app, "no more sessions for client %p, removing...", app);
@@ -2519,57 +5217,67 @@ GstRTSPFilterResult remove_client_filter_func (GstRTSPServer *server, GstRTSPCli
 	return res;
 }
 
-static GstPadProbeReturn rtsp_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+/* called with RTSP_LOCK held */
+static void rtsp_clear_branch (App *app, DreamBranch *branch)
 {
-	App *app = user_data;
 	DreamRTSPserver *r = app->rtsp_server;
 
-	GstElement *element = gst_pad_get_parent_element(pad);
-	GstElement *appsink = NULL;
-	if (element == r->vrtspq)
-		appsink = r->vappsink;
-	else if (element == r->artspq)
-		appsink = r->aappsink;
-	else if (element == r->tsrtspq)
-		appsink = r->tsappsink;
-
-	GST_DEBUG_OBJECT(pad, "unlink... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, appsink);
-
-	GstPad *teepad;
-	teepad = gst_pad_get_peer(pad);
-	gst_pad_unlink (teepad, pad);
-
-	GstElement *tee = gst_pad_get_parent_element(teepad);
-	gst_element_release_request_pad (tee, teepad);
-	gst_object_unref (teepad);
-	gst_object_unref (tee);
-
-	gst_element_unlink (element, appsink);
-
-	GST_DEBUG_OBJECT(pad, "remove... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, appsink);
-
-	gst_bin_remove_many (GST_BIN (app->pipeline), element, appsink, NULL);
+	if (branch == r->abranch)
+	{
+		r->abranch = NULL;
+		r->artspq = r->aappsink = NULL;
+		/* its streaming thread is gone, so is the snapshot's only user */
+		g_clear_pointer (&r->variants_snapshot[0], g_ptr_array_unref);
+	}
+	else if (branch == r->vbranch)
+	{
+		r->vbranch = NULL;
+		r->vrtspq = r->vappsink = NULL;
+		g_clear_pointer (&r->variants_snapshot[1], g_ptr_array_unref);
+	}
+	else if (branch == r->tsbranch)
+	{
+		r->tsbranch = NULL;
+		r->tsrtspq = r->tsappsink = NULL;
+	}
+	dream_branch_unref (branch);
+}
 
-	GST_DEBUG_OBJECT(pad, "set state null %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, appsink);
+static void rtsp_branch_detached (DreamBranch *branch, gpointer user_data)
+{
+	App *app = user_data;
+	DreamRTSPserver *r = app->rtsp_server;
 
-	gst_element_set_state (appsink, GST_STATE_NULL);
-	gst_element_set_state (element, GST_STATE_NULL);
+	gboolean last;
 
-	GST_DEBUG_OBJECT(pad, "unref.... %" GST_PTR_FORMAT " and %" GST_PTR_FORMAT, element, appsink);
+	RTSP_LOCK (app);
+	rtsp_clear_branch (app, branch);
+	last = !r->abranch && !r->vbranch && !r->tsbranch;
+	RTSP_UNLOCK (app);
+	if (last)
+	{
+		GST_INFO("local rtsp server disabled!");
+		if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
+			idle_source_pipeline(app);
+	}
+}
 
-	gst_object_unref (element);
-	gst_object_unref (appsink);
-	element = NULL;
-	appsink = NULL;
+/* called with RTSP_LOCK held, branches which never got attached
+ * are dropped right away */
+static void rtsp_detach_branches (App *app)
+{
+	DreamRTSPserver *r = app->rtsp_server;
+	DreamBranch *branches[3] = { r->abranch, r->vbranch, r->tsbranch };
+	guint i;
 
-	if (!r->tsappsink && !r->aappsink && !r->vappsink)
+	for (i = 0; i < G_N_ELEMENTS (branches); i++)
 	{
-		GST_INFO("!r->tsappsink && !r->aappsink && !r->vappsink");
-		if (app->tcp_upstream->state == UPSTREAM_STATE_DISABLED && app->hls_server->state == HLS_STATE_DISABLED)
-			halt_source_pipeline(app);
-		GST_INFO("local rtsp server disabled!");
+		if (!branches[i])
+			continue;
+		dream_budget_remove (app->budget, branches[i]);
+		if (!dream_branch_detach (branches[i], rtsp_branch_detached, app))
+			rtsp_clear_branch (app, branches[i]);
 	}
-	return GST_PAD_PROBE_REMOVE;
 }
 
 gboolean disable_rtsp_server(App *app)
@@ -2580,11 +5288,23 @@ gboolean disable_rtsp_server(App *app)
 	{
 		if (app->rtsp_server->es_media)
 			gst_rtsp_server_client_filter(GST_RTSP_SERVER(app->rtsp_server->server), (GstRTSPServerClientFilterFunc) remove_client_filter_func, app);
-		DREAMRTSPSERVER_LOCK (app);
+		RTSP_LOCK (app);
 		gst_rtsp_mount_points_remove_factory (app->rtsp_server->mounts, app->rtsp_server->rtsp_es_path);
 		gst_rtsp_mount_points_remove_factory (app->rtsp_server->mounts, app->rtsp_server->rtsp_ts_path);
-		GSource *source = g_main_context_find_source_by_id (g_main_context_default (), r->source_id);
-		g_source_destroy(source);
+		gst_rtsp_mount_points_remove_factory (app->rtsp_server->mounts, app->rtsp_server->rtsp_timeshift_path);
+		GSource *source = g_main_context_find_source_by_id (app->rtsp_service.context, r->source_id);
+		if (source)
+			g_source_destroy(source);
+		if (r->id_backlog_check)
+			g_source_remove (r->id_backlog_check);
+		r->id_backlog_check = 0;
+		g_list_free_full (r->resuming_es_clients, g_object_unref);
+		g_list_free_full (r->resuming_ts_clients, g_object_unref);
+		r->resuming_es_clients = r->resuming_ts_clients = NULL;
+		g_atomic_int_set (&r->resuming_count, 0);
+		g_list_free_full (r->variants, (GDestroyNotify) rtsp_variant_unref);
+		r->variants = NULL;
+		g_atomic_int_inc (&r->variants_gen);
 // 		g_source_unref(source);
 // 		GST_DEBUG("disable_rtsp_server source unreffed");
 		if (r->mounts)
@@ -2596,81 +5316,37 @@ gboolean disable_rtsp_server(App *app)
 		g_free(r->rtsp_port);
 		g_free(r->rtsp_ts_path);
 		g_free(r->rtsp_es_path);
+		g_free(r->rtsp_timeshift_path);
 		g_free(r->uri_parameters);
 		send_signal (app, "rtspStateChanged", g_variant_new("(i)", RTSP_STATE_DISABLED));
 		r->state = RTSP_STATE_DISABLED;
 
-		gst_object_ref (r->tsrtspq);
-		gst_object_ref (r->artspq);
-		gst_object_ref (r->vrtspq);
-		gst_object_ref (r->tsappsink);
-		gst_object_ref (r->aappsink);
-		gst_object_ref (r->vappsink);
+		rtsp_detach_branches (app);
 
-		GstPad *sinkpad;
-		sinkpad = gst_element_get_static_pad (r->tsrtspq, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-		sinkpad = gst_element_get_static_pad (r->artspq, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-		sinkpad = gst_element_get_static_pad (r->vrtspq, "sink");
-		gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, rtsp_pad_probe_unlink_cb, app, NULL);
-		gst_object_unref (sinkpad);
-
-		DREAMRTSPSERVER_UNLOCK (app);
+		RTSP_UNLOCK (app);
 		GST_INFO("rtsp_server disabled! set RTSP_STATE_DISABLED");
 		return TRUE;
 	}
 	return FALSE;
 }
 
-static GstPadProbeReturn upstream_pad_probe_unlink_cb (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+/* also called directly for a branch which never got attached */
+static void upstream_branch_detached (DreamBranch *branch, gpointer user_data)
 {
 	App *app = user_data;
 	DreamTCPupstream *t = app->tcp_upstream;
 
-	GstElement *element = gst_pad_get_parent_element(pad);
-
-	GST_DEBUG_OBJECT (pad, "upstream_pad_probe_unlink_cb %" GST_PTR_FORMAT, element);
-
-	if ((GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_IDLE) && element && element == t->tstcpq)
-	{
-		GstPad *teepad;
-		teepad = gst_pad_get_peer(pad);
-		if (!teepad)
-		{
-			GST_ERROR_OBJECT (pad, "has no peer! tstcpq=%" GST_PTR_FORMAT", tcpsink=%" GST_PTR_FORMAT", tee=%" GST_PTR_FORMAT,t->tstcpq, t->tcpsink, app->tstee);
-			return GST_PAD_PROBE_REMOVE;
-		}
-		GST_DEBUG_OBJECT (pad, "GST_PAD_PROBE_TYPE_IDLE -> unlink and remove tcpsink");
-		gst_pad_unlink (teepad, pad);
-
-		GstElement *tee = gst_pad_get_parent_element(teepad);
-		gst_element_release_request_pad (tee, teepad);
-		gst_object_unref (teepad);
-		gst_object_unref (tee);
-
-		gst_object_ref (t->tcpsink);
-		gst_element_unlink (t->tstcpq, t->tcpsink);
-		gst_bin_remove_many (GST_BIN (app->pipeline), t->tstcpq, t->tcpsink, NULL);
-
-		gst_element_set_state (t->tcpsink, GST_STATE_NULL);
-		gst_element_set_state (t->tstcpq, GST_STATE_NULL);
-
-		gst_object_unref (t->tstcpq);
-		gst_object_unref (t->tcpsink);
-		t->tstcpq = NULL;
-		t->tcpsink = NULL;
-
-		if (app->rtsp_server->state < RTSP_STATE_RUNNING && app->hls_server->state == HLS_STATE_DISABLED)
-			halt_source_pipeline(app);
-		GST_INFO("tcp_upstream disabled!");
-		t->state = UPSTREAM_STATE_DISABLED;
-		send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
-	}
-	GST_DEBUG_OBJECT (pad, "upstream_pad_probe_unlink_cb returns GST_PAD_PROBE_REMOVE");
-	return GST_PAD_PROBE_REMOVE;
+	if (branch)
+		dream_branch_unref (branch);
+	t->branch = NULL;
+	t->tstcpq = NULL;
+	t->tcpsink = NULL;
+
+	if (app->rtsp_server->state < RTSP_STATE_RUNNING && app->hls_server->state == HLS_STATE_DISABLED)
+		idle_source_pipeline(app);
+	GST_INFO("tcp_upstream disabled!");
+	t->state = UPSTREAM_STATE_DISABLED;
+	send_signal (app, "upstreamStateChanged", g_variant_new("(i)", t->state));
 }
 
 gboolean disable_tcp_upstream(App *app)
@@ -2681,19 +5357,12 @@ gboolean disable_tcp_upstream(App *app)
 	DreamTCPupstream *t = app->tcp_upstream;
 	if (t->state >= UPSTREAM_STATE_CONNECTING)
 	{
-		GstPad *sinkpad;
-		if (t->id_bitrate_measure)
-		{
-			sinkpad = gst_element_get_static_pad (t->tcpsink, "sink");
-			gst_pad_remove_probe (sinkpad, t->id_bitrate_measure);
-			t->id_bitrate_measure = 0;
-			gst_object_unref (sinkpad);
-		}
-		gst_object_ref (t->tstcpq);
-		sinkpad = gst_element_get_static_pad (t->tstcpq, "sink");
-		gulong probe_id = gst_pad_add_probe (sinkpad, GST_PAD_PROBE_TYPE_IDLE, upstream_pad_probe_unlink_cb, app, NULL);
-		GST_DEBUG("added upstream_pad_probe_unlink_cb with probe_id = %lu on %" GST_PTR_FORMAT"", probe_id, sinkpad);
-		gst_object_unref (sinkpad);
+		dream_probe_set_window_func (upstream_probe (t), NULL, NULL);
+		dream_rate_controller_set_limit (app->rate, 0);
+		if (t->branch)
+			dream_budget_remove (app->budget, t->branch);
+		if (!t->branch || !dream_branch_detach (t->branch, upstream_branch_detached, app))
+			upstream_branch_detached (t->branch, app);
 		return TRUE;
 	}
 	return FALSE;
@@ -2705,6 +5374,10 @@ gboolean destroy_pipeline(App *app)
 	if (app->pipeline)
 	{
 		get_source_properties (app);
+		g_mutex_lock (&app->properties.lock);
+		app->properties.valid = FALSE;
+		g_mutex_unlock (&app->properties.lock);
+		dream_rate_controller_detach (app->rate);
 		GstStateChangeReturn sret = gst_element_set_state (app->pipeline, GST_STATE_NULL);
 		if (sret == GST_STATE_CHANGE_ASYNC)
 		{
@@ -2748,18 +5421,151 @@ gboolean get_dot_graph (gpointer user_data)
 	return TRUE;
 }
 
+static gpointer service_thread_func (gpointer user_data)
+{
+	DreamServiceThread *s = user_data;
+	GST_DEBUG ("%s service thread started", s->name);
+	g_main_context_push_thread_default (s->context);
+	g_main_loop_run (s->loop);
+	g_main_context_pop_thread_default (s->context);
+	GST_DEBUG ("%s service thread stopped", s->name);
+	return NULL;
+}
+
+void service_thread_init (DreamServiceThread *s, const gchar *name)
+{
+	s->name = name;
+	s->context = g_main_context_new ();
+	s->loop = g_main_loop_new (s->context, FALSE);
+	s->thread = NULL;
+}
+
+void service_thread_start (DreamServiceThread *s)
+{
+	s->thread = g_thread_new (s->name, service_thread_func, s);
+}
+
+/* the context survives until service_thread_clear(), so late
+ * g_main_context_invoke() calls from other threads don't hit freed memory */
+void service_thread_stop (DreamServiceThread *s)
+{
+	if (s->thread)
+	{
+		g_main_loop_quit (s->loop);
+		g_main_context_wakeup (s->context);
+		g_thread_join (s->thread);
+		s->thread = NULL;
+	}
+}
+
+void service_thread_clear (DreamServiceThread *s)
+{
+	service_thread_stop (s);
+	g_main_loop_unref (s->loop);
+	g_main_context_unref (s->context);
+}
+
+typedef struct {
+	GSourceFunc func;
+	gpointer data;
+	GMutex lock;
+	GCond cond;
+	gboolean done;
+} DreamServiceCall;
+
+static gboolean service_call_dispatch (gpointer user_data)
+{
+	DreamServiceCall *call = user_data;
+	call->func (call->data);
+	g_mutex_lock (&call->lock);
+	call->done = TRUE;
+	g_cond_signal (&call->cond);
+	g_mutex_unlock (&call->lock);
+	return G_SOURCE_REMOVE;
+}
+
+/* runs func on the service thread and waits for it to complete */
+void service_thread_call (DreamServiceThread *s, GSourceFunc func, gpointer data)
+{
+	DreamServiceCall call = { func, data };
+
+	if (!s->thread || g_main_context_is_owner (s->context))
+	{
+		func (data);
+		return;
+	}
+	g_mutex_init (&call.lock);
+	g_cond_init (&call.cond);
+	call.done = FALSE;
+	g_main_context_invoke (s->context, service_call_dispatch, &call);
+	g_mutex_lock (&call.lock);
+	while (!call.done)
+		g_cond_wait (&call.cond, &call.lock);
+	g_mutex_unlock (&call.lock);
+	g_mutex_clear (&call.lock);
+	g_cond_clear (&call.cond);
+}
+
 int main (int argc, char *argv[])
 {
 	App app;
-	guint owner_id;
+	guint owner_id, i;
+	gboolean synthetic = FALSE, session_bus = FALSE;
+	guint metrics_port = DEFAULT_METRICS_PORT;
+	gboolean latency_tracing = FALSE, sync_signals = FALSE;
+	gchar *thread_policy = NULL;
+	gint buffer_budget = DEFAULT_BUFFER_BUDGET_MB;
+	gboolean system_allocator = FALSE;
+	gint shm_size = DEFAULT_SHM_SIZE_MB;
+	GError *error = NULL;
+	GOptionContext *context;
+	GOptionEntry entries[] = {
+		{ "synthetic", 0, 0, G_OPTION_ARG_NONE, &synthetic, "use test sources instead of the hardware encoders", NULL },
+		{ "session-bus", 0, 0, G_OPTION_ARG_NONE, &session_bus, "register on the session instead of the system bus", NULL },
+		{ "metrics-port", 0, 0, G_OPTION_ARG_INT, &metrics_port, "serve " METRICS_PATH " on this local port (0 disables)", "PORT" },
+		{ "sync-signals", 0, 0, G_OPTION_ARG_NONE, &sync_signals, "emit D-Bus signals directly from the calling thread", NULL },
+		{ "latency-tracing", 0, 0, G_OPTION_ARG_NONE, &latency_tracing, "stamp video buffers and collect per stage latency histograms", NULL },
+		{ "buffer-budget", 0, 0, G_OPTION_ARG_INT, &buffer_budget, "megabytes shared by the queues of all outputs (0 keeps their own limits)", "MB" },
+		{ "shm-size", 0, 0, G_OPTION_ARG_INT, &shm_size, "megabytes of the shared memory rings for the ts and video streams", "MB" },
+		{ "system-allocator", 0, 0, G_OPTION_ARG_NONE, &system_allocator, "keep GStreamer's allocator instead of the daemon's memory arena", NULL },
+		{ "thread-policy", 0, 0, G_OPTION_ARG_STRING, &thread_policy, "priority and cpus of the streaming threads per class (source, rtsp, hls, upstream), e.g. \"source:50:0;hls:0:1-3\"", "POLICY" },
+		{ NULL }
+	};
 
-	gst_init (0, NULL);
+	context = g_option_context_new ("- Dreambox RTSP server daemon");
+	g_option_context_add_main_entries (context, entries, NULL);
+	g_option_context_add_group (context, gst_init_get_option_group ());
+	if (!g_option_context_parse (context, &argc, &argv, &error))
+	{
+		g_printerr ("%s\n", error->message);
+		g_error_free (error);
+		g_option_context_free (context);
+		return 1;
+	}
+	g_option_context_free (context);
 
 	GST_DEBUG_CATEGORY_INIT (dreamrtspserver_debug, "dreamrtspserver",
 			GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
 			"Dreambox RTSP server daemon");
 
 	memset (&app, 0, sizeof(app));
+	app.synthetic = synthetic;
+	app.metrics_port = metrics_port;
+	app.sync_signals = sync_signals;
+	dream_metrics_init ();
+	dream_latency_set_enabled (latency_tracing);
+	if (!system_allocator)
+	{
+		app.arena = dream_arena_new ();
+		dream_arena_add_bucket (app.arena, ARENA_SMALL_SIZE, ARENA_SMALL_BLOCKS, ARENA_SMALL_BLOCKS*4);
+		dream_arena_add_bucket (app.arena, TS_PACK_SIZE, ARENA_PACKET_BLOCKS, ARENA_PACKET_BLOCKS*4);
+		dream_arena_add_bucket (app.arena, ARENA_BLOCK_SIZE, ARENA_BLOCK_BLOCKS, ARENA_BLOCK_BLOCKS*4);
+		dream_arena_add_bucket (app.arena, ARENA_PAGE_SIZE, ARENA_PAGE_BLOCKS, ARENA_PAGE_BLOCKS*4);
+		for (gsize size = ARENA_PAGE_SIZE*2; size < ARENA_CHUNK_SIZE; size *= 2)
+			dream_arena_add_bucket (app.arena, size, ARENA_CLASS_BLOCKS, ARENA_CLASS_BLOCKS*2);
+		dream_arena_add_bucket (app.arena, ARENA_CHUNK_SIZE, ARENA_CHUNK_BLOCKS, ARENA_CHUNK_BLOCKS*2);
+		dream_arena_install (app.arena);
+	}
 	memset (&app.source_properties, 0, sizeof(SourceProperties));
 	app.source_properties.gopLength = 0; //auto
 	app.source_properties.gopOnSceneChange = FALSE;
@@ -2767,12 +5573,46 @@ int main (int argc, char *argv[])
 	app.source_properties.bFrames = 2; //default
 	app.source_properties.pFrames = 1; //default
 	app.source_properties.profile = 0; //main
-	g_mutex_init (&app.rtsp_mutex);
+	for (i = 0; i < DREAM_LOCK_LAST; i++)
+		g_mutex_init (&app.locks[i]);
+	g_mutex_init (&app.properties.lock);
+	g_mutex_init (&app.shm.lock);
+	g_mutex_init (&app.local.lock);
+	g_mutex_init (&app.timeshift.lock);
+	app.timeshift.readers = g_thread_pool_new (timeshift_request_read, NULL, TIMESHIFT_HTTP_READERS, FALSE, NULL);
+	g_mutex_init (&app.recording.lock);
+	app.shm.size = (gsize) CLAMP (shm_size, 1, 256) * 1024 * 1024;
 
 	introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
 	app.dbus_connection = NULL;
 
-	owner_id = g_bus_own_name (G_BUS_TYPE_SYSTEM,
+	service_thread_init (&app.rtsp_service, "rtsp");
+	service_thread_init (&app.http_service, "http");
+	service_thread_init (&app.dbus_service, "dbus");
+	service_thread_init (&app.signal_service, "signals");
+	service_thread_init (&app.local_service, "unix");
+
+	app.signals = dream_signal_dispatcher_new (app.signal_service.context, object_name, service);
+	app.rate = dream_rate_controller_new (rate_changed, &app);
+	app.threads = dream_thread_policy_new ();
+	if (!dream_thread_policy_parse (app.threads, thread_policy))
+		g_printerr ("ignoring invalid parts of the thread policy '%s'\n", thread_policy);
+	g_free (thread_policy);
+	app.budget = dream_budget_new ((guint64) MAX (buffer_budget, 0) * 1024 * 1024);
+	app.id_budget = g_timeout_add (BUFFER_BUDGET_INTERVAL, (GSourceFunc) dream_budget_rebalance, app.budget);
+	dream_signal_dispatcher_set_properties_delay (app.signals, PROPERTIES_CHANGED_DELAY);
+	for (i = 0; i < G_N_ELEMENTS (signal_properties); i++)
+		dream_signal_dispatcher_map_property (app.signals, signal_properties[i].signal, signal_properties[i].property);
+	dream_signal_dispatcher_set_policy (app.signals, "tcpBitrate", SIGNAL_BITRATE_INTERVAL);
+	dream_signal_dispatcher_set_policy (app.signals, "sourceStateChanged", SIGNAL_STATE_INTERVAL);
+	dream_signal_dispatcher_set_policy (app.signals, "rtspStateChanged", SIGNAL_STATE_INTERVAL);
+	dream_signal_dispatcher_set_policy (app.signals, "hlsStateChanged", SIGNAL_STATE_INTERVAL);
+	dream_signal_dispatcher_set_policy (app.signals, "upstreamStateChanged", SIGNAL_STATE_INTERVAL);
+
+	/* the bus name is owned with the dbus context as thread default, so
+	 * that all D-Bus callbacks are dispatched on the dbus thread */
+	g_main_context_push_thread_default (app.dbus_service.context);
+	owner_id = g_bus_own_name (session_bus ? G_BUS_TYPE_SESSION : G_BUS_TYPE_SYSTEM,
 				   service,
 			    G_BUS_NAME_OWNER_FLAGS_NONE,
 			    on_bus_acquired,
@@ -2780,6 +5620,7 @@ int main (int argc, char *argv[])
 			    on_name_lost,
 			    &app,
 			    NULL);
+	g_main_context_pop_thread_default (app.dbus_service.context);
 
 	if (!create_source_pipeline(&app))
 		g_print ("Failed to create source pipeline!");
@@ -2796,33 +5637,104 @@ int main (int argc, char *argv[])
 
 	app.rtsp_server = create_rtsp_server(&app);
 
+	service_thread_start (&app.rtsp_service);
+	service_thread_start (&app.http_service);
+	service_thread_start (&app.dbus_service);
+	service_thread_start (&app.signal_service);
+	service_thread_start (&app.local_service);
+
+	if (app.metrics_port)
+		service_thread_call (&app.http_service, metrics_server_setup, &app);
+
 	app.loop = g_main_loop_new (NULL, FALSE);
 	g_unix_signal_add (SIGINT, quit_signal, app.loop);
 	g_unix_signal_add (SIGUSR1, (GSourceFunc) get_dot_graph, &app);
 
+	g_main_context_acquire (NULL);
 	g_main_loop_run (app.loop);
 
+	/* no new D-Bus calls. the outputs are disabled while their service
+	 * threads still run, they tear their servers down there */
+	g_bus_unown_name (owner_id);
+
 	if (app.tcp_upstream->state > UPSTREAM_STATE_DISABLED)
 		disable_tcp_upstream(&app);
 	if (app.rtsp_server->state >= RTSP_STATE_IDLE)
 		disable_rtsp_server(&app);
-	if (app.rtsp_server->clients_list)
-		g_list_free (app.rtsp_server->clients_list);
 
 	if (app.hls_server->state >= HLS_STATE_IDLE)
 		disable_hls_server(&app);
+	disable_shm_export(&app, "");
+	disable_unix_output(&app);
+	disable_timeshift(&app);
+	disable_recording(&app);
+	service_thread_call (&app.http_service, metrics_server_teardown, &app);
+
+	/* nothing may run on the service threads or the timeshift readers once
+	 * the structs they use are freed */
+	service_thread_stop (&app.dbus_service);
+	service_thread_stop (&app.http_service);
+	service_thread_stop (&app.rtsp_service);
+	service_thread_stop (&app.local_service);
+	service_thread_stop (&app.signal_service);
+	g_thread_pool_free (app.timeshift.readers, FALSE, TRUE);
 
+	if (app.rtsp_server->clients_list)
+		g_list_free (app.rtsp_server->clients_list);
+	g_object_unref (app.rtsp_server->thread_pool);
+	g_array_free (app.hls_server->discontinuities, TRUE);
 	free(app.hls_server);
 	free(app.rtsp_server);
 	free(app.tcp_upstream);
 
 	destroy_pipeline(&app);
+	/* the detaches above didn't get to complete */
+	for (i = 0; i < SHM_STREAM_LAST; i++)
+	{
+		if (app.shm.streams[i].ring)
+			dream_shm_ring_free (app.shm.streams[i].ring);
+		if (app.shm.streams[i].branch)
+			dream_branch_unref (app.shm.streams[i].branch);
+		gst_caps_replace (&app.shm.streams[i].caps, NULL);
+	}
+	if (app.local.server)
+		dream_unix_server_free (app.local.server);
+	if (app.local.branch)
+		dream_branch_unref (app.local.branch);
+	if (app.timeshift.store)
+		dream_timeshift_unref (app.timeshift.store);
+	if (app.timeshift.branch)
+		dream_branch_unref (app.timeshift.branch);
+	if (app.recording.recorder)
+		dream_recorder_free (app.recording.recorder);
+	if (app.recording.stopping)
+		dream_recorder_free (app.recording.stopping);
+	if (app.recording.branch)
+		dream_branch_unref (app.recording.branch);
 
 	g_main_loop_unref (app.loop);
 
-	g_mutex_clear (&app.rtsp_mutex);
+	service_thread_clear (&app.signal_service);
+	dream_signal_dispatcher_free (app.signals);
+	dream_rate_controller_free (app.rate);
+	dream_thread_policy_free (app.threads);
+	g_source_remove (app.id_budget);
+	dream_budget_free (app.budget);
+	if (app.arena)
+		gst_object_unref (app.arena);
+	service_thread_clear (&app.dbus_service);
+	service_thread_clear (&app.http_service);
+	service_thread_clear (&app.rtsp_service);
+	service_thread_clear (&app.local_service);
+
+	for (i = 0; i < DREAM_LOCK_LAST; i++)
+		g_mutex_clear (&app.locks[i]);
+	g_mutex_clear (&app.properties.lock);
+	g_mutex_clear (&app.shm.lock);
+	g_mutex_clear (&app.local.lock);
+	g_mutex_clear (&app.timeshift.lock);
+	g_mutex_clear (&app.recording.lock);
 
-	g_bus_unown_name (owner_id);
 	g_dbus_node_info_unref (introspection_data);
 
 	return 0;
@@ -19,6 +19,7 @@
 #ifndef __DREAMRTSPSERVER_H__
 #define __DREAMRTSPSERVER_H__
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -30,6 +31,18 @@
 #include <gst/rtsp-server/rtsp-server.h>
 #include <libsoup/soup.h>
 #include "gstdreamrtsp.h"
+#include "dreammetrics.h"
+#include "dreamprobe.h"
+#include "dreamsignal.h"
+#include "dreamrate.h"
+#include "dreambranch.h"
+#include "dreamsched.h"
+#include "dreambudget.h"
+#include "dreamarena.h"
+#include "dreamshm.h"
+#include "dreamunix.h"
+#include "dreamtimeshift.h"
+#include "dreamrecorder.h"
 
 GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 #define GST_CAT_DEFAULT dreamrtspserver_debug
@@ -37,11 +50,35 @@ GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 #define DEFAULT_RTSP_PORT 554
 #define DEFAULT_RTSP_PATH "/stream"
 #define RTSP_ES_PATH_SUFX "-es"
+#define RTSP_TIMESHIFT_PATH_SUFX "-timeshift"
+
+/* --synthetic replaces the encoder sources with test sources for benchmarks
+ * on machines without dreambox hardware */
+#define SYNTHETIC_VIDEO_SOURCE "videotestsrc is-live=true pattern=ball ! video/x-raw,width=1280,height=720,framerate=25/1 ! timeoverlay ! x264enc tune=zerolatency speed-preset=ultrafast key-int-max=50 bitrate=4000"
+#define SYNTHETIC_AUDIO_SOURCE "audiotestsrc is-live=true wave=ticks ! audio/x-raw,rate=48000,channels=2 ! audioconvert ! avenc_aac bitrate=128000"
+
+/* the synthetic sources are bins which have none of the encoder properties */
+#define IS_DREAM_SOURCE(app, src) (GST_IS_ELEMENT(src) && !(app)->synthetic)
+
+#define METRICS_PATH "/metrics"
+#define DEFAULT_METRICS_PORT 0
+#define PROBE_WINDOW GST_SECOND
+
+/* minimum ms between two emissions of the rate limited D-Bus signals */
+#define SIGNAL_BITRATE_INTERVAL 1000
+#define SIGNAL_STATE_INTERVAL 100
+/* ms over which property changes are collected into one PropertiesChanged */
+#define PROPERTIES_CHANGED_DELAY 50
+/* ms between two keyframe requests to the encoder, later ones are merged */
+#define KEYFRAME_REQUEST_INTERVAL 1000
+/* ms a reconfigure call waits for the resulting keyframe */
+#define RECONFIGURE_KEYFRAME_TIMEOUT 2000
 
 #define HLS_PATH "/tmp/hls"
 #define HLS_FRAGMENT_DURATION 2
 #define HLS_FRAGMENT_NAME "segment%05d.ts"
 #define HLS_PLAYLIST_NAME "dream.m3u8"
+#define HLS_START_DELAY (HLS_FRAGMENT_DURATION+1)
 
 #define TOKEN_LEN 36
 
@@ -53,6 +90,10 @@ GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 #define ES_VAPPSRC "es_vappsrc"
 #define TS_APPSRC "ts_appsrc"
 
+/* the %s is replaced by the transcoding elements of the requested variant */
+#define RTSP_ES_VARIANT_LAUNCH "( appsrc name=" ES_VAPPSRC " ! h264parse ! %s ! rtph264pay name=pay0 pt=96   appsrc name=" ES_AAPPSRC " ! aacparse ! rtpmp4apay name=pay1 pt=97 )"
+#define RTSP_TS_VARIANT_LAUNCH "( appsrc name=" ES_VAPPSRC " ! h264parse ! %s ! mpegtsmux name=variantmux ! rtpmp2tpay name=pay0 pt=96   appsrc name=" ES_AAPPSRC " ! aacparse ! variantmux. )"
+
 #define TS_PACK_SIZE 188
 #define TS_PER_FRAME 7
 #define BLOCK_SIZE   TS_PER_FRAME*188
@@ -68,28 +109,99 @@ GST_DEBUG_CATEGORY (dreamrtspserver_debug);
 
 #define WATCHDOG_TIMEOUT 5
 
+#define RTSP_BACKLOG_CHECK_INTERVAL 250
+#define DEFAULT_RTSP_BACKLOG_BYTES 256*1024
+#define DEFAULT_RTSP_BACKLOG_DROP_MS 1000
+#define DEFAULT_RTSP_BACKLOG_EVICT_MS 5000
+
+/* 0 means one client thread per cpu */
+#define DEFAULT_RTSP_MAX_THREADS 0
+#define RTSP_MAX_THREADS_LIMIT 64
+
+/* bytes shared by the queues of all outputs, see dreambudget.h */
+#define DEFAULT_BUFFER_BUDGET_MB 24
+#define BUFFER_BUDGET_INTERVAL 500
+/* live viewers suffer most from lost data, the audio queues need little */
+#define BUDGET_WEIGHT_RTSP_VIDEO 4
+#define BUDGET_WEIGHT_RTSP_AUDIO 1
+#define BUDGET_WEIGHT_UPSTREAM 3
+#define BUDGET_WEIGHT_HLS 2
+
+/* buckets of the default allocator, see dreamarena.h, with the blocks
+ * preallocated for each. mpegtsmux allocates every TS packet on its own,
+ * payloaders and parsers need headers and whole frames */
+#define ARENA_SMALL_SIZE 64
+#define ARENA_SMALL_BLOCKS 256
+#define ARENA_PACKET_BLOCKS 512
+/* a 7 packet TS block with room for an RTP header */
+#define ARENA_BLOCK_SIZE (BLOCK_SIZE + ARENA_SMALL_SIZE)
+#define ARENA_BLOCK_BLOCKS 64
+#define ARENA_PAGE_SIZE 4096
+#define ARENA_PAGE_BLOCKS 32
+/* power of two buckets between a page and a chunk, so a frame never
+ * wastes more than half of its block */
+#define ARENA_CLASS_BLOCKS 8
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_CHUNK_BLOCKS 8
+
+/* shared memory rings, see dreamshm.h. a few seconds of TS at the highest
+ * bitrate, so that a reader always finds a keyframe */
+#define DEFAULT_SHM_SIZE_MB 8
+#define SHM_AUDIO_SIZE (512 * 1024)
+#define BUDGET_WEIGHT_SHM 1
+
+/* TS over a UNIX socket for local clients, see dreamunix.h */
+#define DEFAULT_UNIX_SOCKET_PATH "/tmp/dreamrtspserver.sock"
+#define BUDGET_WEIGHT_UNIX 1
+
+/* the timeshift store, see dreamtimeshift.h. RTSP plays it from the
+ * -timeshift mount, HLS serves the window below TIMESHIFT_HLS_PREFIX */
+#define DEFAULT_TIMESHIFT_DIRECTORY "/tmp"
+#define DEFAULT_TIMESHIFT_MB 256
+#define TIMESHIFT_MAX_MB 16384
+#define TIMESHIFT_APPSRC "timeshift_appsrc"
+#define TIMESHIFT_HLS_PREFIX "/timeshift/"
+#define TIMESHIFT_PLAYLIST_NAME "timeshift.m3u8"
+#define TIMESHIFT_SEGMENT_NAME "timeshift%" G_GUINT64_FORMAT ".ts"
+/* segments are read in chunks of this size by a pool of reader threads */
+#define TIMESHIFT_HTTP_CHUNK (64 * 1024)
+#define TIMESHIFT_HTTP_READERS 2
+#define BUDGET_WEIGHT_TIMESHIFT 2
+
+/* recordings go to files named after their start, see dreamrecorder.h.
+ * 0 megabytes means DEFAULT_RECORD_MAX_MB, 0 seconds no rotation by time */
+#define DEFAULT_RECORD_DIRECTORY "/media/hdd/movie"
+#define DEFAULT_RECORD_MAX_MB 4095
+#define BUDGET_WEIGHT_RECORDING 2
+
 #if HAVE_UPSTREAM
 	#pragma message("building with mediator upstream feature")
 #else
 	#pragma message("building without mediator upstream feature")
 #endif
 
-#define DREAMRTSPSERVER_LOCK(obj) G_STMT_START {   \
-    GST_LOG_OBJECT (obj,                           \
-                    "LOCKING from thread %p",      \
-                    g_thread_self ());             \
-    g_mutex_lock (&obj->rtsp_mutex);               \
-    GST_LOG_OBJECT (obj,                           \
-                    "LOCKED from thread %p",       \
-                    g_thread_self ());             \
+/* one lock per output, see the threading rules below */
+typedef enum {
+	DREAM_LOCK_UPSTREAM,
+	DREAM_LOCK_RTSP,
+	DREAM_LOCK_HLS,
+	DREAM_LOCK_LAST
+} DreamLockId;
+
+/* the uncontended case is a single trylock, waiting is counted */
+#define DREAM_LOCK(obj, id) G_STMT_START {         \
+    if (!g_mutex_trylock (&(obj)->locks[id]))      \
+        dream_lock_wait (obj, id);                 \
 } G_STMT_END
 
-#define DREAMRTSPSERVER_UNLOCK(obj) G_STMT_START { \
-    GST_LOG_OBJECT (obj,                           \
-                    "UNLOCKING from thread %p",    \
-                    g_thread_self ());             \
-    g_mutex_unlock (&obj->rtsp_mutex);             \
-} G_STMT_END
+#define DREAM_UNLOCK(obj, id) g_mutex_unlock (&(obj)->locks[id])
+
+#define UPSTREAM_LOCK(obj)   DREAM_LOCK (obj, DREAM_LOCK_UPSTREAM)
+#define UPSTREAM_UNLOCK(obj) DREAM_UNLOCK (obj, DREAM_LOCK_UPSTREAM)
+#define RTSP_LOCK(obj)       DREAM_LOCK (obj, DREAM_LOCK_RTSP)
+#define RTSP_UNLOCK(obj)     DREAM_UNLOCK (obj, DREAM_LOCK_RTSP)
+#define HLS_LOCK(obj)        DREAM_LOCK (obj, DREAM_LOCK_HLS)
+#define HLS_UNLOCK(obj)      DREAM_UNLOCK (obj, DREAM_LOCK_HLS)
 
 G_BEGIN_DECLS
 
@@ -121,36 +233,76 @@ typedef enum {
 	HLS_STATE_RUNNING = 2
 } hlsState;
 
+typedef enum {
+	VIDEO_SWITCH_IDLE = 0,
+	VIDEO_SWITCH_WAIT_CAPS = 1,
+	VIDEO_SWITCH_WAIT_KEYFRAME = 2
+} videoSwitchState;
+
 typedef struct {
 	GstElement *tstcpq, *tcpsink;
+	DreamBranch *branch;
 	char token[TOKEN_LEN+1];
 	upstreamState state;
 	guint overrun_counter;
-	GstClockTime overrun_period, measure_start;
+	GstClockTime overrun_period;
 	guint id_signal_overrun, id_signal_waiting, id_signal_keepalive;
-	gulong id_resume, id_bitrate_measure;
-	gsize bitrate_sum;
+	gulong id_resume;
 	gint bitrate_avg;
 	gboolean auto_bitrate;
 } DreamTCPupstream;
 
+/* referenced by the variant list and by the streaming threads' snapshots.
+ * start_pts and start_dts are written by the video thread before it sets
+ * started, the audio thread only reads them afterwards */
+typedef struct {
+	gint refcount;
+	GstRTSPMedia *media;
+	gchar *key;
+	GstElement *aappsrc, *vappsrc;
+	GstClockTime start_pts, start_dts;
+	gint started;
+} DreamRTSPVariant;
+
 typedef struct {
 	GstDreamRTSPServer *server;
 	GstRTSPMountPoints *mounts;
-	GstDreamRTSPMediaFactory *es_factory, *ts_factory;
+	GstDreamRTSPMediaFactory *es_factory, *ts_factory, *timeshift_factory;
 	GstRTSPMedia *es_media, *ts_media;
 	GstElement *artspq, *vrtspq, *tsrtspq;
 	GstElement *es_aappsrc, *es_vappsrc;
 	GstElement *ts_appsrc;
 	GstElement *aappsink, *vappsink, *tsappsink;
+	/* own the queues and appsinks above, cleared once detached */
+	DreamBranch *abranch, *vbranch, *tsbranch;
+	/* written once per media by the first keyframe, readers check
+	 * rtsp_started before touching them */
 	GstClockTime rtsp_start_pts, rtsp_start_dts;
+	gint rtsp_started;
 	gchar *rtsp_user, *rtsp_pass;
 	GList *clients_list;
+	gint clients_count;
 	gchar *rtsp_port;
-	gchar *rtsp_ts_path, *rtsp_es_path;
+	gchar *rtsp_ts_path, *rtsp_es_path, *rtsp_timeshift_path;
 	guint source_id;
 	rtspState state;
 	gchar *uri_parameters;
+	guint backlog_bytes, backlog_drop_ms, backlog_evict_ms;
+	/* atomic, bumped on the control context and by the streaming threads,
+	 * read by the D-Bus getter and the metrics scraper */
+	guint congested_count, dropped_count, resumed_count, evicted_count;
+	guint id_backlog_check;
+	GList *resuming_es_clients, *resuming_ts_clients;
+	gint resuming_count;
+	GList *variants;
+	/* bumped with every change of the variant list. each ES appsink's
+	 * streaming thread keeps a snapshot of the list, audio at 0 and video
+	 * at 1, and only takes the lock to renew it after a change */
+	gint variants_gen;
+	GPtrArray *variants_snapshot[2];
+	gint variants_snapshot_gen[2];
+	GstDreamRTSPThreadPool *thread_pool;
+	gint max_threads;
 } DreamRTSPserver;
 
 typedef struct {
@@ -159,20 +311,155 @@ typedef struct {
 	gboolean gopOnSceneChange, openGop;
 } SourceProperties;
 
+/* last known encoder settings, kept up to date by notify:: and caps events
+ * so D-Bus reads never touch the source elements */
+typedef struct {
+	GMutex lock;
+	gboolean valid;
+	SourceProperties source;
+	gint32 input_mode;
+	/* GstState of the source pipeline as of its last state change message */
+	gint source_state;
+} DreamPropertyCache;
+
 typedef struct {
 	GstElement *queue;
 	GstElement *hlssink;
+	DreamBranch *branch;
 	hlsState state;
 	SoupServer *soupserver;
 	SoupAuthDomain *soupauthdomain;
 	guint port;
 	gchar *hls_user, *hls_pass;
 	guint id_timeout;
+	gint starting;
+	/* fragment indexes which follow a video switch, guarded by the HLS lock */
+	GArray *discontinuities;
+	/* discontinuities which already left the playlist, guarded by the HLS lock */
+	guint discontinuity_sequence;
+	/* the switch key unit reached hlssink, the next closed fragment precedes it */
+	gboolean discontinuity_marked;
 } DreamHLSserver;
 
+/* a caps change of the video source in flight, see video_switch_probe() */
+typedef struct {
+	gint state;
+	GstClockTime start;
+	guint dropped;
+	/* running time of the switch keyframe until its key unit reaches hlssink */
+	guint64 hls_switch_time;
+} DreamVideoSwitch;
+
+/* IDRs requested for new consumers, see request_keyframe() */
+typedef struct {
+	gint pending;
+	gint64 last;
+} DreamKeyframeRequests;
+
+typedef enum {
+	SHM_STREAM_TS,
+	SHM_STREAM_VIDEO,
+	SHM_STREAM_AUDIO,
+	SHM_STREAM_LAST
+} DreamShmStreamId;
+
+typedef struct {
+	gboolean enabled;
+	DreamShmRing *ring;
+	DreamBranch *branch;
+	GstElement *queue, *appsink;
+	/* only used by the appsink's streaming thread */
+	GstCaps *caps;
+} DreamShmStream;
+
+/* streams are enabled and disabled on the control context, the lock
+ * guards the rings against the stats readers on other threads */
+typedef struct {
+	GMutex lock;
+	gsize size;
+	DreamShmStream streams[SHM_STREAM_LAST];
+} DreamShmExport;
+
+/* enabled and disabled on the control context, the lock guards the server
+ * against the stats readers. the encoders only run while clients are
+ * connected, their count is updated from the unix service thread */
+typedef struct {
+	GMutex lock;
+	gboolean enabled;
+	DreamUnixServer *server;
+	DreamBranch *branch;
+	GstElement *queue, *appsink;
+	gint clients;
+} DreamUnixOutput;
+
+/* enabled and disabled on the control context. the lock guards the store
+ * against the RTSP and HTTP threads which take their own references. the
+ * store keeps the encoders running, it records without any viewer */
+typedef struct {
+	GMutex lock;
+	gboolean enabled;
+	DreamTimeshift *store;
+	DreamBranch *branch;
+	GstElement *queue, *appsink;
+	/* reads the segments HTTP serves, lives as long as the http thread */
+	GThreadPool *readers;
+} DreamTimeshiftOutput;
+
+/* enabled and disabled on the control context, the lock guards the
+ * recorder against the D-Bus and metrics threads. a detached recorder is
+ * stopping until its thread wrote out the rest */
+typedef struct {
+	GMutex lock;
+	gboolean enabled;
+	DreamRecorder *recorder, *stopping;
+	DreamBranch *branch;
+	GstElement *queue, *appsink;
+} DreamRecordingOutput;
+
+/* the source pipeline is built once and survives its outputs. without any
+ * consumer the encoders are paused, see idle_source_pipeline() */
+typedef struct {
+	gint requested;
+	gint active;
+	GstClockTime since;
+	GstClockTime wake;
+} DreamSourceIdle;
+
+/* threading rules:
+ * - the default main context which runs app->loop is the control context.
+ *   the source pipeline is only built, (un)linked and changes state from
+ *   here and all g_timeout_add() sources of the daemon live here as well.
+ * - the RTSP server, the soup HLS server, the D-Bus object and the UNIX
+ *   socket listener each run on their own service thread with a private
+ *   main context.
+ * - services never block on the pipeline. whatever touches it is handed to
+ *   the control context with g_main_context_invoke (NULL, ...) and answered
+ *   asynchronously (D-Bus invocations, paused soup messages).
+ * - objects which aren't thread safe (soup) are only touched from their own
+ *   service thread, see service_thread_call().
+ * - state shared between threads is protected by the lock of the output
+ *   it belongs to: UPSTREAM_LOCK, RTSP_LOCK or HLS_LOCK. when more than one
+ *   is needed they are taken in that order, the private locks of branches,
+ *   probes and the rate controller nest inside all of them. none of them is
+ *   held across a state change which waits for a streaming thread.
+ * - flags which streaming threads check per buffer (client counts, the RTSP
+ *   start timestamps) are atomics and don't need a lock.
+ * - D-Bus signals are posted to the signal dispatcher which emits them on
+ *   its own service thread, so send_signal() is safe on streaming threads.
+ */
+typedef struct {
+	const gchar *name;
+	GMainContext *context;
+	GMainLoop *loop;
+	GThread *thread;
+} DreamServiceThread;
+
 typedef struct {
 	GDBusConnection *dbus_connection;
 	GMainLoop *loop;
+	DreamServiceThread rtsp_service, http_service, dbus_service, signal_service, local_service;
+	DreamSignalDispatcher *signals;
+	gboolean sync_signals;
 	GstElement *pipeline;
 	GstElement *asrc, *vsrc, *aparse, *vparse;
 	GstElement *tsmux, *tstee;
@@ -181,9 +468,26 @@ typedef struct {
 	DreamTCPupstream *tcp_upstream;
 	DreamRTSPserver *rtsp_server;
 	DreamHLSserver *hls_server;
-	GMutex rtsp_mutex;
+	GMutex locks[DREAM_LOCK_LAST];
 	GstClock *clock;
 	SourceProperties source_properties;
+	DreamPropertyCache properties;
+	DreamVideoSwitch video_switch;
+	DreamKeyframeRequests keyframes;
+	DreamSourceIdle idle;
+	DreamRateController *rate;
+	gint rate_kbps;
+	DreamThreadPolicy *threads;
+	DreamBudget *budget;
+	guint id_budget;
+	DreamArena *arena;
+	DreamShmExport shm;
+	DreamUnixOutput local;
+	DreamTimeshiftOutput timeshift;
+	DreamRecordingOutput recording;
+	gboolean synthetic;
+	guint metrics_port;
+	SoupServer *metrics_server;
 } App;
 
 static const gchar service[] = "com.dreambox.RTSPserver";
@@ -198,6 +502,7 @@ static const gchar introspection_xml[] =
   "      <arg type='i' name='state' direction='out'/>"
   "    </signal>"
   "    <property type='i' name='sourceState' access='read'/>"
+  "    <property type='b' name='sourceIdle' access='read'/>"
   "    <property type='i' name='audioBitrate' access='readwrite'/>"
   "    <property type='i' name='videoBitrate' access='readwrite'/>"
   "    <property type='i' name='gopLength' access='readwrite'/>"
@@ -216,6 +521,12 @@ static const gchar introspection_xml[] =
   "      <arg type='i' name='width' direction='in'/>"
   "      <arg type='i' name='height' direction='in'/>"
   "    </method>"
+  "    <method name='reconfigure'>"
+  "      <arg type='a{sv}' name='changes' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "      <arg type='t' name='keyframePts' direction='out'/>"
+  "      <arg type='t' name='keyframeDelay' direction='out'/>"
+  "    </method>"
   "    <method name='enableHLS'>"
   "      <arg type='b' name='state' direction='in'/>"
   "      <arg type='u' name='port' direction='in'/>"
@@ -256,6 +567,76 @@ static const gchar introspection_xml[] =
   "      <arg type='s' name='host' direction='out'/>"
   "    </signal>"
   "    <property type='i' name='rtspClientCount' access='read'/>"
+  "    <method name='setRTSPBacklogLimits'>"
+  "      <arg type='u' name='bytes' direction='in'/>"
+  "      <arg type='u' name='dropMs' direction='in'/>"
+  "      <arg type='u' name='evictMs' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(uuu)' name='rtspBacklogLimits' access='read'/>"
+  "    <property type='(uuuu)' name='rtspCongestionCounters' access='read'/>"
+  "    <method name='setRTSPThreadPool'>"
+  "      <arg type='i' name='maxThreads' direction='in'/>"
+  "      <arg type='s' name='affinity' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(is)' name='rtspThreadPool' access='read'/>"
+  "    <property type='a(uibuttt)' name='rtspThreadStats' access='read'/>"
+  "    <method name='setThreadPolicy'>"
+  "      <arg type='s' name='threadClass' direction='in'/>"
+  "      <arg type='i' name='priority' direction='in'/>"
+  "      <arg type='s' name='cpus' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='a(sis)' name='threadPolicy' access='read'/>"
+  "    <property type='a(ssuttt)' name='threadStats' access='read'/>"
+  "    <method name='setBufferBudget'>"
+  "      <arg type='t' name='bytes' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(ttdt)' name='bufferBudget' access='read'/>"
+  "    <property type='a(suuu)' name='bufferBudgetQueues' access='read'/>"
+  "    <property type='(ta(utttu))' name='allocStats' access='read'/>"
+  "    <method name='enableSharedMemory'>"
+  "      <arg type='b' name='state' direction='in'/>"
+  "      <arg type='s' name='streams' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='a(sstttt)' name='sharedMemory' access='read'/>"
+  "    <method name='enableUnixSocket'>"
+  "      <arg type='b' name='state' direction='in'/>"
+  "      <arg type='s' name='path' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(sutttt)' name='unixSocket' access='read'/>"
+  "    <method name='enableTimeshift'>"
+  "      <arg type='b' name='state' direction='in'/>"
+  "      <arg type='s' name='directory' direction='in'/>"
+  "      <arg type='u' name='megabytes' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(sbttbdutttt)' name='timeshift' access='read'/>"
+  "    <method name='enableRecording'>"
+  "      <arg type='b' name='state' direction='in'/>"
+  "      <arg type='s' name='directory' direction='in'/>"
+  "      <arg type='u' name='megabytes' direction='in'/>"
+  "      <arg type='u' name='seconds' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(ssubtttttttttt)' name='recording' access='read'/>"
+  "    <signal name='recordingError'>"
+  "      <arg type='s' name='directory' direction='out'/>"
+  "      <arg type='s' name='error' direction='out'/>"
+  "    </signal>"
+  "    <signal name='rtspClientCongestionChanged'>"
+  "      <arg type='s' name='host' direction='out'/>"
+  "      <arg type='i' name='stage' direction='out'/>"
+  "      <arg type='u' name='backlog' direction='out'/>"
+  "    </signal>"
+  "    <signal name='rtspClientEvicted'>"
+  "      <arg type='s' name='host' direction='out'/>"
+  "      <arg type='s' name='reason' direction='out'/>"
+  "    </signal>"
   "    <signal name='uriParametersChanged'>"
   "      <arg type='s' name='parameters' direction='out'/>"
   "    </signal>"
@@ -263,8 +644,23 @@ static const gchar introspection_xml[] =
   "      <arg type='i' name='state' direction='out'/>"
   "    </signal>"
   "    <property type='i' name='rtspState' access='read'/>"
+  "    <method name='getState'>"
+  "      <arg type='a{sv}' name='state' direction='out'/>"
+  "    </method>"
   "    <property type='s' name='uriParameters' access='read'/>"
+  "    <property type='as' name='rtspVariants' access='read'/>"
   "    <property type='b' name='autoBitrate' access='readwrite'/>"
+  "    <property type='b' name='latencyTracing' access='readwrite'/>"
+  "    <property type='a(ssttat)' name='latencyStats' access='read'/>"
+  "    <property type='a(sttttdduutt)' name='probeStats' access='read'/>"
+  "    <method name='setAdaptiveBitrate'>"
+  "      <arg type='b' name='enabled' direction='in'/>"
+  "      <arg type='i' name='minKbps' direction='in'/>"
+  "      <arg type='i' name='maxKbps' direction='in'/>"
+  "      <arg type='b' name='result' direction='out'/>"
+  "    </method>"
+  "    <property type='(bii)' name='adaptiveBitrate' access='read'/>"
+  "    <property type='(iiudddtttttt)' name='adaptiveBitrateStats' access='read'/>"
   "    <signal name='encoderError'/>"
   "  </interface>"
   "</node>";
@@ -290,7 +686,7 @@ gboolean assert_state(App *app, GstElement *element, GstState targetstate);
 
 static gboolean message_cb (GstBus * bus, GstMessage * message, gpointer user_data);
 static GstPadProbeReturn cancel_waiting_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data);
-static GstPadProbeReturn bitrate_measure_probe (GstPad * sinkpad, GstPadProbeInfo * info, gpointer user_data);
+static void upstream_bitrate_measured (DreamProbe *probe, guint64 bitrate, gpointer user_data);
 gboolean upstream_keep_alive(App *app);
 gboolean upstream_set_waiting(App *app);
 gboolean upstream_resume_transmitting(App *app);
@@ -298,9 +694,12 @@ static GstPadProbeReturn inject_authorization (GstPad * sinkpad, GstPadProbeInfo
 static void queue_underrun (GstElement *, gpointer);
 static void queue_overrun (GstElement *, gpointer);
 static void auto_adjust_bitrate(App *app);
+static void rtsp_detach_branches (App *app);
+static void dream_lock_wait (App *app, DreamLockId id);
 
 gboolean create_source_pipeline(App *app);
-gboolean halt_source_pipeline(App *app);
+gboolean idle_source_pipeline(App *app);
+gboolean wake_source_pipeline(App *app);
 gboolean pause_source_pipeline(App *app);
 gboolean unpause_source_pipeline(App *app);
 gboolean destroy_pipeline(App *app);
@@ -308,6 +707,12 @@ gboolean watchdog_ping(gpointer user_data);
 gboolean quit_signal(gpointer loop);
 gboolean get_dot_graph (gpointer user_data);
 
+void service_thread_init (DreamServiceThread *s, const gchar *name);
+void service_thread_start (DreamServiceThread *s);
+void service_thread_stop (DreamServiceThread *s);
+void service_thread_clear (DreamServiceThread *s);
+void service_thread_call (DreamServiceThread *s, GSourceFunc func, gpointer data);
+
 DreamHLSserver *create_hls_server(App *app);
 gboolean enable_hls_server(App *app, guint port, const gchar *user, const gchar *pass);
 gboolean start_hls_pipeline(App *app);
@@ -316,6 +721,20 @@ gboolean disable_hls_server(App *app);
 gboolean hls_client_timeout (gpointer user_data);
 static void soup_do_get (SoupServer *server, SoupMessage *msg, const char *path, App *app);
 static void soup_server_callback (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *context, gpointer data);
+static gboolean soup_server_setup (gpointer user_data);
+static gboolean soup_server_teardown (gpointer user_data);
+static void metrics_soup_callback (SoupServer *server, SoupMessage *msg, const char *path, GHashTable *query, SoupClientContext *context, gpointer data);
+static gboolean metrics_server_setup (gpointer user_data);
+static gboolean metrics_server_teardown (gpointer user_data);
+
+gboolean enable_shm_export(App *app, const gchar *streams);
+gboolean disable_shm_export(App *app, const gchar *streams);
+gboolean enable_unix_output(App *app, const gchar *path);
+gboolean disable_unix_output(App *app);
+gboolean enable_timeshift(App *app, const gchar *directory, guint megabytes);
+gboolean disable_timeshift(App *app);
+gboolean enable_recording(App *app, const gchar *directory, guint megabytes, guint seconds);
+gboolean disable_recording(App *app);
 
 gboolean enable_tcp_upstream(App *app, const gchar *upstream_host, guint32 upstream_port, const gchar *token);
 gboolean disable_tcp_upstream(App *app);
@@ -324,6 +743,7 @@ DreamRTSPserver *create_rtsp_server(App *app);
 gboolean enable_rtsp_server(App *app, const gchar *path, guint32 port, const gchar *user, const gchar *pass);
 gboolean disable_rtsp_server(App *app);
 gboolean start_rtsp_pipeline(App *app);
+gboolean rtsp_backlog_check(gpointer user_data);
 
 static void encoder_signal_lost(GstElement *, gpointer user_data);
 
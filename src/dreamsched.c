@@ -0,0 +1,366 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "dreamsched.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreamsched_debug);
+#define GST_CAT_DEFAULT dreamsched_debug
+
+static const gchar *class_names[DREAM_THREAD_CLASS_LAST] = { "source", "rtsp", "hls", "upstream" };
+
+typedef struct {
+	gint priority;
+	gchar *cpus;
+	cpu_set_t set;
+} DreamThreadClassPolicy;
+
+/* what a pooled thread looked like before it was registered */
+typedef struct {
+	gint tid;
+	gchar name[16];
+	gint policy;
+	struct sched_param param;
+	cpu_set_t set;
+} DreamThreadOrigin;
+
+struct _DreamThreadPolicy {
+	GMutex lock;
+	DreamThreadClassPolicy classes[DREAM_THREAD_CLASS_LAST];
+	GArray *threads;
+	GArray *origins;
+};
+
+static GQuark class_quark (void)
+{
+	static GQuark quark = 0;
+	if (!quark)
+		quark = g_quark_from_static_string ("dream-thread-class");
+	return quark;
+}
+
+/* cpus is a list like "0,2-3", empty means all of them */
+static gboolean parse_cpus (const gchar *cpus, cpu_set_t *set)
+{
+	gint n_cpus = g_get_num_processors ();
+	gchar **ranges, **range;
+	gboolean ret = TRUE, any = FALSE;
+
+	CPU_ZERO (set);
+	ranges = g_strsplit (cpus ? cpus : "", ",", -1);
+	for (range = ranges; *range && ret; range++)
+	{
+		gchar *end;
+		gint64 first, last;
+		if (!**range)
+			continue;
+		first = last = g_ascii_strtoll (*range, &end, 10);
+		if (*end == '-')
+			last = g_ascii_strtoll (end+1, &end, 10);
+		if (*end || first < 0 || last < first || last >= n_cpus || last >= CPU_SETSIZE)
+			ret = FALSE;
+		for (; ret && first <= last; first++)
+		{
+			CPU_SET (first, set);
+			any = TRUE;
+		}
+	}
+	g_strfreev (ranges);
+
+	if (ret && !any)
+	{
+		gint cpu;
+		for (cpu = 0; cpu < n_cpus && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET (cpu, set);
+	}
+	return ret;
+}
+
+static void thread_apply (const DreamThreadStats *t, const DreamThreadClassPolicy *p)
+{
+	struct sched_param param;
+
+	memset (&param, 0, sizeof (param));
+	param.sched_priority = p->priority;
+	if (sched_setscheduler (t->tid, p->priority ? SCHED_FIFO : SCHED_OTHER, &param) < 0)
+		GST_WARNING ("couldn't set priority %d of thread %s: %s", p->priority, t->name, g_strerror (errno));
+	if (sched_setaffinity (t->tid, sizeof (cpu_set_t), &p->set) < 0)
+		GST_WARNING ("couldn't pin thread %s to cpus '%s': %s", t->name, p->cpus, g_strerror (errno));
+	GST_DEBUG ("thread %s (%d) %s priority %d cpus '%s'", t->name, t->tid, class_names[t->cls], p->priority, p->cpus);
+}
+
+static DreamThreadClass element_class (GstElement *element)
+{
+	GstObject *object = gst_object_ref (GST_OBJECT (element));
+
+	while (object)
+	{
+		gpointer cls = g_object_get_qdata (G_OBJECT (object), class_quark ());
+		GstObject *parent;
+		if (cls)
+		{
+			gst_object_unref (object);
+			return GPOINTER_TO_INT (cls) - 1;
+		}
+		parent = gst_object_get_parent (object);
+		gst_object_unref (object);
+		object = parent;
+	}
+	return DREAM_THREAD_CLASS_LAST;
+}
+
+/* runs on the streaming thread which just started */
+static void thread_enter (DreamThreadPolicy *tp, GstElement *owner)
+{
+	DreamThreadStats t;
+	DreamThreadOrigin o;
+	DreamThreadClassPolicy *p;
+
+	memset (&t, 0, sizeof (t));
+	t.cls = element_class (owner);
+	if (t.cls == DREAM_THREAD_CLASS_LAST)
+		return;
+	t.tid = syscall (SYS_gettid);
+	memset (&o, 0, sizeof (o));
+	o.tid = t.tid;
+	pthread_getname_np (pthread_self (), o.name, sizeof (o.name));
+	o.policy = sched_getscheduler (0);
+	sched_getparam (0, &o.param);
+	if (sched_getaffinity (0, sizeof (cpu_set_t), &o.set) < 0)
+		CPU_ZERO (&o.set);
+	g_strlcpy (t.name, GST_OBJECT_NAME (owner), sizeof (t.name));
+	pthread_setname_np (pthread_self (), t.name);
+
+	g_mutex_lock (&tp->lock);
+	g_array_append_val (tp->threads, t);
+	g_array_append_val (tp->origins, o);
+	p = &tp->classes[t.cls];
+	/* threads of untouched classes keep what they inherited */
+	if (p->priority || p->cpus)
+		thread_apply (&t, p);
+	g_mutex_unlock (&tp->lock);
+	GST_INFO ("streaming thread %s (%d) entered, class %s", t.name, t.tid, class_names[t.cls]);
+}
+
+/* runs on the streaming thread which is about to go back into the task
+ * pool, the next task gets it in the state it came in with */
+static void thread_leave (DreamThreadPolicy *tp)
+{
+	gint tid = syscall (SYS_gettid);
+	DreamThreadOrigin o;
+	gboolean found = FALSE;
+	guint i;
+
+	g_mutex_lock (&tp->lock);
+	for (i = 0; i < tp->threads->len; i++)
+	{
+		if (g_array_index (tp->threads, DreamThreadStats, i).tid == tid)
+		{
+			g_array_remove_index_fast (tp->threads, i);
+			break;
+		}
+	}
+	for (i = 0; i < tp->origins->len; i++)
+	{
+		if (g_array_index (tp->origins, DreamThreadOrigin, i).tid == tid)
+		{
+			o = g_array_index (tp->origins, DreamThreadOrigin, i);
+			g_array_remove_index_fast (tp->origins, i);
+			found = TRUE;
+			break;
+		}
+	}
+	g_mutex_unlock (&tp->lock);
+	if (!found)
+		return;
+
+	if (o.policy >= 0 && sched_setscheduler (0, o.policy, &o.param) < 0)
+		GST_WARNING ("couldn't restore the scheduling of thread %d: %s", tid, g_strerror (errno));
+	if (CPU_COUNT (&o.set) && sched_setaffinity (0, sizeof (cpu_set_t), &o.set) < 0)
+		GST_WARNING ("couldn't restore the affinity of thread %d: %s", tid, g_strerror (errno));
+	pthread_setname_np (pthread_self (), o.name);
+}
+
+static void stream_status (GstBus *bus, GstMessage *message, gpointer user_data)
+{
+	GstStreamStatusType type;
+	GstElement *owner;
+
+	gst_message_parse_stream_status (message, &type, &owner);
+	if (type == GST_STREAM_STATUS_TYPE_ENTER)
+		thread_enter (user_data, owner);
+	else if (type == GST_STREAM_STATUS_TYPE_LEAVE)
+		thread_leave (user_data);
+}
+
+DreamThreadPolicy *dream_thread_policy_new (void)
+{
+	DreamThreadPolicy *tp = g_new0 (DreamThreadPolicy, 1);
+	guint i;
+
+	GST_DEBUG_CATEGORY_INIT (dreamsched_debug, "dreamsched", 0, "dreamrtspserver thread policy");
+	g_mutex_init (&tp->lock);
+	for (i = 0; i < DREAM_THREAD_CLASS_LAST; i++)
+		parse_cpus (NULL, &tp->classes[i].set);
+	tp->threads = g_array_new (FALSE, FALSE, sizeof (DreamThreadStats));
+	tp->origins = g_array_new (FALSE, FALSE, sizeof (DreamThreadOrigin));
+	return tp;
+}
+
+void dream_thread_policy_free (DreamThreadPolicy *tp)
+{
+	guint i;
+
+	for (i = 0; i < DREAM_THREAD_CLASS_LAST; i++)
+		g_free (tp->classes[i].cpus);
+	g_array_free (tp->threads, TRUE);
+	g_array_free (tp->origins, TRUE);
+	g_mutex_clear (&tp->lock);
+	g_free (tp);
+}
+
+/* priority 0 is normal scheduling, 1-99 SCHED_FIFO. the kernel's rt
+ * throttling still leaves the rest of the box a share of each cpu */
+gboolean dream_thread_policy_set (DreamThreadPolicy *tp, DreamThreadClass cls, gint priority, const gchar *cpus)
+{
+	DreamThreadClassPolicy *p;
+	cpu_set_t set;
+	guint i;
+
+	if (cls >= DREAM_THREAD_CLASS_LAST || priority < 0 || priority > sched_get_priority_max (SCHED_FIFO))
+		return FALSE;
+	if (!parse_cpus (cpus, &set))
+	{
+		GST_WARNING ("invalid cpu list '%s' (%i cpus available)", cpus, g_get_num_processors ());
+		return FALSE;
+	}
+
+	g_mutex_lock (&tp->lock);
+	p = &tp->classes[cls];
+	p->priority = priority;
+	g_free (p->cpus);
+	p->cpus = cpus && *cpus ? g_strdup (cpus) : NULL;
+	p->set = set;
+	for (i = 0; i < tp->threads->len; i++)
+	{
+		DreamThreadStats *t = &g_array_index (tp->threads, DreamThreadStats, i);
+		if (t->cls == cls)
+			thread_apply (t, p);
+	}
+	g_mutex_unlock (&tp->lock);
+	GST_INFO ("%s threads: priority %d cpus '%s'", class_names[cls], priority, cpus ? cpus : "");
+	return TRUE;
+}
+
+/* "class:priority[:cpus]" separated by ';', e.g. "source:50:0;hls:0:1-3" */
+gboolean dream_thread_policy_parse (DreamThreadPolicy *tp, const gchar *policy)
+{
+	gchar **entries, **entry;
+	gboolean ret = TRUE;
+
+	entries = g_strsplit (policy ? policy : "", ";", -1);
+	for (entry = entries; *entry && ret; entry++)
+	{
+		gchar **fields, *end;
+		gint cls, priority;
+		if (!**entry)
+			continue;
+		fields = g_strsplit (*entry, ":", 3);
+		cls = dream_thread_class_from_name (fields[0]);
+		priority = fields[1] ? g_ascii_strtoll (fields[1], &end, 10) : 0;
+		if (cls < 0 || !fields[1] || *end || !dream_thread_policy_set (tp, cls, priority, fields[2]))
+		{
+			GST_WARNING ("invalid thread policy '%s'", *entry);
+			ret = FALSE;
+		}
+		g_strfreev (fields);
+	}
+	g_strfreev (entries);
+	return ret;
+}
+
+void dream_thread_policy_get (DreamThreadPolicy *tp, DreamThreadClass cls, gint *priority, gchar **cpus)
+{
+	g_mutex_lock (&tp->lock);
+	*priority = tp->classes[cls].priority;
+	*cpus = g_strdup (tp->classes[cls].cpus ? tp->classes[cls].cpus : "");
+	g_mutex_unlock (&tp->lock);
+}
+
+/* the threads of element and everything inside it belong to cls */
+void dream_thread_policy_tag (GstElement *element, DreamThreadClass cls)
+{
+	g_object_set_qdata (G_OBJECT (element), class_quark (), GINT_TO_POINTER (cls + 1));
+}
+
+/* stream-status messages are handled synchronously on the thread which
+ * posts them, that is the streaming thread itself */
+void dream_thread_policy_watch (DreamThreadPolicy *tp, GstBus *bus)
+{
+	gst_bus_enable_sync_message_emission (bus);
+	g_signal_connect (bus, "sync-message::stream-status", G_CALLBACK (stream_status), tp);
+}
+
+/* registered threads with their scheduler statistics */
+GArray *dream_thread_policy_snapshot (DreamThreadPolicy *tp)
+{
+	GArray *threads;
+	guint i;
+
+	g_mutex_lock (&tp->lock);
+	threads = g_array_sized_new (FALSE, FALSE, sizeof (DreamThreadStats), tp->threads->len);
+	g_array_append_vals (threads, tp->threads->data, tp->threads->len);
+	g_mutex_unlock (&tp->lock);
+
+	for (i = 0; i < threads->len; i++)
+	{
+		DreamThreadStats *t = &g_array_index (threads, DreamThreadStats, i);
+		gchar *path = g_strdup_printf ("/proc/self/task/%d/schedstat", t->tid);
+		FILE *f = fopen (path, "r");
+		if (f)
+		{
+			if (fscanf (f, "%" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT " %" G_GUINT64_FORMAT, &t->run_ns, &t->wait_ns, &t->timeslices) != 3)
+				t->run_ns = t->wait_ns = t->timeslices = 0;
+			fclose (f);
+		}
+		g_free (path);
+	}
+	return threads;
+}
+
+const gchar *dream_thread_class_name (DreamThreadClass cls)
+{
+	return cls < DREAM_THREAD_CLASS_LAST ? class_names[cls] : NULL;
+}
+
+gint dream_thread_class_from_name (const gchar *name)
+{
+	gint i;
+
+	for (i = 0; i < DREAM_THREAD_CLASS_LAST; i++)
+		if (g_strcmp0 (name, class_names[i]) == 0)
+			return i;
+	return -1;
+}
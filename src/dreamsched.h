@@ -0,0 +1,63 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gst/gst.h>
+
+#ifndef __DREAMSCHED_H__
+#define __DREAMSCHED_H__
+
+G_BEGIN_DECLS
+
+/* scheduling of the source pipeline's streaming threads. elements are
+ * tagged with the class of their threads, each thread registers itself
+ * from its stream-status message, is named after its element and gets the
+ * priority and cpus of its class. changing a class also moves the threads
+ * which are already running */
+typedef enum {
+	DREAM_THREAD_SOURCE,   /* encoders, their queues and the muxer */
+	DREAM_THREAD_RTSP,
+	DREAM_THREAD_HLS,
+	DREAM_THREAD_UPSTREAM,
+	DREAM_THREAD_CLASS_LAST
+} DreamThreadClass;
+
+typedef struct _DreamThreadPolicy DreamThreadPolicy;
+
+typedef struct {
+	gchar name[16];
+	DreamThreadClass cls;
+	gint tid;
+	/* from /proc/self/task/<tid>/schedstat: time on a cpu, time spent
+	 * runnable but waiting for one and the number of timeslices */
+	guint64 run_ns, wait_ns, timeslices;
+} DreamThreadStats;
+
+DreamThreadPolicy * dream_thread_policy_new      (void);
+void                dream_thread_policy_free     (DreamThreadPolicy *tp);
+gboolean            dream_thread_policy_set      (DreamThreadPolicy *tp, DreamThreadClass cls, gint priority, const gchar *cpus);
+gboolean            dream_thread_policy_parse    (DreamThreadPolicy *tp, const gchar *policy);
+void                dream_thread_policy_get      (DreamThreadPolicy *tp, DreamThreadClass cls, gint *priority, gchar **cpus);
+void                dream_thread_policy_tag      (GstElement *element, DreamThreadClass cls);
+void                dream_thread_policy_watch    (DreamThreadPolicy *tp, GstBus *bus);
+GArray *            dream_thread_policy_snapshot (DreamThreadPolicy *tp);
+const gchar *       dream_thread_class_name      (DreamThreadClass cls);
+gint                dream_thread_class_from_name (const gchar *name);
+
+G_END_DECLS
+
+#endif /* __DREAMSCHED_H__ */
@@ -0,0 +1,196 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <gst/gst.h>
+
+#include "dreamshm.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreamshm_debug);
+#define GST_CAT_DEFAULT dreamshm_debug
+
+G_STATIC_ASSERT (sizeof (DreamShmHeader) <= DREAM_SHM_HEADER_SIZE);
+
+struct _DreamShmRing {
+	gchar *name;
+	DreamShmHeader *header;
+	guint8 *data;
+	gsize map_size;
+	/* the writer's own copies, only the streaming thread touches them */
+	guint64 pos, seq;
+	/* read by the stats from other threads */
+	guint64 bytes, records, keyframes, dropped;
+};
+
+/* capacity is rounded up to a power of two */
+DreamShmRing *dream_shm_ring_new (const gchar *name, gsize capacity)
+{
+	DreamShmRing *ring;
+	gsize size = 4096;
+	gpointer map;
+	int fd;
+
+	GST_DEBUG_CATEGORY_INIT (dreamshm_debug, "dreamshm", 0, "dreamrtspserver shared memory export");
+	while (size < capacity)
+		size <<= 1;
+
+	/* a leftover of a previous run may still be mapped by readers, they
+	 * keep their copy and see it closed */
+	shm_unlink (name);
+	fd = shm_open (name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+	{
+		GST_WARNING ("couldn't create shared memory %s: %s", name, g_strerror (errno));
+		return NULL;
+	}
+	if (ftruncate (fd, DREAM_SHM_HEADER_SIZE + size) < 0)
+	{
+		GST_WARNING ("couldn't size shared memory %s: %s", name, g_strerror (errno));
+		close (fd);
+		shm_unlink (name);
+		return NULL;
+	}
+	map = mmap (NULL, DREAM_SHM_HEADER_SIZE + size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+	{
+		GST_WARNING ("couldn't map shared memory %s: %s", name, g_strerror (errno));
+		shm_unlink (name);
+		return NULL;
+	}
+
+	ring = g_new0 (DreamShmRing, 1);
+	ring->name = g_strdup (name);
+	ring->map_size = DREAM_SHM_HEADER_SIZE + size;
+	ring->header = map;
+	ring->data = (guint8 *) map + DREAM_SHM_HEADER_SIZE;
+	ring->header->version = DREAM_SHM_VERSION;
+	ring->header->header_size = DREAM_SHM_HEADER_SIZE;
+	ring->header->capacity = size;
+	/* readers check the magic last */
+	__atomic_store_n (&ring->header->magic, DREAM_SHM_MAGIC, __ATOMIC_RELEASE);
+	GST_INFO ("exporting to %s, %" G_GSIZE_FORMAT " bytes", name, size);
+	return ring;
+}
+
+void dream_shm_ring_free (DreamShmRing *ring)
+{
+	__atomic_store_n (&ring->header->closed, 1, __ATOMIC_RELEASE);
+	munmap (ring->header, ring->map_size);
+	shm_unlink (ring->name);
+	GST_INFO ("closed %s after %" G_GUINT64_FORMAT " records", ring->name, ring->records);
+	g_free (ring->name);
+	g_free (ring);
+}
+
+const gchar *dream_shm_ring_get_name (DreamShmRing *ring)
+{
+	return ring->name;
+}
+
+void dream_shm_ring_set_caps (DreamShmRing *ring, const gchar *caps)
+{
+	DreamShmHeader *h = ring->header;
+
+	__atomic_store_n (&h->caps_seq, h->caps_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	g_strlcpy (h->caps, caps, DREAM_SHM_CAPS_LEN);
+	__atomic_store_n (&h->caps_seq, h->caps_seq + 1, __ATOMIC_RELEASE);
+	GST_DEBUG ("%s caps %s", ring->name, caps);
+}
+
+/* the positions are guarded like the caps, readers retry while pos_seq is
+ * odd or changed under them */
+static void positions_begin (DreamShmHeader *h)
+{
+	__atomic_store_n (&h->pos_seq, h->pos_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}
+
+static void positions_end (DreamShmHeader *h)
+{
+	__atomic_store_n (&h->pos_seq, h->pos_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void ring_copy_in (DreamShmRing *ring, guint64 pos, gconstpointer src, gsize len)
+{
+	guint64 capacity = ring->header->capacity;
+	gsize offset = pos & (capacity - 1);
+	gsize first = MIN (len, capacity - offset);
+
+	memcpy (ring->data + offset, src, first);
+	memcpy (ring->data, (const guint8 *) src + first, len - first);
+}
+
+/* called from one streaming thread only */
+void dream_shm_ring_write (DreamShmRing *ring, const guint8 *data, gsize size, guint32 flags, guint64 pts, guint64 dts)
+{
+	DreamShmHeader *h = ring->header;
+	DreamShmRecord record;
+	guint64 len = DREAM_SHM_RECORD_LEN (size);
+
+	if (len > h->capacity / 2)
+	{
+		GST_WARNING ("%s: dropping record of %" G_GSIZE_FORMAT " bytes", ring->name, size);
+		__atomic_fetch_add (&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	record.size = size;
+	record.flags = flags;
+	record.seq = ring->seq++;
+	record.pts = pts;
+	record.dts = dts;
+
+	/* whatever lies behind reserve_pos - capacity may be overwritten now */
+	positions_begin (h);
+	h->reserve_pos = ring->pos + len;
+	positions_end (h);
+	/* no reader may see the new data before the new reserve_pos */
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	ring_copy_in (ring, ring->pos, &record, sizeof (record));
+	ring_copy_in (ring, ring->pos + sizeof (record), data, size);
+
+	positions_begin (h);
+	h->write_pos = ring->pos + len;
+	if (flags & DREAM_SHM_FLAG_KEYFRAME)
+	{
+		DreamShmKeyframe *k = &h->keyframe[h->keyframes % DREAM_SHM_KEYFRAMES];
+		k->pos = ring->pos;
+		k->seq = record.seq;
+		k->pts = pts;
+		h->keyframes++;
+		__atomic_fetch_add (&ring->keyframes, 1, __ATOMIC_RELAXED);
+	}
+	positions_end (h);
+	ring->pos += len;
+	__atomic_fetch_add (&ring->bytes, size, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&ring->records, 1, __ATOMIC_RELAXED);
+}
+
+void dream_shm_ring_get_stats (DreamShmRing *ring, DreamShmStats *stats)
+{
+	stats->capacity = ring->header->capacity;
+	stats->bytes = __atomic_load_n (&ring->bytes, __ATOMIC_RELAXED);
+	stats->records = __atomic_load_n (&ring->records, __ATOMIC_RELAXED);
+	stats->keyframes = __atomic_load_n (&ring->keyframes, __ATOMIC_RELAXED);
+	stats->dropped = __atomic_load_n (&ring->dropped, __ATOMIC_RELAXED);
+}
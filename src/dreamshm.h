@@ -0,0 +1,129 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <glib.h>
+
+#ifndef __DREAMSHM_H__
+#define __DREAMSHM_H__
+
+G_BEGIN_DECLS
+
+/* streams exported to POSIX shared memory for local consumers. every
+ * segment is a ring with a single writer, the daemon, and any number of
+ * readers it knows nothing about, so a slow reader can never hold it up.
+ * records are appended at a 64 bit stream position which only grows, a
+ * reader which fell more than the capacity behind lost data and starts
+ * over at the newest keyframe still in the ring. the writer publishes the
+ * end of the record it's about to write in reserve_pos before touching
+ * the data and the end of the finished record in write_pos afterwards,
+ * a reader checks reserve_pos after copying to know its copy is intact.
+ * 64 bit atomics aren't lock free on every platform and never work across
+ * processes when they aren't, so the positions and the keyframe count are
+ * only read and written under the 32 bit sequence counter pos_seq.
+ *
+ * this header and dreamshmreader.c only need glib, readers link against
+ * libdreamshm */
+#define DREAM_SHM_PREFIX "/dreamrtspserver-"
+#define DREAM_SHM_MAGIC 0x53544d44
+#define DREAM_SHM_VERSION 2
+#define DREAM_SHM_HEADER_SIZE 4096
+#define DREAM_SHM_KEYFRAMES 64
+#define DREAM_SHM_CAPS_LEN 1024
+/* readers poll, the writer never wakes anyone up */
+#define DREAM_SHM_POLL_US 5000
+
+#define DREAM_SHM_FLAG_KEYFRAME (1 << 0)
+#define DREAM_SHM_FLAG_DISCONT  (1 << 1)
+
+typedef struct {
+	/* payload bytes following this header */
+	guint32 size;
+	guint32 flags;
+	guint64 seq;
+	/* nanoseconds, G_MAXUINT64 if unknown */
+	guint64 pts;
+	guint64 dts;
+} DreamShmRecord;
+
+/* records start 8 byte aligned */
+#define DREAM_SHM_RECORD_LEN(size) ((sizeof (DreamShmRecord) + (size) + 7) & ~(guint64) 7)
+
+typedef struct {
+	guint64 pos;
+	guint64 seq;
+	guint64 pts;
+} DreamShmKeyframe;
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	/* the data area follows the header at this offset */
+	guint32 header_size;
+	/* set when the writer went away, the segment won't grow anymore */
+	guint32 closed;
+	/* odd while reserve_pos, write_pos or keyframes are being changed */
+	guint32 pos_seq;
+	guint32 reserved;
+	/* bytes of the data area, a power of two */
+	guint64 capacity;
+	guint64 reserve_pos;
+	guint64 write_pos;
+	/* keyframes written so far, the newest is keyframe[(keyframes-1) % DREAM_SHM_KEYFRAMES] */
+	guint64 keyframes;
+	DreamShmKeyframe keyframe[DREAM_SHM_KEYFRAMES];
+	/* odd while the caps are being changed */
+	guint32 caps_seq;
+	gchar caps[DREAM_SHM_CAPS_LEN];
+} DreamShmHeader;
+
+/* the daemon's side, see dreamshm.c */
+typedef struct _DreamShmRing DreamShmRing;
+
+typedef struct {
+	guint64 capacity;
+	guint64 bytes, records, keyframes;
+	/* records larger than half the ring */
+	guint64 dropped;
+} DreamShmStats;
+
+DreamShmRing * dream_shm_ring_new       (const gchar *name, gsize capacity);
+void           dream_shm_ring_free      (DreamShmRing *ring);
+const gchar *  dream_shm_ring_get_name  (DreamShmRing *ring);
+void           dream_shm_ring_set_caps  (DreamShmRing *ring, const gchar *caps);
+void           dream_shm_ring_write     (DreamShmRing *ring, const guint8 *data, gsize size, guint32 flags, guint64 pts, guint64 dts);
+void           dream_shm_ring_get_stats (DreamShmRing *ring, DreamShmStats *stats);
+
+/* the readers' side, see dreamshmreader.c */
+typedef struct _DreamShmReader DreamShmReader;
+
+/* results of dream_shm_reader_read () other than a payload size */
+#define DREAM_SHM_READ_AGAIN      0
+#define DREAM_SHM_READ_OVERRUN   -1
+#define DREAM_SHM_READ_TOO_SMALL -2
+#define DREAM_SHM_READ_CLOSED    -3
+
+DreamShmReader * dream_shm_reader_open          (const gchar *name);
+void             dream_shm_reader_close         (DreamShmReader *reader);
+gboolean         dream_shm_reader_seek_keyframe (DreamShmReader *reader);
+gssize           dream_shm_reader_read          (DreamShmReader *reader, DreamShmRecord *record, guint8 *data, gsize size);
+gchar *          dream_shm_reader_get_caps      (DreamShmReader *reader);
+guint64          dream_shm_reader_get_overruns  (DreamShmReader *reader);
+
+G_END_DECLS
+
+#endif /* __DREAMSHM_H__ */
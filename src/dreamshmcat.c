@@ -0,0 +1,90 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "dreamshm.h"
+
+/* writes a stream the daemon exports to shared memory to stdout, starting
+ * at a keyframe. e.g. "dreamshmcat ts | ffplay -" */
+int main (int argc, char *argv[])
+{
+	DreamShmReader *reader;
+	DreamShmRecord record;
+	gchar *name;
+	guint8 *buf;
+	gsize size = 256 * 1024;
+	guint64 bytes = 0, records = 0;
+	gint64 end = 0;
+	gssize ret;
+
+	if (argc < 2)
+	{
+		fprintf (stderr, "usage: %s ts|video|audio [seconds]\n", argv[0]);
+		return 1;
+	}
+	name = argv[1][0] == '/' ? g_strdup (argv[1]) : g_strconcat (DREAM_SHM_PREFIX, argv[1], NULL);
+	if (argc > 2)
+		end = g_get_monotonic_time () + atoi (argv[2]) * G_USEC_PER_SEC;
+
+	reader = dream_shm_reader_open (name);
+	if (!reader)
+	{
+		fprintf (stderr, "couldn't open %s: %s\n", name, g_strerror (errno));
+		g_free (name);
+		return 1;
+	}
+	while (!dream_shm_reader_seek_keyframe (reader))
+		g_usleep (DREAM_SHM_POLL_US);
+
+	buf = g_malloc (size);
+	while (!end || g_get_monotonic_time () < end)
+	{
+		ret = dream_shm_reader_read (reader, &record, buf, size);
+		if (ret > 0)
+		{
+			if (fwrite (buf, 1, ret, stdout) != (gsize) ret)
+				break;
+			bytes += ret;
+			records++;
+		}
+		else if (ret == DREAM_SHM_READ_AGAIN)
+		{
+			fflush (stdout);
+			g_usleep (DREAM_SHM_POLL_US);
+		}
+		else if (ret == DREAM_SHM_READ_TOO_SMALL)
+		{
+			size = record.size;
+			buf = g_realloc (buf, size);
+		}
+		else if (ret == DREAM_SHM_READ_CLOSED)
+			break;
+	}
+	fflush (stdout);
+	fprintf (stderr, "%" G_GUINT64_FORMAT " bytes %" G_GUINT64_FORMAT " records %" G_GUINT64_FORMAT " overruns\n",
+		 bytes, records, dream_shm_reader_get_overruns (reader));
+
+	g_free (buf);
+	g_free (name);
+	dream_shm_reader_close (reader);
+	return 0;
+}
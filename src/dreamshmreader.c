@@ -0,0 +1,205 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dreamshm.h"
+
+struct _DreamShmReader {
+	const DreamShmHeader *header;
+	const guint8 *data;
+	gsize map_size;
+	guint64 capacity;
+	guint64 pos;
+	guint64 overruns;
+};
+
+typedef struct {
+	guint64 reserve_pos, write_pos, keyframes;
+} DreamShmPositions;
+
+/* a consistent copy of the positions, see positions_begin () in dreamshm.c */
+static void positions_read (const DreamShmHeader *h, DreamShmPositions *p)
+{
+	guint32 seq;
+
+	do {
+		seq = __atomic_load_n (&h->pos_seq, __ATOMIC_ACQUIRE);
+		p->reserve_pos = h->reserve_pos;
+		p->write_pos = h->write_pos;
+		p->keyframes = h->keyframes;
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n (&h->pos_seq, __ATOMIC_RELAXED));
+}
+
+/* name as passed to shm_open (), e.g. DREAM_SHM_PREFIX "ts". the reader
+ * starts at the live edge, see dream_shm_reader_seek_keyframe () */
+DreamShmReader *dream_shm_reader_open (const gchar *name)
+{
+	DreamShmReader *reader;
+	const DreamShmHeader *h;
+	DreamShmPositions p;
+	struct stat st;
+	gpointer map;
+	int fd;
+
+	fd = shm_open (name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (fstat (fd, &st) < 0 || st.st_size < DREAM_SHM_HEADER_SIZE)
+	{
+		close (fd);
+		return NULL;
+	}
+	map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close (fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	h = map;
+	if (__atomic_load_n (&h->magic, __ATOMIC_ACQUIRE) != DREAM_SHM_MAGIC || h->version != DREAM_SHM_VERSION ||
+	    h->header_size + h->capacity != (guint64) st.st_size || (h->capacity & (h->capacity - 1)))
+	{
+		munmap (map, st.st_size);
+		return NULL;
+	}
+
+	reader = g_new0 (DreamShmReader, 1);
+	reader->header = h;
+	reader->data = (const guint8 *) map + h->header_size;
+	reader->map_size = st.st_size;
+	reader->capacity = h->capacity;
+	positions_read (h, &p);
+	reader->pos = p.write_pos;
+	return reader;
+}
+
+void dream_shm_reader_close (DreamShmReader *reader)
+{
+	munmap ((gpointer) reader->header, reader->map_size);
+	g_free (reader);
+}
+
+static void ring_copy_out (DreamShmReader *reader, guint64 pos, gpointer dst, gsize len)
+{
+	gsize offset = pos & (reader->capacity - 1);
+	gsize first = MIN (len, reader->capacity - offset);
+
+	memcpy (dst, reader->data + offset, first);
+	memcpy ((guint8 *) dst + first, reader->data, len - first);
+}
+
+/* whether everything from pos on is still what the writer put there */
+static gboolean ring_intact (DreamShmReader *reader, guint64 pos)
+{
+	DreamShmPositions p;
+
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	positions_read (reader->header, &p);
+	return p.reserve_pos - pos <= reader->capacity;
+}
+
+/* moves to the newest keyframe which is still in the ring, FALSE if there
+ * is none yet */
+gboolean dream_shm_reader_seek_keyframe (DreamShmReader *reader)
+{
+	const DreamShmHeader *h = reader->header;
+	DreamShmPositions p;
+	guint64 n;
+	DreamShmKeyframe k;
+
+	positions_read (h, &p);
+	if (!p.keyframes)
+		return FALSE;
+	n = p.keyframes - 1;
+	k = h->keyframe[n % DREAM_SHM_KEYFRAMES];
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	/* the entry was reused while it was copied */
+	positions_read (h, &p);
+	if (p.keyframes - n >= DREAM_SHM_KEYFRAMES)
+		return FALSE;
+	if (!ring_intact (reader, k.pos))
+		return FALSE;
+	reader->pos = k.pos;
+	return TRUE;
+}
+
+/* copies the next record to data, returns its payload size or one of the
+ * DREAM_SHM_READ_* results. after an overrun the reader continues at the
+ * newest keyframe or the live edge. if data is too small, record->size
+ * tells what's needed and the record can be read again */
+gssize dream_shm_reader_read (DreamShmReader *reader, DreamShmRecord *record, guint8 *data, gsize size)
+{
+	const DreamShmHeader *h = reader->header;
+	DreamShmPositions p;
+	guint64 write_pos;
+
+	positions_read (h, &p);
+	write_pos = p.write_pos;
+
+	if (reader->pos == write_pos)
+		return __atomic_load_n (&h->closed, __ATOMIC_ACQUIRE) ? DREAM_SHM_READ_CLOSED : DREAM_SHM_READ_AGAIN;
+	if (write_pos - reader->pos > reader->capacity)
+		goto overrun;
+
+	ring_copy_out (reader, reader->pos, record, sizeof (*record));
+	if (!ring_intact (reader, reader->pos) || DREAM_SHM_RECORD_LEN (record->size) > write_pos - reader->pos)
+		goto overrun;
+	if (record->size > size)
+		return DREAM_SHM_READ_TOO_SMALL;
+	ring_copy_out (reader, reader->pos + sizeof (*record), data, record->size);
+	if (!ring_intact (reader, reader->pos))
+		goto overrun;
+
+	reader->pos += DREAM_SHM_RECORD_LEN (record->size);
+	return record->size;
+
+overrun:
+	reader->overruns++;
+	if (!dream_shm_reader_seek_keyframe (reader))
+	{
+		positions_read (h, &p);
+		reader->pos = p.write_pos;
+	}
+	return DREAM_SHM_READ_OVERRUN;
+}
+
+/* the stream's caps as a string, free with g_free () */
+gchar *dream_shm_reader_get_caps (DreamShmReader *reader)
+{
+	const DreamShmHeader *h = reader->header;
+	gchar caps[DREAM_SHM_CAPS_LEN];
+	guint32 seq;
+
+	do {
+		seq = __atomic_load_n (&h->caps_seq, __ATOMIC_ACQUIRE);
+		memcpy (caps, h->caps, DREAM_SHM_CAPS_LEN);
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n (&h->caps_seq, __ATOMIC_RELAXED));
+	caps[DREAM_SHM_CAPS_LEN-1] = '\0';
+	return g_strdup (caps);
+}
+
+guint64 dream_shm_reader_get_overruns (DreamShmReader *reader)
+{
+	return reader->overruns;
+}
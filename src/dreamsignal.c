@@ -0,0 +1,370 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include "dreamsignal.h"
+#include "dreammetrics.h"
+
+GST_DEBUG_CATEGORY_STATIC (dreamsignal_debug);
+#define GST_CAT_DEFAULT dreamsignal_debug
+
+typedef struct _DreamSignal DreamSignal;
+
+struct _DreamSignal {
+	DreamSignal *next;
+	const gchar *interface_name, *name;
+	GVariant *parameters;
+	/* name is a property, parameters its new value */
+	gboolean property;
+};
+
+typedef struct {
+	const gchar *signal, *property;
+} DreamSignalProperty;
+
+typedef struct {
+	const gchar *name;
+	gint64 interval;
+	gint64 last_emitted;
+	DreamSignal *pending;
+} DreamSignalPolicy;
+
+typedef struct {
+	GSource source;
+	DreamSignalDispatcher *dispatcher;
+} DreamSignalSource;
+
+struct _DreamSignalDispatcher {
+	/* posted signals, newest first. producers push with a compare and
+	 * swap, the dispatcher takes the whole list at once */
+	DreamSignal *head;
+	GMainContext *context;
+	GSource *source;
+	gchar *object_path, *interface_name;
+	GMutex connection_lock;
+	GDBusConnection *connection;
+	/* only touched by the dispatcher once it runs */
+	GArray *policies;
+	GArray *properties;
+	gint64 properties_delay;
+	/* property name -> new value, announced once changed_due is reached */
+	GHashTable *changed;
+	gint64 changed_due;
+};
+
+static void signal_free (DreamSignal *s)
+{
+	if (s->parameters)
+		g_variant_unref (s->parameters);
+	g_slice_free (DreamSignal, s);
+}
+
+static void signal_emit (DreamSignalDispatcher *d, DreamSignal *s)
+{
+	GDBusConnection *connection;
+
+	g_mutex_lock (&d->connection_lock);
+	connection = d->connection ? g_object_ref (d->connection) : NULL;
+	g_mutex_unlock (&d->connection_lock);
+
+	if (gst_debug_category_get_threshold (dreamsignal_debug) >= GST_LEVEL_DEBUG)
+	{
+		gchar *params = s->parameters ? g_variant_print (s->parameters, TRUE) : NULL;
+		GST_DEBUG ("%s signal name=%s parameters=%s", connection ? "sending" : "no dbus connection, can't send", s->name, params ? params : "[not given]");
+		g_free (params);
+	}
+	if (connection)
+	{
+		g_dbus_connection_emit_signal (connection, NULL, d->object_path, s->interface_name ? s->interface_name : d->interface_name, s->name, s->parameters, NULL);
+		g_object_unref (connection);
+		dream_metrics_add (DREAM_METRIC_SIGNALS_EMITTED, 1);
+	}
+	signal_free (s);
+}
+
+static DreamSignalPolicy *find_policy (DreamSignalDispatcher *d, const gchar *name)
+{
+	guint i;
+
+	for (i = 0; i < d->policies->len; i++)
+	{
+		DreamSignalPolicy *p = &g_array_index (d->policies, DreamSignalPolicy, i);
+		if (g_strcmp0 (p->name, name) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+static DreamSignalProperty *find_property (DreamSignalDispatcher *d, const gchar *signal_name)
+{
+	guint i;
+
+	for (i = 0; i < d->properties->len; i++)
+	{
+		DreamSignalProperty *p = &g_array_index (d->properties, DreamSignalProperty, i);
+		if (g_strcmp0 (p->signal, signal_name) == 0)
+			return p;
+	}
+	return NULL;
+}
+
+/* value is consumed */
+static void property_changed (DreamSignalDispatcher *d, const gchar *property, GVariant *value, gint64 now)
+{
+	if (!d->changed)
+	{
+		d->changed = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_variant_unref);
+		d->changed_due = now + d->properties_delay;
+	}
+	g_hash_table_replace (d->changed, (gpointer) property, value);
+}
+
+static void properties_emit (DreamSignalDispatcher *d)
+{
+	DreamSignal *s = g_slice_new0 (DreamSignal);
+	GVariantBuilder builder;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+	g_hash_table_iter_init (&iter, d->changed);
+	while (g_hash_table_iter_next (&iter, &key, &value))
+		g_variant_builder_add (&builder, "{sv}", key, value);
+	g_hash_table_unref (d->changed);
+	d->changed = NULL;
+
+	s->interface_name = "org.freedesktop.DBus.Properties";
+	s->name = "PropertiesChanged";
+	s->parameters = g_variant_ref_sink (g_variant_new ("(sa{sv}@as)", d->interface_name, &builder, g_variant_new_strv (NULL, 0)));
+	signal_emit (d, s);
+}
+
+static gboolean source_prepare (GSource *source, gint *timeout)
+{
+	DreamSignalDispatcher *d = ((DreamSignalSource *) source)->dispatcher;
+	*timeout = -1;
+	return __atomic_load_n (&d->head, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static gboolean source_check (GSource *source)
+{
+	DreamSignalDispatcher *d = ((DreamSignalSource *) source)->dispatcher;
+	return __atomic_load_n (&d->head, __ATOMIC_ACQUIRE) != NULL;
+}
+
+static gboolean source_dispatch (GSource *source, GSourceFunc callback, gpointer user_data)
+{
+	DreamSignalDispatcher *d = ((DreamSignalSource *) source)->dispatcher;
+	DreamSignal *list = __atomic_exchange_n (&d->head, NULL, __ATOMIC_ACQUIRE);
+	DreamSignal *s, *ordered = NULL;
+	gint64 now = g_get_monotonic_time (), next = -1;
+	guint i;
+
+	/* restore posting order */
+	while (list)
+	{
+		s = list;
+		list = s->next;
+		s->next = ordered;
+		ordered = s;
+	}
+
+	while (ordered)
+	{
+		DreamSignalPolicy *p;
+		DreamSignalProperty *prop;
+		s = ordered;
+		ordered = s->next;
+		if (s->property)
+		{
+			property_changed (d, s->name, s->parameters, now);
+			g_slice_free (DreamSignal, s);
+			continue;
+		}
+		if (s->parameters && (prop = find_property (d, s->name)))
+			property_changed (d, prop->property, g_variant_get_child_value (s->parameters, 0), now);
+		p = find_policy (d, s->name);
+		if (!p)
+		{
+			signal_emit (d, s);
+			continue;
+		}
+		if (p->pending)
+		{
+			signal_free (p->pending);
+			dream_metrics_add (DREAM_METRIC_SIGNALS_COALESCED, 1);
+		}
+		p->pending = s;
+	}
+
+	for (i = 0; i < d->policies->len; i++)
+	{
+		DreamSignalPolicy *p = &g_array_index (d->policies, DreamSignalPolicy, i);
+		if (!p->pending)
+			continue;
+		if (now >= p->last_emitted + p->interval)
+		{
+			signal_emit (d, p->pending);
+			p->pending = NULL;
+			p->last_emitted = now;
+		}
+		else if (next < 0 || p->last_emitted + p->interval < next)
+			next = p->last_emitted + p->interval;
+	}
+	if (d->changed)
+	{
+		if (now >= d->changed_due)
+			properties_emit (d);
+		else if (next < 0 || d->changed_due < next)
+			next = d->changed_due;
+	}
+	g_source_set_ready_time (source, next);
+	return G_SOURCE_CONTINUE;
+}
+
+static GSourceFuncs source_funcs = {
+	source_prepare,
+	source_check,
+	source_dispatch,
+	NULL
+};
+
+DreamSignalDispatcher *dream_signal_dispatcher_new (GMainContext *context, const gchar *object_path, const gchar *interface_name)
+{
+	DreamSignalDispatcher *d = g_new0 (DreamSignalDispatcher, 1);
+
+	GST_DEBUG_CATEGORY_INIT (dreamsignal_debug, "dreamsignal", 0, "dreamrtspserver D-Bus signal dispatcher");
+	d->context = g_main_context_ref (context);
+	d->object_path = g_strdup (object_path);
+	d->interface_name = g_strdup (interface_name);
+	g_mutex_init (&d->connection_lock);
+	d->policies = g_array_new (FALSE, TRUE, sizeof (DreamSignalPolicy));
+	d->properties = g_array_new (FALSE, TRUE, sizeof (DreamSignalProperty));
+
+	d->source = g_source_new (&source_funcs, sizeof (DreamSignalSource));
+	((DreamSignalSource *) d->source)->dispatcher = d;
+	g_source_set_name (d->source, "dream-signal-dispatcher");
+	g_source_attach (d->source, context);
+	return d;
+}
+
+/* call before the dispatcher's context runs */
+void dream_signal_dispatcher_set_policy (DreamSignalDispatcher *d, const gchar *signal_name, guint interval_ms)
+{
+	DreamSignalPolicy p = { signal_name, (gint64) interval_ms * 1000, G_MININT64 / 2, NULL };
+	g_array_append_val (d->policies, p);
+}
+
+/* call before the dispatcher's context runs */
+void dream_signal_dispatcher_set_properties_delay (DreamSignalDispatcher *d, guint delay_ms)
+{
+	d->properties_delay = (gint64) delay_ms * 1000;
+}
+
+/* the first argument of signal_name is the new value of property_name. both
+ * must be static strings, call before the dispatcher's context runs */
+void dream_signal_dispatcher_map_property (DreamSignalDispatcher *d, const gchar *signal_name, const gchar *property_name)
+{
+	DreamSignalProperty p = { signal_name, property_name };
+	g_array_append_val (d->properties, p);
+}
+
+void dream_signal_dispatcher_set_connection (DreamSignalDispatcher *d, GDBusConnection *connection)
+{
+	g_mutex_lock (&d->connection_lock);
+	if (d->connection)
+		g_object_unref (d->connection);
+	d->connection = connection ? g_object_ref (connection) : NULL;
+	g_mutex_unlock (&d->connection_lock);
+}
+
+/* call after the dispatcher's context stopped running, pending signals are dropped */
+void dream_signal_dispatcher_free (DreamSignalDispatcher *d)
+{
+	DreamSignal *s = __atomic_exchange_n (&d->head, NULL, __ATOMIC_ACQUIRE);
+	guint i;
+
+	while (s)
+	{
+		DreamSignal *next = s->next;
+		signal_free (s);
+		s = next;
+	}
+	for (i = 0; i < d->policies->len; i++)
+	{
+		DreamSignalPolicy *p = &g_array_index (d->policies, DreamSignalPolicy, i);
+		if (p->pending)
+			signal_free (p->pending);
+	}
+	g_source_destroy (d->source);
+	g_source_unref (d->source);
+	g_main_context_unref (d->context);
+	g_array_free (d->policies, TRUE);
+	g_array_free (d->properties, TRUE);
+	if (d->changed)
+		g_hash_table_unref (d->changed);
+	dream_signal_dispatcher_set_connection (d, NULL);
+	g_mutex_clear (&d->connection_lock);
+	g_free (d->object_path);
+	g_free (d->interface_name);
+	g_free (d);
+}
+
+static void signal_push (DreamSignalDispatcher *d, DreamSignal *s)
+{
+	DreamSignal *head;
+
+	head = __atomic_load_n (&d->head, __ATOMIC_RELAXED);
+	do
+		s->next = head;
+	while (!__atomic_compare_exchange_n (&d->head, &head, s, TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	/* the dispatcher only needs waking when it may have gone to sleep on an empty list */
+	if (!head)
+		g_main_context_wakeup (d->context);
+}
+
+/* interface_name and signal_name must be static strings, NULL posts on
+ * the dispatcher's interface */
+void dream_signal_post_full (DreamSignalDispatcher *d, const gchar *interface_name, const gchar *signal_name, GVariant *parameters)
+{
+	DreamSignal *s = g_slice_new (DreamSignal);
+
+	s->interface_name = interface_name;
+	s->name = signal_name;
+	s->parameters = parameters ? g_variant_ref_sink (parameters) : NULL;
+	s->property = FALSE;
+	signal_push (d, s);
+	dream_metrics_add (DREAM_METRIC_SIGNALS_POSTED, 1);
+}
+
+/* property_name must be a static string, value is consumed */
+void dream_signal_post_property (DreamSignalDispatcher *d, const gchar *property_name, GVariant *value)
+{
+	DreamSignal *s = g_slice_new (DreamSignal);
+
+	s->interface_name = NULL;
+	s->name = property_name;
+	s->parameters = g_variant_ref_sink (value);
+	s->property = TRUE;
+	signal_push (d, s);
+}
+
+void dream_signal_post (DreamSignalDispatcher *d, const gchar *signal_name, GVariant *parameters)
+{
+	dream_signal_post_full (d, NULL, signal_name, parameters);
+}
@@ -0,0 +1,48 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+#include <gio/gio.h>
+
+#ifndef __DREAMSIGNAL_H__
+#define __DREAMSIGNAL_H__
+
+G_BEGIN_DECLS
+
+/* D-Bus signals are posted from any thread without taking a lock and
+ * emitted from the dispatcher's main context. signals with a policy are
+ * coalesced to their latest parameters and emitted at most once per interval.
+ *
+ * property changes, posted directly or as the first argument of a mapped
+ * signal, are collected on the dispatcher's context for the properties
+ * delay and announced in one org.freedesktop.DBus.Properties
+ * PropertiesChanged of the dispatcher's interface */
+typedef struct _DreamSignalDispatcher DreamSignalDispatcher;
+
+DreamSignalDispatcher * dream_signal_dispatcher_new     (GMainContext *context, const gchar *object_path, const gchar *interface_name);
+void                    dream_signal_dispatcher_free    (DreamSignalDispatcher *d);
+void                    dream_signal_dispatcher_set_policy (DreamSignalDispatcher *d, const gchar *signal_name, guint interval_ms);
+void                    dream_signal_dispatcher_set_connection (DreamSignalDispatcher *d, GDBusConnection *connection);
+void                    dream_signal_dispatcher_set_properties_delay (DreamSignalDispatcher *d, guint delay_ms);
+void                    dream_signal_dispatcher_map_property (DreamSignalDispatcher *d, const gchar *signal_name, const gchar *property_name);
+void                    dream_signal_post               (DreamSignalDispatcher *d, const gchar *signal_name, GVariant *parameters);
+void                    dream_signal_post_full          (DreamSignalDispatcher *d, const gchar *interface_name, const gchar *signal_name, GVariant *parameters);
+void                    dream_signal_post_property      (DreamSignalDispatcher *d, const gchar *property_name, GVariant *value);
+
+G_END_DECLS
+
+#endif /* __DREAMSIGNAL_H__ */
@@ -0,0 +1,591 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+
+#include "dreamtimeshift.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gst/app/app.h>
+
+GST_DEBUG_CATEGORY_STATIC (dreamtimeshift_debug);
+#define GST_CAT_DEFAULT dreamtimeshift_debug
+
+/* the player's appsrc doesn't queue more than this */
+#define PLAYER_MAX_BYTES (1024 * 1024)
+#define PLAYER_CAPS "video/mpegts, systemstream=(boolean)true, packetsize=(int)188"
+
+/* the lock guards everything but the file writes. the streaming thread
+ * writes a full chunk without it, readers of that part of the ring check
+ * afterwards whether it was overwritten meanwhile. cond wakes the players
+ * up for new data */
+struct _DreamTimeshift {
+	gint refcount;
+	GMutex lock;
+	GCond cond;
+	gchar *directory;
+	int fd, read_fd;
+	gboolean direct;
+	guint64 capacity;
+	guint8 *chunk;
+	gsize chunk_fill;
+	/* everything before is in the file */
+	guint64 flushed;
+	guint64 written;
+	GArray *marks;
+	guint64 keyframes, segments;
+	gint64 last_mark, last_segment;
+	gboolean last_delta;
+	gboolean closed;
+	guint64 writes, write_us, max_write_us, overruns;
+};
+
+struct _DreamTimeshiftPlayer {
+	DreamTimeshift *ts;
+	GstElement *appsrc;
+	GThread *thread;
+	/* guarded by the timeshift's lock */
+	gboolean running, need_data, seeking, discont, eos;
+	gint64 seek_time;
+	/* arrival time of media time 0, -1 until the first keyframe */
+	gint64 origin;
+	/* added to the timestamps after a seek, so that the keyframe it starts
+	 * with is at the requested time */
+	gint64 shift;
+	DreamTimeshiftMark mark;
+};
+
+/* the next chunk goes there, so the data of that chunk is as good as gone */
+static guint64 oldest_pos (DreamTimeshift *ts)
+{
+	return ts->flushed + DREAM_TIMESHIFT_CHUNK > ts->capacity ? ts->flushed + DREAM_TIMESHIFT_CHUNK - ts->capacity : 0;
+}
+
+/* index of the first mark at or after pos */
+static guint mark_search (GArray *marks, guint64 pos)
+{
+	guint lo = 0, hi = marks->len;
+
+	while (lo < hi)
+	{
+		guint mid = (lo + hi) / 2;
+		if (g_array_index (marks, DreamTimeshiftMark, mid).pos < pos)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* an anonymous file in directory, or a uniquely named one where the kernel
+ * or the file system can't do O_TMPFILE. name is the latter's, to be
+ * unlinked once both descriptors are open */
+static int store_open (const gchar *directory, int flags, gchar **name)
+{
+	int fd = open (directory, O_TMPFILE | O_WRONLY | O_CLOEXEC | flags, 0600);
+
+	*name = NULL;
+	if (fd < 0 && (errno == EISDIR || errno == EOPNOTSUPP))
+	{
+		*name = g_build_filename (directory, "dreamrtspserver.timeshift.XXXXXX", NULL);
+		fd = g_mkstemp_full (*name, O_WRONLY | O_CLOEXEC | flags, 0600);
+		if (fd < 0)
+			g_clear_pointer (name, g_free);
+	}
+	return fd;
+}
+
+DreamTimeshift *dream_timeshift_new (const gchar *directory, guint64 size)
+{
+	DreamTimeshift *ts;
+	gboolean direct = TRUE;
+	gchar *name, *proc;
+	int fd, err;
+
+	GST_DEBUG_CATEGORY_INIT (dreamtimeshift_debug, "dreamtimeshift", 0, "dreamrtspserver timeshift store");
+	size = MAX (size - size % DREAM_TIMESHIFT_CHUNK, 4 * DREAM_TIMESHIFT_CHUNK);
+	fd = store_open (directory, O_DIRECT, &name);
+	/* tmpfs and others */
+	if (fd < 0 && errno == EINVAL)
+	{
+		direct = FALSE;
+		fd = store_open (directory, 0, &name);
+	}
+	if (fd < 0)
+	{
+		GST_WARNING ("can't create a file in %s: %s", directory, g_strerror (errno));
+		return NULL;
+	}
+	err = posix_fallocate (fd, 0, size);
+	if (err == EINVAL || err == EOPNOTSUPP)
+		err = ftruncate (fd, size) < 0 ? errno : 0;
+	if (err)
+	{
+		GST_WARNING ("can't allocate %" G_GUINT64_FORMAT " bytes in %s: %s", size, directory, g_strerror (err));
+		close (fd);
+		if (name)
+			unlink (name);
+		g_free (name);
+		return NULL;
+	}
+
+	ts = g_new0 (DreamTimeshift, 1);
+	ts->refcount = 1;
+	g_mutex_init (&ts->lock);
+	g_cond_init (&ts->cond);
+	ts->directory = g_strdup (directory);
+	ts->fd = fd;
+	/* reads go through the page cache, a direct descriptor would need
+	 * aligned reads. an anonymous file can only be reopened through /proc */
+	proc = g_strdup_printf ("/proc/self/fd/%d", fd);
+	ts->read_fd = open (name ? name : proc, O_RDONLY | O_CLOEXEC);
+	g_free (proc);
+	if (name)
+		unlink (name);
+	g_free (name);
+	ts->direct = direct;
+	ts->capacity = size;
+	if (posix_memalign ((void **) &ts->chunk, DREAM_TIMESHIFT_ALIGN, DREAM_TIMESHIFT_CHUNK))
+		ts->chunk = NULL;
+	ts->marks = g_array_new (FALSE, FALSE, sizeof (DreamTimeshiftMark));
+	ts->last_delta = TRUE;
+	if (ts->read_fd < 0 || !ts->chunk)
+	{
+		GST_WARNING ("can't set up the timeshift in %s", directory);
+		dream_timeshift_unref (ts);
+		return NULL;
+	}
+	GST_INFO ("timeshift of %" G_GUINT64_FORMAT " bytes in %s%s", size, directory, direct ? " with direct i/o" : "");
+	return ts;
+}
+
+DreamTimeshift *dream_timeshift_ref (DreamTimeshift *ts)
+{
+	g_atomic_int_inc (&ts->refcount);
+	return ts;
+}
+
+/* the index is gone with the last reference, so is the file */
+void dream_timeshift_unref (DreamTimeshift *ts)
+{
+	if (!g_atomic_int_dec_and_test (&ts->refcount))
+		return;
+	close (ts->fd);
+	if (ts->read_fd >= 0)
+		close (ts->read_fd);
+	free (ts->chunk);
+	g_array_free (ts->marks, TRUE);
+	g_cond_clear (&ts->cond);
+	g_mutex_clear (&ts->lock);
+	g_free (ts->directory);
+	g_free (ts);
+}
+
+const gchar *dream_timeshift_get_directory (DreamTimeshift *ts)
+{
+	return ts->directory;
+}
+
+/* runs on the streaming thread without the lock. the staged chunk stays
+ * readable until it is in the file */
+static void chunk_flush (DreamTimeshift *ts)
+{
+	guint64 offset = ts->flushed % ts->capacity;
+	gint64 start = g_get_monotonic_time (), took;
+	gsize done = 0;
+	gssize n = 0;
+
+	while (done < DREAM_TIMESHIFT_CHUNK && (n = pwrite (ts->fd, ts->chunk + done, DREAM_TIMESHIFT_CHUNK - done, offset + done)) > 0)
+		done += n;
+	if (done < DREAM_TIMESHIFT_CHUNK)
+		GST_WARNING ("writing the timeshift in %s at %" G_GUINT64_FORMAT " failed: %s", ts->directory, offset, n < 0 ? g_strerror (errno) : "short write");
+	took = g_get_monotonic_time () - start;
+
+	g_mutex_lock (&ts->lock);
+	ts->flushed += DREAM_TIMESHIFT_CHUNK;
+	ts->chunk_fill = 0;
+	ts->writes++;
+	ts->write_us += took;
+	ts->max_write_us = MAX (ts->max_write_us, (guint64) took);
+	g_array_remove_range (ts->marks, 0, mark_search (ts->marks, oldest_pos (ts)));
+	g_mutex_unlock (&ts->lock);
+	GST_LOG ("chunk at %" G_GUINT64_FORMAT " written in %" G_GINT64_FORMAT " us", offset, took);
+}
+
+void dream_timeshift_write (DreamTimeshift *ts, GstBuffer *buffer)
+{
+	gboolean delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	gint64 now = g_get_monotonic_time ();
+	gboolean keyframe = !delta && ts->last_delta;
+	gboolean overlong;
+	GstMapInfo map;
+	gsize done = 0;
+
+	if (!gst_buffer_map (buffer, &map, GST_MAP_READ))
+		return;
+	g_mutex_lock (&ts->lock);
+	overlong = ts->last_segment && now - ts->last_segment >= DREAM_TIMESHIFT_TARGET;
+	if (keyframe || overlong || now - ts->last_mark >= DREAM_TIMESHIFT_MARK_INTERVAL)
+	{
+		DreamTimeshiftMark mark = { ts->written, now, 0, 0 };
+		if (keyframe)
+			mark.keyframe = ++ts->keyframes;
+		if (overlong || (keyframe && (!ts->last_segment || now - ts->last_segment >= DREAM_TIMESHIFT_SEGMENT)))
+		{
+			mark.segment = ++ts->segments;
+			ts->last_segment = now;
+		}
+		g_array_append_val (ts->marks, mark);
+		ts->last_mark = now;
+	}
+	ts->last_delta = delta;
+	while (done < map.size)
+	{
+		gsize n = MIN (map.size - done, DREAM_TIMESHIFT_CHUNK - ts->chunk_fill);
+		memcpy (ts->chunk + ts->chunk_fill, map.data + done, n);
+		ts->chunk_fill += n;
+		ts->written += n;
+		done += n;
+		if (ts->chunk_fill == DREAM_TIMESHIFT_CHUNK)
+		{
+			g_mutex_unlock (&ts->lock);
+			chunk_flush (ts);
+			g_mutex_lock (&ts->lock);
+		}
+	}
+	g_cond_broadcast (&ts->cond);
+	g_mutex_unlock (&ts->lock);
+	gst_buffer_unmap (buffer, &map);
+}
+
+/* no more writes, the players end with the window */
+void dream_timeshift_close (DreamTimeshift *ts)
+{
+	g_mutex_lock (&ts->lock);
+	ts->closed = TRUE;
+	g_cond_broadcast (&ts->cond);
+	g_mutex_unlock (&ts->lock);
+}
+
+/* returns the bytes read, less at the end of the stream, or -1 if pos
+ * isn't in the ring (anymore) */
+gssize dream_timeshift_read (DreamTimeshift *ts, guint64 pos, guint8 *data, gsize size)
+{
+	guint64 flushed, end, p;
+	gssize n;
+
+	g_mutex_lock (&ts->lock);
+	if (pos < oldest_pos (ts) || pos > ts->written)
+	{
+		ts->overruns++;
+		g_mutex_unlock (&ts->lock);
+		return -1;
+	}
+	size = MIN (size, ts->written - pos);
+	flushed = ts->flushed;
+	end = pos + size;
+	if (end > flushed)
+	{
+		p = MAX (pos, flushed);
+		memcpy (data + (p - pos), ts->chunk + (p - flushed), end - p);
+	}
+	g_mutex_unlock (&ts->lock);
+
+	for (p = pos; p < MIN (end, flushed); p += n)
+	{
+		guint64 offset = p % ts->capacity;
+		n = pread (ts->read_fd, data + (p - pos), MIN (MIN (end, flushed) - p, ts->capacity - offset), offset);
+		if (n <= 0)
+		{
+			GST_WARNING ("reading the timeshift in %s at %" G_GUINT64_FORMAT " failed: %s", ts->directory, offset, n < 0 ? g_strerror (errno) : "end of file");
+			return -1;
+		}
+	}
+
+	/* the writer may have got there meanwhile */
+	g_mutex_lock (&ts->lock);
+	if (pos < oldest_pos (ts))
+	{
+		ts->overruns++;
+		size = 0;
+		n = -1;
+	}
+	else
+		n = size;
+	g_mutex_unlock (&ts->lock);
+	return n;
+}
+
+/* called with the lock held */
+static gboolean seek_locked (DreamTimeshift *ts, gint64 time, DreamTimeshiftMark *mark)
+{
+	DreamTimeshiftMark *found = NULL;
+	guint i;
+
+	for (i = ts->marks->len; i > 0; i--)
+	{
+		DreamTimeshiftMark *m = &g_array_index (ts->marks, DreamTimeshiftMark, i - 1);
+		if (!m->keyframe)
+			continue;
+		found = m;
+		if (m->time <= time)
+			break;
+	}
+	if (!found)
+		return FALSE;
+	*mark = *found;
+	return TRUE;
+}
+
+/* the last keyframe at or before time, the oldest one if time is older */
+gboolean dream_timeshift_seek (DreamTimeshift *ts, gint64 time, DreamTimeshiftMark *mark)
+{
+	gboolean ret;
+
+	g_mutex_lock (&ts->lock);
+	ret = seek_locked (ts, time, mark);
+	g_mutex_unlock (&ts->lock);
+	return ret;
+}
+
+static gboolean next_locked (DreamTimeshift *ts, guint64 pos, DreamTimeshiftMark *mark)
+{
+	guint i = mark_search (ts->marks, pos + 1);
+
+	if (i == ts->marks->len)
+		return FALSE;
+	*mark = g_array_index (ts->marks, DreamTimeshiftMark, i);
+	return TRUE;
+}
+
+/* the first mark after pos, FALSE at the live end */
+gboolean dream_timeshift_next (DreamTimeshift *ts, guint64 pos, DreamTimeshiftMark *mark)
+{
+	gboolean ret;
+
+	g_mutex_lock (&ts->lock);
+	ret = next_locked (ts, pos, mark);
+	g_mutex_unlock (&ts->lock);
+	return ret;
+}
+
+/* the complete segments in the window, oldest first */
+GArray *dream_timeshift_segments (DreamTimeshift *ts)
+{
+	GArray *segments = g_array_new (FALSE, FALSE, sizeof (DreamTimeshiftSegment));
+	DreamTimeshiftMark *start = NULL;
+	guint i;
+
+	g_mutex_lock (&ts->lock);
+	for (i = 0; i < ts->marks->len; i++)
+	{
+		DreamTimeshiftMark *m = &g_array_index (ts->marks, DreamTimeshiftMark, i);
+		if (!m->segment)
+			continue;
+		if (start)
+		{
+			DreamTimeshiftSegment s = { start->segment, start->pos, m->pos - start->pos, m->time - start->time };
+			g_array_append_val (segments, s);
+		}
+		start = m;
+	}
+	g_mutex_unlock (&ts->lock);
+	return segments;
+}
+
+void dream_timeshift_get_stats (DreamTimeshift *ts, DreamTimeshiftStats *stats)
+{
+	guint i;
+
+	g_mutex_lock (&ts->lock);
+	stats->capacity = ts->capacity;
+	stats->direct = ts->direct;
+	stats->wrapped = oldest_pos (ts) > 0;
+	stats->written = ts->written;
+	stats->window = ts->marks->len ? g_array_index (ts->marks, DreamTimeshiftMark, ts->marks->len - 1).time - g_array_index (ts->marks, DreamTimeshiftMark, 0).time : 0;
+	stats->keyframes = 0;
+	for (i = 0; i < ts->marks->len; i++)
+		if (g_array_index (ts->marks, DreamTimeshiftMark, i).keyframe)
+			stats->keyframes++;
+	stats->writes = ts->writes;
+	stats->write_us = ts->write_us;
+	stats->max_write_us = ts->max_write_us;
+	stats->overruns = ts->overruns;
+	g_mutex_unlock (&ts->lock);
+}
+
+static void player_need_data (GstAppSrc *appsrc, guint length, gpointer user_data)
+{
+	DreamTimeshiftPlayer *p = user_data;
+
+	g_mutex_lock (&p->ts->lock);
+	p->need_data = TRUE;
+	g_cond_broadcast (&p->ts->cond);
+	g_mutex_unlock (&p->ts->lock);
+}
+
+static void player_enough_data (GstAppSrc *appsrc, gpointer user_data)
+{
+	DreamTimeshiftPlayer *p = user_data;
+
+	g_mutex_lock (&p->ts->lock);
+	p->need_data = FALSE;
+	g_mutex_unlock (&p->ts->lock);
+}
+
+/* offset is the media time in nanoseconds */
+static gboolean player_seek_data (GstAppSrc *appsrc, guint64 offset, gpointer user_data)
+{
+	DreamTimeshiftPlayer *p = user_data;
+
+	g_mutex_lock (&p->ts->lock);
+	if (p->origin >= 0)
+	{
+		p->seek_time = p->origin + (gint64) (offset / GST_USECOND);
+		p->seeking = TRUE;
+		p->eos = FALSE;
+		g_cond_broadcast (&p->ts->cond);
+	}
+	g_mutex_unlock (&p->ts->lock);
+	GST_DEBUG ("player %p seeks to %" GST_TIME_FORMAT, p, GST_TIME_ARGS (offset));
+	return TRUE;
+}
+
+/* pushes from mark to mark, timestamped with the arrival times */
+static gpointer player_thread (gpointer user_data)
+{
+	DreamTimeshiftPlayer *p = user_data;
+	DreamTimeshift *ts = p->ts;
+
+	g_mutex_lock (&ts->lock);
+	while (p->running)
+	{
+		DreamTimeshiftMark mark, next;
+		GstClockTime duration;
+		GstBuffer *buffer;
+		guint8 *data;
+		gsize size;
+		gint64 pts;
+
+		if (p->seeking && seek_locked (ts, p->seek_time, &mark))
+		{
+			if (p->origin < 0)
+				p->origin = mark.time;
+			else
+				p->shift = p->seek_time - mark.time;
+			p->mark = mark;
+			p->seeking = FALSE;
+			p->discont = TRUE;
+		}
+		if (p->seeking || !p->need_data || p->eos || !next_locked (ts, p->mark.pos, &next))
+		{
+			if (!p->seeking && p->need_data && !p->eos && ts->closed)
+			{
+				p->eos = TRUE;
+				g_mutex_unlock (&ts->lock);
+				gst_app_src_end_of_stream (GST_APP_SRC (p->appsrc));
+				g_mutex_lock (&ts->lock);
+				continue;
+			}
+			g_cond_wait (&ts->cond, &ts->lock);
+			continue;
+		}
+		mark = p->mark;
+		size = next.pos - mark.pos;
+		pts = mark.time - p->origin + p->shift;
+		duration = (g_array_index (ts->marks, DreamTimeshiftMark, ts->marks->len - 1).time - p->origin) * GST_USECOND;
+		g_mutex_unlock (&ts->lock);
+
+		data = g_malloc (size);
+		if (dream_timeshift_read (ts, mark.pos, data, size) != (gssize) size)
+		{
+			g_free (data);
+			g_mutex_lock (&ts->lock);
+			/* fell out of the window, continue with its start and without
+			 * a jump in the timestamps */
+			GST_INFO ("player %p overrun at %" G_GUINT64_FORMAT, p, mark.pos);
+			if (p->mark.pos == mark.pos)
+			{
+				DreamTimeshiftMark oldest;
+				if (seek_locked (ts, G_MININT64, &oldest))
+				{
+					p->shift -= oldest.time - mark.time;
+					p->mark = oldest;
+					p->discont = TRUE;
+				}
+				/* the window holds no keyframe, retry after the next write
+				 * instead of spinning */
+				else
+					g_cond_wait (&ts->cond, &ts->lock);
+			}
+			continue;
+		}
+		buffer = gst_buffer_new_wrapped (data, size);
+		GST_BUFFER_PTS (buffer) = MAX (pts, 0) * GST_USECOND;
+		if (p->discont)
+			GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DISCONT);
+		gst_app_src_set_duration (GST_APP_SRC (p->appsrc), duration);
+		gst_app_src_push_buffer (GST_APP_SRC (p->appsrc), buffer);
+
+		g_mutex_lock (&ts->lock);
+		/* unless it seeked meanwhile */
+		if (p->mark.pos == mark.pos)
+		{
+			p->mark = next;
+			p->discont = FALSE;
+		}
+	}
+	g_mutex_unlock (&ts->lock);
+	return NULL;
+}
+
+DreamTimeshiftPlayer *dream_timeshift_player_new (DreamTimeshift *ts, GstElement *appsrc)
+{
+	DreamTimeshiftPlayer *p = g_new0 (DreamTimeshiftPlayer, 1);
+	GstAppSrcCallbacks callbacks = { player_need_data, player_enough_data, player_seek_data };
+	GstCaps *caps = gst_caps_from_string (PLAYER_CAPS);
+
+	p->ts = dream_timeshift_ref (ts);
+	p->appsrc = gst_object_ref (appsrc);
+	p->running = TRUE;
+	p->origin = -1;
+	/* to the oldest keyframe, once there is one */
+	p->seeking = TRUE;
+	p->seek_time = G_MININT64;
+	g_object_set (appsrc, "format", GST_FORMAT_TIME, "stream-type", GST_APP_STREAM_TYPE_SEEKABLE, "max-bytes", (guint64) PLAYER_MAX_BYTES, NULL);
+	gst_app_src_set_caps (GST_APP_SRC (appsrc), caps);
+	gst_caps_unref (caps);
+	gst_app_src_set_callbacks (GST_APP_SRC (appsrc), &callbacks, p, NULL);
+	p->thread = g_thread_new ("timeshift", player_thread, p);
+	return p;
+}
+
+void dream_timeshift_player_free (DreamTimeshiftPlayer *p)
+{
+	g_mutex_lock (&p->ts->lock);
+	p->running = FALSE;
+	g_cond_broadcast (&p->ts->cond);
+	g_mutex_unlock (&p->ts->lock);
+	g_thread_join (p->thread);
+	gst_object_unref (p->appsrc);
+	dream_timeshift_unref (p->ts);
+	g_free (p);
+}
@@ -0,0 +1,102 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+
+#include <gst/gst.h>
+
+#ifndef __DREAMTIMESHIFT_H__
+#define __DREAMTIMESHIFT_H__
+
+G_BEGIN_DECLS
+
+/* the last minutes of TS in a preallocated file used as a ring. the stream
+ * is staged in aligned chunks which are written with O_DIRECT where the
+ * file system supports it, so the page cache doesn't fill up with a
+ * stream nobody might watch. the index lives in memory: a mark every
+ * DREAM_TIMESHIFT_MARK_INTERVAL of arrival time and one at every keyframe.
+ *
+ * positions are absolute byte offsets into the stream, times are the
+ * monotonic arrival times in microseconds. readers get the data still in
+ * the staging chunk as well. the file is created anonymously in the given
+ * directory, it doesn't outlive the last reference */
+#define DREAM_TIMESHIFT_CHUNK (256 * 1024)
+#define DREAM_TIMESHIFT_ALIGN 4096
+#define DREAM_TIMESHIFT_MARK_INTERVAL (100 * G_TIME_SPAN_MILLISECOND)
+/* a keyframe at least this long after the previous segment's start begins
+ * the next segment. decided when writing, so segments don't change while
+ * the window moves */
+#define DREAM_TIMESHIFT_SEGMENT (2 * G_TIME_SPAN_SECOND)
+/* without a keyframe by then a time mark begins it, so no segment gets
+ * longer and HLS can announce a fixed target duration */
+#define DREAM_TIMESHIFT_TARGET (6 * G_TIME_SPAN_SECOND)
+
+typedef struct _DreamTimeshift DreamTimeshift;
+typedef struct _DreamTimeshiftPlayer DreamTimeshiftPlayer;
+
+typedef struct {
+	guint64 pos;
+	gint64 time;
+	/* sequence number of the keyframe, 0 for a time mark */
+	guint64 keyframe;
+	/* sequence number of the segment it starts, 0 otherwise */
+	guint64 segment;
+} DreamTimeshiftMark;
+
+/* from a segment's first keyframe to the next one's */
+typedef struct {
+	guint64 seq;
+	guint64 pos;
+	guint64 size;
+	gint64 duration;
+} DreamTimeshiftSegment;
+
+typedef struct {
+	guint64 capacity;
+	gboolean direct;
+	/* the oldest data has been overwritten */
+	gboolean wrapped;
+	guint64 written;
+	gint64 window;
+	guint keyframes;
+	guint64 writes;
+	guint64 write_us;
+	guint64 max_write_us;
+	guint64 overruns;
+} DreamTimeshiftStats;
+
+DreamTimeshift * dream_timeshift_new           (const gchar *directory, guint64 size);
+DreamTimeshift * dream_timeshift_ref           (DreamTimeshift *ts);
+void             dream_timeshift_unref         (DreamTimeshift *ts);
+const gchar *    dream_timeshift_get_directory (DreamTimeshift *ts);
+void             dream_timeshift_write         (DreamTimeshift *ts, GstBuffer *buffer);
+void             dream_timeshift_close         (DreamTimeshift *ts);
+gssize           dream_timeshift_read          (DreamTimeshift *ts, guint64 pos, guint8 *data, gsize size);
+gboolean         dream_timeshift_seek          (DreamTimeshift *ts, gint64 time, DreamTimeshiftMark *mark);
+gboolean         dream_timeshift_next          (DreamTimeshift *ts, guint64 pos, DreamTimeshiftMark *mark);
+GArray *         dream_timeshift_segments      (DreamTimeshift *ts);
+void             dream_timeshift_get_stats     (DreamTimeshift *ts, DreamTimeshiftStats *stats);
+
+/* feeds a seekable appsrc in TIME format from its own thread. media time 0
+ * is the oldest keyframe when the player is created, a seek starts at the
+ * keyframe before the requested time */
+DreamTimeshiftPlayer * dream_timeshift_player_new  (DreamTimeshift *ts, GstElement *appsrc);
+void                   dream_timeshift_player_free (DreamTimeshiftPlayer *player);
+
+G_END_DECLS
+
+#endif /* __DREAMTIMESHIFT_H__ */
@@ -0,0 +1,758 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+
+#include "dreamunix.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <glib-unix.h>
+
+GST_DEBUG_CATEGORY_STATIC (dreamunix_debug);
+#define GST_CAT_DEFAULT dreamunix_debug
+
+#define UNIX_LISTEN_BACKLOG 4
+/* buffers per sendmsg, the kernel's UIO_MAXIOV */
+#define UNIX_IOV_MAX 1024
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS (1024 + 9)
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#define F_SEAL_WRITE 0x0008
+#endif
+
+#ifndef HAVE_MEMFD_CREATE
+static int memfd_create (const char *name, unsigned int flags)
+{
+	return syscall (SYS_memfd_create, name, flags);
+}
+#endif
+
+/* one batch as sealed memfd, shared by all memfd clients */
+typedef struct {
+	gint refcount;
+	int fd;
+	DreamUnixSegmentHeader header;
+} DreamUnixSegment;
+
+typedef struct {
+	int fd;
+	/* reads the request, belongs to the server's context */
+	GSource *source;
+	/* frees the client if its request doesn't come, on the same context */
+	GSource *timeout_source;
+	gchar request[DREAM_UNIX_REQUEST_LEN];
+	guint request_len;
+	gboolean active, memfd, wait_keyframe, discont;
+	/* byte stream: buffers not sent completely, the first one from offset on */
+	GQueue pending;
+	gsize offset, pending_bytes;
+	/* memfd: segments not sent yet, the first one's header from header_sent on */
+	GQueue segments;
+	DreamUnixSegmentHeader header;
+	gsize header_sent;
+} DreamUnixClient;
+
+/* the lock guards the client list and the statistics. clients are accepted
+ * and read on the server's context, the streaming thread writes to them and
+ * frees those which are gone. sources are destroyed with the lock held and
+ * their callbacks check for that first */
+struct _DreamUnixServer {
+	GMutex lock;
+	GMainContext *context;
+	DreamUnixClientsFunc func;
+	gpointer user_data;
+	gchar *path;
+	int fd;
+	GSource *accept_source;
+	/* announces clients dropped by the streaming thread on the context */
+	GSource *notify_source;
+	GList *clients;
+	/* clients past their request, checked per buffer */
+	gint active;
+	/* the batch being collected, only touched by the streaming thread */
+	GPtrArray *batch;
+	gsize batch_bytes;
+	gint64 batch_start;
+	gboolean batch_keyframe, last_delta;
+	GstClockTime batch_pts;
+	guint64 seq;
+	GstMapInfo maps[UNIX_IOV_MAX];
+	struct iovec iov[UNIX_IOV_MAX];
+	guint64 bytes, batches, segments, drops;
+};
+
+static void segment_unref (DreamUnixSegment *segment)
+{
+	if (!g_atomic_int_dec_and_test (&segment->refcount))
+		return;
+	close (segment->fd);
+	g_free (segment);
+}
+
+static DreamUnixSegment *segment_ref (DreamUnixSegment *segment)
+{
+	g_atomic_int_inc (&segment->refcount);
+	return segment;
+}
+
+/* maps buffers from the list on into the server's iovecs, the first one
+ * from offset on */
+static guint batch_map (DreamUnixServer *server, GList *l, gsize offset)
+{
+	guint n = 0;
+
+	for (; l && n < UNIX_IOV_MAX; l = l->next, offset = 0)
+	{
+		if (!gst_buffer_map (l->data, &server->maps[n], GST_MAP_READ))
+			break;
+		server->iov[n].iov_base = server->maps[n].data + offset;
+		server->iov[n].iov_len = server->maps[n].size - offset;
+		n++;
+	}
+	return n;
+}
+
+static void batch_unmap (DreamUnixServer *server, GList *l, guint n)
+{
+	guint i;
+
+	for (i = 0; i < n; i++, l = l->next)
+		gst_buffer_unmap (l->data, &server->maps[i]);
+}
+
+/* the clients rely on a segment never changing under their mapping */
+static DreamUnixSegment *segment_new (DreamUnixServer *server, GList *buffers)
+{
+	DreamUnixSegment *segment;
+	gsize size = 0;
+	int fd;
+
+	fd = memfd_create ("dreamrtspserver-ts", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+	{
+		GST_WARNING ("can't create a memfd segment: %s", g_strerror (errno));
+		return NULL;
+	}
+	while (buffers)
+	{
+		guint n = batch_map (server, buffers, 0);
+		gssize written = n ? writev (fd, server->iov, n) : -1;
+		batch_unmap (server, buffers, n);
+		if (written < 0)
+		{
+			GST_WARNING ("can't write a memfd segment: %s", g_strerror (errno));
+			close (fd);
+			return NULL;
+		}
+		size += written;
+		buffers = g_list_nth (buffers, n);
+	}
+	if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+	{
+		GST_WARNING ("can't seal a memfd segment: %s", g_strerror (errno));
+		close (fd);
+		return NULL;
+	}
+	segment = g_new0 (DreamUnixSegment, 1);
+	segment->refcount = 1;
+	segment->fd = fd;
+	segment->header.magic = DREAM_UNIX_SEGMENT_MAGIC;
+	segment->header.size = size;
+	segment->header.flags = server->batch_keyframe ? DREAM_UNIX_FLAG_KEYFRAME : 0;
+	segment->header.seq = server->seq;
+	segment->header.pts = server->batch_pts;
+	return segment;
+}
+
+static void client_free (DreamUnixServer *server, DreamUnixClient *c)
+{
+	GstBuffer *buffer;
+	DreamUnixSegment *segment;
+
+	server->clients = g_list_remove (server->clients, c);
+	if (c->active)
+		g_atomic_int_add (&server->active, -1);
+	g_source_destroy (c->source);
+	g_source_unref (c->source);
+	if (c->timeout_source)
+	{
+		g_source_destroy (c->timeout_source);
+		g_source_unref (c->timeout_source);
+	}
+	close (c->fd);
+	while ((buffer = g_queue_pop_head (&c->pending)))
+		gst_buffer_unref (buffer);
+	while ((segment = g_queue_pop_head (&c->segments)))
+		segment_unref (segment);
+	g_free (c);
+}
+
+/* what is already partly on the wire is completed, so that the client
+ * stays in sync with the packets or headers */
+static void client_drop (DreamUnixServer *server, DreamUnixClient *c)
+{
+	GstBuffer *buffer, *head = c->offset ? g_queue_pop_head (&c->pending) : NULL;
+	DreamUnixSegment *segment, *first = c->header_sent ? g_queue_pop_head (&c->segments) : NULL;
+
+	while ((buffer = g_queue_pop_head (&c->pending)))
+		gst_buffer_unref (buffer);
+	while ((segment = g_queue_pop_head (&c->segments)))
+		segment_unref (segment);
+	c->pending_bytes = 0;
+	if (head)
+	{
+		g_queue_push_tail (&c->pending, head);
+		c->pending_bytes = gst_buffer_get_size (head) - c->offset;
+	}
+	if (first)
+		g_queue_push_tail (&c->segments, first);
+	c->wait_keyframe = TRUE;
+	c->discont = TRUE;
+	server->drops++;
+	GST_INFO ("client %d fell behind, dropping to live", c->fd);
+}
+
+static gboolean client_flush (DreamUnixServer *server, DreamUnixClient *c)
+{
+	while (c->pending.length)
+	{
+		struct msghdr msg = { 0, };
+		gssize sent, total;
+		gsize want = 0;
+		guint i, n;
+
+		n = batch_map (server, c->pending.head, c->offset);
+		if (!n)
+		{
+			/* can't happen with system memory, don't get stuck on it */
+			c->pending_bytes -= gst_buffer_get_size (c->pending.head->data) - c->offset;
+			gst_buffer_unref (g_queue_pop_head (&c->pending));
+			c->offset = 0;
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			want += server->iov[i].iov_len;
+		msg.msg_iov = server->iov;
+		msg.msg_iovlen = n;
+		sent = sendmsg (c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		batch_unmap (server, c->pending.head, n);
+		if (sent < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		server->bytes += sent;
+		c->pending_bytes -= sent;
+		total = sent;
+		sent += c->offset;
+		c->offset = 0;
+		while (sent > 0)
+		{
+			gsize size = gst_buffer_get_size (c->pending.head->data);
+			if ((gsize) sent < size)
+			{
+				c->offset = sent;
+				break;
+			}
+			gst_buffer_unref (g_queue_pop_head (&c->pending));
+			sent -= size;
+		}
+		/* the socket is full */
+		if ((gsize) total < want)
+			break;
+	}
+	return TRUE;
+}
+
+static gboolean client_send_batch (DreamUnixServer *server, DreamUnixClient *c)
+{
+	guint i;
+
+	if (c->pending_bytes + server->batch_bytes > DREAM_UNIX_MAX_PENDING)
+	{
+		client_drop (server, c);
+		if (!server->batch_keyframe)
+			return client_flush (server, c);
+		c->wait_keyframe = FALSE;
+	}
+	for (i = 0; i < server->batch->len; i++)
+		g_queue_push_tail (&c->pending, gst_buffer_ref (g_ptr_array_index (server->batch, i)));
+	c->pending_bytes += server->batch_bytes;
+	return client_flush (server, c);
+}
+
+static gboolean client_flush_segments (DreamUnixServer *server, DreamUnixClient *c)
+{
+	DreamUnixSegment *segment;
+
+	while ((segment = g_queue_peek_head (&c->segments)))
+	{
+		union {
+			struct cmsghdr cmsg;
+			gchar buf[CMSG_SPACE (sizeof (int))];
+		} control;
+		struct msghdr msg = { 0, };
+		struct iovec iov;
+		gssize sent;
+
+		/* the descriptor goes with the header's first byte */
+		if (!c->header_sent)
+		{
+			struct cmsghdr *cmsg;
+			c->header = segment->header;
+			if (c->discont)
+				c->header.flags |= DREAM_UNIX_FLAG_DISCONT;
+			memset (&control, 0, sizeof (control));
+			msg.msg_control = control.buf;
+			msg.msg_controllen = sizeof (control.buf);
+			cmsg = CMSG_FIRSTHDR (&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+			memcpy (CMSG_DATA (cmsg), &segment->fd, sizeof (int));
+		}
+		iov.iov_base = (gchar *) &c->header + c->header_sent;
+		iov.iov_len = sizeof (c->header) - c->header_sent;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		sent = sendmsg (c->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		c->discont = FALSE;
+		c->header_sent += sent;
+		if (c->header_sent < sizeof (c->header))
+			break;
+		c->header_sent = 0;
+		server->bytes += segment->header.size;
+		segment_unref (g_queue_pop_head (&c->segments));
+	}
+	return TRUE;
+}
+
+static gboolean client_send_segment (DreamUnixServer *server, DreamUnixClient *c, DreamUnixSegment *segment)
+{
+	if (g_queue_get_length (&c->segments) >= DREAM_UNIX_MAX_SEGMENTS)
+	{
+		client_drop (server, c);
+		if (!server->batch_keyframe)
+			return client_flush_segments (server, c);
+		c->wait_keyframe = FALSE;
+	}
+	g_queue_push_tail (&c->segments, segment_ref (segment));
+	return client_flush_segments (server, c);
+}
+
+static void batch_clear (DreamUnixServer *server)
+{
+	g_ptr_array_set_size (server->batch, 0);
+	server->batch_bytes = 0;
+}
+
+/* runs on the streaming thread. the memfd segment is only written when a
+ * memfd client takes this batch */
+static gboolean clients_notify (gpointer user_data)
+{
+	DreamUnixServer *server = user_data;
+	guint active;
+
+	g_mutex_lock (&server->lock);
+	if (g_source_is_destroyed (g_main_current_source ()))
+	{
+		g_mutex_unlock (&server->lock);
+		return G_SOURCE_REMOVE;
+	}
+	g_source_unref (server->notify_source);
+	server->notify_source = NULL;
+	active = g_atomic_int_get (&server->active);
+	g_mutex_unlock (&server->lock);
+
+	if (server->func)
+		server->func (server, active, server->user_data);
+	return G_SOURCE_REMOVE;
+}
+
+/* called with the lock held */
+static void clients_notify_later (DreamUnixServer *server)
+{
+	if (server->notify_source)
+		return;
+	server->notify_source = g_idle_source_new ();
+	g_source_set_callback (server->notify_source, clients_notify, server, NULL);
+	g_source_attach (server->notify_source, server->context);
+}
+
+static void batch_flush (DreamUnixServer *server)
+{
+	DreamUnixSegment *segment = NULL;
+	gboolean segment_failed = FALSE, changed = FALSE;
+	GList *l, *next, *buffers = NULL;
+	guint i;
+
+	g_mutex_lock (&server->lock);
+	for (l = server->clients; l; l = next)
+	{
+		DreamUnixClient *c = l->data;
+		gboolean ok = TRUE;
+
+		next = l->next;
+		if (!c->active || (c->wait_keyframe && !server->batch_keyframe))
+			continue;
+		c->wait_keyframe = FALSE;
+		if (c->memfd)
+		{
+			if (!segment && !segment_failed)
+			{
+				for (i = server->batch->len; i > 0; i--)
+					buffers = g_list_prepend (buffers, g_ptr_array_index (server->batch, i - 1));
+				segment = segment_new (server, buffers);
+				segment_failed = !segment;
+				if (segment)
+					server->segments++;
+			}
+			if (segment)
+				ok = client_send_segment (server, c, segment);
+		}
+		else
+			ok = client_send_batch (server, c);
+		if (!ok)
+		{
+			GST_INFO ("client %d: %s", c->fd, g_strerror (errno));
+			client_free (server, c);
+			changed = TRUE;
+		}
+	}
+	server->batches++;
+	if (changed)
+		clients_notify_later (server);
+	g_mutex_unlock (&server->lock);
+
+	g_list_free (buffers);
+	if (segment)
+		segment_unref (segment);
+	server->seq++;
+	batch_clear (server);
+}
+
+void dream_unix_server_push (DreamUnixServer *server, GstBuffer *buffer)
+{
+	gboolean delta = GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	gint64 now;
+
+	if (!g_atomic_int_get (&server->active))
+	{
+		batch_clear (server);
+		return;
+	}
+	now = g_get_monotonic_time ();
+	/* a keyframe starts a new batch, so that waiting clients begin with it */
+	if (!delta && server->last_delta && server->batch->len)
+		batch_flush (server);
+	server->last_delta = delta;
+	if (!server->batch->len)
+	{
+		server->batch_start = now;
+		server->batch_keyframe = !delta;
+		server->batch_pts = GST_BUFFER_PTS (buffer);
+	}
+	g_ptr_array_add (server->batch, gst_buffer_ref (buffer));
+	server->batch_bytes += gst_buffer_get_size (buffer);
+	if (server->batch_bytes >= DREAM_UNIX_BATCH_BYTES || now - server->batch_start >= DREAM_UNIX_BATCH_TIME)
+		batch_flush (server);
+}
+
+static DreamUnixClient *client_lookup (DreamUnixServer *server, GSource *source)
+{
+	GList *l;
+
+	for (l = server->clients; l; l = l->next)
+		if (((DreamUnixClient *) l->data)->source == source || ((DreamUnixClient *) l->data)->timeout_source == source)
+			return l->data;
+	return NULL;
+}
+
+static void client_activate (DreamUnixServer *server, DreamUnixClient *c)
+{
+	gchar **words, **word;
+
+	words = g_strsplit_set (g_strstrip (c->request), " \t", -1);
+	for (word = words; *word; word++)
+	{
+		if (!**word)
+			continue;
+		if (g_strcmp0 (*word, "keyframe") == 0)
+			c->wait_keyframe = TRUE;
+		else if (g_strcmp0 (*word, "memfd") == 0)
+			c->memfd = TRUE;
+		else
+			GST_WARNING ("client %d: ignoring unknown request '%s'", c->fd, *word);
+	}
+	g_strfreev (words);
+	g_source_destroy (c->timeout_source);
+	g_source_unref (c->timeout_source);
+	c->timeout_source = NULL;
+	c->active = TRUE;
+	g_atomic_int_inc (&server->active);
+	GST_INFO ("client %d: %s%s", c->fd, c->memfd ? "memfd segments" : "byte stream", c->wait_keyframe ? " from the next keyframe" : "");
+}
+
+static gboolean client_input_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+	DreamUnixServer *server = user_data;
+	GSource *source = g_main_current_source ();
+	DreamUnixClient *c;
+	gboolean ret = G_SOURCE_CONTINUE, changed = FALSE;
+	gchar buf[DREAM_UNIX_REQUEST_LEN];
+	guint active;
+	gssize n;
+
+	g_mutex_lock (&server->lock);
+	/* freed by the streaming thread meanwhile */
+	if (g_source_is_destroyed (source) || !(c = client_lookup (server, source)))
+	{
+		g_mutex_unlock (&server->lock);
+		return G_SOURCE_REMOVE;
+	}
+	n = recv (fd, buf, sizeof (buf), 0);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		;
+	else if (n < 0 || (n == 0 && !c->request_len && !c->active))
+	{
+		GST_DEBUG ("client %d went away", fd);
+		changed = c->active;
+		client_free (server, c);
+		ret = G_SOURCE_REMOVE;
+	}
+	else if (c->active)
+	{
+		/* only the request is read. this is the client shutting down its
+		 * side, it's gone for good when sending fails */
+		if (n == 0)
+			ret = G_SOURCE_REMOVE;
+	}
+	else if (c->request_len + n >= DREAM_UNIX_REQUEST_LEN)
+	{
+		GST_WARNING ("client %d: request too long", fd);
+		client_free (server, c);
+		ret = G_SOURCE_REMOVE;
+	}
+	else
+	{
+		memcpy (c->request + c->request_len, buf, n);
+		c->request_len += n;
+		c->request[c->request_len] = '\0';
+		if (n == 0 || strchr (c->request, '\n'))
+		{
+			client_activate (server, c);
+			changed = TRUE;
+			if (n == 0)
+				ret = G_SOURCE_REMOVE;
+		}
+	}
+	active = g_atomic_int_get (&server->active);
+	g_mutex_unlock (&server->lock);
+
+	if (changed && server->func)
+		server->func (server, active, server->user_data);
+	return ret;
+}
+
+/* keeps a client which connects and never sends its request from
+ * occupying one of the slots for good */
+static gboolean client_timeout_cb (gpointer user_data)
+{
+	DreamUnixServer *server = user_data;
+	GSource *source = g_main_current_source ();
+	DreamUnixClient *c;
+
+	g_mutex_lock (&server->lock);
+	if (!g_source_is_destroyed (source) && (c = client_lookup (server, source)) && !c->active)
+	{
+		GST_WARNING ("client %d: no request within %u seconds", c->fd, DREAM_UNIX_REQUEST_TIMEOUT);
+		client_free (server, c);
+	}
+	g_mutex_unlock (&server->lock);
+	return G_SOURCE_REMOVE;
+}
+
+static gboolean accept_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+	DreamUnixServer *server = user_data;
+	DreamUnixClient *c;
+	int client_fd;
+
+	g_mutex_lock (&server->lock);
+	if (g_source_is_destroyed (g_main_current_source ()))
+	{
+		g_mutex_unlock (&server->lock);
+		return G_SOURCE_REMOVE;
+	}
+	client_fd = accept4 (fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0)
+	{
+		if (errno != EAGAIN && errno != EINTR)
+			GST_WARNING ("accept on %s failed: %s", server->path, g_strerror (errno));
+	}
+	else if (g_list_length (server->clients) >= DREAM_UNIX_MAX_CLIENTS)
+	{
+		GST_WARNING ("refusing client %d, there are %u already", client_fd, DREAM_UNIX_MAX_CLIENTS);
+		close (client_fd);
+	}
+	else
+	{
+		c = g_new0 (DreamUnixClient, 1);
+		c->fd = client_fd;
+		g_queue_init (&c->pending);
+		g_queue_init (&c->segments);
+		c->source = g_unix_fd_source_new (client_fd, G_IO_IN | G_IO_HUP | G_IO_ERR);
+		g_source_set_callback (c->source, (GSourceFunc) client_input_cb, server, NULL);
+		g_source_attach (c->source, server->context);
+		c->timeout_source = g_timeout_source_new_seconds (DREAM_UNIX_REQUEST_TIMEOUT);
+		g_source_set_callback (c->timeout_source, client_timeout_cb, server, NULL);
+		g_source_attach (c->timeout_source, server->context);
+		server->clients = g_list_append (server->clients, c);
+		GST_DEBUG ("client %d connected", client_fd);
+	}
+	g_mutex_unlock (&server->lock);
+	return G_SOURCE_CONTINUE;
+}
+
+DreamUnixServer *dream_unix_server_new (GMainContext *context, DreamUnixClientsFunc func, gpointer user_data)
+{
+	DreamUnixServer *server = g_new0 (DreamUnixServer, 1);
+
+	GST_DEBUG_CATEGORY_INIT (dreamunix_debug, "dreamunix", 0, "dreamrtspserver unix socket output");
+	g_mutex_init (&server->lock);
+	server->context = g_main_context_ref (context);
+	server->func = func;
+	server->user_data = user_data;
+	server->fd = -1;
+	server->batch = g_ptr_array_new_with_free_func ((GDestroyNotify) gst_buffer_unref);
+	return server;
+}
+
+/* after dream_unix_server_close() and once nothing pushes anymore */
+void dream_unix_server_free (DreamUnixServer *server)
+{
+	g_ptr_array_free (server->batch, TRUE);
+	g_main_context_unref (server->context);
+	g_free (server->path);
+	g_mutex_clear (&server->lock);
+	g_free (server);
+}
+
+/* a stale socket of a previous run is replaced. only the owner and its
+ * group may connect */
+gboolean dream_unix_server_listen (DreamUnixServer *server, const gchar *path)
+{
+	struct sockaddr_un addr;
+	mode_t mask;
+	int fd, ret;
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen (path) >= sizeof (addr.sun_path))
+	{
+		GST_WARNING ("socket path %s is too long", path);
+		return FALSE;
+	}
+	strcpy (addr.sun_path, path);
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		GST_WARNING ("can't create a unix socket: %s", g_strerror (errno));
+		return FALSE;
+	}
+	unlink (path);
+	/* the socket is created with the permissions the umask leaves, there
+	 * mustn't be a moment in which others can connect. the umask is process
+	 * wide, whatever else is created meanwhile only ends up stricter */
+	mask = umask (0117);
+	ret = bind (fd, (struct sockaddr *) &addr, sizeof (addr));
+	umask (mask);
+	if (ret < 0 || listen (fd, UNIX_LISTEN_BACKLOG) < 0)
+	{
+		GST_WARNING ("can't listen on %s: %s", path, g_strerror (errno));
+		close (fd);
+		return FALSE;
+	}
+	server->fd = fd;
+	server->path = g_strdup (path);
+	server->accept_source = g_unix_fd_source_new (fd, G_IO_IN);
+	g_source_set_callback (server->accept_source, (GSourceFunc) accept_cb, server, NULL);
+	g_source_attach (server->accept_source, server->context);
+	GST_INFO ("listening on %s", path);
+	return TRUE;
+}
+
+/* call it on the server's context, so that none of its callbacks is
+ * running anymore afterwards */
+void dream_unix_server_close (DreamUnixServer *server)
+{
+	g_mutex_lock (&server->lock);
+	while (server->clients)
+		client_free (server, server->clients->data);
+	if (server->accept_source)
+	{
+		g_source_destroy (server->accept_source);
+		g_source_unref (server->accept_source);
+		server->accept_source = NULL;
+	}
+	if (server->notify_source)
+	{
+		g_source_destroy (server->notify_source);
+		g_source_unref (server->notify_source);
+		server->notify_source = NULL;
+	}
+	if (server->fd >= 0)
+	{
+		close (server->fd);
+		unlink (server->path);
+		server->fd = -1;
+	}
+	g_mutex_unlock (&server->lock);
+	GST_INFO ("closed %s", server->path);
+}
+
+const gchar *dream_unix_server_get_path (DreamUnixServer *server)
+{
+	return server->path;
+}
+
+void dream_unix_server_get_stats (DreamUnixServer *server, DreamUnixStats *stats)
+{
+	g_mutex_lock (&server->lock);
+	stats->clients = g_atomic_int_get (&server->active);
+	stats->bytes = server->bytes;
+	stats->batches = server->batches;
+	stats->segments = server->segments;
+	stats->drops = server->drops;
+	g_mutex_unlock (&server->lock);
+}
@@ -0,0 +1,90 @@
+/*
+ * dreamrtspserver
+ * Copyright 2015 Andreas Frisch <fraxinas@opendreambox.org>
+ *
+ * This program is licensed under the Creative Commons
+ * Attribution-NonCommercial-ShareAlike 3.0 Unported
+ * License. To view a copy of this license, visit
+ * http://creativecommons.org/licenses/by-nc-sa/3.0/ or send a letter to
+ * Creative Commons,559 Nathan Abbott Way,Stanford,California 94305,USA.
+ *
+ * Alternatively, this program may be distributed and executed on
+ * hardware which is licensed by Dream Multimedia GmbH.
+ *
+ * This program is NOT free software. It is open source, you are allowed
+ * to modify it (if you keep the license), but it may not be commercially
+ * distributed other than under the conditions noted above.
+ */
+
+
+#include <gst/gst.h>
+
+#ifndef __DREAMUNIX_H__
+#define __DREAMUNIX_H__
+
+G_BEGIN_DECLS
+
+/* TS for trusted local clients over a UNIX stream socket. after connecting
+ * a client sends one request line of space separated words and then only
+ * reads:
+ *   keyframe  start with the next keyframe instead of right away
+ *   memfd     receive sealed memfd segments instead of the byte stream
+ * an empty line asks for the byte stream from the next packet on. a client
+ * which hasn't sent its line within DREAM_UNIX_REQUEST_TIMEOUT seconds is
+ * disconnected.
+ *
+ * the stream is collected into batches which are written with one sendmsg
+ * per client. a memfd client gets every batch as a DreamUnixSegmentHeader
+ * carrying the segment's file descriptor as SCM_RIGHTS, it maps the
+ * descriptor read only and closes it when done. the header is the unit of
+ * recvmsg, the descriptor arrives with its first byte.
+ *
+ * the mux never waits for a client. one which falls too far behind loses
+ * what is queued for it and continues with the next keyframe */
+#define DREAM_UNIX_BATCH_BYTES (64 * 1024)
+#define DREAM_UNIX_BATCH_TIME (40 * G_TIME_SPAN_MILLISECOND)
+#define DREAM_UNIX_MAX_PENDING (2 * 1024 * 1024)
+#define DREAM_UNIX_MAX_SEGMENTS 32
+#define DREAM_UNIX_MAX_CLIENTS 16
+#define DREAM_UNIX_REQUEST_LEN 64
+#define DREAM_UNIX_REQUEST_TIMEOUT 5
+
+#define DREAM_UNIX_SEGMENT_MAGIC 0x53554d44
+#define DREAM_UNIX_FLAG_KEYFRAME 1
+/* the client lost data before this segment */
+#define DREAM_UNIX_FLAG_DISCONT 2
+
+typedef struct {
+	guint32 magic;
+	guint32 size;
+	guint32 flags;
+	guint32 reserved;
+	guint64 seq;
+	guint64 pts;
+} DreamUnixSegmentHeader;
+
+typedef struct _DreamUnixServer DreamUnixServer;
+
+typedef struct {
+	guint clients;
+	guint64 bytes;
+	guint64 batches;
+	guint64 segments;
+	guint64 drops;
+} DreamUnixStats;
+
+/* called on the server's context whenever a client starts or ends, also
+ * for clients the streaming thread dropped */
+typedef void (*DreamUnixClientsFunc) (DreamUnixServer *server, guint clients, gpointer user_data);
+
+DreamUnixServer * dream_unix_server_new       (GMainContext *context, DreamUnixClientsFunc func, gpointer user_data);
+void              dream_unix_server_free      (DreamUnixServer *server);
+gboolean          dream_unix_server_listen    (DreamUnixServer *server, const gchar *path);
+void              dream_unix_server_close     (DreamUnixServer *server);
+const gchar *     dream_unix_server_get_path  (DreamUnixServer *server);
+void              dream_unix_server_push      (DreamUnixServer *server, GstBuffer *buffer);
+void              dream_unix_server_get_stats (DreamUnixServer *server, DreamUnixStats *stats);
+
+G_END_DECLS
+
+#endif /* __DREAMUNIX_H__ */
@@ -17,16 +17,39 @@
  */
 
 #include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 
 #include "gstdreamrtsp.h"
 
+#define GST_DREAM_RTSP_CLIENT_GET_PRIVATE(obj)  \
+	(G_TYPE_INSTANCE_GET_PRIVATE ((obj), GST_TYPE_DREAM_RTSP_CLIENT, GstDreamRTSPClientPrivate))
+
+struct _GstDreamRTSPClientPrivate
+{
+	GMutex lock;
+	GstDreamRTSPClientCongestion congestion;
+	GstClockTime congestion_since;
+};
+
 G_DEFINE_TYPE (GstDreamRTSPClient, gst_dream_rtsp_client, GST_TYPE_RTSP_CLIENT);
 
 GST_DEBUG_CATEGORY_STATIC (rtsp_server_debug);
 #define GST_CAT_DEFAULT rtsp_server_debug
 
+static void gst_dream_rtsp_client_finalize (GObject * object);
+
 static void gst_dream_rtsp_client_class_init (GstDreamRTSPClientClass * klass)
 {
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+	g_type_class_add_private (klass, sizeof (GstDreamRTSPClientPrivate));
+
+	gobject_class->finalize = gst_dream_rtsp_client_finalize;
+
 	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
 			GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
 			"Dreambox RTSP server daemon");
@@ -34,9 +57,446 @@ static void gst_dream_rtsp_client_class_init (GstDreamRTSPClientClass * klass)
 
 static void gst_dream_rtsp_client_init (GstDreamRTSPClient * client)
 {
+	GstDreamRTSPClientPrivate *priv = GST_DREAM_RTSP_CLIENT_GET_PRIVATE (client);
+
+	client->priv = priv;
+	g_mutex_init (&priv->lock);
+	priv->congestion = GST_DREAM_RTSP_CLIENT_CONGESTION_NONE;
+	priv->congestion_since = GST_CLOCK_TIME_NONE;
+
 	GST_DEBUG_OBJECT (client, "Client is initialized");
 }
 
+static void gst_dream_rtsp_client_finalize (GObject * object)
+{
+	GstDreamRTSPClient *client = GST_DREAM_RTSP_CLIENT (object);
+
+	g_mutex_clear (&client->priv->lock);
+
+	G_OBJECT_CLASS (gst_dream_rtsp_client_parent_class)->finalize (object);
+}
+
+/* number of bytes which were written to the client's socket but not yet
+ * acknowledged by the peer. this is the kernel side of the backlog, the
+ * watch's own backlog is bounded by the client's "drop-backlog" setting. */
+gsize gst_dream_rtsp_client_get_backlog (GstDreamRTSPClient *client)
+{
+	GstRTSPConnection *conn;
+	GSocket *socket;
+	int pending = 0;
+
+	conn = gst_rtsp_client_get_connection (GST_RTSP_CLIENT (client));
+	if (!conn)
+		return 0;
+
+	socket = gst_rtsp_connection_get_write_socket (conn);
+	if (!socket)
+		return 0;
+
+	if (ioctl (g_socket_get_fd (socket), SIOCOUTQ, &pending) < 0 || pending < 0)
+	{
+		GST_LOG_OBJECT (client, "SIOCOUTQ failed: %s", g_strerror (errno));
+		return 0;
+	}
+	return pending;
+}
+
+typedef struct {
+	gboolean set_active;
+	gboolean active;
+	GstRTSPMedia *media;
+} DreamInterleavedWalk;
+
+static GstRTSPFilterResult interleaved_media_filter_func (GstRTSPSession *sess, GstRTSPSessionMedia *session_media, gpointer user_data)
+{
+	DreamInterleavedWalk *walk = user_data;
+	GstRTSPMedia *media = gst_rtsp_session_media_get_media (session_media);
+	guint idx, n_streams = gst_rtsp_media_n_streams (media);
+
+	for (idx = 0; idx < n_streams; idx++)
+	{
+		GstRTSPStreamTransport *trans = gst_rtsp_session_media_get_transport (session_media, idx);
+		const GstRTSPTransport *transport;
+		if (!trans)
+			continue;
+		transport = gst_rtsp_stream_transport_get_transport (trans);
+		if (!transport || transport->lower_transport != GST_RTSP_LOWER_TRANS_TCP)
+			continue;
+		walk->media = media;
+		if (walk->set_active)
+			gst_rtsp_stream_transport_set_active (trans, walk->active);
+	}
+	return GST_RTSP_FILTER_KEEP;
+}
+
+static GstRTSPFilterResult interleaved_session_filter_func (GstRTSPClient *client, GstRTSPSession *sess, gpointer user_data)
+{
+	g_list_free (gst_rtsp_session_filter (sess, interleaved_media_filter_func, user_data));
+	return GST_RTSP_FILTER_KEEP;
+}
+
+/* returns the media which the client receives over TCP interleaved
+ * transports or NULL if it only uses UDP (no reference is taken) */
+GstRTSPMedia *gst_dream_rtsp_client_get_interleaved_media (GstDreamRTSPClient *client)
+{
+	DreamInterleavedWalk walk = { FALSE, FALSE, NULL };
+	g_list_free (gst_rtsp_client_session_filter (GST_RTSP_CLIENT (client), interleaved_session_filter_func, &walk));
+	return walk.media;
+}
+
+void gst_dream_rtsp_client_set_interleaved_active (GstDreamRTSPClient *client, gboolean active)
+{
+	DreamInterleavedWalk walk = { TRUE, active, NULL };
+	GST_DEBUG_OBJECT (client, "%sactivating interleaved transports", active ? "" : "de");
+	g_list_free (gst_rtsp_client_session_filter (GST_RTSP_CLIENT (client), interleaved_session_filter_func, &walk));
+}
+
+GstDreamRTSPClientCongestion gst_dream_rtsp_client_get_congestion (GstDreamRTSPClient *client, GstClockTime *since)
+{
+	GstDreamRTSPClientPrivate *priv = client->priv;
+	GstDreamRTSPClientCongestion stage;
+
+	g_mutex_lock (&priv->lock);
+	stage = priv->congestion;
+	if (since)
+		*since = priv->congestion_since;
+	g_mutex_unlock (&priv->lock);
+	return stage;
+}
+
+void gst_dream_rtsp_client_set_congestion (GstDreamRTSPClient *client, GstDreamRTSPClientCongestion stage, GstClockTime since)
+{
+	GstDreamRTSPClientPrivate *priv = client->priv;
+
+	g_mutex_lock (&priv->lock);
+	GST_DEBUG_OBJECT (client, "congestion stage %i -> %i", priv->congestion, stage);
+	priv->congestion = stage;
+	priv->congestion_since = since;
+	g_mutex_unlock (&priv->lock);
+}
+
+#define GST_DREAM_RTSP_THREAD_POOL_GET_PRIVATE(obj)  \
+	(G_TYPE_INSTANCE_GET_PRIVATE ((obj), GST_TYPE_DREAM_RTSP_THREAD_POOL, GstDreamRTSPThreadPoolPrivate))
+
+/* slots are never freed while the pool exists, so client signal handlers
+ * can keep pointing to theirs. a slot gets recycled once its thread left,
+ * the generation tells its clients from those of an earlier thread */
+typedef struct {
+	GstRTSPThread *thread;
+	guint generation;
+	GstDreamRTSPThreadStats stats;
+} DreamPoolSlot;
+
+struct _GstDreamRTSPThreadPoolPrivate
+{
+	GMutex lock;
+	GPtrArray *slots;
+	GArray *cpus;
+};
+
+static GQuark pool_slot_quark, pool_generation_quark;
+
+G_DEFINE_TYPE (GstDreamRTSPThreadPool, gst_dream_rtsp_thread_pool, GST_TYPE_RTSP_THREAD_POOL);
+
+static void gst_dream_rtsp_thread_pool_finalize (GObject * object);
+static GstRTSPThread *gst_dream_rtsp_thread_pool_get_thread (GstRTSPThreadPool * pool, GstRTSPThreadType type, GstRTSPContext * ctx);
+static void gst_dream_rtsp_thread_pool_thread_enter (GstRTSPThreadPool * pool, GstRTSPThread * thread);
+static void gst_dream_rtsp_thread_pool_thread_leave (GstRTSPThreadPool * pool, GstRTSPThread * thread);
+
+static void gst_dream_rtsp_thread_pool_class_init (GstDreamRTSPThreadPoolClass * klass)
+{
+	GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+	GstRTSPThreadPoolClass *tpool_class = GST_RTSP_THREAD_POOL_CLASS (klass);
+
+	g_type_class_add_private (klass, sizeof (GstDreamRTSPThreadPoolPrivate));
+
+	gobject_class->finalize = gst_dream_rtsp_thread_pool_finalize;
+
+	tpool_class->get_thread = gst_dream_rtsp_thread_pool_get_thread;
+	tpool_class->thread_enter = gst_dream_rtsp_thread_pool_thread_enter;
+	tpool_class->thread_leave = gst_dream_rtsp_thread_pool_thread_leave;
+
+	pool_slot_quark = g_quark_from_static_string ("gst-dream-rtsp-pool-slot");
+	pool_generation_quark = g_quark_from_static_string ("gst-dream-rtsp-pool-generation");
+
+	GST_DEBUG_CATEGORY_INIT (rtsp_server_debug, "dreamrtspserver",
+			GST_DEBUG_BOLD | GST_DEBUG_FG_YELLOW | GST_DEBUG_BG_BLUE,
+			"Dreambox RTSP server daemon");
+}
+
+static void gst_dream_rtsp_thread_pool_init (GstDreamRTSPThreadPool * pool)
+{
+	GstDreamRTSPThreadPoolPrivate *priv = GST_DREAM_RTSP_THREAD_POOL_GET_PRIVATE (pool);
+
+	pool->priv = priv;
+	g_mutex_init (&priv->lock);
+	priv->slots = g_ptr_array_new_with_free_func (g_free);
+	priv->cpus = g_array_new (FALSE, FALSE, sizeof (gint));
+}
+
+static void gst_dream_rtsp_thread_pool_finalize (GObject * object)
+{
+	GstDreamRTSPThreadPool *pool = GST_DREAM_RTSP_THREAD_POOL (object);
+
+	g_ptr_array_free (pool->priv->slots, TRUE);
+	g_array_free (pool->priv->cpus, TRUE);
+	g_mutex_clear (&pool->priv->lock);
+
+	G_OBJECT_CLASS (gst_dream_rtsp_thread_pool_parent_class)->finalize (object);
+}
+
+/* must be called with the pool lock held */
+static DreamPoolSlot *thread_pool_find_slot (GstDreamRTSPThreadPool *pool, GstRTSPThread *thread, gboolean create)
+{
+	GstDreamRTSPThreadPoolPrivate *priv = pool->priv;
+	DreamPoolSlot *slot, *free_slot = NULL;
+	guint i;
+
+	for (i = 0; i < priv->slots->len; i++)
+	{
+		slot = g_ptr_array_index (priv->slots, i);
+		if (slot->thread == thread)
+			return slot;
+		if (!slot->thread && !free_slot)
+			free_slot = slot;
+	}
+	if (!create)
+		return NULL;
+
+	slot = free_slot;
+	if (!slot)
+	{
+		slot = g_new0 (DreamPoolSlot, 1);
+		slot->stats.index = priv->slots->len;
+		g_ptr_array_add (priv->slots, slot);
+	}
+	slot->thread = thread;
+	slot->generation++;
+	slot->stats.clients = 0;
+	slot->stats.running = TRUE;
+	slot->stats.cpu = priv->cpus->len ? g_array_index (priv->cpus, gint, slot->stats.index % priv->cpus->len) : -1;
+	GST_DEBUG_OBJECT (pool, "thread %p uses slot %u (cpu %i)", thread, slot->stats.index, slot->stats.cpu);
+	return slot;
+}
+
+static void thread_pool_count_request (GstRTSPClient *client, GstRTSPContext *ctx, gpointer user_data)
+{
+	DreamPoolSlot *slot = user_data;
+	__sync_fetch_and_add (&slot->stats.requests, 1);
+}
+
+static void thread_pool_count_message (GstRTSPClient *client, GstRTSPSession *session, GstRTSPMessage *message, gpointer user_data)
+{
+	DreamPoolSlot *slot = user_data;
+	__sync_fetch_and_add (&slot->stats.messages, 1);
+}
+
+static void thread_pool_client_closed (GstRTSPClient *client, gpointer user_data)
+{
+	GstDreamRTSPThreadPool *pool = user_data;
+	DreamPoolSlot *slot = g_object_get_qdata (G_OBJECT (client), pool_slot_quark);
+
+	if (!slot)
+		return;
+	g_mutex_lock (&pool->priv->lock);
+	/* not if the slot has a new thread meanwhile, its count started at 0 */
+	if (slot->generation == GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (client), pool_generation_quark)) && slot->stats.clients)
+		slot->stats.clients--;
+	g_mutex_unlock (&pool->priv->lock);
+	g_object_set_qdata (G_OBJECT (client), pool_slot_quark, NULL);
+}
+
+static void thread_pool_attach_client (GstDreamRTSPThreadPool *pool, DreamPoolSlot *slot, GstRTSPClient *client)
+{
+	static const gchar *request_signals[] = { "options-request", "describe-request", "setup-request", "play-request",
+		"pause-request", "teardown-request", "get-parameter-request", "set-parameter-request", NULL };
+	const gchar **signal;
+
+	slot->stats.clients++;
+	slot->stats.total_clients++;
+	if (!client)
+		return;
+	g_object_set_qdata (G_OBJECT (client), pool_slot_quark, slot);
+	g_object_set_qdata (G_OBJECT (client), pool_generation_quark, GUINT_TO_POINTER (slot->generation));
+	for (signal = request_signals; *signal; signal++)
+		g_signal_connect (client, *signal, (GCallback) thread_pool_count_request, slot);
+	g_signal_connect (client, "send-message", (GCallback) thread_pool_count_message, slot);
+	g_signal_connect_object (client, "closed", (GCallback) thread_pool_client_closed, pool, 0);
+}
+
+/* client threads are created up to max-threads, after that each new client
+ * is assigned to the thread which currently serves the fewest clients
+ * instead of the parent's plain round robin */
+static GstRTSPThread *gst_dream_rtsp_thread_pool_get_thread (GstRTSPThreadPool * tpool, GstRTSPThreadType type, GstRTSPContext * ctx)
+{
+	GstDreamRTSPThreadPool *pool = GST_DREAM_RTSP_THREAD_POOL (tpool);
+	GstDreamRTSPThreadPoolPrivate *priv = pool->priv;
+	GstRTSPThreadPoolClass *parent_class = GST_RTSP_THREAD_POOL_CLASS (gst_dream_rtsp_thread_pool_parent_class);
+	GstRTSPClient *client = ctx ? ctx->client : NULL;
+	DreamPoolSlot *slot, *best = NULL;
+	GstRTSPThread *thread = NULL;
+	gint max_threads = gst_rtsp_thread_pool_get_max_threads (tpool);
+	guint i, running = 0;
+
+	if (type != GST_RTSP_THREAD_TYPE_CLIENT)
+		return parent_class->get_thread (tpool, type, ctx);
+
+	g_mutex_lock (&priv->lock);
+	for (i = 0; i < priv->slots->len; i++)
+	{
+		slot = g_ptr_array_index (priv->slots, i);
+		if (!slot->thread)
+			continue;
+		running++;
+		if (!best || slot->stats.clients < best->stats.clients)
+			best = slot;
+	}
+	if (best && max_threads >= 0 && running >= (guint) max_threads && gst_rtsp_thread_reuse (best->thread))
+	{
+		thread = gst_rtsp_thread_ref (best->thread);
+		thread_pool_attach_client (pool, best, client);
+		GST_DEBUG_OBJECT (pool, "client %p reuses thread %u with %u clients", client, best->stats.index, best->stats.clients);
+	}
+	g_mutex_unlock (&priv->lock);
+
+	if (thread)
+		return thread;
+
+	thread = parent_class->get_thread (tpool, type, ctx);
+	if (!thread)
+		return NULL;
+
+	g_mutex_lock (&priv->lock);
+	slot = thread_pool_find_slot (pool, thread, TRUE);
+	thread_pool_attach_client (pool, slot, client);
+	GST_DEBUG_OBJECT (pool, "client %p got thread %u with %u clients", client, slot->stats.index, slot->stats.clients);
+	g_mutex_unlock (&priv->lock);
+
+	return thread;
+}
+
+static void gst_dream_rtsp_thread_pool_thread_enter (GstRTSPThreadPool * tpool, GstRTSPThread * thread)
+{
+	GstDreamRTSPThreadPool *pool = GST_DREAM_RTSP_THREAD_POOL (tpool);
+	DreamPoolSlot *slot;
+	gint cpu;
+
+	if (thread->type != GST_RTSP_THREAD_TYPE_CLIENT)
+		return;
+
+	g_mutex_lock (&pool->priv->lock);
+	slot = thread_pool_find_slot (pool, thread, TRUE);
+	cpu = slot->stats.cpu;
+	g_mutex_unlock (&pool->priv->lock);
+
+	if (cpu >= 0)
+	{
+		cpu_set_t set;
+		int ret;
+		CPU_ZERO (&set);
+		CPU_SET (cpu, &set);
+		ret = pthread_setaffinity_np (pthread_self (), sizeof (set), &set);
+		if (ret)
+			GST_WARNING_OBJECT (pool, "couldn't pin client thread to cpu %i: %s", cpu, g_strerror (ret));
+		else
+			GST_DEBUG_OBJECT (pool, "pinned client thread %p to cpu %i", thread, cpu);
+	}
+}
+
+static void gst_dream_rtsp_thread_pool_thread_leave (GstRTSPThreadPool * tpool, GstRTSPThread * thread)
+{
+	GstDreamRTSPThreadPool *pool = GST_DREAM_RTSP_THREAD_POOL (tpool);
+	DreamPoolSlot *slot;
+
+	g_mutex_lock (&pool->priv->lock);
+	slot = thread_pool_find_slot (pool, thread, FALSE);
+	if (slot)
+	{
+		GST_DEBUG_OBJECT (pool, "client thread %u left", slot->stats.index);
+		slot->thread = NULL;
+		slot->stats.running = FALSE;
+		slot->stats.clients = 0;
+	}
+	g_mutex_unlock (&pool->priv->lock);
+}
+
+/* cpus is a list like "0,2-3", an empty string or NULL disables pinning.
+ * only threads started afterwards are affected. */
+gboolean gst_dream_rtsp_thread_pool_set_affinity (GstDreamRTSPThreadPool *pool, const gchar *cpus)
+{
+	GArray *list = g_array_new (FALSE, FALSE, sizeof (gint));
+	gint n_cpus = g_get_num_processors ();
+	gchar **ranges, **range;
+	gboolean ret = TRUE;
+
+	ranges = g_strsplit (cpus ? cpus : "", ",", -1);
+	for (range = ranges; *range && ret; range++)
+	{
+		gchar *end;
+		gint64 first, last;
+		if (!**range)
+			continue;
+		first = last = g_ascii_strtoll (*range, &end, 10);
+		if (*end == '-')
+			last = g_ascii_strtoll (end+1, &end, 10);
+		if (*end || first < 0 || last < first || last >= n_cpus)
+			ret = FALSE;
+		for (; ret && first <= last; first++)
+		{
+			gint cpu = first;
+			g_array_append_val (list, cpu);
+		}
+	}
+	g_strfreev (ranges);
+
+	if (!ret)
+	{
+		GST_WARNING_OBJECT (pool, "invalid cpu list '%s' (%i cpus available)", cpus, n_cpus);
+		g_array_free (list, TRUE);
+		return FALSE;
+	}
+
+	g_mutex_lock (&pool->priv->lock);
+	g_array_free (pool->priv->cpus, TRUE);
+	pool->priv->cpus = list;
+	g_mutex_unlock (&pool->priv->lock);
+	GST_INFO_OBJECT (pool, "client thread affinity set to '%s'", cpus);
+	return TRUE;
+}
+
+gchar *gst_dream_rtsp_thread_pool_get_affinity (GstDreamRTSPThreadPool *pool)
+{
+	GString *str = g_string_new (NULL);
+	guint i;
+
+	g_mutex_lock (&pool->priv->lock);
+	for (i = 0; i < pool->priv->cpus->len; i++)
+		g_string_append_printf (str, "%s%i", i ? "," : "", g_array_index (pool->priv->cpus, gint, i));
+	g_mutex_unlock (&pool->priv->lock);
+	return g_string_free (str, FALSE);
+}
+
+/* returns an array of GstDreamRTSPThreadStats, one per slot */
+GArray *gst_dream_rtsp_thread_pool_get_stats (GstDreamRTSPThreadPool *pool)
+{
+	GArray *stats = g_array_new (FALSE, FALSE, sizeof (GstDreamRTSPThreadStats));
+	guint i;
+
+	g_mutex_lock (&pool->priv->lock);
+	for (i = 0; i < pool->priv->slots->len; i++)
+	{
+		DreamPoolSlot *slot = g_ptr_array_index (pool->priv->slots, i);
+		g_array_append_val (stats, slot->stats);
+	}
+	g_mutex_unlock (&pool->priv->lock);
+	return stats;
+}
+
+GstDreamRTSPThreadPool *gst_dream_rtsp_thread_pool_new (void)
+{
+	return g_object_new (GST_TYPE_DREAM_RTSP_THREAD_POOL, NULL);
+}
+
 #define gst_dream_rtsp_server_parent_class parent_class
 G_DEFINE_TYPE (GstDreamRTSPServer, gst_dream_rtsp_server, GST_TYPE_RTSP_SERVER);
 
@@ -67,7 +527,12 @@ static GstRTSPClient *gst_dream_rtsp_create_client (GstRTSPServer * server)
 {
 	GstDreamRTSPClient *client;
 	client = g_object_new(GST_TYPE_DREAM_RTSP_CLIENT, NULL);
-	
+
+	/* never let a slow TCP interleaved receiver block the shared media's
+	 * streaming thread, the congestion handling takes care of such clients */
+	if (g_object_class_find_property (G_OBJECT_GET_CLASS (client), "drop-backlog"))
+		g_object_set (client, "drop-backlog", TRUE, NULL);
+
 	GstRTSPSessionPool *spool = gst_rtsp_server_get_session_pool (server);
 	gst_rtsp_client_set_session_pool (GST_RTSP_CLIENT(client), spool);
 	g_object_unref (spool);
@@ -107,7 +572,17 @@ static guint gst_dream_rtsp_media_factory_signals[SIGNAL_LAST] = { 0 };
 static void gst_dream_rtsp_media_factory_finalize (GObject * obj);
 static GstRTSPMedia *rtsp_dream_media_factory_construct (GstRTSPMediaFactory * factory, const GstRTSPUrl * url);
 static gchar *rtsp_dream_media_factory_gen_key (GstRTSPMediaFactory * factory, const GstRTSPUrl * url);
+static GstElement *rtsp_dream_media_factory_create_element (GstRTSPMediaFactory * factory, const GstRTSPUrl * url);
 
+#define GST_DREAM_RTSP_MEDIA_FACTORY_GET_PRIVATE(obj)  \
+	(G_TYPE_INSTANCE_GET_PRIVATE ((obj), GST_TYPE_DREAM_RTSP_MEDIA_FACTORY, GstDreamRTSPMediaFactoryPrivate))
+
+struct _GstDreamRTSPMediaFactoryPrivate
+{
+	gchar *variant_launch;
+};
+
+static GQuark variant_quark;
 
 G_DEFINE_TYPE (GstDreamRTSPMediaFactory, gst_dream_rtsp_media_factory, GST_TYPE_RTSP_MEDIA_FACTORY);
 
@@ -126,10 +601,15 @@ gst_dream_rtsp_media_factory_class_init (GstDreamRTSPMediaFactoryClass * klass)
 	gobject_class = G_OBJECT_CLASS (klass);
 	mediafactory_class = GST_RTSP_MEDIA_FACTORY_CLASS (klass);
 
+	g_type_class_add_private (klass, sizeof (GstDreamRTSPMediaFactoryPrivate));
+
 	gobject_class->finalize = gst_dream_rtsp_media_factory_finalize;
 
 	mediafactory_class->construct = rtsp_dream_media_factory_construct;
 	mediafactory_class->gen_key = rtsp_dream_media_factory_gen_key;
+	mediafactory_class->create_element = rtsp_dream_media_factory_create_element;
+
+	variant_quark = g_quark_from_static_string ("gst-dream-rtsp-variant");
 
 	gst_dream_rtsp_media_factory_signals[SIGNAL_URI_PARAMETRIZED] =
 		g_signal_new ("uri-parametrized", G_TYPE_FROM_CLASS (klass),
@@ -145,6 +625,8 @@ gst_dream_rtsp_media_factory_class_init (GstDreamRTSPMediaFactoryClass * klass)
 static void
 gst_dream_rtsp_media_factory_init (GstDreamRTSPMediaFactory * factory)
 {
+	factory->priv = GST_DREAM_RTSP_MEDIA_FACTORY_GET_PRIVATE (factory);
+	factory->priv->variant_launch = NULL;
 }
 
 static void
@@ -154,21 +636,111 @@ gst_dream_rtsp_media_factory_finalize (GObject * obj)
 
 	GST_DEBUG_OBJECT (factory, "finalize");
 
+	g_free (factory->priv->variant_launch);
+
 	G_OBJECT_CLASS (gst_dream_rtsp_media_factory_parent_class)->finalize (obj);
 }
 
+/* parses the variant parameters out of the query string and returns them
+ * in normalised form (sorted, validated) or NULL if the main stream is meant */
+static gchar *
+rtsp_dream_media_factory_parse_variant (const gchar *query, guint *bitrate, guint *lines)
+{
+	gchar **params, **param;
+	guint vbr = 0, res = 0;
+	gchar *result = NULL;
+
+	if (!query || !*query)
+		return NULL;
+
+	params = g_strsplit (query, "&", -1);
+	for (param = params; *param; param++)
+	{
+		gchar *value = strchr (*param, '=');
+		guint64 number;
+		if (!value)
+			continue;
+		*value++ = '\0';
+		number = g_ascii_strtoull (value, NULL, 10);
+		if (g_strcmp0 (*param, "vbr") == 0 && number >= DREAM_RTSP_VARIANT_MIN_BITRATE && number <= DREAM_RTSP_VARIANT_MAX_BITRATE)
+			vbr = number;
+		else if (g_strcmp0 (*param, "res") == 0 && number >= DREAM_RTSP_VARIANT_MIN_LINES && number <= DREAM_RTSP_VARIANT_MAX_LINES)
+			res = number & ~1;
+	}
+	g_strfreev (params);
+
+	if (vbr && res)
+		result = g_strdup_printf ("res=%u&vbr=%u", res, vbr);
+	else if (res)
+		result = g_strdup_printf ("res=%u", res);
+	else if (vbr)
+		result = g_strdup_printf ("vbr=%u", vbr);
+
+	/* without explicit bitrate, scale the reference bitrate by the number of pixels */
+	if (res && !vbr)
+		vbr = MAX (DREAM_RTSP_VARIANT_MIN_BITRATE, (guint64) DREAM_RTSP_VARIANT_REF_BITRATE * res * res / (DREAM_RTSP_VARIANT_MAX_LINES * DREAM_RTSP_VARIANT_MAX_LINES));
+	if (bitrate)
+		*bitrate = vbr;
+	if (lines)
+		*lines = res;
+	return result;
+}
+
 static gchar *
 rtsp_dream_media_factory_gen_key (GstRTSPMediaFactory* factory, const GstRTSPUrl* url)
 {
-	gchar *result;
+	gchar *result, *variant;
 	guint16 port;
 
 	gst_rtsp_url_get_port (url, &port);
-	result = g_strdup_printf ("%u%s", port, url->abspath);
+	variant = rtsp_dream_media_factory_parse_variant (url->query, NULL, NULL);
+	if (variant)
+		result = g_strdup_printf ("%u%s?%s", port, url->abspath, variant);
+	else
+		result = g_strdup_printf ("%u%s", port, url->abspath);
+	g_free (variant);
 
 	return result;
 }
 
+static GstElement *
+rtsp_dream_media_factory_create_element (GstRTSPMediaFactory * factory, const GstRTSPUrl * url)
+{
+	GstDreamRTSPMediaFactoryPrivate *priv = GST_DREAM_RTSP_MEDIA_FACTORY (factory)->priv;
+	GstElement *element;
+	GError *error = NULL;
+	gchar *variant, *transcode, *launch;
+	guint bitrate, lines;
+
+	variant = rtsp_dream_media_factory_parse_variant (url->query, &bitrate, &lines);
+	if (!variant || !priv->variant_launch)
+	{
+		g_free (variant);
+		return GST_RTSP_MEDIA_FACTORY_CLASS (gst_dream_rtsp_media_factory_parent_class)->create_element (factory, url);
+	}
+
+	if (lines)
+		transcode = g_strdup_printf (DREAM_RTSP_VARIANT_DECODER " ! videoscale ! video/x-raw,height=%u ! " DREAM_RTSP_VARIANT_ENCODER " bitrate=%u ! h264parse", lines, bitrate);
+	else
+		transcode = g_strdup_printf (DREAM_RTSP_VARIANT_DECODER " ! " DREAM_RTSP_VARIANT_ENCODER " bitrate=%u ! h264parse", bitrate);
+	launch = g_strdup_printf (priv->variant_launch, transcode);
+
+	GST_INFO_OBJECT (factory, "creating variant '%s' launch=%s", variant, launch);
+	element = gst_parse_launch_full (launch, NULL, GST_PARSE_FLAG_PLACE_IN_BIN, &error);
+	if (element == NULL || error)
+	{
+		g_critical ("could not parse variant launch syntax (%s): %s", launch, error ? error->message : "unknown reason");
+		g_clear_error (&error);
+		if (element)
+			gst_object_unref (element);
+		element = NULL;
+	}
+	g_free (launch);
+	g_free (transcode);
+	g_free (variant);
+	return element;
+}
+
 static GstRTSPMedia *
 rtsp_dream_media_factory_construct (GstRTSPMediaFactory * factory, const GstRTSPUrl * url)
 {
@@ -192,6 +764,8 @@ rtsp_dream_media_factory_construct (GstRTSPMediaFactory * factory, const GstRTSP
 
 	gst_rtsp_media_collect_streams (media);
 
+	g_object_set_qdata_full (G_OBJECT (media), variant_quark, rtsp_dream_media_factory_parse_variant (url->query, NULL, NULL), g_free);
+
 	pipeline = klass->create_pipeline (factory, media);
 	if (pipeline == NULL)
 		goto no_pipeline;
@@ -219,6 +793,21 @@ rtsp_dream_media_factory_construct (GstRTSPMediaFactory * factory, const GstRTSP
 	}
 }
 
+/* the launch line for variants must contain exactly one %s where the
+ * transcoding elements get inserted after the video appsrc and parser */
+void
+gst_dream_rtsp_media_factory_set_variant_launch (GstDreamRTSPMediaFactory *factory, const gchar *launch)
+{
+	g_free (factory->priv->variant_launch);
+	factory->priv->variant_launch = g_strdup (launch);
+}
+
+const gchar *
+gst_dream_rtsp_media_get_variant (GstRTSPMedia *media)
+{
+	return g_object_get_qdata (G_OBJECT (media), variant_quark);
+}
+
 GstDreamRTSPMediaFactory *
 gst_dream_rtsp_media_factory_new ()
 {
@@ -60,6 +60,66 @@ GType   gst_dream_rtsp_client_get_type (void);
 /* creating the factory */
 GstDreamRTSPClient * gst_dream_rtsp_client_new (void);
 
+/* congestion stages of a client using RTP over RTSP (TCP interleaved) */
+typedef enum {
+	GST_DREAM_RTSP_CLIENT_CONGESTION_NONE = 0,
+	GST_DREAM_RTSP_CLIENT_CONGESTION_BACKLOG = 1,
+	GST_DREAM_RTSP_CLIENT_CONGESTION_DROPPING = 2,
+	GST_DREAM_RTSP_CLIENT_CONGESTION_RESUMING = 3,
+	GST_DREAM_RTSP_CLIENT_CONGESTION_EVICTED = 4
+} GstDreamRTSPClientCongestion;
+
+gsize                        gst_dream_rtsp_client_get_backlog        (GstDreamRTSPClient *client);
+GstRTSPMedia *               gst_dream_rtsp_client_get_interleaved_media (GstDreamRTSPClient *client);
+void                         gst_dream_rtsp_client_set_interleaved_active (GstDreamRTSPClient *client, gboolean active);
+GstDreamRTSPClientCongestion gst_dream_rtsp_client_get_congestion     (GstDreamRTSPClient *client, GstClockTime *since);
+void                         gst_dream_rtsp_client_set_congestion     (GstDreamRTSPClient *client, GstDreamRTSPClientCongestion stage, GstClockTime since);
+
+#define GST_TYPE_DREAM_RTSP_THREAD_POOL              (gst_dream_rtsp_thread_pool_get_type ())
+#define GST_IS_DREAM_RTSP_THREAD_POOL(obj)           (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GST_TYPE_DREAM_RTSP_THREAD_POOL))
+#define GST_IS_DREAM_RTSP_THREAD_POOL_CLASS(klass)   (G_TYPE_CHECK_CLASS_TYPE ((klass), GST_TYPE_DREAM_RTSP_THREAD_POOL))
+#define GST_DREAM_RTSP_THREAD_POOL_GET_CLASS(obj)    (G_TYPE_INSTANCE_GET_CLASS ((obj), GST_TYPE_DREAM_RTSP_THREAD_POOL, GstDreamRTSPThreadPoolClass))
+#define GST_DREAM_RTSP_THREAD_POOL(obj)              (G_TYPE_CHECK_INSTANCE_CAST ((obj), GST_TYPE_DREAM_RTSP_THREAD_POOL, GstDreamRTSPThreadPool))
+#define GST_DREAM_RTSP_THREAD_POOL_CLASS(klass)      (G_TYPE_CHECK_CLASS_CAST ((klass), GST_TYPE_DREAM_RTSP_THREAD_POOL, GstDreamRTSPThreadPoolClass))
+#define GST_DREAM_RTSP_THREAD_POOL_CAST(obj)         ((GstDreamRTSPThreadPool*)(obj))
+
+typedef struct _GstDreamRTSPThreadPool GstDreamRTSPThreadPool;
+typedef struct _GstDreamRTSPThreadPoolClass GstDreamRTSPThreadPoolClass;
+typedef struct _GstDreamRTSPThreadPoolPrivate GstDreamRTSPThreadPoolPrivate;
+
+struct _GstDreamRTSPThreadPool {
+	GstRTSPThreadPool   parent;
+
+	/*< private >*/
+	GstDreamRTSPThreadPoolPrivate *priv;
+	gpointer _gst_reserved[GST_PADDING];
+};
+
+struct _GstDreamRTSPThreadPoolClass {
+	GstRTSPThreadPoolClass  parent_class;
+
+	/*< private >*/
+	gpointer _gst_reserved[GST_PADDING];
+};
+
+/* snapshot of one client thread of the pool */
+typedef struct {
+	guint index;
+	gint cpu;
+	gboolean running;
+	guint clients;
+	guint64 total_clients;
+	guint64 requests;
+	guint64 messages;
+} GstDreamRTSPThreadStats;
+
+GType                    gst_dream_rtsp_thread_pool_get_type (void);
+
+GstDreamRTSPThreadPool * gst_dream_rtsp_thread_pool_new          (void);
+gboolean                 gst_dream_rtsp_thread_pool_set_affinity (GstDreamRTSPThreadPool *pool, const gchar *cpus);
+gchar *                  gst_dream_rtsp_thread_pool_get_affinity (GstDreamRTSPThreadPool *pool);
+GArray *                 gst_dream_rtsp_thread_pool_get_stats    (GstDreamRTSPThreadPool *pool);
+
 #define GST_TYPE_DREAM_RTSP_SERVER              (gst_dream_rtsp_server_get_type())
 #define GST_IS_DREAM_RTSP_SERVER(obj)           (G_TYPE_CHECK_INSTANCE_TYPE((obj), GST_TYPE_DREAM_RTSP_SERVER))
 #define GST_IS_DREAM_RTSP_SERVER_CLASS(cls)     (G_TYPE_CHECK_CLASS_TYPE((cls), GST_TYPE_DREAM_RTSP_SERVER))
@@ -131,6 +191,18 @@ GType                      gst_dream_rtsp_media_factory_get_type (void);
 /* creating the factory */
 GstDreamRTSPMediaFactory * gst_dream_rtsp_media_factory_new      (void);
 
+/* stream variants selected by query parameters, e.g. ?vbr=2000&res=720 */
+#define DREAM_RTSP_VARIANT_MIN_BITRATE   100
+#define DREAM_RTSP_VARIANT_MAX_BITRATE   20000
+#define DREAM_RTSP_VARIANT_MIN_LINES     240
+#define DREAM_RTSP_VARIANT_MAX_LINES     1080
+#define DREAM_RTSP_VARIANT_REF_BITRATE   5000
+#define DREAM_RTSP_VARIANT_DECODER       "avdec_h264"
+#define DREAM_RTSP_VARIANT_ENCODER       "x264enc tune=zerolatency speed-preset=ultrafast key-int-max=50"
+
+void                       gst_dream_rtsp_media_factory_set_variant_launch (GstDreamRTSPMediaFactory *factory, const gchar *launch);
+const gchar *              gst_dream_rtsp_media_get_variant      (GstRTSPMedia *media);
+
 G_END_DECLS
 
 #endif /* __GSTDREAMRTSP_H__ */
\ No newline at end of file
@@ -0,0 +1,1562 @@
+#!/usr/bin/python
+# benchmarks for dreamrtspserver, run one scenario per subcommand:
+#   controlplane  RTSP request latency while HLS and D-Bus traffic hits the daemon
+#   storm         RTSP connect storm throughput for a range of client thread pool sizes
+#   rtsp          sustained viewers on the TS and ES mounts over UDP and TCP
+#   hls           simulated HLS players fetching the playlist and segments in real time
+#   metrics       scrapes /metrics periodically and reports the scrape latency
+#   signals       time spent in send_signal under client churn, compare a daemon
+#                 spawned with --sync-signals to one without
+#   reconfigure   stream glitch when changing several encoder settings, one
+#                 property at a time versus one reconfigure transaction
+#   handover      RTSP packet gaps, handover latency and lock contention while
+#                 D-Bus, HLS, RTSP and upstream traffic hits the daemon
+#   sched         streaming thread runqueue waits and RTSP packet gaps next to
+#                 cpu hogs, with and without a real-time thread policy
+#   budget        queue memory and daemon rss with every output stalled at once,
+#                 for several buffering budgets
+#   alloc         malloc/free per second left in steady state streaming, per
+#                 bucket of the daemon's memory arena
+#   shm           shared memory TS readers against RTSP viewers on loopback,
+#                 throughput and cpu of readers and daemon
+#   unix          unix socket readers of the byte stream and of memfd segments
+#                 against RTSP viewers on loopback, and drops of stalled readers
+#   timeshift     write throughput and latency of the timeshift store per
+#                 file system, and the time from a seeking PLAY to its first packet
+#   recording     RTSP packet gaps with and without a recording, and the
+#                 recording's write throughput, backlog and dropped data
+# with --spawn the daemon is started with the synthetic source, --json writes
+# machine readable results, see "make benchmark"
+import argparse
+import base64
+import json
+import os
+import resource
+import socket
+import subprocess
+import sys
+import threading
+import time
+
+try:
+	from urllib.request import urlopen, Request
+	from urllib.error import URLError
+except ImportError:
+	from urllib2 import urlopen, Request, URLError
+
+import dbus
+
+from rtspclient import RTSPClient, RTSPError, is_keyframe
+from unixclient import UnixClient, UnixClientError
+
+INTERFACE = 'com.dreambox.RTSPserver'
+OBJECT = '/com/dreambox/RTSPserver'
+
+def percentile(values, p):
+	values = sorted(values)
+	if not values:
+		return 0.0
+	return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+def report(name, values, unit='ms', scale=1000.0):
+	values = [v * scale for v in values]
+	print('%-24s n=%-6d p50=%8.2f p95=%8.2f p99=%8.2f max=%8.2f %s' % (name, len(values), percentile(values, 50), percentile(values, 95), percentile(values, 99), max(values or [0]), unit))
+
+def stats(values, scale=1000.0):
+	values = [v * scale for v in values]
+	return {'n': len(values), 'p50': percentile(values, 50), 'p95': percentile(values, 95), 'p99': percentile(values, 99), 'max': max(values or [0])}
+
+def write_json(args, scenario, result):
+	if not args.json:
+		return
+	result = dict(result, scenario=scenario, timestamp=time.time(), host=args.host)
+	with open(args.json, 'w') as f:
+		json.dump(result, f, indent=2, sort_keys=True)
+	print('results written to %s' % args.json)
+
+class Daemon(object):
+	"""optionally spawned daemon and its cpu/rss usage from /proc"""
+	def __init__(self, pid=None):
+		self.pid = pid
+		self.process = None
+		self.samples = []
+		self._sampler = None
+		self._running = False
+
+	def spawn(self, path, session_bus, bus, metrics_port=0, sync_signals=False):
+		cmd = [path, '--synthetic']
+		if session_bus:
+			cmd.append('--session-bus')
+		if metrics_port:
+			cmd.append('--metrics-port=%d' % metrics_port)
+		if sync_signals:
+			cmd.append('--sync-signals')
+		self.process = subprocess.Popen(cmd)
+		self.pid = self.process.pid
+		end = time.time() + 10
+		while not bus.name_has_owner(INTERFACE):
+			if time.time() > end or self.process.poll() is not None:
+				raise RuntimeError('daemon didn\'t register %s' % INTERFACE)
+			time.sleep(0.1)
+
+	def stop(self):
+		self.stop_sampling()
+		if self.process:
+			self.process.terminate()
+			self.process.wait()
+			self.process = None
+
+	def _cpu_time(self):
+		with open('/proc/%d/stat' % self.pid) as f:
+			fields = f.read().rsplit(')', 1)[1].split()
+		return (int(fields[11]) + int(fields[12])) / float(os.sysconf('SC_CLK_TCK'))
+
+	def _rss_kb(self):
+		with open('/proc/%d/status' % self.pid) as f:
+			for line in f:
+				if line.startswith('VmRSS:'):
+					return int(line.split()[1])
+		return 0
+
+	def _sample(self):
+		last = (time.time(), self._cpu_time())
+		while self._running:
+			time.sleep(0.5)
+			try:
+				now = (time.time(), self._cpu_time())
+				self.samples.append((100.0 * (now[1] - last[1]) / (now[0] - last[0]), self._rss_kb()))
+				last = now
+			except (IOError, OSError):
+				break
+
+	def start_sampling(self):
+		if not self.pid:
+			return
+		self.samples = []
+		self._running = True
+		self._sampler = threading.Thread(target=self._sample)
+		self._sampler.daemon = True
+		self._sampler.start()
+
+	def stop_sampling(self):
+		self._running = False
+		if self._sampler:
+			self._sampler.join()
+			self._sampler = None
+
+	def usage(self):
+		if not self.samples:
+			return {}
+		cpu = [c for c, r in self.samples]
+		rss = [r for c, r in self.samples]
+		return {'cpu_percent_avg': sum(cpu) / len(cpu), 'cpu_percent_max': max(cpu), 'rss_kb_avg': sum(rss) / len(rss), 'rss_kb_max': max(rss)}
+
+def get_bus(args):
+	return dbus.SessionBus() if args.session_bus else dbus.SystemBus()
+
+class Load(threading.Thread):
+	"""runs func in a loop until stopped and records its duration"""
+	def __init__(self, func, once=False):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.func = func
+		self.durations = []
+		self.errors = 0
+		self.running = True
+		self.once = once
+
+	def run(self):
+		while self.running:
+			start = time.time()
+			try:
+				self.func()
+				self.durations.append(time.time() - start)
+			except Exception:
+				self.errors += 1
+				time.sleep(0.1)
+			if self.once:
+				break
+
+def controlplane(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	playlist = 'http://%s:%d/dream.m3u8' % (args.host, args.hls_port)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+
+	def hls_get():
+		urlopen(playlist, timeout=3 * args.duration).read()
+
+	def dbus_get():
+		props.Get(INTERFACE, 'rtspClientCount')
+
+	def rtsp_cycle(latency):
+		client = RTSPClient(url, timeout=args.duration)
+		try:
+			client.connect()
+			client.request('OPTIONS')
+			client.describe()
+			for method, values in client.latency.items():
+				latency.setdefault(method, []).extend(values)
+		finally:
+			client.close()
+
+	# first HLS request starts the idle pipeline, this used to stall all services
+	first_hls = Load(hls_get, once=True)
+	loads = []
+	if not args.no_hls:
+		loads += [Load(hls_get) for i in range(args.hls_clients)]
+	if not args.no_dbus:
+		loads += [Load(dbus_get) for i in range(args.dbus_clients)]
+
+	latency = {}
+	errors = 0
+	first_hls.start()
+	for load in loads:
+		load.start()
+	end = time.time() + args.duration
+	while time.time() < end:
+		try:
+			rtsp_cycle(latency)
+		except (RTSPError, IOError):
+			errors += 1
+		time.sleep(args.interval)
+	for load in loads:
+		load.running = False
+	first_hls.join()
+	for load in loads:
+		load.join()
+
+	for method in sorted(latency):
+		report('rtsp %s' % method, latency[method])
+	report('hls first playlist', first_hls.durations)
+	report('hls playlist', sum([l.durations for l in loads if l.func == hls_get], []))
+	report('dbus Get', sum([l.durations for l in loads if l.func == dbus_get], []))
+	print('rtsp errors=%d load errors=%d' % (errors, first_hls.errors + sum(l.errors for l in loads)))
+	return 0 if not errors else 1
+
+def storm(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	original = props.Get(INTERFACE, 'rtspThreadPool')
+
+	def session(latency):
+		start = time.time()
+		client = RTSPClient(url, args.transport, timeout=10.0)
+		try:
+			client.start()
+			latency.append(time.time() - start)
+			client.teardown()
+		finally:
+			client.close()
+
+	results = []
+	try:
+		for threads in args.threads:
+			if not iface.setRTSPThreadPool(threads, args.affinity):
+				print('couldn\'t set thread pool to %d threads' % threads)
+				return 1
+			latency = []
+			load = [Load(lambda: session(latency)) for i in range(args.clients)]
+			start = time.time()
+			for l in load:
+				l.start()
+			time.sleep(args.duration)
+			for l in load:
+				l.running = False
+			for l in load:
+				l.join()
+			elapsed = time.time() - start
+			errors = sum(l.errors for l in load)
+			results.append((threads, len(latency) / elapsed, errors))
+			report('%d threads setup' % threads, latency)
+			stats = props.Get(INTERFACE, 'rtspThreadStats')
+			print('  per thread clients: %s' % ' '.join('%d:%d' % (int(t[0]), int(t[4])) for t in stats))
+	finally:
+		iface.setRTSPThreadPool(original[0], original[1])
+
+	print('%-8s %12s %8s' % ('threads', 'sessions/s', 'errors'))
+	for threads, rate, errors in results:
+		print('%-8d %12.1f %8d' % (threads, rate, errors))
+	return 0
+
+class Viewer(threading.Thread):
+	"""one sustained rtsp client recording setup latencies, time to first keyframe and throughput"""
+	def __init__(self, url, mount, transport, duration):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.mount = mount
+		self.transport = transport
+		self.duration = duration
+		self.client = RTSPClient(url, transport, timeout=10.0)
+		self.result = {'mount': mount, 'transport': transport, 'error': None}
+
+	def run(self):
+		client = self.client
+		try:
+			client.start()
+			played = time.time()
+			first_keyframe = None
+			nbytes = packets = 0
+			for arrival, stream, packet in client.rtp_packets(self.duration):
+				nbytes += len(packet)
+				packets += 1
+				if first_keyframe is None and stream == 0 and is_keyframe(packet, self.mount == 'ts'):
+					first_keyframe = arrival - played
+			self.result.update({
+				'describe_ms': 1000.0 * client.latency['DESCRIBE'][0],
+				'setup_ms': 1000.0 * sum(client.latency['SETUP']),
+				'play_ms': 1000.0 * client.latency['PLAY'][0],
+				'first_keyframe_ms': 1000.0 * first_keyframe if first_keyframe is not None else None,
+				'packets': packets,
+				'kbps': 8 * nbytes / 1000.0 / self.duration})
+			client.teardown()
+		except (RTSPError, IOError, KeyError) as e:
+			self.result['error'] = str(e)
+		finally:
+			client.close()
+
+class Player(threading.Thread):
+	"""polls the playlist like a live HLS player and plays the segments back in real time"""
+	def __init__(self, base, user, pw, duration, startup):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.base = base
+		self.auth = 'Basic ' + base64.b64encode(('%s:%s' % (user, pw)).encode()).decode() if user else None
+		self.duration = duration
+		self.startup = startup
+		self.playlist_times = []
+		self.segment_times = []
+		self.segment_bytes = 0
+		self.stalls = 0
+		self.stall_time = 0.0
+		self.errors = 0
+		self.first_segment = None
+
+	def fetch(self, name):
+		req = Request(self.base + name)
+		if self.auth:
+			req.add_header('Authorization', self.auth)
+		start = time.time()
+		data = urlopen(req, timeout=10).read()
+		return data, time.time() - start
+
+	def run(self):
+		start = time.time()
+		end = start + self.duration
+		seen = set()
+		queue = []
+		target = 2.0
+		buffered = 0.0
+		playing_since = None
+		stalled_since = None
+		while time.time() < end:
+			try:
+				data, elapsed = self.fetch('dream.m3u8')
+				self.playlist_times.append(elapsed)
+				duration = None
+				for line in data.decode('latin-1').splitlines():
+					if line.startswith('#EXT-X-TARGETDURATION:'):
+						target = float(line.split(':')[1])
+					elif line.startswith('#EXTINF:'):
+						duration = float(line.split(':')[1].split(',')[0])
+					elif line and not line.startswith('#'):
+						if line not in seen:
+							seen.add(line)
+							queue.append((line, duration or target))
+						duration = None
+				# a live player joins at the live edge
+				if self.first_segment is None and len(queue) > 3:
+					queue = queue[-3:]
+				while queue and time.time() < end:
+					name, seg_duration = queue.pop(0)
+					data, elapsed = self.fetch(name)
+					self.segment_times.append(elapsed)
+					self.segment_bytes += len(data)
+					now = time.time()
+					if self.first_segment is None:
+						self.first_segment = now - start
+					# drain the playback buffer up to now
+					if playing_since is not None:
+						buffered -= now - playing_since
+						if buffered < 0:
+							if stalled_since is None:
+								self.stalls += 1
+								stalled_since = now + buffered
+							buffered = 0.0
+					buffered += seg_duration
+					if stalled_since is not None:
+						self.stall_time += now - stalled_since
+						stalled_since = None
+					if playing_since is None and buffered < self.startup:
+						continue
+					playing_since = now
+			except (IOError, ValueError):
+				self.errors += 1
+			time.sleep(min(target / 2, max(0, end - time.time())))
+
+def hls(args):
+	base = 'http://%s:%d/' % (args.host, args.hls_port)
+	players = [Player(base, args.hls_user, args.hls_pass, args.duration, args.startup) for i in range(args.players)]
+
+	args.daemon.start_sampling()
+	for p in players:
+		p.start()
+		time.sleep(args.ramp / max(1, args.players))
+	for p in players:
+		p.join()
+	args.daemon.stop_sampling()
+
+	playlist = sum([p.playlist_times for p in players], [])
+	segments = sum([p.segment_times for p in players], [])
+	report('playlist', playlist)
+	report('segment', segments)
+	report('first segment', [p.first_segment for p in players if p.first_segment is not None])
+	stalls = sum(p.stalls for p in players)
+	errors = sum(p.errors for p in players)
+	kbps = [8 * p.segment_bytes / 1000.0 / args.duration for p in players]
+	print('stalls=%d stall time=%.1fs errors=%d kbps min=%.0f' % (stalls, sum(p.stall_time for p in players), errors, min(kbps or [0])))
+	usage = args.daemon.usage()
+	if usage:
+		print('daemon cpu avg=%.1f%% max=%.1f%% rss max=%d kB' % (usage['cpu_percent_avg'], usage['cpu_percent_max'], usage['rss_kb_max']))
+
+	write_json(args, 'hls', {
+		'config': {'players': args.players, 'duration': args.duration, 'auth': bool(args.hls_user)},
+		'playlist_ms': stats(playlist), 'segment_ms': stats(segments),
+		'first_segment_ms': stats([p.first_segment for p in players if p.first_segment is not None]),
+		'players': [{'stalls': p.stalls, 'stall_s': p.stall_time, 'errors': p.errors, 'segments': len(p.segment_times), 'kbps': 8 * p.segment_bytes / 1000.0 / args.duration} for p in players],
+		'stalls': stalls, 'errors': errors, 'daemon': usage})
+	return 0 if not errors and not stalls else 1
+
+def parse_metrics(text):
+	"""returns {name{labels}: value} of a prometheus text exposition"""
+	samples = {}
+	for line in text.splitlines():
+		if not line or line.startswith('#'):
+			continue
+		key, _, value = line.rpartition(' ')
+		samples[key] = float(value)
+	return samples
+
+def metrics(args):
+	url = 'http://127.0.0.1:%d/metrics' % args.metrics_port
+	times = []
+	errors = 0
+	first = last = None
+	end = time.time() + args.duration
+	while time.time() < end:
+		start = time.time()
+		try:
+			samples = parse_metrics(urlopen(url, timeout=5).read().decode())
+			times.append(time.time() - start)
+			first = first or samples
+			last = samples
+		except (IOError, ValueError):
+			errors += 1
+		time.sleep(args.interval)
+	report('scrape', times)
+	if first and last:
+		for key in sorted(last):
+			if key.endswith('_total') or '_total{' in key:
+				print('  %-60s %16.0f (+%.0f)' % (key, last[key], last[key] - first.get(key, 0)))
+	print('samples=%d errors=%d' % (len(last or {}), errors))
+	write_json(args, 'metrics', {'scrape_ms': stats(times), 'errors': errors, 'samples': last or {}})
+	return 0 if not errors and last else 1
+
+def signals(args):
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	metrics_url = 'http://127.0.0.1:%d/metrics' % args.metrics_port
+
+	def scrape():
+		return parse_metrics(urlopen(metrics_url, timeout=5).read().decode())
+
+	def session():
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			client.teardown()
+		finally:
+			client.close()
+
+	if not args.metrics_port:
+		print('signals needs --metrics-port')
+		return 2
+	before = scrape()
+	load = [Load(session) for i in range(args.clients)]
+	for l in load:
+		l.start()
+	time.sleep(args.duration)
+	for l in load:
+		l.running = False
+	for l in load:
+		l.join()
+	time.sleep(1)
+	after = scrape()
+
+	def delta(key):
+		return after.get(key, 0) - before.get(key, 0)
+	posted = delta('dream_signals_total{outcome="posted"}')
+	emitted = delta('dream_signals_total{outcome="emitted"}')
+	coalesced = delta('dream_signals_total{outcome="coalesced"}')
+	seconds = delta('dream_signal_send_seconds_total')
+	sessions = sum(len(l.durations) for l in load)
+	errors = sum(l.errors for l in load)
+	mode = 'sync' if args.sync_signals else 'dispatched'
+	calls = posted
+	print('%s: sessions=%d signals=%d emitted=%d coalesced=%d send_signal avg=%.2f us total=%.3f ms errors=%d' % (mode, sessions, calls, emitted, coalesced,
+		1e6 * seconds / max(1, calls), 1e3 * seconds, errors))
+	write_json(args, 'signals', {
+		'config': {'clients': args.clients, 'duration': args.duration, 'mode': mode},
+		'sessions': sessions, 'calls': calls, 'emitted': emitted, 'coalesced': coalesced,
+		'send_signal_us_avg': 1e6 * seconds / max(1, calls), 'send_signal_ms_total': 1e3 * seconds, 'errors': errors})
+	return 0 if not errors else 1
+
+RECONFIGURE_STEPS = [
+	{'videoBitrate': 2000, 'gopLength': 25, 'framerate': 25, 'width': 1280, 'height': 720},
+	{'videoBitrate': 5000, 'gopLength': 50, 'framerate': 50, 'width': 1920, 'height': 1080},
+]
+
+def reconfigure(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s-es' % (args.host, args.rtsp_port, args.path)
+	client = RTSPClient(url, 'tcp', timeout=10.0)
+	results = {'single': [], 'transaction': []}
+	keyframes = {'single': [], 'transaction': []}
+	first_keyframe = {'single': [], 'transaction': []}
+	errors = 0
+
+	def typed(step):
+		return dict((k, dbus.Int32(v)) for k, v in step.items())
+
+	def apply_single(step):
+		for key, value in sorted(step.items()):
+			if key in ('width', 'height'):
+				continue
+			props.Set(INTERFACE, key, dbus.Int32(value))
+		if 'width' in step:
+			iface.setResolution(step['width'], step['height'])
+
+	def apply_transaction(step):
+		iface.reconfigure(dbus.Dictionary(typed(step), signature='sv'))
+
+	try:
+		client.start()
+		packets = client.rtp_packets(args.rounds * 2 * len(args.modes) * (args.settle + 1) + 10)
+		for i in range(args.rounds):
+			for mode in args.modes:
+				for step in RECONFIGURE_STEPS:
+					start = time.time()
+					try:
+						(apply_single if mode == 'single' else apply_transaction)(step)
+					except dbus.DBusException:
+						errors += 1
+						continue
+					# glitch: longest stall of the video stream after the request,
+					# keyframes: how many showed up while settling
+					previous = start
+					first = None
+					gap = 0.0
+					count = 0
+					for arrival, stream, packet in packets:
+						if stream != 0:
+							continue
+						gap = max(gap, arrival - previous)
+						previous = arrival
+						if is_keyframe(packet):
+							first = first or arrival
+							count += 1
+						if arrival - start > args.settle:
+							break
+					if first is None:
+						errors += 1
+						continue
+					results[mode].append(gap)
+					first_keyframe[mode].append(first - start)
+					keyframes[mode].append(count)
+		client.teardown()
+	except (RTSPError, IOError, KeyError, StopIteration) as e:
+		print('error: %s' % e)
+		errors += 1
+	finally:
+		client.close()
+
+	summary = {}
+	for mode in args.modes:
+		report('%s glitch' % mode, results[mode])
+		report('%s first keyframe' % mode, first_keyframe[mode])
+		summary[mode] = {'glitch_ms': stats(results[mode]), 'first_keyframe_ms': stats(first_keyframe[mode]), 'keyframes_avg': sum(keyframes[mode]) / float(max(1, len(keyframes[mode])))}
+		print('%-24s keyframes per change avg=%.1f' % (mode, summary[mode]['keyframes_avg']))
+	print('errors=%d' % errors)
+	write_json(args, 'reconfigure', {'config': {'rounds': args.rounds, 'settle': args.settle, 'steps': RECONFIGURE_STEPS}, 'summary': summary, 'errors': errors})
+	return 0 if not errors else 1
+
+def wake(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s-es' % (args.host, args.rtsp_port, args.path)
+	enable, first_keyframe = [], []
+	errors = 0
+
+	iface.enableHLS(False, 0, '', '')
+	for i in range(args.rounds):
+		iface.enableRTSP(False, '', 0, '', '')
+		deadline = time.time() + args.settle
+		while not props.Get(INTERFACE, 'sourceIdle') and time.time() < deadline:
+			time.sleep(0.05)
+		if not props.Get(INTERFACE, 'sourceIdle'):
+			print('round %d: source pipeline didn\'t go idle' % i)
+			errors += 1
+		# enable: the D-Bus call alone, first keyframe: from the call to the
+		# first IDR a new viewer receives
+		start = time.time()
+		if not iface.enableRTSP(True, args.path, args.rtsp_port, '', ''):
+			errors += 1
+			continue
+		enable.append(time.time() - start)
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			for arrival, stream, packet in client.rtp_packets(args.settle + 5):
+				if stream == 0 and is_keyframe(packet):
+					first_keyframe.append(arrival - start)
+					break
+			else:
+				errors += 1
+			client.teardown()
+		except (RTSPError, IOError, KeyError) as e:
+			print('error: %s' % e)
+			errors += 1
+		finally:
+			client.close()
+
+	report('enableRTSP from idle', enable)
+	report('first keyframe from idle', first_keyframe)
+	print('errors=%d' % errors)
+	write_json(args, 'wake', {'config': {'rounds': args.rounds}, 'enable_ms': stats(enable), 'first_keyframe_ms': stats(first_keyframe), 'errors': errors})
+	return 0 if not errors else 1
+
+class Drain(threading.Thread):
+	"""a tcp server which accepts upstream connections and discards the data"""
+	def __init__(self):
+		threading.Thread.__init__(self)
+		self.daemon = True
+		self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		self.sock.bind(('127.0.0.1', 0))
+		self.sock.listen(8)
+		self.port = self.sock.getsockname()[1]
+
+	def run(self):
+		while True:
+			conn, _ = self.sock.accept()
+			threading.Thread(target=self._drain, args=(conn,)).start()
+
+	def _drain(self, conn):
+		try:
+			while conn.recv(65536):
+				pass
+		except socket.error:
+			pass
+		conn.close()
+
+class Stall(Drain):
+	"""a tcp server which accepts upstream connections and never reads from them"""
+	def __init__(self):
+		Drain.__init__(self)
+		self.conns = []
+
+	def _drain(self, conn):
+		self.conns.append(conn)
+
+def budget(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	original = props.Get(INTERFACE, 'bufferBudget')[0]
+	stall = Stall()
+	stall.start()
+	results = {}
+	errors = 0
+
+	try:
+		for mb in args.budgets:
+			iface.setBufferBudget(dbus.UInt64(mb * 1024 * 1024))
+			args.daemon.start_sampling()
+			# every output stops consuming at once
+			viewers = []
+			for i in range(args.viewers):
+				client = RTSPClient(url, 'tcp', timeout=10.0, rcvbuf=4096)
+				try:
+					client.start()
+					viewers.append(client)
+				except (RTSPError, IOError, KeyError):
+					errors += 1
+					client.close()
+			if not iface.enableUpstream(True, '127.0.0.1', stall.port, ''):
+				errors += 1
+			samples = []
+			end = time.time() + args.duration
+			while time.time() < end:
+				samples.append(props.Get(INTERFACE, 'bufferBudget'))
+				time.sleep(0.5)
+			queues = props.Get(INTERFACE, 'bufferBudgetQueues')
+			iface.enableUpstream(False, '', 0, '')
+			for client in viewers:
+				client.close()
+			args.daemon.stop_sampling()
+
+			usage = args.daemon.usage()
+			used = [int(s[1]) for s in samples]
+			label = '%d MB' % mb if mb else 'unlimited'
+			print('%-10s used max=%.1f MB pressure max=%.2f rebalances=%d' % (label, max(used or [0]) / 1048576.0, max([float(s[2]) for s in samples] or [0]), int(samples[-1][3]) if samples else 0))
+			for name, weight, limit, level in queues:
+				print('  %-12s weight=%d limit=%8.1f kB level=%8.1f kB' % (name, weight, limit / 1024.0, level / 1024.0))
+			if usage:
+				print('  daemon rss max=%d kB' % usage['rss_kb_max'])
+			results[label] = {'used_max': max(used or [0]), 'queues': [{'name': str(q[0]), 'weight': int(q[1]), 'limit': int(q[2]), 'level': int(q[3])} for q in queues], 'daemon': usage}
+			time.sleep(args.settle)
+	finally:
+		iface.setBufferBudget(dbus.UInt64(original))
+
+	write_json(args, 'budget', {'config': {'budgets_mb': args.budgets, 'viewers': args.viewers, 'duration': args.duration}, 'results': results, 'errors': errors})
+	return 0 if not errors else 1
+
+def alloc(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	drain = Drain()
+	drain.start()
+	errors = []
+
+	def alloc_stats():
+		fallbacks, buckets = props.Get(INTERFACE, 'allocStats')
+		return int(fallbacks), dict((int(size) or 'shared', (int(reused), int(allocated), int(released))) for size, reused, allocated, released, cached in buckets)
+
+	def watch():
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			for packet in client.rtp_packets(args.warmup + args.duration):
+				pass
+			client.teardown()
+		except (RTSPError, IOError, KeyError):
+			errors.append(url)
+		finally:
+			client.close()
+
+	if not props.Get(INTERFACE, 'allocStats')[1]:
+		print('the daemon runs with --system-allocator')
+		return 1
+	if not iface.enableUpstream(True, '127.0.0.1', drain.port, ''):
+		errors.append('upstream')
+	viewers = [threading.Thread(target=watch) for i in range(args.viewers)]
+	for viewer in viewers:
+		viewer.start()
+	# the free lists fill up while the outputs start
+	time.sleep(args.warmup)
+	fallbacks, before = alloc_stats()
+	start = time.time()
+	for viewer in viewers:
+		viewer.join()
+	elapsed = time.time() - start
+	fallbacks_after, after = alloc_stats()
+	iface.enableUpstream(False, '', 0, '')
+
+	results = {}
+	for bucket in sorted(after, key=str):
+		reused, allocated, released = [(a - b) / elapsed for a, b in zip(after[bucket], before.get(bucket, (0, 0, 0)))]
+		print('bucket %-8s reused %9.1f/s  malloc %7.1f/s  free %7.1f/s' % (bucket, reused, allocated, released))
+		results[str(bucket)] = {'reused_per_s': reused, 'malloc_per_s': allocated, 'free_per_s': released}
+	fallback_rate = (fallbacks_after - fallbacks) / elapsed
+	print('system allocator %7.1f/s' % fallback_rate)
+	write_json(args, 'alloc', {'config': {'viewers': args.viewers, 'warmup': args.warmup, 'duration': args.duration},
+		'buckets': results, 'fallback_per_s': fallback_rate, 'errors': len(errors)})
+	return 0 if not errors else 1
+
+def shm(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	results = {}
+	errors = 0
+
+	def rtsp_phase():
+		received = []
+		failed = []
+
+		def watch():
+			client = RTSPClient(url, 'tcp', timeout=10.0)
+			n = 0
+			try:
+				client.start()
+				for arrival, stream, packet in client.rtp_packets(args.duration):
+					n += len(packet)
+				client.teardown()
+			except (RTSPError, IOError, KeyError):
+				failed.append(url)
+			finally:
+				client.close()
+			received.append(n)
+
+		start = resource.getrusage(resource.RUSAGE_SELF)
+		readers = [threading.Thread(target=watch) for i in range(args.readers)]
+		for reader in readers:
+			reader.start()
+		for reader in readers:
+			reader.join()
+		end = resource.getrusage(resource.RUSAGE_SELF)
+		return sum(received), (end.ru_utime + end.ru_stime) - (start.ru_utime + start.ru_stime), len(failed)
+
+	def shm_phase():
+		if not iface.enableSharedMemory(True, 'ts'):
+			return 0, 0.0, args.readers
+		received = 0
+		cpu = 0.0
+		failed = 0
+		try:
+			devnull = open(os.devnull, 'w')
+			readers = [subprocess.Popen([args.shmcat, 'ts', str(int(args.duration))], stdout=devnull, stderr=subprocess.PIPE) for i in range(args.readers)]
+			for reader in readers:
+				err = reader.stderr.read().decode()
+				pid, status, usage = os.wait4(reader.pid, 0)
+				reader.returncode = status
+				cpu += usage.ru_utime + usage.ru_stime
+				if status or not err.split():
+					failed += 1
+				else:
+					received += int(err.split()[0])
+			devnull.close()
+		finally:
+			iface.enableSharedMemory(False, '')
+		return received, cpu, failed
+
+	for name, phase in (('rtsp', rtsp_phase), ('shm', shm_phase)):
+		args.daemon.start_sampling()
+		received, reader_cpu, failed = phase()
+		args.daemon.stop_sampling()
+		usage = args.daemon.usage()
+		errors += failed
+		rate = received * 8 / args.duration / 1e6
+		print('%-4s %d readers  %7.2f Mbit/s total  reader cpu %5.1f%%  daemon cpu avg=%.1f%%' % (name, args.readers, rate, 100.0 * reader_cpu / args.duration, usage.get('cpu_percent_avg', 0)))
+		results[name] = {'mbit_per_s': rate, 'reader_cpu_percent': 100.0 * reader_cpu / args.duration, 'daemon': usage, 'failed': failed}
+		time.sleep(args.settle)
+
+	write_json(args, 'shm', {'config': {'readers': args.readers, 'duration': args.duration}, 'results': results, 'errors': errors})
+	return 0 if not errors else 1
+
+def unix(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, 'org.freedesktop.DBus.Properties')
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	results = {}
+	errors = 0
+
+	def rtsp_reader(received, failed):
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		n = 0
+		try:
+			client.start()
+			for arrival, stream, packet in client.rtp_packets(args.duration):
+				n += len(packet)
+			client.teardown()
+		except (RTSPError, IOError, KeyError):
+			failed.append(url)
+		finally:
+			client.close()
+		received.append(n)
+
+	def unix_reader(received, failed, memfd):
+		n = 0
+		try:
+			client = UnixClient(args.socket, keyframe=True, memfd=memfd)
+		except (socket.error, IOError):
+			failed.append(args.socket)
+			received.append(0)
+			return
+		end = time.time() + args.duration
+		try:
+			while time.time() < end:
+				if memfd:
+					segment = client.segment()
+					if segment is None:
+						break
+					n += len(segment[3])
+				else:
+					data = client.read()
+					if not data:
+						break
+					n += len(data)
+		except (socket.error, IOError, UnixClientError):
+			failed.append(args.socket)
+		finally:
+			client.close()
+		received.append(n)
+
+	def run_phase(name):
+		received = []
+		failed = []
+		stalled = []
+		if name != 'rtsp':
+			if not iface.enableUnixSocket(True, args.socket):
+				return 0, 0.0, args.readers, 0
+			# connected and asking, but never reading
+			stalled = [UnixClient(args.socket, memfd=(name == 'memfd'), rcvbuf=4096) for i in range(args.stalled)]
+		try:
+			start = resource.getrusage(resource.RUSAGE_SELF)
+			if name == 'rtsp':
+				readers = [threading.Thread(target=rtsp_reader, args=(received, failed)) for i in range(args.readers)]
+			else:
+				readers = [threading.Thread(target=unix_reader, args=(received, failed, name == 'memfd')) for i in range(args.readers)]
+			for reader in readers:
+				reader.start()
+			for reader in readers:
+				reader.join()
+			end = resource.getrusage(resource.RUSAGE_SELF)
+			drops = 0
+			if name != 'rtsp':
+				drops = int(props.Get(INTERFACE, 'unixSocket')[5])
+		finally:
+			for client in stalled:
+				client.close()
+			if name != 'rtsp':
+				iface.enableUnixSocket(False, '')
+		return sum(received), (end.ru_utime + end.ru_stime) - (start.ru_utime + start.ru_stime), len(failed), drops
+
+	for name in ('rtsp', 'unix', 'memfd'):
+		args.daemon.start_sampling()
+		received, reader_cpu, failed, drops = run_phase(name)
+		args.daemon.stop_sampling()
+		usage = args.daemon.usage()
+		errors += failed
+		rate = received * 8 / args.duration / 1e6
+		print('%-5s %d readers  %7.2f Mbit/s total  reader cpu %5.1f%%  daemon cpu avg=%.1f%%  drops %d' % (name, args.readers, rate, 100.0 * reader_cpu / args.duration, usage.get('cpu_percent_avg', 0), drops))
+		results[name] = {'mbit_per_s': rate, 'reader_cpu_percent': 100.0 * reader_cpu / args.duration, 'daemon': usage, 'failed': failed, 'drops': drops}
+		time.sleep(args.settle)
+
+	write_json(args, 'unix', {'config': {'readers': args.readers, 'stalled': args.stalled, 'duration': args.duration}, 'results': results, 'errors': errors})
+	return 0 if not errors else 1
+
+def timeshift(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, 'org.freedesktop.DBus.Properties')
+	url = 'rtsp://%s:%d/%s-timeshift' % (args.host, args.rtsp_port, args.path)
+	offsets = [float(o) for o in args.offsets.split(',')]
+	results = {}
+	errors = 0
+
+	def seek(offset):
+		"""seconds from the seeking PLAY to the first rtp packet"""
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.connect()
+			client.describe()
+			client.setup()
+			start = time.time()
+			client.play(offset)
+			for arrival, stream, packet in client.rtp_packets(10.0):
+				return arrival - start
+			return None
+		finally:
+			client.teardown()
+			client.close()
+
+	for directory in args.directories.split(','):
+		if not iface.enableTimeshift(True, directory, args.megabytes):
+			print('%-32s couldn\'t enable the timeshift' % directory)
+			errors += 1
+			continue
+		try:
+			args.daemon.start_sampling()
+			time.sleep(args.fill)
+			args.daemon.stop_sampling()
+			stats = props.Get(INTERFACE, 'timeshift')
+			direct, written, window, writes, write_us, max_write_us = bool(stats[1]), int(stats[3]), float(stats[5]), int(stats[7]), int(stats[8]), int(stats[9])
+			rate = written * 8 / args.fill / 1e6
+			print('%-32s %s  %7.2f Mbit/s  window %5.1fs  chunk write avg=%.2fms max=%.2fms' % (directory, 'direct ' if direct else 'cached ', rate, window, write_us / 1000.0 / max(writes, 1), max_write_us / 1000.0))
+			latencies = {}
+			for offset in offsets:
+				samples = []
+				for i in range(args.seeks):
+					try:
+						latency = seek(min(offset, window))
+					except (RTSPError, IOError, KeyError):
+						latency = None
+					if latency is None:
+						errors += 1
+					else:
+						samples.append(latency)
+				report('seek to %.0fs' % offset, samples)
+				latencies['%g' % offset] = samples
+			results[directory] = {'direct': direct, 'mbit_per_s': rate, 'window_s': window, 'writes': writes, 'write_us_avg': write_us / max(writes, 1), 'write_us_max': max_write_us, 'daemon': args.daemon.usage(), 'seek_s': latencies}
+		finally:
+			iface.enableTimeshift(False, '', 0)
+		time.sleep(args.settle)
+
+	write_json(args, 'timeshift', {'config': {'directories': args.directories, 'megabytes': args.megabytes, 'fill': args.fill, 'offsets': offsets, 'seeks': args.seeks}, 'results': results, 'errors': errors})
+	return 0 if not errors else 1
+
+def recording(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, 'org.freedesktop.DBus.Properties')
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	results = {}
+	errors = 0
+
+	def watch(gaps, duration):
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			previous = None
+			for arrival, stream, packet in client.rtp_packets(duration):
+				if previous is not None:
+					gaps.append(arrival - previous)
+				previous = arrival
+			client.teardown()
+		finally:
+			client.close()
+
+	for name in ('live', 'recording'):
+		if name == 'recording' and not iface.enableRecording(True, args.directory, args.megabytes, args.seconds):
+			print('couldn\'t record to %s' % args.directory)
+			errors += 1
+			break
+		gaps = []
+		backlog = []
+		running = [True]
+
+		def sample():
+			while running[0]:
+				backlog.append(int(props.Get(INTERFACE, 'recording')[5]))
+				time.sleep(0.5)
+
+		sampler = threading.Thread(target=sample)
+		if name == 'recording':
+			sampler.start()
+		try:
+			args.daemon.start_sampling()
+			watch(gaps, args.duration)
+		except (RTSPError, IOError, KeyError):
+			errors += 1
+		finally:
+			args.daemon.stop_sampling()
+			running[0] = False
+			if sampler.is_alive():
+				sampler.join()
+		report('%s rtsp packet gap' % name, gaps)
+		results[name] = {'gap_ms': stats(gaps), 'daemon': args.daemon.usage()}
+		if name == 'recording':
+			rec = props.Get(INTERFACE, 'recording')
+			files, direct, written, max_backlog, writes, write_us, max_write_us, syncs, sync_us, gap_count, dropped = int(rec[2]), bool(rec[3]), int(rec[4]), int(rec[6]), int(rec[7]), int(rec[8]), int(rec[9]), int(rec[10]), int(rec[11]), int(rec[12]), int(rec[13])
+			iface.enableRecording(False, '', 0, 0)
+			rate = written * 8 / args.duration / 1e6
+			print('%s %d files  %7.2f Mbit/s  write avg=%.2fms max=%.2fms  sync avg=%.2fms  backlog avg=%d max=%d  gaps %d dropped %d' % ('direct' if direct else 'cached', files, rate, write_us / 1000.0 / max(writes, 1), max_write_us / 1000.0, sync_us / 1000.0 / max(syncs, 1), sum(backlog) // max(len(backlog), 1), max_backlog, gap_count, dropped))
+			results[name].update({'files': files, 'direct': direct, 'mbit_per_s': rate, 'write_us_avg': write_us / max(writes, 1), 'write_us_max': max_write_us,
+				'sync_us_avg': sync_us / max(syncs, 1), 'backlog_bytes': backlog, 'max_backlog_bytes': max_backlog, 'gaps': gap_count, 'dropped_bytes': dropped})
+		time.sleep(args.settle)
+
+	write_json(args, 'recording', {'config': {'directory': args.directory, 'megabytes': args.megabytes, 'seconds': args.seconds, 'duration': args.duration}, 'results': results, 'errors': errors})
+	return 0 if not errors else 1
+
+def toggle(args):
+	bus = get_bus(args)
+	iface = dbus.Interface(bus.get_object(INTERFACE, OBJECT), INTERFACE)
+	url = 'rtsp://%s:%d/%s-es' % (args.host, args.rtsp_port, args.path)
+	playlist = 'http://%s:%d/dream.m3u8' % (args.host, args.hls_port)
+	drain = Drain()
+	drain.start()
+	calls = {'enable': [], 'disable': []}
+	gaps = []
+	busy = errors = 0
+	running = [True]
+
+	def scrape():
+		if not args.metrics_port:
+			return {}
+		try:
+			return parse_metrics(urlopen('http://127.0.0.1:%d/metrics' % args.metrics_port, timeout=5).read().decode())
+		except (IOError, ValueError):
+			return {}
+
+	def watch():
+		# the viewer keeps streaming while the other outputs come and go
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			previous = None
+			for arrival, stream, packet in client.rtp_packets(3600):
+				if not running[0]:
+					break
+				if stream == 0:
+					if previous is not None:
+						gaps.append(arrival - previous)
+					previous = arrival
+			client.teardown()
+		except (RTSPError, IOError, KeyError):
+			gaps.append(None)
+		finally:
+			client.close()
+
+	def enable(output):
+		if output == 'hls':
+			if not iface.enableHLS(True, args.hls_port, args.hls_user, args.hls_pass):
+				return False
+			# the hls branch is only attached by the first request
+			try:
+				urlopen(playlist, timeout=10).read()
+			except IOError:
+				pass
+			return True
+		return iface.enableUpstream(True, '127.0.0.1', drain.port, '')
+
+	def disable(output):
+		if output == 'hls':
+			return iface.enableHLS(False, 0, '', '')
+		return iface.enableUpstream(False, '', 0, '')
+
+	before = scrape()
+	viewer = threading.Thread(target=watch)
+	viewer.daemon = True
+	viewer.start()
+	args.daemon.start_sampling()
+	time.sleep(2)
+	for i in range(args.rounds):
+		output = args.outputs[i % len(args.outputs)]
+		for action, func in (('enable', enable), ('disable', disable)):
+			start = time.time()
+			try:
+				ok = func(output)
+			except dbus.DBusException as e:
+				print('%s %s: %s' % (action, output, e))
+				errors += 1
+				continue
+			calls[action].append(time.time() - start)
+			# a branch still being detached refuses to come back yet
+			if not ok:
+				busy += 1
+				time.sleep(0.01)
+			time.sleep(args.interval)
+	time.sleep(2)
+	running[0] = False
+	viewer.join(15)
+	args.daemon.stop_sampling()
+	after = scrape()
+
+	report('enable', calls['enable'])
+	report('disable', calls['disable'])
+	if None in gaps:
+		print('rtsp viewer failed')
+		errors += 1
+	gaps = [g for g in gaps if g is not None]
+	report('rtsp packet gap', gaps)
+	leaked = None
+	if before and after:
+		leaked = after.get('dream_branches', 0) - before.get('dream_branches', 0)
+		detaches = after.get('dream_branch_detach_seconds_count', 0) - before.get('dream_branch_detach_seconds_count', 0)
+		detach_s = after.get('dream_branch_detach_seconds_sum', 0) - before.get('dream_branch_detach_seconds_sum', 0)
+		print('branches before=%d after=%d attached=+%d detached=+%d detach avg=%.1f ms' % (before.get('dream_branches', 0), after.get('dream_branches', 0),
+			after.get('dream_branch_attached_total', 0) - before.get('dream_branch_attached_total', 0),
+			after.get('dream_branch_detached_total', 0) - before.get('dream_branch_detached_total', 0),
+			1000.0 * detach_s / max(1, detaches)))
+	usage = args.daemon.usage()
+	growth = None
+	if usage:
+		growth = args.daemon.samples[-1][1] - args.daemon.samples[0][1]
+		print('daemon cpu avg=%.1f%% max=%.1f%% rss growth=%d kB' % (usage['cpu_percent_avg'], usage['cpu_percent_max'], growth))
+	print('busy=%d errors=%d' % (busy, errors))
+	write_json(args, 'toggle', {'config': {'rounds': args.rounds, 'outputs': args.outputs, 'interval': args.interval},
+		'enable_ms': stats(calls['enable']), 'disable_ms': stats(calls['disable']), 'gap_ms': stats(gaps),
+		'leaked_branches': leaked, 'rss_growth_kb': growth, 'daemon': usage, 'busy': busy, 'errors': errors})
+	return 0 if not errors and not leaked else 1
+
+def handover(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	playlist = 'http://%s:%d/dream.m3u8' % (args.host, args.hls_port)
+	metrics_url = 'http://127.0.0.1:%d/metrics' % args.metrics_port
+	gaps = []
+	running = [True]
+
+	def scrape():
+		return parse_metrics(urlopen(metrics_url, timeout=5).read().decode())
+
+	def watch():
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			previous = None
+			for arrival, stream, packet in client.rtp_packets(3600):
+				if not running[0]:
+					break
+				if previous is not None:
+					gaps.append(arrival - previous)
+				previous = arrival
+			client.teardown()
+		except (RTSPError, IOError, KeyError):
+			gaps.append(None)
+		finally:
+			client.close()
+
+	# every one of these used to take the single daemon wide lock
+	def dbus_get():
+		props.Get(INTERFACE, 'rtspVariants')
+		props.Get(INTERFACE, 'upstreamState')
+
+	def dbus_set():
+		props.Set(INTERFACE, 'autoBitrate', auto_bitrate)
+
+	def hls_get():
+		urlopen(playlist, timeout=10).read()
+
+	def rtsp_churn():
+		client = RTSPClient(url, timeout=10.0)
+		try:
+			client.connect()
+			client.describe()
+		finally:
+			client.close()
+
+	def upstream_toggle():
+		iface.enableUpstream(True, '127.0.0.1', drain.port, '')
+		time.sleep(0.2)
+		iface.enableUpstream(False, '', 0, '')
+
+	def handover_us(before, after, path, stage):
+		key = 'dream_latency_seconds_%%s{path="%s",stage="%s"}' % (path, stage)
+		count = after.get(key % 'count', 0) - before.get(key % 'count', 0)
+		return 1e6 * (after.get(key % 'sum', 0) - before.get(key % 'sum', 0)) / count if count else None
+
+	def phase(name, loads):
+		start_gap = len(gaps)
+		before = scrape()
+		for load in loads:
+			load.start()
+		time.sleep(args.duration)
+		for load in loads:
+			load.running = False
+		for load in loads:
+			load.join()
+		after = scrape()
+		window = [g for g in gaps[start_gap:] if g is not None]
+		mux, over = handover_us(before, after, 'source', 'mux'), handover_us(before, after, 'ts_rtsp', 'handover')
+		contended = dict((lock, after.get('dream_lock_contended_total{lock="%s"}' % lock, 0) - before.get('dream_lock_contended_total{lock="%s"}' % lock, 0)) for lock in ('upstream', 'rtsp', 'hls'))
+		waited = sum(after.get('dream_lock_wait_seconds_total{lock="%s"}' % lock, 0) - before.get('dream_lock_wait_seconds_total{lock="%s"}' % lock, 0) for lock in contended)
+		report('%s rtsp packet gap' % name, window)
+		if mux is not None and over is not None:
+			print('%s mux->handover avg=%.1f us' % (name, over - mux))
+		print('%s lock contention %s waited=%.1f ms load calls=%d errors=%d' % (name, ' '.join('%s=%d' % c for c in sorted(contended.items())),
+			1000.0 * waited, sum(len(l.durations) for l in loads), sum(l.errors for l in loads)))
+		return {'gap_ms': stats(window), 'handover_us': over - mux if mux is not None and over is not None else None,
+			'contended': contended, 'wait_ms': 1000.0 * waited, 'load_errors': sum(l.errors for l in loads)}
+
+	if not args.metrics_port:
+		print('handover needs --metrics-port')
+		return 2
+	drain = Drain()
+	drain.start()
+	auto_bitrate = props.Get(INTERFACE, 'autoBitrate')
+	props.Set(INTERFACE, 'latencyTracing', True)
+	viewer = threading.Thread(target=watch)
+	viewer.daemon = True
+	viewer.start()
+	time.sleep(2)
+	results = {'quiet': phase('quiet', [])}
+	loads = [Load(dbus_get) for i in range(args.dbus_clients)] + [Load(dbus_set)]
+	loads += [Load(hls_get) for i in range(args.hls_clients)]
+	loads += [Load(rtsp_churn) for i in range(args.rtsp_clients)]
+	if not args.no_upstream:
+		loads.append(Load(upstream_toggle))
+	results['loaded'] = phase('loaded', loads)
+	running[0] = False
+	viewer.join(15)
+	props.Set(INTERFACE, 'latencyTracing', False)
+
+	errors = 1 if None in gaps else 0
+	write_json(args, 'handover', dict(results, config={'duration': args.duration, 'dbus_clients': args.dbus_clients,
+		'hls_clients': args.hls_clients, 'rtsp_clients': args.rtsp_clients, 'upstream': not args.no_upstream}, errors=errors))
+	return 0 if not errors else 1
+
+def sched(args):
+	bus = get_bus(args)
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	iface = dbus.Interface(proxy, INTERFACE)
+	props = dbus.Interface(proxy, dbus.PROPERTIES_IFACE)
+	url = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+
+	def thread_stats():
+		return dict((str(name), (str(cls), run, wait, slices)) for name, cls, tid, run, wait, slices in props.Get(INTERFACE, 'threadStats'))
+
+	def watch(gaps, duration):
+		client = RTSPClient(url, 'tcp', timeout=10.0)
+		try:
+			client.start()
+			previous = None
+			for arrival, stream, packet in client.rtp_packets(duration):
+				if previous is not None:
+					gaps.append(arrival - previous)
+				previous = arrival
+			client.teardown()
+		finally:
+			client.close()
+
+	# stand-ins for the ui and everything else competing for the cpus
+	hogs = [subprocess.Popen([sys.executable, '-c', 'while True: pass']) for i in range(args.hogs)]
+	results = {}
+	errors = 0
+	try:
+		for priority in args.priorities:
+			for cls in args.classes:
+				if not iface.setThreadPolicy(cls, priority, args.cpus):
+					print('couldn\'t set %s threads to priority %d cpus \'%s\'' % (cls, priority, args.cpus))
+					errors += 1
+			time.sleep(1)
+			before = thread_stats()
+			gaps = []
+			try:
+				watch(gaps, args.duration)
+			except (RTSPError, IOError, KeyError):
+				errors += 1
+			after = thread_stats()
+			waits = {}
+			for name, (cls, run, wait, slices) in after.items():
+				if name in before:
+					slices -= before[name][3]
+					waits[name] = {'class': cls, 'wait_ms': (wait - before[name][2]) / 1e6, 'wait_per_slice_us': (wait - before[name][2]) / 1e3 / slices if slices else 0}
+			label = 'priority %d' % priority
+			report('%s rtsp packet gap' % label, gaps)
+			for name in sorted(waits):
+				w = waits[name]
+				print('  %-16s %-8s runqueue wait %8.1f ms  %7.1f us per timeslice' % (name, w['class'], w['wait_ms'], w['wait_per_slice_us']))
+			results[label] = {'gap_ms': stats(gaps), 'threads': waits}
+	finally:
+		for cls in args.classes:
+			iface.setThreadPolicy(cls, 0, '')
+		for hog in hogs:
+			hog.kill()
+			hog.wait()
+
+	write_json(args, 'sched', {'config': {'hogs': args.hogs, 'priorities': args.priorities, 'classes': args.classes, 'cpus': args.cpus, 'duration': args.duration},
+		'results': results, 'errors': errors})
+	return 0 if not errors else 1
+
+def rtsp(args):
+	base = 'rtsp://%s:%d/%s' % (args.host, args.rtsp_port, args.path)
+	urls = {'ts': base, 'es': base + '-es'}
+	combos = [(m, t) for m in args.mounts for t in args.transports]
+	viewers = [Viewer(urls[combos[i % len(combos)][0]], combos[i % len(combos)][0], combos[i % len(combos)][1], args.duration) for i in range(args.clients)]
+
+	args.daemon.start_sampling()
+	for v in viewers:
+		v.start()
+		time.sleep(args.ramp / max(1, args.clients))
+	for v in viewers:
+		v.join()
+	args.daemon.stop_sampling()
+
+	clients = [v.result for v in viewers]
+	summary = {}
+	for mount, transport in combos:
+		ok = [c for c in clients if c['mount'] == mount and c['transport'] == transport and not c['error']]
+		key = '%s/%s' % (mount, transport)
+		summary[key] = {
+			'clients': len(ok),
+			'describe_ms': stats([c['describe_ms'] for c in ok], 1),
+			'setup_ms': stats([c['setup_ms'] for c in ok], 1),
+			'play_ms': stats([c['play_ms'] for c in ok], 1),
+			'first_keyframe_ms': stats([c['first_keyframe_ms'] for c in ok if c['first_keyframe_ms'] is not None], 1),
+			'kbps': stats([c['kbps'] for c in ok], 1)}
+		s = summary[key]
+		print('%-8s clients=%-3d describe p95=%7.1f setup p95=%7.1f play p95=%7.1f keyframe p95=%7.1f ms  kbps p50=%7.0f min=%7.0f' % (key, len(ok),
+			s['describe_ms']['p95'], s['setup_ms']['p95'], s['play_ms']['p95'], s['first_keyframe_ms']['p95'], s['kbps']['p50'], min([c['kbps'] for c in ok] or [0])))
+	errors = [c for c in clients if c['error']]
+	usage = args.daemon.usage()
+	if usage:
+		print('daemon cpu avg=%.1f%% max=%.1f%% rss max=%d kB' % (usage['cpu_percent_avg'], usage['cpu_percent_max'], usage['rss_kb_max']))
+	print('errors=%d' % len(errors))
+
+	write_json(args, 'rtsp', {
+		'config': {'clients': args.clients, 'duration': args.duration, 'mounts': args.mounts, 'transports': args.transports},
+		'summary': summary, 'clients': clients, 'daemon': usage, 'errors': len(errors)})
+	return 0 if not errors else 1
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--host', default='127.0.0.1')
+	parser.add_argument('--rtsp-port', type=int, default=554)
+	parser.add_argument('--hls-port', type=int, default=8080)
+	parser.add_argument('--path', default='stream')
+	parser.add_argument('--hls-user', default='')
+	parser.add_argument('--hls-pass', default='')
+	parser.add_argument('--session-bus', action='store_true')
+	parser.add_argument('--spawn', metavar='DAEMON', help='start this daemon binary with the synthetic source')
+	parser.add_argument('--pid', type=int, help='pid of a running daemon for cpu/rss sampling')
+	parser.add_argument('--json', metavar='FILE', help='write results as json')
+	parser.add_argument('--metrics-port', type=int, default=0, help='local port of the metrics endpoint')
+	parser.add_argument('--sync-signals', action='store_true', help='spawn the daemon with signals emitted on the calling thread')
+	sub = parser.add_subparsers(dest='scenario')
+
+	p = sub.add_parser('controlplane', help='RTSP request latency under HLS and D-Bus load')
+	p.add_argument('--duration', type=float, default=20.0)
+	p.add_argument('--interval', type=float, default=0.05)
+	p.add_argument('--hls-clients', type=int, default=4)
+	p.add_argument('--dbus-clients', type=int, default=2)
+	p.add_argument('--no-hls', action='store_true')
+	p.add_argument('--no-dbus', action='store_true')
+	p.set_defaults(func=controlplane)
+
+	p = sub.add_parser('storm', help='RTSP session setup throughput per thread pool size')
+	p.add_argument('--duration', type=float, default=10.0)
+	p.add_argument('--clients', type=int, default=32, help='concurrent connecting clients')
+	p.add_argument('--threads', type=int, nargs='+', default=[1, 2, 4, 8])
+	p.add_argument('--affinity', default='', help='cpu list for the client threads, e.g. 0-3')
+	p.add_argument('--transport', default='tcp', choices=['udp', 'tcp'])
+	p.set_defaults(func=storm)
+
+	p = sub.add_parser('rtsp', help='sustained RTSP viewers on the TS and ES mounts')
+	p.add_argument('--duration', type=float, default=30.0)
+	p.add_argument('--clients', type=int, default=8)
+	p.add_argument('--ramp', type=float, default=2.0, help='seconds over which the clients connect')
+	p.add_argument('--mounts', nargs='+', default=['ts', 'es'], choices=['ts', 'es'])
+	p.add_argument('--transports', nargs='+', default=['udp', 'tcp'], choices=['udp', 'tcp'])
+	p.set_defaults(func=rtsp)
+
+	p = sub.add_parser('hls', help='simulated HLS players')
+	p.add_argument('--duration', type=float, default=60.0)
+	p.add_argument('--players', type=int, default=8)
+	p.add_argument('--ramp', type=float, default=5.0, help='seconds over which the players start')
+	p.add_argument('--startup', type=float, default=4.0, help='seconds buffered before playback starts')
+	p.set_defaults(func=hls)
+
+	p = sub.add_parser('metrics', help='scrape the metrics endpoint')
+	p.add_argument('--duration', type=float, default=10.0)
+	p.add_argument('--interval', type=float, default=1.0)
+	p.set_defaults(func=metrics)
+
+	p = sub.add_parser('signals', help='time spent sending D-Bus signals under RTSP client churn')
+	p.add_argument('--duration', type=float, default=10.0)
+	p.add_argument('--clients', type=int, default=8)
+	p.set_defaults(func=signals)
+
+	p = sub.add_parser('reconfigure', help='stream glitch of separate property sets versus one reconfigure call')
+	p.add_argument('--rounds', type=int, default=5)
+	p.add_argument('--settle', type=float, default=3.0, help='seconds to watch for keyframes after each change')
+	p.add_argument('--modes', nargs='+', default=['single', 'transaction'], choices=['single', 'transaction'])
+	p.set_defaults(func=reconfigure)
+
+	p = sub.add_parser('wake', help='time to the first keyframe when enabling RTSP on an idle source pipeline')
+	p.add_argument('--rounds', type=int, default=10)
+	p.add_argument('--settle', type=float, default=5.0, help='seconds to wait for the source to go idle')
+	p.set_defaults(func=wake)
+
+	p = sub.add_parser('toggle', help='enable and disable HLS and upstream over and over while an RTSP viewer streams')
+	p.add_argument('--rounds', type=int, default=2000)
+	p.add_argument('--interval', type=float, default=0.01, help='seconds between the calls')
+	p.add_argument('--outputs', nargs='+', default=['hls', 'upstream'], choices=['hls', 'upstream'])
+	p.set_defaults(func=toggle)
+
+	p = sub.add_parser('handover', help='RTSP handover latency and lock contention with and without control plane load')
+	p.add_argument('--duration', type=float, default=20.0, help='seconds per phase')
+	p.add_argument('--dbus-clients', type=int, default=4)
+	p.add_argument('--hls-clients', type=int, default=4)
+	p.add_argument('--rtsp-clients', type=int, default=4, help='clients connecting and describing over and over')
+	p.add_argument('--no-upstream', action='store_true', help='don\'t toggle the upstream during the load phase')
+	p.set_defaults(func=handover)
+
+	p = sub.add_parser('sched', help='RTSP packet gaps and streaming thread runqueue waits next to cpu hogs per thread priority')
+	p.add_argument('--duration', type=float, default=20.0, help='seconds per priority')
+	p.add_argument('--hogs', type=int, default=os.sysconf('SC_NPROCESSORS_ONLN'), help='busy looping processes')
+	p.add_argument('--priorities', type=int, nargs='+', default=[0, 50])
+	p.add_argument('--classes', nargs='+', default=['source', 'rtsp'], choices=['source', 'rtsp', 'hls', 'upstream'])
+	p.add_argument('--cpus', default='', help='pin the classes to these cpus, e.g. 0-1')
+	p.set_defaults(func=sched)
+
+	p = sub.add_parser('budget', help='queue memory and daemon rss while every output is stalled, per buffering budget')
+	p.add_argument('--budgets', type=int, nargs='+', default=[0, 24], help='megabytes, 0 keeps the queues\' own limits')
+	p.add_argument('--duration', type=float, default=30.0, help='seconds of stall per budget')
+	p.add_argument('--settle', type=float, default=5.0, help='seconds between the budgets')
+	p.add_argument('--viewers', type=int, default=4, help='rtsp viewers which stop reading')
+	p.set_defaults(func=budget)
+
+	p = sub.add_parser('alloc', help='heap allocations per second of the memory arena while streaming')
+	p.add_argument('--viewers', type=int, default=4, help='rtsp viewers next to the upstream')
+	p.add_argument('--warmup', type=float, default=10.0, help='seconds before counting')
+	p.add_argument('--duration', type=float, default=30.0, help='seconds counted')
+	p.set_defaults(func=alloc)
+
+	p = sub.add_parser('shm', help='throughput and cpu of shared memory readers against rtsp viewers on loopback')
+	p.add_argument('--readers', type=int, default=4, help='consumers in each phase')
+	p.add_argument('--duration', type=float, default=30.0, help='seconds per phase')
+	p.add_argument('--settle', type=float, default=5.0, help='seconds between the phases')
+	p.add_argument('--shmcat', default='dreamshmcat', help='the shared memory reader to run')
+	p.set_defaults(func=shm)
+
+	p = sub.add_parser('unix', help='throughput and cpu of unix socket and memfd readers against rtsp viewers on loopback')
+	p.add_argument('--readers', type=int, default=4, help='consumers in each phase')
+	p.add_argument('--stalled', type=int, default=1, help='unix socket clients which never read')
+	p.add_argument('--duration', type=float, default=30.0, help='seconds per phase')
+	p.add_argument('--settle', type=float, default=5.0, help='seconds between the phases')
+	p.add_argument('--socket', default='/tmp/dreamrtspserver-bench.sock', help='path of the unix socket')
+	p.set_defaults(func=unix)
+
+	p = sub.add_parser('timeshift', help='timeshift write throughput and seek latency per file system')
+	p.add_argument('--directories', default='/tmp', help='comma separated directories for the timeshift file, e.g. one on flash and one on tmpfs')
+	p.add_argument('--megabytes', type=int, default=64, help='size of the timeshift')
+	p.add_argument('--fill', type=float, default=30.0, help='seconds of recording before seeking')
+	p.add_argument('--offsets', default='0,10,20', help='comma separated seconds to seek to')
+	p.add_argument('--seeks', type=int, default=5, help='seeks per offset')
+	p.add_argument('--settle', type=float, default=5.0, help='seconds between the paths')
+	p.set_defaults(func=timeshift)
+
+	p = sub.add_parser('recording', help='rtsp packet gaps with and without a recording, recording throughput and backlog')
+	p.add_argument('--directory', default='/tmp', help='where the recording goes')
+	p.add_argument('--megabytes', type=int, default=0, help='new file after this size, 0 is the daemon\'s default')
+	p.add_argument('--seconds', type=int, default=10, help='new file after this time, 0 never')
+	p.add_argument('--duration', type=float, default=30.0, help='seconds per phase')
+	p.add_argument('--settle', type=float, default=5.0, help='seconds between the phases')
+	p.set_defaults(func=recording)
+
+	args = parser.parse_args()
+	if not getattr(args, 'func', None):
+		parser.print_help()
+		return 2
+
+	args.daemon = Daemon(args.pid)
+	if args.spawn:
+		bus = get_bus(args)
+		args.daemon.spawn(args.spawn, args.session_bus, bus, args.metrics_port, args.sync_signals)
+		iface = dbus.Interface(bus.get_object(INTERFACE, OBJECT), INTERFACE)
+		if not iface.enableRTSP(True, args.path, args.rtsp_port, '', ''):
+			print('couldn\'t enable the rtsp server')
+			args.daemon.stop()
+			return 1
+		if not iface.enableHLS(True, args.hls_port, args.hls_user, args.hls_pass):
+			print('couldn\'t enable the hls server')
+	try:
+		return args.func(args)
+	finally:
+		args.daemon.stop()
+
+if __name__ == '__main__':
+	sys.exit(main())
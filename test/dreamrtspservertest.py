@@ -11,8 +11,27 @@ class StreamServerControl(object):
 	PROP_XRES = 'width'
 	PROP_YRES = 'height'
 	PROP_RTSP_STATE = 'rtspState'
+	PROP_SOURCE_IDLE = 'sourceIdle'
 	PROP_UPSTREAM_STATE = 'upstreamState'
 	PROP_AUTO_BITRATE = 'autoBitrate'
+	PROP_RTSP_BACKLOG_LIMITS = 'rtspBacklogLimits'
+	PROP_RTSP_CONGESTION_COUNTERS = 'rtspCongestionCounters'
+	PROP_RTSP_THREAD_POOL = 'rtspThreadPool'
+	PROP_RTSP_THREAD_STATS = 'rtspThreadStats'
+	PROP_THREAD_POLICY = 'threadPolicy'
+	PROP_THREAD_STATS = 'threadStats'
+	PROP_BUFFER_BUDGET = 'bufferBudget'
+	PROP_BUFFER_BUDGET_QUEUES = 'bufferBudgetQueues'
+	PROP_ALLOC_STATS = 'allocStats'
+	PROP_SHARED_MEMORY = 'sharedMemory'
+	PROP_UNIX_SOCKET = 'unixSocket'
+	PROP_TIMESHIFT = 'timeshift'
+	PROP_RECORDING = 'recording'
+	PROP_LATENCY_TRACING = 'latencyTracing'
+	PROP_LATENCY_STATS = 'latencyStats'
+	PROP_PROBE_STATS = 'probeStats'
+	PROP_ADAPTIVE_BITRATE = 'adaptiveBitrate'
+	PROP_ADAPTIVE_BITRATE_STATS = 'adaptiveBitrateStats'
 
 	FRAME_RATE_25 = 25
 	FRAME_RATE_30 = 30
@@ -42,9 +61,128 @@ class StreamServerControl(object):
 	def enableRTSP(self, state, path='', port=0, user='', pw=''):
 		return self._interface.enableRTSP(state, path, port, user, pw)
 
+	def enableSharedMemory(self, state, streams=''):
+		"""streams is a comma separated list of ts, video and audio, read them with shmreader.ShmReader"""
+		return self._interface.enableSharedMemory(state, streams)
+
+	def enableUnixSocket(self, state, path=''):
+		"""an empty path listens on /tmp/dreamrtspserver.sock, connect with unixclient.UnixClient"""
+		return self._interface.enableUnixSocket(state, path)
+
+	def enableTimeshift(self, state, directory='', megabytes=0):
+		"""the ring is an anonymous file in directory, an empty one means /tmp, 0 megabytes means 256.
+		play it from the -timeshift rtsp mount or /timeshift/timeshift.m3u8"""
+		return self._interface.enableTimeshift(state, directory, megabytes)
+
+	def enableRecording(self, state, directory='', megabytes=0, seconds=0):
+		"""an empty directory records to /media/hdd/movie, a new file starts after megabytes (0 means 4095)
+		or seconds (0 never) at the next keyframe"""
+		return self._interface.enableRecording(state, directory, megabytes, seconds)
+
 	def enableUpstream(self, state, host='', aport=0, vport=0):
 		return self._interface.enableUpstream(state, host, aport, vport)
 
+	def setRTSPBacklogLimits(self, nbytes, drop_ms, evict_ms):
+		return self._interface.setRTSPBacklogLimits(nbytes, drop_ms, evict_ms)
+
+	def getRTSPBacklogLimits(self):
+		return self._getProperty(self.PROP_RTSP_BACKLOG_LIMITS)
+
+	def getRTSPCongestionCounters(self):
+		return self._getProperty(self.PROP_RTSP_CONGESTION_COUNTERS)
+
+	def setRTSPThreadPool(self, max_threads, affinity=''):
+		return self._interface.setRTSPThreadPool(max_threads, affinity)
+
+	def getRTSPThreadPool(self):
+		return self._getProperty(self.PROP_RTSP_THREAD_POOL)
+
+	def getRTSPThreadStats(self):
+		return self._getProperty(self.PROP_RTSP_THREAD_STATS)
+
+	def setThreadPolicy(self, thread_class, priority=0, cpus=''):
+		"""thread_class is one of source, rtsp, hls, upstream. priority 1-99 is SCHED_FIFO"""
+		return self._interface.setThreadPolicy(thread_class, priority, cpus)
+
+	def getThreadPolicy(self):
+		return self._getProperty(self.PROP_THREAD_POLICY)
+
+	def getThreadStats(self):
+		"""returns (name, class, tid, run ns, runqueue wait ns, timeslices) per streaming thread"""
+		return self._getProperty(self.PROP_THREAD_STATS)
+
+	def setBufferBudget(self, bytes):
+		"""0 gives every queue its own limit back"""
+		return self._interface.setBufferBudget(dbus.UInt64(bytes))
+
+	def getBufferBudget(self):
+		"""returns (budget, used, pressure, rebalances)"""
+		return self._getProperty(self.PROP_BUFFER_BUDGET)
+
+	def getBufferBudgetQueues(self):
+		"""returns (branch, weight, limit, level) per budgeted queue"""
+		return self._getProperty(self.PROP_BUFFER_BUDGET_QUEUES)
+
+	def getAllocStats(self):
+		"""returns (fallbacks, [(size, reused, allocated, released, cached)]), size 0 are the shared sub-memories"""
+		return self._getProperty(self.PROP_ALLOC_STATS)
+
+	def getSharedMemory(self):
+		"""returns (stream, shm name, capacity, bytes, records, keyframes) per exported stream"""
+		return self._getProperty(self.PROP_SHARED_MEMORY)
+
+	def getUnixSocket(self):
+		"""returns (path, clients, bytes, batches, segments, drops), path is empty while disabled"""
+		return self._getProperty(self.PROP_UNIX_SOCKET)
+
+	def getTimeshift(self):
+		"""returns (path, direct, capacity, written, wrapped, window, keyframes, writes, write_us, max_write_us, overruns),
+		path is empty while disabled, window is in seconds"""
+		return self._getProperty(self.PROP_TIMESHIFT)
+
+	def getRecording(self):
+		"""returns (directory, file, files, direct, bytes, backlog, max_backlog, writes, write_us, max_write_us,
+		syncs, sync_us, gaps, dropped), directory is empty while disabled"""
+		return self._getProperty(self.PROP_RECORDING)
+
+	def getLatencyTracing(self):
+		return self._getProperty(self.PROP_LATENCY_TRACING)
+
+	def setLatencyTracing(self, enabled):
+		self._setProperty(self.PROP_LATENCY_TRACING, dbus.Boolean(enabled))
+	latencyTracing = property(getLatencyTracing, setLatencyTracing)
+
+	def getLatencyStats(self):
+		return self._getProperty(self.PROP_LATENCY_STATS)
+
+	def getProbeStats(self):
+		return self._getProperty(self.PROP_PROBE_STATS)
+
+	def setAdaptiveBitrate(self, enabled, min_kbps=0, max_kbps=0):
+		return self._interface.setAdaptiveBitrate(enabled, min_kbps, max_kbps)
+
+	def getAdaptiveBitrate(self):
+		return self._getProperty(self.PROP_ADAPTIVE_BITRATE)
+
+	def getAdaptiveBitrateStats(self):
+		"""returns (limit, target, adjustments, fill, motion, saved kbit/h, adapted p50/p95/p99, ceiling p50/p95/p99)"""
+		return self._getProperty(self.PROP_ADAPTIVE_BITRATE_STATS)
+
+	def reconfigure(self, **changes):
+		"""applies encoder settings in one go, e.g. reconfigure(videoBitrate=4000, width=1280, height=720)
+		returns (result, keyframe pts in ns, keyframe delay in us)"""
+		typed = dict((k, dbus.Boolean(v) if isinstance(v, bool) else dbus.Int32(v)) for k, v in changes.items())
+		return self._interface.reconfigure(dbus.Dictionary(typed, signature='sv'))
+
+	def getState(self):
+		return self._interface.getState()
+
+	def onPropertiesChanged(self, callback):
+		return self._proxy.connect_to_signal('PropertiesChanged', callback, dbus_interface=dbus.PROPERTIES_IFACE)
+
+	def getSourceIdle(self):
+		return self._getProperty(self.PROP_SOURCE_IDLE)
+
 	def getRTSPState(self):
 		return self._getProperty(self.PROP_RTSP_STATE)
 
@@ -0,0 +1,210 @@
+#!/usr/bin/python
+# minimal RTSP/RTP client used by the dreamrtspserver tests and benchmarks
+import base64
+import re
+import select
+import socket
+import struct
+import time
+
+class RTSPError(Exception):
+	pass
+
+class RTSPClient(object):
+	def __init__(self, url, transport='tcp', user='', pw='', timeout=10.0, rcvbuf=0):
+		m = re.match(r'rtsp://(?:([^:@]*):?([^@]*)@)?([^:/]+)(?::(\d+))?(/.*)?', url)
+		if not m:
+			raise RTSPError('invalid url %s' % url)
+		self.user = user or m.group(1) or ''
+		self.pw = pw or m.group(2) or ''
+		self.host = m.group(3)
+		self.port = int(m.group(4) or 554)
+		self.url = 'rtsp://%s:%d%s' % (self.host, self.port, m.group(5) or '/')
+		self.transport = transport
+		self.timeout = timeout
+		self.rcvbuf = rcvbuf
+		self.cseq = 0
+		self.session = None
+		self.controls = []
+		self.udp_sockets = []
+		self.sock = None
+		self._buf = b''
+		self.latency = {}
+
+	def connect(self):
+		self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		if self.rcvbuf:
+			self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, self.rcvbuf)
+		self.sock.settimeout(self.timeout)
+		self.sock.connect((self.host, self.port))
+
+	def close(self):
+		for s in self.udp_sockets:
+			s.close()
+		self.udp_sockets = []
+		if self.sock:
+			self.sock.close()
+			self.sock = None
+
+	def _read_more(self):
+		data = self.sock.recv(65536)
+		if not data:
+			raise RTSPError('connection closed by server')
+		self._buf += data
+
+	def _read_response(self):
+		while True:
+			# skip interleaved data which may arrive before the response
+			while self._buf[:1] == b'$':
+				if len(self._buf) < 4:
+					self._read_more()
+					continue
+				length = struct.unpack('>H', self._buf[2:4])[0]
+				if len(self._buf) < 4 + length:
+					self._read_more()
+					continue
+				self._buf = self._buf[4 + length:]
+			idx = self._buf.find(b'\r\n\r\n')
+			if idx >= 0:
+				break
+			self._read_more()
+		head = self._buf[:idx].decode('latin-1')
+		self._buf = self._buf[idx + 4:]
+		lines = head.split('\r\n')
+		status = int(lines[0].split(' ')[1])
+		headers = {}
+		for line in lines[1:]:
+			k, _, v = line.partition(':')
+			headers[k.strip().lower()] = v.strip()
+		length = int(headers.get('content-length', 0))
+		while len(self._buf) < length:
+			self._read_more()
+		body = self._buf[:length].decode('latin-1')
+		self._buf = self._buf[length:]
+		return status, headers, body
+
+	def request(self, method, url=None, headers=None):
+		self.cseq += 1
+		lines = ['%s %s RTSP/1.0' % (method, url or self.url), 'CSeq: %d' % self.cseq, 'User-Agent: dreamrtspserver-test']
+		if self.session:
+			lines.append('Session: %s' % self.session)
+		if self.user:
+			auth = base64.b64encode(('%s:%s' % (self.user, self.pw)).encode()).decode()
+			lines.append('Authorization: Basic %s' % auth)
+		for k, v in (headers or {}).items():
+			lines.append('%s: %s' % (k, v))
+		start = time.time()
+		self.sock.sendall(('\r\n'.join(lines) + '\r\n\r\n').encode('latin-1'))
+		status, rheaders, body = self._read_response()
+		self.latency.setdefault(method, []).append(time.time() - start)
+		if status != 200:
+			raise RTSPError('%s %s failed with status %d' % (method, url or self.url, status))
+		return rheaders, body
+
+	def describe(self):
+		headers, sdp = self.request('DESCRIBE', headers={'Accept': 'application/sdp'})
+		base = headers.get('content-base', self.url)
+		if not base.endswith('/'):
+			base += '/'
+		self.controls = []
+		for line in sdp.splitlines():
+			if line.startswith('a=control:'):
+				control = line[len('a=control:'):]
+				if control == '*':
+					continue
+				self.controls.append(control if control.startswith('rtsp://') else base + control)
+		return sdp
+
+	def setup(self):
+		for idx, control in enumerate(self.controls):
+			if self.transport == 'tcp':
+				transport = 'RTP/AVP/TCP;unicast;interleaved=%d-%d' % (2 * idx, 2 * idx + 1)
+			else:
+				rtp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+				rtp.bind(('', 0))
+				rtcp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+				rtcp.bind(('', 0))
+				self.udp_sockets += [rtp, rtcp]
+				transport = 'RTP/AVP;unicast;client_port=%d-%d' % (rtp.getsockname()[1], rtcp.getsockname()[1])
+			headers, _ = self.request('SETUP', control, {'Transport': transport})
+			if 'session' in headers:
+				self.session = headers['session'].split(';')[0]
+
+	def play(self, start=0):
+		"""start is in seconds, the timeshift mount can seek there"""
+		self.request('PLAY', headers={'Range': 'npt=%.3f-' % start})
+
+	def teardown(self):
+		try:
+			self.request('TEARDOWN')
+		except (RTSPError, socket.error):
+			pass
+
+	def start(self):
+		self.connect()
+		self.describe()
+		self.setup()
+		self.play()
+
+	def rtp_packets(self, duration):
+		"""yields (arrival time, stream index, rtp packet) for duration seconds"""
+		end = time.time() + duration
+		while time.time() < end:
+			if self.transport == 'tcp':
+				while len(self._buf) >= 4 and self._buf[:1] == b'$':
+					channel = ord(self._buf[1:2])
+					length = struct.unpack('>H', self._buf[2:4])[0]
+					if len(self._buf) < 4 + length:
+						break
+					packet = self._buf[4:4 + length]
+					self._buf = self._buf[4 + length:]
+					if channel % 2 == 0 and len(packet) >= 12:
+						yield time.time(), channel // 2, packet
+				r, _, _ = select.select([self.sock], [], [], max(0, end - time.time()))
+				if r:
+					self._read_more()
+			else:
+				rtp_sockets = self.udp_sockets[0::2]
+				r, _, _ = select.select(rtp_sockets, [], [], max(0, end - time.time()))
+				for s in r:
+					packet = s.recv(65536)
+					if len(packet) >= 12:
+						yield time.time(), rtp_sockets.index(s), packet
+
+	def packets(self, duration):
+		"""yields (arrival time, stream index, rtp payload type, rtp timestamp, size) for duration seconds"""
+		for arrival, stream, packet in self.rtp_packets(duration):
+			pt, ts = ord(packet[1:2]) & 0x7f, struct.unpack('>I', packet[4:8])[0]
+			yield arrival, stream, pt, ts, len(packet)
+
+def rtp_payload(packet):
+	"""strips the rtp header including csrcs, extension and padding"""
+	b0 = ord(packet[0:1])
+	offset = 12 + 4 * (b0 & 0x0f)
+	if b0 & 0x10 and len(packet) >= offset + 4:
+		offset += 4 + 4 * struct.unpack('>H', packet[offset + 2:offset + 4])[0]
+	end = len(packet)
+	if b0 & 0x20:
+		end -= ord(packet[-1:])
+	return packet[offset:end]
+
+def is_keyframe(packet, mp2t=False):
+	"""true if the rtp packet starts or carries a h264 idr/sps or a ts random access point"""
+	payload = rtp_payload(packet)
+	if not payload:
+		return False
+	if mp2t:
+		for i in range(0, len(payload) - 187, 188):
+			ts = payload[i:i + 188]
+			if ord(ts[0:1]) != 0x47:
+				continue
+			if ord(ts[3:4]) & 0x20 and ord(ts[4:5]) > 0 and ord(ts[5:6]) & 0x40:
+				return True
+		return False
+	nal = ord(payload[0:1]) & 0x1f
+	if nal == 24 and len(payload) > 3:
+		nal = ord(payload[3:4]) & 0x1f
+	elif nal == 28 and len(payload) > 1:
+		fu = ord(payload[1:2])
+		nal = fu & 0x1f if fu & 0x80 else 0
+	return nal in (5, 7)
@@ -0,0 +1,81 @@
+#!/usr/bin/python
+# checks that a TCP interleaved client which stops reading gets dropped and
+# evicted by the server without affecting the latency of other clients
+import argparse
+import sys
+import dbus
+
+from rtspclient import RTSPClient
+
+INTERFACE = 'com.dreambox.RTSPserver'
+OBJECT = '/com/dreambox/RTSPserver'
+
+def percentile(values, p):
+	values = sorted(values)
+	if not values:
+		return 0.0
+	return values[min(len(values) - 1, int(len(values) * p / 100.0))]
+
+def measure_lag(client, duration, clock_rate=90000):
+	"""arrival jitter of the first stream relative to its rtp timestamps in ms"""
+	first = None
+	lags = []
+	for arrival, stream, pt, ts, size in client.packets(duration):
+		if stream != 0:
+			continue
+		if first is None:
+			first = (arrival, ts)
+		lags.append((arrival - first[0]) - ((ts - first[1]) & 0xffffffff) / float(clock_rate))
+	if not lags:
+		return []
+	base = min(lags)
+	return [(lag - base) * 1000.0 for lag in lags]
+
+def main():
+	parser = argparse.ArgumentParser()
+	parser.add_argument('--url', default='rtsp://127.0.0.1:554/stream')
+	parser.add_argument('--duration', type=float, default=10.0)
+	parser.add_argument('--transport', default='udp', choices=['udp', 'tcp'], help='transport of the measuring client')
+	parser.add_argument('--max-degradation', type=float, default=100.0, help='allowed increase of the p95 lag in ms')
+	parser.add_argument('--session-bus', action='store_true')
+	args = parser.parse_args()
+
+	bus = dbus.SessionBus() if args.session_bus else dbus.SystemBus()
+	proxy = bus.get_object(INTERFACE, OBJECT)
+	getprop = lambda name: proxy.Get(INTERFACE, name, dbus_interface=dbus.PROPERTIES_IFACE)
+
+	reference = RTSPClient(args.url, args.transport)
+	reference.start()
+	baseline = measure_lag(reference, args.duration)
+	counters_before = [int(v) for v in getprop('rtspCongestionCounters')]
+
+	slow = RTSPClient(args.url, 'tcp', rcvbuf=4096)
+	slow.start()
+	# never read from the slow client from now on
+	loaded = measure_lag(reference, 2 * args.duration)
+	counters_after = [int(v) for v in getprop('rtspCongestionCounters')]
+
+	reference.teardown()
+	reference.close()
+	slow.close()
+
+	delta = [b - a for a, b in zip(counters_before, counters_after)]
+	print('baseline lag  p50=%.1f p95=%.1f max=%.1f ms (%d packets)' % (percentile(baseline, 50), percentile(baseline, 95), max(baseline or [0]), len(baseline)))
+	print('with slow lag p50=%.1f p95=%.1f max=%.1f ms (%d packets)' % (percentile(loaded, 50), percentile(loaded, 95), max(loaded or [0]), len(loaded)))
+	print('congested=%d dropped=%d resumed=%d evicted=%d' % tuple(delta))
+
+	ok = True
+	if not baseline or not loaded:
+		print('FAIL: measuring client received no data')
+		ok = False
+	elif percentile(loaded, 95) - percentile(baseline, 95) > args.max_degradation:
+		print('FAIL: lag of the measuring client degraded by more than %.0f ms' % args.max_degradation)
+		ok = False
+	if delta[0] < 1:
+		print('FAIL: slow client was never detected as congested')
+		ok = False
+	print('PASS' if ok else 'FAILED')
+	return 0 if ok else 1
+
+if __name__ == '__main__':
+	sys.exit(main())
@@ -0,0 +1,127 @@
+#!/usr/bin/python
+# reader for the shared memory rings of dreamrtspserver, see src/dreamshm.h,
+# used by the tests and benchmarks
+import mmap
+import os
+import struct
+import time
+
+PREFIX = 'dreamrtspserver-'
+MAGIC = 0x53544d44
+VERSION = 2
+KEYFRAMES = 64
+FLAG_KEYFRAME = 1
+FLAG_DISCONT = 2
+
+# magic, version, header_size, closed, pos_seq, reserved, capacity, reserve_pos, write_pos, keyframes
+HEADER = struct.Struct('=IIIIIIQQQQ')
+KEYFRAME = struct.Struct('=QQQ')
+CAPS_OFFSET = HEADER.size + KEYFRAMES * KEYFRAME.size
+SEQ = struct.Struct('=I')
+CAPS_LEN = 1024
+# size, flags, seq, pts, dts
+RECORD = struct.Struct('=IIQQQ')
+
+class ShmError(Exception):
+	pass
+
+class Overrun(ShmError):
+	pass
+
+class ShmReader(object):
+	def __init__(self, stream='ts'):
+		fd = os.open(os.path.join('/dev/shm', PREFIX + stream), os.O_RDONLY)
+		try:
+			self.map = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+		finally:
+			os.close(fd)
+		magic, version, self.header_size, closed, seq, reserved, self.capacity, reserve, write, keyframes = self._header()
+		if magic != MAGIC or version != VERSION:
+			raise ShmError('not a dreamrtspserver ring')
+		self.pos = self._positions()[1]
+		self.overruns = 0
+
+	def close(self):
+		self.map.close()
+
+	def _header(self):
+		return HEADER.unpack_from(self.map, 0)
+
+	def _seqlocked(self, offset, read):
+		"""retries read() until the sequence counter at offset was even and unchanged"""
+		while True:
+			seq = SEQ.unpack_from(self.map, offset)[0]
+			value = read()
+			if not seq & 1 and seq == SEQ.unpack_from(self.map, offset)[0]:
+				return value
+
+	def _positions(self):
+		"""(reserve_pos, write_pos, keyframes), consistent under pos_seq"""
+		return self._seqlocked(16, lambda: self._header()[7:10])
+
+	def _copy(self, pos, length):
+		offset = pos & (self.capacity - 1)
+		start = self.header_size + offset
+		first = min(length, self.capacity - offset)
+		return self.map[start:start + first] + self.map[self.header_size:self.header_size + length - first]
+
+	def _intact(self, pos):
+		return self._positions()[0] - pos <= self.capacity
+
+	def caps(self):
+		caps = self._seqlocked(CAPS_OFFSET, lambda: self.map[CAPS_OFFSET + 4:CAPS_OFFSET + 4 + CAPS_LEN])
+		return caps.split(b'\0', 1)[0].decode()
+
+	def seek_keyframe(self):
+		"""moves to the newest keyframe still in the ring"""
+		count = self._positions()[2]
+		if not count:
+			return False
+		pos, seq, pts = KEYFRAME.unpack_from(self.map, HEADER.size + ((count - 1) % KEYFRAMES) * KEYFRAME.size)
+		if self._positions()[2] - (count - 1) >= KEYFRAMES or not self._intact(pos):
+			return False
+		self.pos = pos
+		return True
+
+	def read(self):
+		"""returns (flags, seq, pts, payload) of the next record, None if there's none yet,
+		raises Overrun after repositioning at the newest keyframe"""
+		write = self._positions()[1]
+		if self.pos == write:
+			if self._header()[3]:
+				raise ShmError('closed')
+			return None
+		if write - self.pos > self.capacity:
+			return self._overrun()
+		size, flags, seq, pts, dts = RECORD.unpack(self._copy(self.pos, RECORD.size))
+		length = (RECORD.size + size + 7) & ~7
+		if not self._intact(self.pos) or length > write - self.pos:
+			return self._overrun()
+		payload = self._copy(self.pos + RECORD.size, size)
+		if not self._intact(self.pos):
+			return self._overrun()
+		self.pos += length
+		return flags, seq, pts, payload
+
+	def _overrun(self):
+		self.overruns += 1
+		if not self.seek_keyframe():
+			self.pos = self._positions()[1]
+		raise Overrun()
+
+	def records(self, duration):
+		"""yields (flags, seq, pts, payload) for duration seconds, starting at a keyframe"""
+		end = time.time() + duration
+		while not self.seek_keyframe():
+			if time.time() > end:
+				return
+			time.sleep(0.005)
+		while time.time() < end:
+			try:
+				record = self.read()
+			except Overrun:
+				continue
+			if record is None:
+				time.sleep(0.005)
+			else:
+				yield record
@@ -0,0 +1,66 @@
+#!/usr/bin/python
+# client for the unix socket TS output of dreamrtspserver, see src/dreamunix.h,
+# used by the tests and benchmarks. memfd segments need python 3
+import array
+import mmap
+import os
+import socket
+import struct
+
+DEFAULT_PATH = '/tmp/dreamrtspserver.sock'
+SEGMENT_MAGIC = 0x53554d44
+FLAG_KEYFRAME = 1
+FLAG_DISCONT = 2
+
+# magic, size, flags, reserved, seq, pts
+SEGMENT = struct.Struct('=IIIIQQ')
+
+class UnixClientError(Exception):
+	pass
+
+class UnixClient(object):
+	def __init__(self, path=DEFAULT_PATH, keyframe=False, memfd=False, rcvbuf=0, timeout=10.0):
+		self.memfd = memfd
+		self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+		if rcvbuf:
+			self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, rcvbuf)
+		self.sock.settimeout(timeout)
+		self.sock.connect(path)
+		words = []
+		if keyframe:
+			words.append('keyframe')
+		if memfd:
+			words.append('memfd')
+		self.sock.sendall((' '.join(words) + '\n').encode())
+
+	def close(self):
+		self.sock.close()
+
+	def read(self, size=65536):
+		"""the next chunk of the byte stream, empty when the daemon closed it"""
+		return self.sock.recv(size)
+
+	def segment(self):
+		"""the next memfd segment as (flags, seq, pts, data), None when closed"""
+		header = b''
+		fds = array.array('i')
+		while len(header) < SEGMENT.size:
+			data, ancdata, flags, addr = self.sock.recvmsg(SEGMENT.size - len(header), socket.CMSG_LEN(fds.itemsize))
+			if not data:
+				return None
+			header += data
+			for level, kind, cdata in ancdata:
+				if level == socket.SOL_SOCKET and kind == socket.SCM_RIGHTS:
+					fds.frombytes(cdata[:len(cdata) - len(cdata) % fds.itemsize])
+		magic, size, flags, reserved, seq, pts = SEGMENT.unpack(header)
+		if magic != SEGMENT_MAGIC or len(fds) != 1:
+			raise UnixClientError('bad segment header')
+		try:
+			data = b''
+			if size:
+				m = mmap.mmap(fds[0], size, mmap.MAP_SHARED, mmap.PROT_READ)
+				data = m[:]
+				m.close()
+		finally:
+			os.close(fds[0])
+		return flags, seq, pts, data